@@ -0,0 +1,212 @@
+/**
+ * @file accesslog.c
+ * @brief Asynchronous access log for a tiny web proxy.
+ *
+ * Threads serving connections append records to rings of their own (see
+ * ring.c); the logger thread formats and writes them. Key implementation
+ * details:
+ *     - Each ring has a single producer, its thread, and a single consumer,
+ *       the logger, so appending takes no lock and no atomic
+ *       read-modify-write.
+ *     - Records are binary: the wall-clock time and the IPv4 address and
+ *       port. Formatting, including the calendar time and the dotted-quad
+ *       address, happens on the logger thread; names are never resolved.
+ *     - Sampling counts down per thread, so skipped connections cost one
+ *       decrement and never touch the ring. The io_uring front end accepts
+ *       without addresses, and asks the socket for one only for sampled
+ *       connections.
+ *     - The logger wakes every ACCESSLOG_FLUSH_MS milliseconds and writes
+ *       everything pending in as few writes as its buffer allows, then one
+ *       event=drop line if records were dropped since; records still in
+ *       rings when the process exits are lost.
+ *     - Rings are taken on first use and never freed, as the threads
+ *       logging live as long as the proxy.
+ *
+ * Descriptions of individual functions, data structures, and global variables
+ * are provided in their respective leading comments.
+ *
+ * @author Iltikin Wayet
+ */
+
+#include "accesslog.h"
+#include "csapp.h"
+#include "ring.h"
+
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+// Size of the logger's output buffer.
+#define ACCESSLOG_BUF (64 * 1024)
+// Longest formatted line.
+#define ACCESSLOG_LINE_MAX 128
+
+/**
+ * @brief Access log record of one accepted connection.
+ */
+typedef struct {
+    int64_t sec;   // Wall-clock seconds when accepted
+    int32_t nsec;  // Nanoseconds past sec
+    uint32_t ip;   // Client IPv4 address, network byte order
+    uint16_t port; // Client port, network byte order
+} lrecord;
+
+// Log one accepted connection in log_sample, 0 if the log is off.
+static unsigned long log_sample = 0;
+// File descriptor the log is written to.
+static int logfd = -1;
+// Rings of all threads logging.
+static rset rings;
+// Ring of the calling thread, NULL until it logs.
+static __thread rring *self;
+// Connections of the calling thread until the next sampled one.
+static __thread unsigned long skip = 1;
+// Output buffer of the logger, ACCESSLOG_BUF bytes.
+static char out[ACCESSLOG_BUF];
+
+// ---------- HELPER PROTOTYPES ------------ //
+static void logger(void);
+static void log_record(const void *record, void *arg);
+static size_t format_time(char *buf, int64_t sec, int32_t nsec);
+static size_t log_flush(size_t len);
+
+// ---------- FUNCTION ROUTINES ------------ //
+
+/**
+ * @brief Starts the logger thread; call once, before accesslog_accept.
+ *
+ * @param[in] sample : log one accepted connection in <sample>; 0 turns the
+ *                     log off and starts no thread.
+ * @param[in] fd     : file descriptor the log is written to, e.g. 1.
+ */
+void accesslog_init(unsigned long sample, int fd) {
+    log_sample = sample;
+    logfd = fd;
+    if (log_sample == 0)
+        return;
+    ring_init(&rings, sizeof(lrecord), ACCESSLOG_RING);
+    if (!ring_writer(ACCESSLOG_FLUSH_MS, logger)) {
+        fprintf(stderr, "Could not start the access log; logging off\n");
+        log_sample = 0;
+    }
+}
+
+/**
+ * @brief Logs an accepted client connection, if sampled.
+ *     Takes a few hundred nanoseconds at most, and never blocks; the
+ *     record is dropped if the thread's ring is full.
+ *
+ * @param[in] fd   : client connection file descriptor.
+ * @param[in] addr : client address, or NULL to ask the socket for it, only
+ *                   if the connection is sampled.
+ */
+void accesslog_accept(int fd, const struct sockaddr_in *addr) {
+    if (log_sample == 0)
+        return;
+    if (--skip > 0)
+        return;
+    skip = log_sample;
+    if (self == NULL)
+        self = ring_take(&rings);
+    lrecord *record = ring_slot(self);
+    if (record == NULL)
+        return;
+
+    struct sockaddr_in peer;
+    if (addr == NULL) {
+        socklen_t len = sizeof(peer);
+        if (getpeername(fd, (struct sockaddr *)&peer, &len) < 0)
+            memset(&peer, 0, sizeof(peer));
+        addr = &peer;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    record->sec = ts.tv_sec;
+    record->nsec = ts.tv_nsec;
+    record->ip = addr->sin_addr.s_addr;
+    record->port = addr->sin_port;
+    ring_push(self);
+}
+
+// ---------- HELPER ROUTINES ------------ //
+
+/**
+ * @brief Flush function of the logger thread; runs every
+ *     ACCESSLOG_FLUSH_MS. Formats the records of all rings, and a line
+ *     counting those dropped since the last run, and writes them out.
+ */
+static void logger(void) {
+    size_t len = 0;
+    uint64_t dropped = ring_drain(&rings, log_record, &len);
+    if (dropped > 0) {
+        if (len + ACCESSLOG_LINE_MAX > ACCESSLOG_BUF)
+            len = log_flush(len);
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        len += format_time(out + len, ts.tv_sec, ts.tv_nsec);
+        len += snprintf(out + len, ACCESSLOG_BUF - len,
+                        " event=drop records=%" PRIu64 "\n", dropped);
+    }
+    log_flush(len);
+}
+
+/**
+ * @brief Formats one record into the output buffer, flushing it first if
+ *     full.
+ *
+ * @param[in]     record : lrecord drained.
+ * @param[in,out] arg    : void* pointer to the bytes in the output buffer.
+ */
+static void log_record(const void *record, void *arg) {
+    const lrecord *r = record;
+    size_t *len = arg;
+    if (*len + ACCESSLOG_LINE_MAX > ACCESSLOG_BUF)
+        *len = log_flush(*len);
+    char ip[INET_ADDRSTRLEN];
+    struct in_addr in = {.s_addr = r->ip};
+    inet_ntop(AF_INET, &in, ip, sizeof(ip));
+    *len += format_time(out + *len, r->sec, r->nsec);
+    *len += snprintf(out + *len, ACCESSLOG_BUF - *len,
+                     " event=accept client=%s:%u\n", ip,
+                     (unsigned)ntohs(r->port));
+}
+
+/**
+ * @brief Formats "ts=<UTC time with microseconds>" into <buf>.
+ *     The calendar part is recomputed only when the second changes.
+ *
+ * @param[out] buf  : buffer with room for ACCESSLOG_LINE_MAX bytes.
+ * @param[in]  sec  : wall-clock seconds.
+ * @param[in]  nsec : nanoseconds past <sec>.
+ *
+ * @return bytes formatted.
+ */
+static size_t format_time(char *buf, int64_t sec, int32_t nsec) {
+    static int64_t cached_sec = -1;
+    static char cached[32];
+    if (sec != cached_sec) {
+        time_t t = (time_t)sec;
+        struct tm tm;
+        gmtime_r(&t, &tm);
+        strftime(cached, sizeof(cached), "ts=%Y-%m-%dT%H:%M:%S", &tm);
+        cached_sec = sec;
+    }
+    return snprintf(buf, ACCESSLOG_LINE_MAX, "%s.%06dZ", cached, nsec / 1000);
+}
+
+/**
+ * @brief Writes the first <len> bytes of the output buffer to the log.
+ *
+ * @param[in] len : bytes of formatted lines in the buffer.
+ *
+ * @return 0, the length of the emptied buffer.
+ */
+static size_t log_flush(size_t len) {
+    if (len > 0 && rio_writen(logfd, out, len) < 0)
+        perror("access log write");
+    return 0;
+}
@@ -0,0 +1,54 @@
+/**
+ * @file accesslog.h
+ * @brief Asynchronous access log for a tiny web proxy.
+ *
+ * Accepted client connections are logged off the accept path: the thread
+ * serving a connection only appends a small binary record to a ring of its
+ * own, and a logger thread formats the records of all rings, with numeric
+ * addresses, and writes them out in batches as key=value lines, e.g.
+ *     ts=2026-10-14T09:30:00.123456Z event=accept client=127.0.0.1:51016
+ * Logging may be sampled, one connection in n, or turned off. Records that
+ * find a ring full are dropped and counted, never waited on.
+ *
+ * Descriptions of individual functions and data structures are provided in
+ * their respective leading comments.
+ *
+ * accesslog.c has more detailed implementation-related comments.
+ *
+ * @author Iltikin Wayet
+ */
+
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#include <netinet/in.h>
+
+// Default sample: every accepted connection is logged.
+#define ACCESSLOG_SAMPLE 1
+
+// Records each thread's ring holds; a power of two.
+#define ACCESSLOG_RING 4096
+
+// Milliseconds between two flushes of the logger thread.
+#define ACCESSLOG_FLUSH_MS 100
+
+/**
+ * @brief Starts the logger thread; call once, before accesslog_accept.
+ *
+ * @param[in] sample : log one accepted connection in <sample>; 0 turns the
+ *                     log off and starts no thread.
+ * @param[in] fd     : file descriptor the log is written to, e.g. 1.
+ */
+void accesslog_init(unsigned long sample, int fd);
+
+/**
+ * @brief Logs an accepted client connection, if sampled.
+ *     Takes a few hundred nanoseconds at most, and never blocks.
+ *
+ * @param[in] fd   : client connection file descriptor.
+ * @param[in] addr : client address, or NULL to ask the socket for it, only
+ *                   if the connection is sampled.
+ */
+void accesslog_accept(int fd, const struct sockaddr_in *addr);
+
+#endif /* ACCESSLOG_H */
@@ -0,0 +1,251 @@
+/**
+ * @file admit.c
+ * @brief Overload protection for a tiny web proxy.
+ *
+ * Front ends ask before serving; every check answers from a counter or a
+ * table set, never waiting on a server or a queue: connection and origin
+ * checks are lock-free, and the per-client check holds one of ADMIT_LOCKS
+ * striped mutexes for a few loads and stores. Key implementation details:
+ *     - Open connections are one atomic counter, taken with a fetch-add
+ *       and given back when the cap was already reached, so the cap is
+ *       never exceeded and admitting takes no lock.
+ *     - Queue delay is measured, not estimated: acceptors stamp each
+ *       connection with the monotonic clock, and workers shed those that
+ *       waited longer than the limit before reading anything from them.
+ *       Shedding the oldest connections first lets the queue drain at once,
+ *       instead of every queued client timing out slowly.
+ *     - Per-client rate limits are token buckets, kept as the generic cell
+ *       rate algorithm does: one theoretical arrival time per client IP,
+ *       pushed back by 1/rate for every request admitted. A client may run
+ *       ADMIT_BURST seconds ahead of its rate before being refused, and is
+ *       told how long until its bucket holds a token again.
+ *     - Client IPs hash into a fixed table of ADMIT_CLIENTS slots, in sets
+ *       of ADMIT_WAYS striped over ADMIT_LOCKS mutexes, so the table never
+ *       grows. A new client takes the set's slot furthest behind the clock;
+ *       a slot behind it holds a full bucket anyway, so nothing is lost.
+ *       When every slot of the set is busy, the new client shares the
+ *       bucket of the one least ahead instead of resetting it, which errs
+ *       towards limiting, never towards letting a busy client past its
+ *       rate.
+ *     - Fetches per origin are counted in a fixed table of ADMIT_ORIGINS
+ *       atomic counters, by hash of host and port. Origins sharing a slot
+ *       share its cap, which errs towards shedding, never towards letting
+ *       one origin past it.
+ *
+ * Descriptions of individual functions, data structures, and global variables
+ * are provided in their respective leading comments.
+ *
+ * @author Iltikin Wayet
+ */
+
+#include "admit.h"
+#include "hash.h"
+#include "metrics.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+
+// Mutexes striping the client table.
+#define ADMIT_LOCKS 64
+
+// Client slots searched per IP; a power of two dividing ADMIT_CLIENTS.
+#define ADMIT_WAYS 4
+
+/**
+ * @brief Rate limit state of one client IP.
+ */
+typedef struct {
+    uint32_t ip;  // Client IPv4 address, network byte order
+    bool used;    // Whether the slot holds a client
+    uint64_t tat; // Theoretical arrival time, metrics_now nanoseconds
+} aclient;
+
+// Cap on open client connections, 0 for none.
+static size_t max_connections;
+// Client connections open.
+static atomic_size_t connections;
+// Longest queue wait in nanoseconds, 0 for no limit.
+static uint64_t queue_ns;
+// Nanoseconds a request pushes its client's arrival time back, 0 for no
+// rate limit.
+static uint64_t interval_ns;
+// Nanoseconds a client's arrival time may run ahead of the clock.
+static uint64_t burst_ns;
+// Rate limit state of client IPs, in sets of ADMIT_WAYS slots by hash.
+static aclient clients[ADMIT_CLIENTS];
+// Mutexes guarding the client sets, set i by mutex i % ADMIT_LOCKS.
+static pthread_mutex_t client_mutex[ADMIT_LOCKS];
+// Cap on fetches in flight per origin, 0 for none.
+static size_t max_fetches;
+// Fetches in flight, by origin hash.
+static atomic_size_t fetches[ADMIT_ORIGINS];
+
+// ---------- HELPER PROTOTYPES ------------ //
+static size_t client_hash(uint32_t ip);
+
+// ---------- FUNCTION ROUTINES ------------ //
+
+/**
+ * @brief Sets the limits; call once, before accepting.
+ *
+ * @param[in] config : limits, 0 for those that are off.
+ */
+void admit_init(const aconfig *config) {
+    max_connections = config->connections;
+    atomic_init(&connections, 0);
+    queue_ns = (uint64_t)config->queue_ms * 1000000;
+    if (config->rate > 0) {
+        interval_ns = (uint64_t)(1e9 / config->rate);
+        if (interval_ns == 0)
+            interval_ns = 1;
+        burst_ns = (uint64_t)ADMIT_BURST * 1000000000;
+    }
+    for (size_t i = 0; i < ADMIT_LOCKS; i++)
+        pthread_mutex_init(&client_mutex[i], NULL);
+    max_fetches = config->fetches;
+    for (size_t i = 0; i < ADMIT_ORIGINS; i++)
+        atomic_init(&fetches[i], 0);
+}
+
+/**
+ * @brief Admits a connection just accepted, if under the connection cap.
+ *     Admitted connections are given back with admit_close.
+ *
+ * @return true if admitted, false if the connection is to be shed.
+ */
+bool admit_open(void) {
+    if (max_connections == 0)
+        return true;
+    if (atomic_fetch_add_explicit(&connections, 1, memory_order_relaxed) <
+        max_connections)
+        return true;
+    atomic_fetch_sub_explicit(&connections, 1, memory_order_relaxed);
+    return false;
+}
+
+/**
+ * @brief Gives back a connection admitted by admit_open, once closed or
+ *     handed off.
+ */
+void admit_close(void) {
+    if (max_connections > 0)
+        atomic_fetch_sub_explicit(&connections, 1, memory_order_relaxed);
+}
+
+/**
+ * @brief Returns whether a connection queued for a worker was taken off
+ *     the queue soon enough to be served.
+ *
+ * @param[in] accepted : when the connection was accepted, metrics_now time.
+ */
+bool admit_queued(uint64_t accepted) {
+    return queue_ns == 0 || metrics_now() - accepted <= queue_ns;
+}
+
+/**
+ * @brief Admits a request under the rate limit of its client IP.
+ *     Clients that are not IPv4 are not limited.
+ *
+ * @param[in] fd   : client socket descriptor.
+ * @param[in] addr : client address, NULL to ask the socket for it.
+ *
+ * @return 0 if admitted, else seconds the client is to retry after.
+ */
+long admit_client(int fd, const struct sockaddr_in *addr) {
+    if (interval_ns == 0)
+        return 0;
+    struct sockaddr_in peer;
+    if (addr == NULL) {
+        socklen_t len = sizeof(peer);
+        if (getpeername(fd, (struct sockaddr *)&peer, &len) < 0)
+            return 0;
+        addr = &peer;
+    }
+    if (addr->sin_family != AF_INET)
+        return 0;
+
+    uint32_t ip = addr->sin_addr.s_addr;
+    size_t i = client_hash(ip);
+    aclient *set = &clients[i * ADMIT_WAYS];
+    aclient *client = NULL;
+    uint64_t now = metrics_now();
+    long retry = 0;
+    pthread_mutex_lock(&client_mutex[i % ADMIT_LOCKS]);
+    // A new client takes the slot furthest behind, unused slots first.
+    for (size_t w = 0; w < ADMIT_WAYS; w++) {
+        if (set[w].used && set[w].ip == ip) {
+            client = &set[w];
+            break;
+        }
+        if (client == NULL || !set[w].used ||
+            (client->used && set[w].tat < client->tat))
+            client = &set[w];
+    }
+    // Only a slot behind the clock is taken over; a busy one is shared.
+    if (!client->used || (client->ip != ip && client->tat < now)) {
+        client->ip = ip;
+        client->used = true;
+    }
+    // A client idle long enough starts with a full bucket.
+    if (client->tat < now)
+        client->tat = now;
+    if (client->tat - now > burst_ns) {
+        uint64_t wait = client->tat - now - burst_ns;
+        retry = (long)((wait + 999999999) / 1000000000);
+    } else {
+        client->tat += interval_ns;
+    }
+    pthread_mutex_unlock(&client_mutex[i % ADMIT_LOCKS]);
+    return retry;
+}
+
+/**
+ * @brief Admits a server fetch under the cap of its origin.
+ *     Admitted fetches are given back with admit_origin_done.
+ *
+ * @param[in]  host : server host name.
+ * @param[in]  port : server port.
+ * @param[out] slot : origin slot counting the fetch, -1 if none.
+ *
+ * @return true if admitted, false if the request is to be shed.
+ */
+bool admit_origin(const char *host, const char *port, int *slot) {
+    *slot = -1;
+    if (max_fetches == 0)
+        return true;
+    size_t i = hash_origin(host, port) & (ADMIT_ORIGINS - 1);
+    if (atomic_fetch_add_explicit(&fetches[i], 1, memory_order_relaxed) <
+        max_fetches) {
+        *slot = (int)i;
+        return true;
+    }
+    atomic_fetch_sub_explicit(&fetches[i], 1, memory_order_relaxed);
+    return false;
+}
+
+/**
+ * @brief Gives back a fetch admitted by admit_origin, once it ended.
+ *
+ * @param[in] slot : origin slot from admit_origin; -1 does nothing.
+ */
+void admit_origin_done(int slot) {
+    if (slot >= 0)
+        atomic_fetch_sub_explicit(&fetches[slot], 1, memory_order_relaxed);
+}
+
+// ---------- HELPER ROUTINES ------------ //
+
+/**
+ * @brief Hash function for client IPs, to a client table set.
+ *
+ * @param[in] ip : client IPv4 address.
+ */
+static size_t client_hash(uint32_t ip) {
+    uint32_t h = ip;
+    h ^= h >> 16;
+    h *= 0x45d9f3bU;
+    h ^= h >> 16;
+    return h & (ADMIT_CLIENTS / ADMIT_WAYS - 1);
+}
+
@@ -0,0 +1,112 @@
+/**
+ * @file admit.h
+ * @brief Overload protection for a tiny web proxy.
+ *
+ * Decides, before any server work, whether a connection or request is
+ * served. Under overload the proxy sheds: connections past a cap on those
+ * open at once, and connections that waited in the worker queue too long,
+ * get a 503 with Retry-After instead of waiting their turn, so the clients
+ * admitted keep their latency. Clients sending requests faster than the
+ * rate allowed per client IP get a 429 with Retry-After, and requests that
+ * would fetch from a server already sent the most fetches allowed per
+ * origin get a 503. Every limit is off unless set at startup, and costs
+ * nothing while off.
+ *
+ * Descriptions of individual functions and data structures are provided in
+ * their respective leading comments.
+ *
+ * admit.c has more detailed implementation-related comments.
+ *
+ * @author Iltikin Wayet
+ */
+
+#ifndef ADMIT_H
+#define ADMIT_H
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Seconds shed clients are told to retry after.
+#define ADMIT_RETRY_AFTER 1
+
+// Seconds of requests at its rate a client may send in a burst.
+#define ADMIT_BURST 2
+
+// Client IPs with a rate limit of their own; a power of two.
+#define ADMIT_CLIENTS 4096
+
+// Origins with a fetch count of their own; a power of two.
+#define ADMIT_ORIGINS 1024
+
+/**
+ * @brief Overload protection startup configuration.
+ */
+struct admit_config {
+    size_t connections; // Client connections open at once, 0 for no cap.
+    long queue_ms;      // Longest worker queue wait, 0 for no limit.
+    double rate;        // Requests per second per client IP, 0 for no limit.
+    size_t fetches;     // Server fetches in flight per origin, 0 for no cap.
+};
+typedef struct admit_config aconfig;
+
+/**
+ * @brief Sets the limits; call once, before accepting.
+ *
+ * @param[in] config : limits, 0 for those that are off.
+ */
+void admit_init(const aconfig *config);
+
+/**
+ * @brief Admits a connection just accepted, if under the connection cap.
+ *     Admitted connections are given back with admit_close.
+ *
+ * @return true if admitted, false if the connection is to be shed.
+ */
+bool admit_open(void);
+
+/**
+ * @brief Gives back a connection admitted by admit_open, once closed or
+ *     handed off.
+ */
+void admit_close(void);
+
+/**
+ * @brief Returns whether a connection queued for a worker was taken off
+ *     the queue soon enough to be served.
+ *
+ * @param[in] accepted : when the connection was accepted, metrics_now time.
+ */
+bool admit_queued(uint64_t accepted);
+
+/**
+ * @brief Admits a request under the rate limit of its client IP.
+ *
+ * @param[in] fd   : client socket descriptor.
+ * @param[in] addr : client address, NULL to ask the socket for it.
+ *
+ * @return 0 if admitted, else seconds the client is to retry after.
+ */
+long admit_client(int fd, const struct sockaddr_in *addr);
+
+/**
+ * @brief Admits a server fetch under the cap of its origin.
+ *     Admitted fetches are given back with admit_origin_done.
+ *
+ * @param[in]  host : server host name.
+ * @param[in]  port : server port.
+ * @param[out] slot : origin slot counting the fetch, -1 if none.
+ *
+ * @return true if admitted, false if the request is to be shed.
+ */
+bool admit_origin(const char *host, const char *port, int *slot);
+
+/**
+ * @brief Gives back a fetch admitted by admit_origin, once it ended.
+ *
+ * @param[in] slot : origin slot from admit_origin; -1 does nothing.
+ */
+void admit_origin_done(int slot);
+
+#endif /* ADMIT_H */
@@ -0,0 +1,446 @@
+/**
+ * @file alloc_test.c
+ * @brief Allocation test for the cache hit path of the tiny web proxy.
+ *
+ * Serving a cache hit is meant to call no allocator, once connections and
+ * buffers are warm. This test checks it: it links the proxy itself, its
+ * main renamed to tinyproxy_main, along with its own malloc, calloc, and
+ * realloc, which count every call made in a proxy process before handing
+ * it to glibc. For each front end (threaded workers, -E, -U) it runs the
+ * proxy in a child process and, over ALLOC_CONNS client connections,
+ * fetches a few objects from an origin server of its own: ALLOC_WARM rounds
+ * to warm up, which miss once and may allocate, then ALLOC_ROUNDS rounds of
+ * hits. The front end fails if any of those hits allocated, or reached the
+ * origin. Threaded workers keep the connections alive; the event loops
+ * answer one request per connection, so each of their hits also takes a
+ * connection from the loop's free list. Warm-up rounds open every client
+ * connection at once, growing those free lists past the few connections
+ * open at a time after. Counters live in a shared mapping, so the proxy
+ * processes need no way of reporting them.
+ *
+ * Build from the repository root with make alloc_test; run with no
+ * arguments, exiting 0 if no front end allocated serving hits:
+ *     ./alloc_test
+ *
+ * @author Iltikin Wayet
+ */
+
+#include "cache.h"
+#include "csapp.h"
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Kept-alive client connections to each proxy.
+#define ALLOC_CONNS 8
+// Rounds over every object before counting.
+#define ALLOC_WARM 2
+// Rounds over every object counted.
+#define ALLOC_ROUNDS 50
+// Microseconds the proxy gets to finish up after the last response read.
+#define ALLOC_SETTLE_US 200000
+// Tries, 50 ms apart, at connecting to a proxy just started.
+#define ALLOC_TRIES 100
+
+// Allocator entry points of glibc, called by the counting ones.
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+// The proxy's main, renamed when linked into this test.
+int tinyproxy_main(int argc, char **argv);
+
+/**
+ * @brief Counters shared by the test and the processes it starts.
+ */
+typedef struct {
+    atomic_long allocs;  // Allocator calls made by proxy processes
+    atomic_long fetches; // Requests the origin answered
+} counters;
+
+/**
+ * @brief Front end under test, by its proxy options.
+ */
+typedef struct {
+    const char *name; // Front end name, as reported
+    const char *flag; // Option selecting it, NULL for the threaded one
+    bool persist;     // Whether it serves further requests per connection
+} front_end;
+
+/**
+ * @brief Client connection to the proxy under test.
+ */
+typedef struct {
+    int fd;    // Socket descriptor, -1 if not connected
+    rio_t rio; // Buffer of the connection
+} client;
+
+// Front ends tested, in order.
+static const front_end front_ends[] = {
+    {"threaded", NULL, true},
+    {"epoll", "-E", false},
+    {"io_uring", "-U", false},
+};
+
+// Object sizes fetched, head included.
+static const size_t alloc_sizes[] = {1024, 16 * 1024, 64 * 1024};
+
+// Counters, mapped shared before any process is started.
+static counters *shared;
+// Whether this process is a proxy, whose allocator calls are counted.
+static bool counting;
+// Origin server port.
+static int origin_port;
+// Port of the proxy under test.
+static int proxy_port;
+// Origin response head, given the body length.
+static const char origin_head[] = "HTTP/1.1 200 OK\r\n"
+                                  "Cache-Control: max-age=3600\r\n"
+                                  "Content-Type: application/octet-stream\r\n"
+                                  "Content-Length: %8zu\r\n\r\n";
+// Response bodies, never looked at.
+static char origin_body[MAX_OBJECT_SIZE];
+
+/**
+ * @brief Counting malloc; counts calls made by a proxy process.
+ */
+void *malloc(size_t size) {
+    if (counting)
+        atomic_fetch_add_explicit(&shared->allocs, 1, memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+/**
+ * @brief Counting calloc; counts calls made by a proxy process.
+ */
+void *calloc(size_t nmemb, size_t size) {
+    if (counting)
+        atomic_fetch_add_explicit(&shared->allocs, 1, memory_order_relaxed);
+    return __libc_calloc(nmemb, size);
+}
+
+/**
+ * @brief Counting realloc; counts calls made by a proxy process.
+ */
+void *realloc(void *ptr, size_t size) {
+    if (counting)
+        atomic_fetch_add_explicit(&shared->allocs, 1, memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+/**
+ * @brief Serves one origin connection: answers GET /<size>/<name> with a
+ *     response of <size> bytes, until the proxy closes it or asks to.
+ *
+ * @param[in] vargp : void* pointer to the malloc'd connection descriptor.
+ */
+static void *origin_conn(void *vargp) {
+    int fd = *(int *)vargp;
+    free(vargp);
+    rio_t rio;
+    rio_readinitb(&rio, fd);
+    char line[MAXLINE];
+    while (rio_readlineb(&rio, line, sizeof(line)) > 0) {
+        size_t size = alloc_sizes[0];
+        sscanf(line, "GET /%zu/", &size);
+        bool persist = strstr(line, "HTTP/1.1") != NULL;
+        while (rio_readlineb(&rio, line, sizeof(line)) > 0 &&
+               strcmp(line, "\r\n") != 0) {
+            if (!strncasecmp(line, "Connection: close", 17))
+                persist = false;
+        }
+        atomic_fetch_add_explicit(&shared->fetches, 1, memory_order_relaxed);
+
+        // The padded length keeps the head one size for every body.
+        char head[MAXLINE];
+        int head_len = snprintf(NULL, 0, origin_head, (size_t)0);
+        size_t body = (size > (size_t)head_len) ? size - head_len : 1;
+        if (body > sizeof(origin_body))
+            body = sizeof(origin_body);
+        snprintf(head, sizeof(head), origin_head, body);
+        if (rio_writen(fd, head, head_len) < 0 ||
+            rio_writen(fd, origin_body, body) < 0 || !persist)
+            break;
+    }
+    close(fd);
+    return NULL;
+}
+
+/**
+ * @brief Starts the origin server, in a child process, on an ephemeral
+ *     loopback port.
+ *
+ * @return process ID of the origin server.
+ */
+static pid_t origin_start() {
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenfd < 0 || bind(listenfd, (struct sockaddr *)&addr, addrlen) < 0 ||
+        listen(listenfd, 1024) < 0 ||
+        getsockname(listenfd, (struct sockaddr *)&addr, &addrlen) < 0) {
+        perror("origin listen");
+        exit(1);
+    }
+    origin_port = ntohs(addr.sin_port);
+    pid_t pid = fork();
+    if (pid != 0) {
+        close(listenfd);
+        return pid;
+    }
+
+    memset(origin_body, 'x', sizeof(origin_body));
+    while (1) {
+        int *fd = malloc(sizeof(int));
+        *fd = accept(listenfd, NULL, NULL);
+        if (*fd < 0) {
+            free(fd);
+            continue;
+        }
+        // Head and body are separate writes.
+        int one = 1;
+        setsockopt(*fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        pthread_t tid;
+        pthread_create(&tid, NULL, origin_conn, fd);
+        pthread_detach(tid);
+    }
+}
+
+/**
+ * @brief Returns a loopback port free at the time of the call.
+ */
+static int free_port() {
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, addrlen) < 0 ||
+        getsockname(fd, (struct sockaddr *)&addr, &addrlen) < 0) {
+        perror("free port");
+        exit(1);
+    }
+    close(fd);
+    return ntohs(addr.sin_port);
+}
+
+/**
+ * @brief Starts a proxy, in a child process counting its allocator calls,
+ *     with its access log discarded.
+ *
+ * @param[in] front : front end run.
+ * @param[in] port  : port the proxy listens on.
+ *
+ * @return process ID of the proxy.
+ */
+static pid_t proxy_start(const front_end *front, int port) {
+    pid_t pid = fork();
+    if (pid != 0)
+        return pid;
+
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+    char port_arg[16];
+    snprintf(port_arg, sizeof(port_arg), "%d", port);
+    char *argv[4] = {"tinyproxy"};
+    int argc = 1;
+    if (front->flag != NULL)
+        argv[argc++] = (char *)front->flag;
+    argv[argc++] = port_arg;
+    argv[argc] = NULL;
+    counting = true;
+    _exit(tinyproxy_main(argc, argv));
+}
+
+/**
+ * @brief Connects a client to the proxy under test, waiting for a proxy
+ *     just started to listen.
+ *
+ * @param[out] c : client connected.
+ *
+ * @return true if connected.
+ */
+static bool proxy_connect(client *c) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(proxy_port);
+    for (int i = 0; i < ALLOC_TRIES; i++) {
+        c->fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (c->fd < 0)
+            return false;
+        if (connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            rio_readinitb(&c->rio, c->fd);
+            return true;
+        }
+        close(c->fd);
+        c->fd = -1;
+        usleep(50000);
+    }
+    return false;
+}
+
+/**
+ * @brief Sends a request for an object and reads the whole response.
+ *
+ * @param[in] fd   : proxy connection.
+ * @param[in] rio  : buffer of the proxy connection.
+ * @param[in] size : object size, head included.
+ *
+ * @return true if a 200 response was read whole.
+ */
+static bool fetch_object(int fd, rio_t *rio, size_t size) {
+    char buf[MAXLINE];
+    int len = snprintf(buf, sizeof(buf),
+                       "GET http://127.0.0.1:%d/%zu/alloc HTTP/1.1\r\n"
+                       "Host: 127.0.0.1:%d\r\n\r\n",
+                       origin_port, size, origin_port);
+    if (rio_writen(fd, buf, len) < 0)
+        return false;
+
+    ssize_t n = rio_readlineb(rio, buf, sizeof(buf));
+    if (n <= 0 || strncmp(buf, "HTTP/1.1 200", 12) != 0)
+        return false;
+    size_t length = 0;
+    while ((n = rio_readlineb(rio, buf, sizeof(buf))) > 0) {
+        if (strcmp(buf, "\r\n") == 0)
+            break;
+        if (strncasecmp(buf, "Content-Length:", 15) == 0)
+            length = strtoull(buf + 15, NULL, 10);
+    }
+    if (n <= 0)
+        return false;
+
+    static char body[64 * 1024];
+    while (length > 0) {
+        size_t want = (length < sizeof(body)) ? length : sizeof(body);
+        n = rio_readnb(rio, body, want);
+        if (n <= 0)
+            return false;
+        length -= n;
+    }
+    return true;
+}
+
+/**
+ * @brief Fetches every object by every client, a number of times.
+ *     Clients of a front end closing after each response reconnect.
+ *
+ * @param[in]     front   : front end tested.
+ * @param[in,out] clients : ALLOC_CONNS clients.
+ * @param[in]     rounds  : times every object is fetched by each client.
+ * @param[in]     warm    : whether every client connects at the start of
+ *                          a round, rather than when it fetches.
+ *
+ * @return true if every response was read whole.
+ */
+static bool fetch_rounds(const front_end *front, client *clients, int rounds,
+                         bool warm) {
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; warm && i < ALLOC_CONNS; i++) {
+            if (clients[i].fd < 0 && !proxy_connect(&clients[i]))
+                return false;
+        }
+        for (int i = 0; i < ALLOC_CONNS; i++) {
+            client *c = &clients[i];
+            for (size_t j = 0; j < sizeof(alloc_sizes) / sizeof(size_t); j++) {
+                if (c->fd < 0 && !proxy_connect(c))
+                    return false;
+                if (!fetch_object(c->fd, &c->rio, alloc_sizes[j]))
+                    return false;
+                if (!front->persist) {
+                    close(c->fd);
+                    c->fd = -1;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Tests one front end: warms a proxy up, then counts the allocator
+ *     calls and origin fetches of the hits served after.
+ *
+ * @param[in] front : front end tested.
+ *
+ * @return true if no hit allocated or reached the origin.
+ */
+static bool test_front_end(const front_end *front) {
+    proxy_port = free_port();
+    pid_t pid = proxy_start(front, proxy_port);
+    static client clients[ALLOC_CONNS];
+    for (int i = 0; i < ALLOC_CONNS; i++)
+        clients[i].fd = -1;
+
+    long allocs = 0, fetches = 0;
+    bool ok = fetch_rounds(front, clients, ALLOC_WARM, true);
+    if (ok) {
+        usleep(ALLOC_SETTLE_US);
+        allocs = atomic_load(&shared->allocs);
+        fetches = atomic_load(&shared->fetches);
+        ok = fetch_rounds(front, clients, ALLOC_ROUNDS, false);
+        usleep(ALLOC_SETTLE_US);
+        allocs = atomic_load(&shared->allocs) - allocs;
+        fetches = atomic_load(&shared->fetches) - fetches;
+    }
+    if (!ok) {
+        printf("%-8s : requests failed\n", front->name);
+    } else {
+        long hits = (long)ALLOC_ROUNDS * ALLOC_CONNS *
+                    (sizeof(alloc_sizes) / sizeof(size_t));
+        printf("%-8s : %ld hits, %ld allocations, %ld origin fetches\n",
+               front->name, hits, allocs, fetches);
+        ok = (allocs == 0 && fetches == 0);
+    }
+
+    for (int i = 0; i < ALLOC_CONNS; i++) {
+        if (clients[i].fd >= 0)
+            close(clients[i].fd);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return ok;
+}
+
+int main() {
+    signal(SIGPIPE, SIG_IGN);
+    shared = mmap(NULL, sizeof(counters), PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    atomic_init(&shared->allocs, 0);
+    atomic_init(&shared->fetches, 0);
+
+    pid_t origin = origin_start();
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(front_ends) / sizeof(front_ends[0]); i++) {
+        if (!test_front_end(&front_ends[i]))
+            failed++;
+    }
+    kill(origin, SIGKILL);
+    waitpid(origin, NULL, 0);
+    printf("%s\n", failed ? "FAIL" : "OK");
+    return failed ? 1 : 0;
+}
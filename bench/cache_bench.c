@@ -0,0 +1,138 @@
+/**
+ * @file cache_bench.c
+ * @brief Cache hit microbenchmark for the tiny web proxy cache.
+ *
+ * Serves the same cached object over a loopback TCP connection repeatedly,
+ * once with hits copied out of the heap (rio_writen) and once with hits sent
+ * from memory files (sendfile), and reports time per hit and throughput for
+ * a few object sizes.
+ *
+ * Build from the repository root with make cache_bench, or by hand:
+ *     gcc -O2 -pthread -I. bench/cache_bench.c cache.c csapp.c disk.c \
+ *         slab.c -o cache_bench
+ *
+ * Usage:
+ *     ./cache_bench [hits]
+ *
+ * @author Iltikin Wayet
+ */
+
+#include "cache.h"
+#include "csapp.h"
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// Default number of hits served per measurement.
+#define BENCH_HITS 20000
+
+// Object sizes measured.
+static const size_t bench_sizes[] = {16 * 1024, 64 * 1024, MAX_OBJECT_SIZE};
+
+// Object text inserted into the cache.
+static char bench_text[MAX_OBJECT_SIZE];
+
+/**
+ * @brief Drain thread; reads and discards everything sent by the cache.
+ *
+ * @param[in] vargp : void* pointer to the receiving socket descriptor.
+ */
+static void *drain(void *vargp) {
+    int fd = *(int *)vargp;
+    char buf[MAXBUF];
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+    return NULL;
+}
+
+/**
+ * @brief Opens a connected loopback TCP socket pair.
+ *
+ * @param[out] sendfd : sending end.
+ * @param[out] recvfd : receiving end.
+ */
+static void loopback_pair(int *sendfd, int *recvfd) {
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenfd < 0 || bind(listenfd, (struct sockaddr *)&addr, addrlen) < 0 ||
+        listen(listenfd, 1) < 0 ||
+        getsockname(listenfd, (struct sockaddr *)&addr, &addrlen) < 0) {
+        perror("loopback listen");
+        exit(1);
+    }
+    *sendfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(*sendfd, (struct sockaddr *)&addr, addrlen) < 0) {
+        perror("loopback connect");
+        exit(1);
+    }
+    *recvfd = accept(listenfd, NULL, NULL);
+    close(listenfd);
+}
+
+/**
+ * @brief Returns the current monotonic time in seconds.
+ */
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Measures <hits> cache hits of an object of <size> bytes.
+ *
+ * @param[in] zerocopy : whether hits are served with sendfile.
+ * @param[in] size     : size of the cached object.
+ * @param[in] hits     : number of hits to serve.
+ */
+static void bench(bool zerocopy, size_t size, long hits) {
+    cconfig config = {.shards = 1, .zerocopy = zerocopy};
+    cache_init(&config);
+    cache_insert("http://bench/object", bench_text, size);
+
+    int sendfd, recvfd;
+    loopback_pair(&sendfd, &recvfd);
+    pthread_t tid;
+    pthread_create(&tid, NULL, drain, &recvfd);
+
+    double start = now();
+    for (long i = 0; i < hits; i++) {
+        if (!cache_gettext("http://bench/object", sendfd)) {
+            fprintf(stderr, "unexpected cache miss\n");
+            exit(1);
+        }
+    }
+    double elapsed = now() - start;
+
+    close(sendfd);
+    pthread_join(tid, NULL);
+    close(recvfd);
+    cache_free();
+
+    printf("%-9s %7zu B  %8.2f us/hit  %8.1f MB/s\n",
+           zerocopy ? "sendfile" : "copy", size, elapsed / hits * 1e6,
+           (double)size * hits / elapsed / 1e6);
+}
+
+int main(int argc, char **argv) {
+    long hits = (argc > 1) ? strtol(argv[1], NULL, 10) : BENCH_HITS;
+    memset(bench_text, 'x', sizeof(bench_text));
+
+    for (size_t i = 0; i < sizeof(bench_sizes) / sizeof(bench_sizes[0]); i++) {
+        bench(false, bench_sizes[i], hits);
+        bench(true, bench_sizes[i], hits);
+    }
+    return 0;
+}
@@ -0,0 +1,175 @@
+/**
+ * @file cache_threads_bench.c
+ * @brief Multithreaded cache microbenchmark for the tiny web proxy cache.
+ *
+ * Runs cache_gettext and cache_insert from 1, 2, 4, ... up to N threads at
+ * once, on BENCH_KEYS keys picked uniformly, and reports operations per
+ * second summed over threads, for three mixes: lookups only, nine lookups
+ * to one insert, and inserts only. Hits are written to /dev/null, so their
+ * cost is the lookup, pinning, and one copy into the kernel; inserts replace
+ * keys already cached, so the cache stays full and evicts.
+ *
+ * Build from the repository root with make cache_threads_bench, or by hand:
+ *     gcc -O2 -pthread -I. bench/cache_threads_bench.c cache.c csapp.c \
+ *         disk.c slab.c -o cache_threads_bench
+ *
+ * Usage:
+ *     ./cache_threads_bench [threads] [ops per thread]
+ *
+ * @author Iltikin Wayet
+ */
+
+#include "cache.h"
+#include "csapp.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Default most threads measured.
+#define BENCH_THREADS 8
+// Default operations per thread and measurement.
+#define BENCH_OPS 200000
+// Keys looked up and inserted.
+#define BENCH_KEYS 1024
+// Object size of every key.
+#define BENCH_SIZE (4 * 1024)
+// Cache memory, holding every key.
+#define BENCH_CACHE (64 * 1024 * 1024)
+
+/**
+ * @brief Mix of operations measured.
+ */
+typedef struct {
+    const char *name; // Mix name
+    int inserts;      // Inserts per 10 operations
+} bench_mix;
+
+// Mixes measured.
+static const bench_mix bench_mixes[] = {
+    {"get", 0}, {"get+ins", 1}, {"insert", 10}};
+
+/**
+ * @brief Benchmark thread arguments.
+ */
+typedef struct {
+    const bench_mix *mix; // Mix run
+    long ops;             // Operations run
+    uint64_t rng;         // Random state of the thread
+    long misses;          // Lookups that missed
+} bench_arg;
+
+// Keys, formatted once.
+static char bench_keys[BENCH_KEYS][64];
+// Object text inserted into the cache.
+static char bench_text[BENCH_SIZE];
+// Descriptor of /dev/null, hits are written to.
+static int nullfd;
+// Barrier started threads wait on, so they run at once.
+static pthread_barrier_t barrier;
+
+/**
+ * @brief Returns the current monotonic time in seconds.
+ */
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Returns the next of a xorshift64* sequence.
+ *
+ * @param[in,out] state : random state, nonzero.
+ */
+static uint64_t rng_next(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * @brief Benchmark thread function; runs its operations of the mix.
+ *
+ * @param[in] vargp : void* pointer to the thread arguments.
+ */
+static void *run(void *vargp) {
+    bench_arg *arg = vargp;
+    pthread_barrier_wait(&barrier);
+    for (long i = 0; i < arg->ops; i++) {
+        uint64_t r = rng_next(&arg->rng);
+        const char *key = bench_keys[r % BENCH_KEYS];
+        if ((int)((r >> 32) % 10) < arg->mix->inserts)
+            cache_insert(key, bench_text, sizeof(bench_text));
+        else if (!cache_gettext(key, nullfd))
+            arg->misses++;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Measures <ops> operations of a mix on each of <threads> threads.
+ *
+ * @param[in] mix     : mix of operations.
+ * @param[in] threads : threads run at once.
+ * @param[in] ops     : operations per thread.
+ */
+static void bench(const bench_mix *mix, int threads, long ops) {
+    cconfig config = {
+        .shards = CACHE_SHARDS, .zerocopy = true, .size = BENCH_CACHE};
+    cache_init(&config);
+    for (int i = 0; i < BENCH_KEYS; i++)
+        cache_insert(bench_keys[i], bench_text, sizeof(bench_text));
+
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    bench_arg *args = calloc(threads, sizeof(bench_arg));
+    pthread_barrier_init(&barrier, NULL, threads + 1);
+    for (int i = 0; i < threads; i++) {
+        args[i] = (bench_arg){
+            .mix = mix, .ops = ops, .rng = 0x9E3779B97F4A7C15ULL * (i + 1)};
+        pthread_create(&tids[i], NULL, run, &args[i]);
+    }
+    pthread_barrier_wait(&barrier);
+    double start = now();
+    long misses = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        misses += args[i].misses;
+    }
+    double elapsed = now() - start;
+    pthread_barrier_destroy(&barrier);
+    free(args);
+    free(tids);
+    cache_free();
+
+    printf("%-7s %3d threads  %8.2f Mops/s  %7.1f ns/op/thread  %ld misses\n",
+           mix->name, threads, threads * ops / elapsed / 1e6,
+           elapsed / ops * 1e9, misses);
+}
+
+int main(int argc, char **argv) {
+    int threads = (argc > 1) ? atoi(argv[1]) : BENCH_THREADS;
+    long ops = (argc > 2) ? strtol(argv[2], NULL, 10) : BENCH_OPS;
+    nullfd = open("/dev/null", O_WRONLY);
+    if (nullfd < 0) {
+        perror("/dev/null");
+        return 1;
+    }
+    memset(bench_text, 'x', sizeof(bench_text));
+    for (int i = 0; i < BENCH_KEYS; i++)
+        snprintf(bench_keys[i], sizeof(bench_keys[i]),
+                 "http://bench.example/object/%d", i);
+
+    for (size_t m = 0; m < sizeof(bench_mixes) / sizeof(bench_mixes[0]); m++)
+        for (int n = 1; n <= threads; n *= 2)
+            bench(&bench_mixes[m], n, ops);
+    return 0;
+}
@@ -0,0 +1,430 @@
+/**
+ * @file hit_test.c
+ * @brief Cache hit test for responses the tiny web proxy adapts to store.
+ *
+ * Some responses reach the cache only because the proxy rewrites them or
+ * the requests they answer: a chunked body is stored as its chunk data
+ * alone, with a Content-Length added on commit, and with -z a response
+ * varying by Accept-Encoding alone is stored, since the request went to
+ * the server without one. This test checks that such responses are served
+ * as hits: it links the proxy itself, its main renamed to tinyproxy_main,
+ * and for each front end (threaded workers, -E, -U) and each case runs the
+ * proxy in a child process against an origin server of its own. A case
+ * fetches one object three times, over a new connection each time: an
+ * HTTP/1.1 request that misses, then HTTP/1.1 and HTTP/1.0 requests that
+ * are to hit. It fails unless every body arrives whole, the hit sent to
+ * the HTTP/1.0 client is framed by a Content-Length, and the origin
+ * answered the first request alone. Fetches counted by the origin live in
+ * a shared mapping, so that it needs no way of reporting them.
+ *
+ * Build from the repository root with make hit_test; run with no
+ * arguments, exiting 0 if every case hit:
+ *     ./hit_test
+ *
+ * @author Iltikin Wayet
+ */
+
+#include "csapp.h"
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Body length of every object, in bytes.
+#define HIT_BODY (40 * 1024)
+// Bytes per chunk of a chunked body.
+#define HIT_CHUNK 3000
+// Microseconds the proxy gets to commit a fill after its response is read.
+#define HIT_SETTLE_US 100000
+// Tries, 50 ms apart, at connecting to a proxy just started.
+#define HIT_TRIES 100
+
+// The proxy's main, renamed when linked into this test.
+int tinyproxy_main(int argc, char **argv);
+
+/**
+ * @brief Front end under test, by its proxy option.
+ */
+typedef struct {
+    const char *name; // Front end name, as reported
+    const char *flag; // Option selecting it, NULL for the threaded one
+} front_end;
+
+/**
+ * @brief Case tested, by the origin response it asks for.
+ */
+typedef struct {
+    const char *name; // Case name, as reported, and origin path
+    const char *head; // Origin response head, but for its framing
+    bool chunked;     // Whether the origin chunks the body to HTTP/1.1
+    const char *flag; // Further proxy option, NULL if none
+} hit_case;
+
+/**
+ * @brief Response read by a client.
+ */
+typedef struct {
+    bool ok;         // Whether a 200 response was read whole
+    bool length;     // Whether it was framed by a Content-Length
+    size_t body_len; // Length of its body
+} reply;
+
+// Front ends tested, in order.
+static const front_end front_ends[] = {
+    {"threaded", NULL},
+    {"epoll", "-E"},
+    {"io_uring", "-U"},
+};
+
+// Cases tested on every front end, in order.
+static const hit_case hit_cases[] = {
+    {"chunked",
+     "HTTP/1.1 200 OK\r\n"
+     "Cache-Control: max-age=3600\r\n"
+     "Content-Type: text/html\r\n",
+     true, NULL},
+    {"vary",
+     "HTTP/1.1 200 OK\r\n"
+     "Cache-Control: max-age=3600\r\n"
+     "Content-Type: text/html\r\n"
+     "Vary: Accept-Encoding\r\n",
+     false, "-z"},
+};
+
+// Requests the origin answered, mapped shared before any process starts.
+static atomic_long *fetches;
+// Origin server port.
+static int origin_port;
+// Port of the proxy under test.
+static int proxy_port;
+// Body of every object.
+static char origin_body[HIT_BODY];
+
+/**
+ * @brief Serves one origin connection: answers GET /<case> with the
+ *     response of that case, chunked to HTTP/1.1 requests if it says so,
+ *     until the proxy closes the connection or asks to.
+ *
+ * @param[in] vargp : void* pointer to the malloc'd connection descriptor.
+ */
+static void *origin_conn(void *vargp) {
+    int fd = *(int *)vargp;
+    free(vargp);
+    rio_t rio;
+    rio_readinitb(&rio, fd);
+    char line[MAXLINE];
+    while (rio_readlineb(&rio, line, sizeof(line)) > 0) {
+        const hit_case *c = &hit_cases[0];
+        for (size_t i = 0; i < sizeof(hit_cases) / sizeof(hit_case); i++) {
+            size_t len = strlen(hit_cases[i].name);
+            if (!strncmp(line + strlen("GET /"), hit_cases[i].name, len) &&
+                line[strlen("GET /") + len] == ' ')
+                c = &hit_cases[i];
+        }
+        bool http11 = strstr(line, "HTTP/1.1") != NULL;
+        bool persist = http11;
+        while (rio_readlineb(&rio, line, sizeof(line)) > 0 &&
+               strcmp(line, "\r\n") != 0) {
+            if (!strncasecmp(line, "Connection: close", 17))
+                persist = false;
+        }
+        atomic_fetch_add(fetches, 1);
+
+        char head[MAXLINE];
+        int head_len = snprintf(head, sizeof(head), "%s", c->head);
+        bool chunked = c->chunked && http11;
+        if (chunked)
+            head_len += snprintf(head + head_len, sizeof(head) - head_len,
+                                 "Transfer-Encoding: chunked\r\n\r\n");
+        else
+            head_len += snprintf(head + head_len, sizeof(head) - head_len,
+                                 "Content-Length: %d\r\n\r\n", HIT_BODY);
+        if (rio_writen(fd, head, head_len) < 0)
+            break;
+        bool sent = true;
+        if (chunked) {
+            for (size_t pos = 0; sent && pos < HIT_BODY; pos += HIT_CHUNK) {
+                size_t n = (HIT_BODY - pos < HIT_CHUNK) ? HIT_BODY - pos
+                                                        : HIT_CHUNK;
+                int size_len = snprintf(line, sizeof(line), "%zx\r\n", n);
+                sent = rio_writen(fd, line, size_len) >= 0 &&
+                       rio_writen(fd, origin_body + pos, n) >= 0 &&
+                       rio_writen(fd, "\r\n", 2) >= 0;
+            }
+            sent = sent && rio_writen(fd, "0\r\n\r\n", 5) >= 0;
+        } else {
+            sent = rio_writen(fd, origin_body, HIT_BODY) >= 0;
+        }
+        if (!sent || !persist)
+            break;
+    }
+    close(fd);
+    return NULL;
+}
+
+/**
+ * @brief Starts the origin server, in a child process, on an ephemeral
+ *     loopback port.
+ *
+ * @return process ID of the origin server.
+ */
+static pid_t origin_start() {
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenfd < 0 || bind(listenfd, (struct sockaddr *)&addr, addrlen) < 0 ||
+        listen(listenfd, 1024) < 0 ||
+        getsockname(listenfd, (struct sockaddr *)&addr, &addrlen) < 0) {
+        perror("origin listen");
+        exit(1);
+    }
+    origin_port = ntohs(addr.sin_port);
+    pid_t pid = fork();
+    if (pid != 0) {
+        close(listenfd);
+        return pid;
+    }
+
+    while (1) {
+        int *fd = malloc(sizeof(int));
+        *fd = accept(listenfd, NULL, NULL);
+        if (*fd < 0) {
+            free(fd);
+            continue;
+        }
+        // Chunk sizes and data are separate writes.
+        int one = 1;
+        setsockopt(*fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        pthread_t tid;
+        pthread_create(&tid, NULL, origin_conn, fd);
+        pthread_detach(tid);
+    }
+}
+
+/**
+ * @brief Returns a loopback port free at the time of the call.
+ */
+static int free_port() {
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, addrlen) < 0 ||
+        getsockname(fd, (struct sockaddr *)&addr, &addrlen) < 0) {
+        perror("free port");
+        exit(1);
+    }
+    close(fd);
+    return ntohs(addr.sin_port);
+}
+
+/**
+ * @brief Starts a proxy, in a child process, with its access log discarded.
+ *
+ * @param[in] front : front end run.
+ * @param[in] c     : case run, whose proxy option is passed along.
+ * @param[in] port  : port the proxy listens on.
+ *
+ * @return process ID of the proxy.
+ */
+static pid_t proxy_start(const front_end *front, const hit_case *c,
+                         int port) {
+    pid_t pid = fork();
+    if (pid != 0)
+        return pid;
+
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+    char port_arg[16];
+    snprintf(port_arg, sizeof(port_arg), "%d", port);
+    char *argv[5] = {"tinyproxy"};
+    int argc = 1;
+    if (front->flag != NULL)
+        argv[argc++] = (char *)front->flag;
+    if (c->flag != NULL)
+        argv[argc++] = (char *)c->flag;
+    argv[argc++] = port_arg;
+    argv[argc] = NULL;
+    _exit(tinyproxy_main(argc, argv));
+}
+
+/**
+ * @brief Connects to the proxy under test, waiting for a proxy just started
+ *     to listen.
+ *
+ * @return socket descriptor, -1 if the proxy never listened.
+ */
+static int proxy_connect() {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(proxy_port);
+    for (int i = 0; i < HIT_TRIES; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+            return fd;
+        close(fd);
+        usleep(50000);
+    }
+    return -1;
+}
+
+/**
+ * @brief Reads <n> body bytes and checks them against the origin body.
+ *
+ * @param[in]     rio : buffer of the proxy connection.
+ * @param[in,out] r   : response read, whose body length grows by <n>.
+ * @param[in]     n   : bytes to read.
+ *
+ * @return true if read whole and matching.
+ */
+static bool read_body(rio_t *rio, reply *r, size_t n) {
+    static char body[HIT_CHUNK];
+    while (n > 0) {
+        size_t want = (n < sizeof(body)) ? n : sizeof(body);
+        if (r->body_len + want > HIT_BODY || rio_readnb(rio, body, want) <= 0 ||
+            memcmp(body, origin_body + r->body_len, want) != 0)
+            return false;
+        r->body_len += want;
+        n -= want;
+    }
+    return true;
+}
+
+/**
+ * @brief Fetches the object of a case over a new proxy connection, reading
+ *     a body framed by Content-Length or by chunks.
+ *
+ * @param[in] c       : case whose object is fetched.
+ * @param[in] version : HTTP version of the request, e.g. "1.1".
+ *
+ * @return response read.
+ */
+static reply fetch_object(const hit_case *c, const char *version) {
+    reply r = {false, false, 0};
+    int fd = proxy_connect();
+    if (fd < 0)
+        return r;
+    rio_t rio;
+    rio_readinitb(&rio, fd);
+    char buf[MAXLINE];
+    int len = snprintf(buf, sizeof(buf),
+                       "GET http://127.0.0.1:%d/%s HTTP/%s\r\n"
+                       "Host: 127.0.0.1:%d\r\n\r\n",
+                       origin_port, c->name, version, origin_port);
+    ssize_t n = -1;
+    if (rio_writen(fd, buf, len) >= 0)
+        n = rio_readlineb(&rio, buf, sizeof(buf));
+    if (n <= 0 || strncmp(buf, "HTTP/1.", 7) != 0 ||
+        strncmp(buf + 8, " 200", 4) != 0) {
+        close(fd);
+        return r;
+    }
+    size_t length = 0;
+    bool chunked = false;
+    while ((n = rio_readlineb(&rio, buf, sizeof(buf))) > 0 &&
+           strcmp(buf, "\r\n") != 0) {
+        if (!strncasecmp(buf, "Content-Length:", 15)) {
+            r.length = true;
+            length = strtoull(buf + 15, NULL, 10);
+        } else if (!strncasecmp(buf, "Transfer-Encoding:", 18)) {
+            chunked = strstr(buf, "chunked") != NULL;
+        }
+    }
+
+    bool ok = n > 0;
+    if (ok && chunked) {
+        size_t size;
+        while ((ok = rio_readlineb(&rio, buf, sizeof(buf)) > 0 &&
+                     sscanf(buf, "%zx", &size) == 1) &&
+               size > 0) {
+            ok = read_body(&rio, &r, size) &&
+                 rio_readlineb(&rio, buf, sizeof(buf)) > 0;
+            if (!ok)
+                break;
+        }
+        ok = ok && rio_readlineb(&rio, buf, sizeof(buf)) > 0;
+    } else if (ok) {
+        ok = r.length && read_body(&rio, &r, length);
+    }
+    r.ok = ok && r.body_len == HIT_BODY;
+    close(fd);
+    return r;
+}
+
+/**
+ * @brief Tests one case on one front end: a miss, then two hits.
+ *
+ * @param[in] front : front end tested.
+ * @param[in] c     : case tested.
+ *
+ * @return true if both hits were served whole, the HTTP/1.0 one framed by
+ *     a Content-Length, without reaching the origin.
+ */
+static bool test_case(const front_end *front, const hit_case *c) {
+    proxy_port = free_port();
+    pid_t pid = proxy_start(front, c, proxy_port);
+
+    long before = atomic_load(fetches);
+    reply miss = fetch_object(c, "1.1");
+    usleep(HIT_SETTLE_US);
+    reply hit = fetch_object(c, "1.1");
+    reply hit10 = fetch_object(c, "1.0");
+    long origin = atomic_load(fetches) - before;
+    bool ok = miss.ok && hit.ok && hit10.ok && hit10.length && origin == 1;
+    printf("%-8s %-8s : miss %s, hits %s/%s, %ld origin fetches\n",
+           front->name, c->name, miss.ok ? "ok" : "bad",
+           hit.ok ? "ok" : "bad",
+           !hit10.ok ? "bad" : hit10.length ? "ok" : "unframed", origin);
+
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return ok;
+}
+
+int main() {
+    signal(SIGPIPE, SIG_IGN);
+    fetches = mmap(NULL, sizeof(atomic_long), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (fetches == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    atomic_init(fetches, 0);
+    for (size_t i = 0; i < sizeof(origin_body); i++)
+        origin_body[i] = 'a' + i % 26;
+
+    pid_t origin = origin_start();
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(front_ends) / sizeof(front_ends[0]); i++) {
+        for (size_t j = 0; j < sizeof(hit_cases) / sizeof(hit_case); j++) {
+            if (!test_case(&front_ends[i], &hit_cases[j]))
+                failed++;
+        }
+    }
+    kill(origin, SIGKILL);
+    waitpid(origin, NULL, 0);
+    printf("%s\n", failed ? "FAIL" : "OK");
+    return failed ? 1 : 0;
+}
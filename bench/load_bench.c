@@ -0,0 +1,557 @@
+/**
+ * @file load_bench.c
+ * @brief Load generator and end-to-end benchmark for the tiny web proxy.
+ *
+ * Starts an origin server of its own on a loopback port, then drives a
+ * running proxy with closed-loop client threads, one connection each, and
+ * reports throughput and p50/p99/p999 latency per workload:
+ *     hit   : a few hot objects, fetched once before timing; all hits.
+ *     miss  : a new URI every request; all misses, served by the origin.
+ *     zipf  : BENCH_OBJECTS objects requested with Zipf(BENCH_ZIPF_S)
+ *             popularity; the hit ratio is whatever the cache achieves.
+ *     sizes : the hit workload for objects from 1 KiB to MAX_OBJECT_SIZE.
+ *     churn : hits over BENCH_CHURN_CONNS connections, each closed after
+ *             one request; latency includes the connect.
+ *
+ * Object sizes are of the whole response, head included, so the largest
+ * object exactly fits the default object size limit. The origin answers
+ * GET /<size>/<name> with <size> bytes, fresh for an hour; every run tags
+ * its names, so reruns against one proxy do not hit earlier objects. The
+ * BENCH_HOT hot objects of the largest size take a few MiB of cache, more
+ * than the default, so run the proxy with a larger one for the hit
+ * workloads to stay hits.
+ *
+ * Build from the repository root with make load_bench, or by hand:
+ *     gcc -O2 -pthread -I. bench/load_bench.c csapp.c -o load_bench -lm
+ *
+ * Usage, with the proxy listening on <port>, e.g. ./tinyproxy -c 64M 8080:
+ *     ./load_bench [-c conns] [-d seconds] [-w workload] <port>
+ *
+ * @author Iltikin Wayet
+ */
+
+#include "cache.h"
+#include "csapp.h"
+
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// Default client connections of the keep-alive workloads.
+#define BENCH_CONNS 32
+// Client connections of the churn workload.
+#define BENCH_CHURN_CONNS 256
+// Default seconds each workload runs.
+#define BENCH_SECONDS 5
+// Object size of the hit, miss, zipf, and churn workloads.
+#define BENCH_SIZE (4 * 1024)
+// Most hot objects of the hit workloads.
+#define BENCH_HOT 64
+// Objects of the zipf workload.
+#define BENCH_OBJECTS 1000
+// Zipf exponent of the zipf workload.
+#define BENCH_ZIPF_S 0.99
+// Longest URI requested.
+#define BENCH_URI 128
+
+// Object sizes of the sizes workload.
+static const size_t bench_sizes[] = {1024, 16 * 1024, 64 * 1024,
+                                     MAX_OBJECT_SIZE};
+
+/**
+ * @brief Kind of URIs a workload requests.
+ */
+typedef enum {
+    WORK_HIT,  // One of a few hot objects
+    WORK_MISS, // A URI never requested before
+    WORK_ZIPF  // One of BENCH_OBJECTS, Zipf distributed
+} work_kind;
+
+/**
+ * @brief Workload run for a fixed time.
+ */
+typedef struct {
+    const char *name; // Workload name
+    work_kind kind;   // URIs requested
+    size_t size;      // Object size, head included
+    size_t hot;       // Hot objects of WORK_HIT
+    int conns;        // Client threads, one connection each
+    bool churn;       // Whether connections close after each request
+} workload;
+
+/**
+ * @brief Client thread and the latencies it measured.
+ */
+typedef struct {
+    const workload *work; // Workload driven
+    pthread_t tid;        // Thread ID
+    uint64_t rng;         // Random state of the thread
+    uint64_t *lat;        // Request latencies in nanoseconds
+    size_t nlat;          // Latencies measured
+    size_t cap;           // Latencies that fit in lat
+    uint64_t bytes;       // Response bytes received
+    long errors;          // Requests failed
+} driver;
+
+// Proxy address, resolved once.
+static struct addrinfo *proxy_addr;
+// Origin server port.
+static int origin_port;
+// Tag making this run's URIs unique.
+static long run_tag;
+// Number of miss URIs taken.
+static atomic_long miss_next;
+// Whether the running workload should stop.
+static atomic_bool stopping;
+// Zipf cumulative distribution over BENCH_OBJECTS objects.
+static double zipf_cdf[BENCH_OBJECTS];
+// Origin response head, given the body length.
+static const char origin_head[] = "HTTP/1.1 200 OK\r\n"
+                                  "Cache-Control: max-age=3600\r\n"
+                                  "Content-Type: application/octet-stream\r\n"
+                                  "Content-Length: %8zu\r\n\r\n";
+// Response bodies, never looked at.
+static char origin_body[MAX_OBJECT_SIZE];
+
+/**
+ * @brief Returns the current monotonic time in nanoseconds.
+ */
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Returns the next of a xorshift64* sequence.
+ *
+ * @param[in,out] state : random state, nonzero.
+ */
+static uint64_t rng_next(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * @brief Serves one origin connection: answers GET /<size>/<name> with a
+ *     response of <size> bytes, until the proxy closes it or asks to.
+ *
+ * @param[in] vargp : void* pointer to the malloc'd connection descriptor.
+ */
+static void *origin_conn(void *vargp) {
+    int fd = *(int *)vargp;
+    free(vargp);
+    rio_t rio;
+    rio_readinitb(&rio, fd);
+    char line[MAXLINE];
+    while (rio_readlineb(&rio, line, sizeof(line)) > 0) {
+        size_t size = BENCH_SIZE;
+        sscanf(line, "GET /%zu/", &size);
+        bool persist = strstr(line, "HTTP/1.1") != NULL;
+        while (rio_readlineb(&rio, line, sizeof(line)) > 0 &&
+               strcmp(line, "\r\n") != 0) {
+            if (!strncasecmp(line, "Connection: close", 17))
+                persist = false;
+        }
+
+        // The padded length keeps the head one size for every body.
+        char head[MAXLINE];
+        int head_len = snprintf(NULL, 0, origin_head, (size_t)0);
+        size_t body = (size > (size_t)head_len) ? size - head_len : 1;
+        if (body > sizeof(origin_body))
+            body = sizeof(origin_body);
+        snprintf(head, sizeof(head), origin_head, body);
+        if (rio_writen(fd, head, head_len) < 0 ||
+            rio_writen(fd, origin_body, body) < 0 || !persist)
+            break;
+    }
+    close(fd);
+    return NULL;
+}
+
+/**
+ * @brief Origin server thread; accepts connections from the proxy.
+ *
+ * @param[in] vargp : void* pointer to the listening socket descriptor.
+ */
+static void *origin(void *vargp) {
+    int listenfd = *(int *)vargp;
+    while (1) {
+        int *fd = malloc(sizeof(int));
+        *fd = accept(listenfd, NULL, NULL);
+        if (*fd < 0) {
+            free(fd);
+            continue;
+        }
+        // Head and body are separate writes.
+        int one = 1;
+        setsockopt(*fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        pthread_t tid;
+        pthread_create(&tid, NULL, origin_conn, fd);
+        pthread_detach(tid);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Starts the origin server on an ephemeral loopback port.
+ */
+static void origin_start() {
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    static int listenfd;
+    listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenfd < 0 || bind(listenfd, (struct sockaddr *)&addr, addrlen) < 0 ||
+        listen(listenfd, 1024) < 0 ||
+        getsockname(listenfd, (struct sockaddr *)&addr, &addrlen) < 0) {
+        perror("origin listen");
+        exit(1);
+    }
+    origin_port = ntohs(addr.sin_port);
+    memset(origin_body, 'x', sizeof(origin_body));
+    pthread_t tid;
+    pthread_create(&tid, NULL, origin, &listenfd);
+    pthread_detach(tid);
+}
+
+/**
+ * @brief Opens a connection to the proxy.
+ *
+ * @return socket descriptor, -1 if not connected.
+ */
+static int proxy_connect() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd >= 0 &&
+        connect(fd, proxy_addr->ai_addr, proxy_addr->ai_addrlen) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Formats the URI of the next request of a client thread.
+ *
+ * @param[in,out] d   : client thread.
+ * @param[out]    uri : buffer of BENCH_URI bytes.
+ */
+static void next_uri(driver *d, char *uri) {
+    const workload *work = d->work;
+    char name[32];
+    switch (work->kind) {
+    case WORK_HIT:
+        snprintf(name, sizeof(name), "h%zu",
+                 (size_t)(rng_next(&d->rng) % work->hot));
+        break;
+    case WORK_MISS:
+        snprintf(name, sizeof(name), "m%ld", atomic_fetch_add(&miss_next, 1));
+        break;
+    case WORK_ZIPF: {
+        double u = (rng_next(&d->rng) >> 11) * 0x1.0p-53;
+        size_t lo = 0, hi = BENCH_OBJECTS - 1;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (zipf_cdf[mid] < u)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        snprintf(name, sizeof(name), "z%zu", lo);
+        break;
+    }
+    }
+    snprintf(uri, BENCH_URI, "http://127.0.0.1:%d/%zu/%ld-%s", origin_port,
+             work->size, run_tag, name);
+}
+
+/**
+ * @brief Sends a request for <uri> and reads the whole response.
+ *
+ * @param[in]  fd    : proxy connection.
+ * @param[in]  rio   : buffer of the proxy connection.
+ * @param[in]  uri   : absolute URI requested.
+ * @param[out] bytes : response bytes received.
+ *
+ * @return 0 if a 200 response was read whole, 1 if then the proxy closes
+ *     the connection, -1 if not read.
+ */
+static int fetch_uri(int fd, rio_t *rio, const char *uri, uint64_t *bytes) {
+    char buf[MAXLINE];
+    int len = snprintf(buf, sizeof(buf),
+                       "GET %s HTTP/1.1\r\nHost: 127.0.0.1:%d\r\n\r\n", uri,
+                       origin_port);
+    if (rio_writen(fd, buf, len) < 0)
+        return -1;
+
+    ssize_t n = rio_readlineb(rio, buf, sizeof(buf));
+    if (n <= 0 || strncmp(buf, "HTTP/1.", 7) != 0 ||
+        strncmp(buf + 8, " 200", 4) != 0)
+        return -1;
+    *bytes += n;
+    bool persist = (buf[7] == '1');
+    size_t length = 0;
+    while ((n = rio_readlineb(rio, buf, sizeof(buf))) > 0) {
+        *bytes += n;
+        if (strcmp(buf, "\r\n") == 0)
+            break;
+        if (strncasecmp(buf, "Content-Length:", 15) == 0)
+            length = strtoull(buf + 15, NULL, 10);
+        else if (strncasecmp(buf, "Connection: close", 17) == 0)
+            persist = false;
+    }
+    if (n <= 0)
+        return -1;
+
+    static __thread char body[64 * 1024];
+    while (length > 0) {
+        size_t want = (length < sizeof(body)) ? length : sizeof(body);
+        n = rio_readnb(rio, body, want);
+        if (n <= 0)
+            return -1;
+        length -= n;
+        *bytes += n;
+    }
+    return persist ? 0 : 1;
+}
+
+/**
+ * @brief Client thread function; requests URIs of its workload back to
+ *     back until told to stop, timing each request.
+ *
+ * @param[in] vargp : void* pointer to the client thread.
+ */
+static void *drive(void *vargp) {
+    driver *d = vargp;
+    int fd = -1;
+    rio_t rio;
+    char uri[BENCH_URI];
+    while (!atomic_load_explicit(&stopping, memory_order_relaxed)) {
+        next_uri(d, uri);
+        uint64_t start = now_ns();
+        int res = -1;
+        // A kept connection the proxy closed meanwhile is retried once on
+        // a new one, as browsers do; the retry counts towards latency.
+        for (int tries = 0; res < 0 && tries < 2; tries++) {
+            bool reused = (fd >= 0);
+            if (fd < 0 && (fd = proxy_connect()) >= 0)
+                rio_readinitb(&rio, fd);
+            if (fd < 0)
+                break;
+            res = fetch_uri(fd, &rio, uri, &d->bytes);
+            if (res < 0) {
+                close(fd);
+                fd = -1;
+            }
+            if (!reused)
+                break;
+        }
+        if (fd >= 0 && (res != 0 || d->work->churn)) {
+            close(fd);
+            fd = -1;
+        }
+        if (res < 0) {
+            d->errors++;
+            continue;
+        }
+        if (d->nlat == d->cap) {
+            d->cap = (d->cap > 0) ? d->cap * 2 : 4096;
+            d->lat = realloc(d->lat, d->cap * sizeof(uint64_t));
+        }
+        d->lat[d->nlat++] = now_ns() - start;
+    }
+    if (fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+/**
+ * @brief Fetches every hot object of a workload once, so that it is cached.
+ *
+ * @param[in] work : hit workload.
+ */
+static void warm(const workload *work) {
+    int fd = proxy_connect();
+    if (fd < 0) {
+        perror("proxy connect");
+        exit(1);
+    }
+    rio_t rio;
+    rio_readinitb(&rio, fd);
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < work->hot; i++) {
+        char uri[BENCH_URI];
+        snprintf(uri, sizeof(uri), "http://127.0.0.1:%d/%zu/%ld-h%zu",
+                 origin_port, work->size, run_tag, i);
+        if (fetch_uri(fd, &rio, uri, &bytes) != 0) {
+            close(fd);
+            if ((fd = proxy_connect()) < 0) {
+                perror("proxy connect");
+                exit(1);
+            }
+            rio_readinitb(&rio, fd);
+        }
+    }
+    close(fd);
+}
+
+/**
+ * @brief Compares two latencies, for qsort.
+ */
+static int lat_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Runs a workload for <seconds> and prints its results.
+ *
+ * @param[in] work    : workload run.
+ * @param[in] seconds : time it runs for.
+ */
+static void bench(const workload *work, int seconds) {
+    if (work->kind == WORK_HIT)
+        warm(work);
+
+    driver *drivers = calloc(work->conns, sizeof(driver));
+    atomic_store(&stopping, false);
+    uint64_t start = now_ns();
+    for (int i = 0; i < work->conns; i++) {
+        drivers[i].work = work;
+        drivers[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1) + run_tag;
+        pthread_create(&drivers[i].tid, NULL, drive, &drivers[i]);
+    }
+    sleep(seconds);
+    atomic_store(&stopping, true);
+
+    size_t total = 0;
+    uint64_t bytes = 0;
+    long errors = 0;
+    for (int i = 0; i < work->conns; i++) {
+        pthread_join(drivers[i].tid, NULL);
+        total += drivers[i].nlat;
+        bytes += drivers[i].bytes;
+        errors += drivers[i].errors;
+    }
+    double elapsed = (now_ns() - start) * 1e-9;
+
+    uint64_t *lat = malloc((total + 1) * sizeof(uint64_t));
+    size_t n = 0;
+    for (int i = 0; i < work->conns; i++) {
+        memcpy(lat + n, drivers[i].lat, drivers[i].nlat * sizeof(uint64_t));
+        n += drivers[i].nlat;
+        free(drivers[i].lat);
+    }
+    free(drivers);
+    qsort(lat, n, sizeof(uint64_t), lat_cmp);
+    lat[n] = 0;
+    double p50 = lat[n * 50 / 100] * 1e-3;
+    double p99 = lat[n * 99 / 100] * 1e-3;
+    double p999 = lat[n * 999 / 1000] * 1e-3;
+    free(lat);
+
+    printf("%-5s %7zu B %4d conns %9.0f req/s %8.1f MB/s  "
+           "p50 %8.1f  p99 %8.1f  p999 %8.1f us  %ld errors\n",
+           work->name, work->size, work->conns, n / elapsed,
+           bytes / elapsed / 1e6, p50, p99, p999, errors);
+    fflush(stdout);
+}
+
+/**
+ * @brief Prints command line usage and exits.
+ *
+ * @param[in] prog : program name.
+ */
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-c conns] [-d seconds] "
+            "[-w hit|miss|zipf|sizes|churn] <port>\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    signal(SIGPIPE, SIG_IGN);
+    int conns = BENCH_CONNS;
+    int seconds = BENCH_SECONDS;
+    const char *only = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:d:w:")) != -1) {
+        switch (opt) {
+        case 'c':
+            conns = atoi(optarg);
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        case 'w':
+            only = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || conns <= 0 || seconds <= 0)
+        usage(argv[0]);
+
+    struct addrinfo hints = {.ai_family = AF_INET,
+                             .ai_socktype = SOCK_STREAM};
+    int res = getaddrinfo("127.0.0.1", argv[optind], &hints, &proxy_addr);
+    if (res != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(res));
+        return 1;
+    }
+    run_tag = (long)getpid() * 1000 + time(NULL) % 1000;
+    origin_start();
+
+    double sum = 0;
+    for (size_t i = 0; i < BENCH_OBJECTS; i++)
+        sum += 1.0 / pow(i + 1, BENCH_ZIPF_S);
+    double acc = 0;
+    for (size_t i = 0; i < BENCH_OBJECTS; i++) {
+        acc += 1.0 / pow(i + 1, BENCH_ZIPF_S) / sum;
+        zipf_cdf[i] = acc;
+    }
+    zipf_cdf[BENCH_OBJECTS - 1] = 1.0;
+
+    workload works[] = {
+        {"hit", WORK_HIT, BENCH_SIZE, BENCH_HOT, conns, false},
+        {"miss", WORK_MISS, BENCH_SIZE, 0, conns, false},
+        {"zipf", WORK_ZIPF, BENCH_SIZE, 0, conns, false},
+        {"churn", WORK_HIT, BENCH_SIZE, BENCH_HOT, BENCH_CHURN_CONNS, true},
+    };
+    for (size_t i = 0; i < sizeof(works) / sizeof(works[0]); i++) {
+        if (only == NULL || !strcmp(only, works[i].name))
+            bench(&works[i], seconds);
+        // Object sizes run after the keep-alive hit workload.
+        if (i == 0 && (only == NULL || !strcmp(only, "sizes"))) {
+            for (size_t j = 0; j < sizeof(bench_sizes) / sizeof(size_t); j++) {
+                workload sized = {"size", WORK_HIT, bench_sizes[j], BENCH_HOT,
+                                  conns, false};
+                bench(&sized, seconds);
+            }
+        }
+    }
+    freeaddrinfo(proxy_addr);
+    return 0;
+}
@@ -0,0 +1,152 @@
+/**
+ * @file parse_bench.c
+ * @brief Request head parsing microbenchmark for the tiny web proxy.
+ *
+ * Parses request heads as browsers and command line clients send them, once
+ * whole and once resumed across reads of a few dozen bytes, and reports time
+ * per head and throughput. Every parse works on a fresh copy of the head,
+ * as the parser terminates it in place; the copy is timed separately and
+ * left out.
+ *
+ * Build from the repository root with make parse_bench (passing e.g.
+ * CFLAGS="-O2 -mavx2"), or by hand, with the vector width to measure:
+ *     gcc -O2 -I. bench/parse_bench.c request.c -o parse_bench
+ *     gcc -O2 -mavx2 -I. bench/parse_bench.c request.c -o parse_bench
+ *     gcc -O2 -DREQUEST_NO_SIMD -I. bench/parse_bench.c request.c \
+ *         -o parse_bench
+ *
+ * Usage:
+ *     ./parse_bench [heads]
+ *
+ * @author Iltikin Wayet
+ */
+
+#include "request.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Default number of heads parsed per measurement.
+#define BENCH_HEADS 1000000
+
+// Read size of the resumed measurement.
+#define BENCH_READ 48
+
+/**
+ * @brief Request head measured.
+ */
+typedef struct {
+    const char *name; // Client that sends it
+    const char *text; // Request head as proxied
+} bench_head;
+
+// Request heads measured.
+static const bench_head bench_heads[] = {
+    {"curl",
+     "GET http://example.com/ HTTP/1.1\r\n"
+     "Host: example.com\r\n"
+     "User-Agent: curl/8.5.0\r\n"
+     "Accept: */*\r\n"
+     "Proxy-Connection: Keep-Alive\r\n"
+     "\r\n"},
+    {"firefox",
+     "GET http://www.example.org/news/index.html HTTP/1.1\r\n"
+     "Host: www.example.org\r\n"
+     "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 "
+     "Firefox/128.0\r\n"
+     "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;"
+     "q=0.8\r\n"
+     "Accept-Language: en-US,en;q=0.5\r\n"
+     "Accept-Encoding: gzip, deflate\r\n"
+     "Connection: keep-alive\r\n"
+     "Referer: http://www.example.org/\r\n"
+     "Upgrade-Insecure-Requests: 1\r\n"
+     "Priority: u=0, i\r\n"
+     "\r\n"},
+    {"chrome",
+     "GET http://www.example.org/assets/app.js?v=20240611 HTTP/1.1\r\n"
+     "Host: www.example.org\r\n"
+     "Proxy-Connection: keep-alive\r\n"
+     "sec-ch-ua: \"Chromium\";v=\"126\", \"Google Chrome\";v=\"126\", "
+     "\"Not-A.Brand\";v=\"8\"\r\n"
+     "sec-ch-ua-mobile: ?0\r\n"
+     "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) "
+     "AppleWebKit/537.36 (KHTML, like Gecko) Chrome/126.0.0.0 "
+     "Safari/537.36\r\n"
+     "sec-ch-ua-platform: \"Windows\"\r\n"
+     "Accept: */*\r\n"
+     "Referer: http://www.example.org/news/index.html\r\n"
+     "Accept-Encoding: gzip, deflate\r\n"
+     "Accept-Language: en-US,en;q=0.9\r\n"
+     "Cookie: _ga=GA1.2.1864768811.1718120000; _gid=GA1.2.492855043."
+     "1718120000; session=eyJ1c2VyIjoiYmVuY2giLCJleHAiOjE3MTgyMDAwMDB9."
+     "c2lnbmF0dXJlLXBsYWNlaG9sZGVy; prefs=theme%3Ddark%26lang%3Den\r\n"
+     "If-None-Match: \"5f3c-61a8e2b9c4d80\"\r\n"
+     "If-Modified-Since: Tue, 11 Jun 2024 08:00:00 GMT\r\n"
+     "\r\n"},
+};
+
+/**
+ * @brief Returns the current monotonic time in seconds.
+ */
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Measures parsing <heads> copies of a request head.
+ *
+ * @param[in] head  : request head.
+ * @param[in] piece : bytes made available per parse call, 0 for all.
+ * @param[in] heads : number of heads to parse.
+ */
+static void bench(const bench_head *head, size_t piece, long heads) {
+    size_t len = strlen(head->text);
+    char *buf = malloc(len);
+    request_parser parser;
+    request_info request;
+
+    // Copy cost alone, subtracted below.
+    double start = now();
+    for (long i = 0; i < heads; i++) {
+        memcpy(buf, head->text, len);
+        __asm__ volatile("" : : "r"(buf) : "memory");
+    }
+    double copy = now() - start;
+
+    start = now();
+    for (long i = 0; i < heads; i++) {
+        memcpy(buf, head->text, len);
+        request_parser_init(&parser);
+        ssize_t res = 0;
+        for (size_t avail = piece; res == 0; avail += piece) {
+            if (piece == 0 || avail > len)
+                avail = len;
+            res = request_parse_head(&parser, &request, buf, avail);
+        }
+        if (res != (ssize_t)len) {
+            fprintf(stderr, "unexpected parse result %zd\n", res);
+            exit(1);
+        }
+    }
+    double elapsed = now() - start - copy;
+    free(buf);
+
+    printf("%-8s %4zu B %2zu headers  %-7s %8.1f ns/head  %8.1f MB/s\n",
+           head->name, len, parser.nheaders, piece ? "resumed" : "whole",
+           elapsed / heads * 1e9, (double)len * heads / elapsed / 1e6);
+}
+
+int main(int argc, char **argv) {
+    long heads = (argc > 1) ? strtol(argv[1], NULL, 10) : BENCH_HEADS;
+
+    for (size_t i = 0; i < sizeof(bench_heads) / sizeof(bench_heads[0]); i++) {
+        bench(&bench_heads[i], 0, heads);
+        bench(&bench_heads[i], BENCH_READ, heads);
+    }
+    return 0;
+}
@@ -0,0 +1,197 @@
+/**
+ * @file relay_bench.c
+ * @brief Response body relay microbenchmark for the tiny web proxy.
+ *
+ * Relays a body from one loopback TCP connection to another, as the proxy
+ * does on a cache miss, with three loops: 8 KiB reads and writes, as rio
+ * buffered relaying did; reads growing from 16 KiB to 256 KiB while they
+ * come back full, as the threaded relay now copies; and splice through a
+ * pipe, as with -r splice. A source thread writes the body and a sink
+ * thread discards it; the time until the sink has all of it is reported.
+ *
+ * Build from the repository root with make relay_bench, or by hand:
+ *     gcc -O2 -pthread -I. bench/relay_bench.c splice.c -o relay_bench
+ *
+ * Usage:
+ *     ./relay_bench [MiB]
+ *
+ * @author Iltikin Wayet
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "splice.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// Default body size relayed per measurement, in MiB.
+#define BENCH_MIB 1024
+
+// Read sizes of the copying loops.
+#define BENCH_RIO (8 * 1024)
+#define BENCH_READ_MIN (16 * 1024)
+#define BENCH_READ_MAX (256 * 1024)
+
+/**
+ * @brief Source of a body: socket to write it to and its size.
+ */
+typedef struct {
+    int fd;      // Socket written to, closed when done
+    size_t size; // Bytes to write
+} bench_source;
+
+/**
+ * @brief Returns the current monotonic time in seconds.
+ */
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Connects a loopback TCP socket pair; exits on failure.
+ *
+ * @param[out] fds : connecting and accepted ends.
+ */
+static void tcp_pair(int fds[2]) {
+    struct sockaddr_in addr = {.sin_family = AF_INET,
+                               .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t len = sizeof(addr);
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenfd < 0 || bind(listenfd, (struct sockaddr *)&addr, len) < 0 ||
+        listen(listenfd, 1) < 0 ||
+        getsockname(listenfd, (struct sockaddr *)&addr, &len) < 0 ||
+        (fds[0] = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+        connect(fds[0], (struct sockaddr *)&addr, len) < 0 ||
+        (fds[1] = accept(listenfd, NULL, NULL)) < 0) {
+        perror("tcp_pair");
+        exit(1);
+    }
+    close(listenfd);
+}
+
+/**
+ * @brief Source thread: writes the body, then closes its socket.
+ *
+ * @param[in] vargp : void* pointer to bench_source struct.
+ */
+static void *source(void *vargp) {
+    bench_source *src = vargp;
+    static char chunk[1 << 20];
+    for (size_t left = src->size; left > 0;) {
+        size_t n = (left < sizeof(chunk)) ? left : sizeof(chunk);
+        ssize_t res = write(src->fd, chunk, n);
+        if (res <= 0) {
+            perror("source");
+            exit(1);
+        }
+        left -= res;
+    }
+    close(src->fd);
+    return NULL;
+}
+
+/**
+ * @brief Sink thread: reads and drops everything until EOF.
+ *
+ * @param[in] vargp : void* pointer to the socket descriptor.
+ */
+static void *sink(void *vargp) {
+    int fd = *(int *)vargp;
+    static char chunk[1 << 20];
+    while (read(fd, chunk, sizeof(chunk)) > 0) {
+    }
+    return NULL;
+}
+
+/**
+ * @brief Copies from <from> to <to> until EOF with reads of <min> bytes,
+ *     doubling up to <max> while they come back full.
+ *
+ * @return number of read and write calls.
+ */
+static long copy_loop(int from, int to, size_t min, size_t max) {
+    char *buf = malloc(max);
+    size_t size = min;
+    long calls = 0;
+    ssize_t n;
+    while ((n = read(from, buf, size)) > 0) {
+        calls++;
+        for (ssize_t off = 0; off < n;) {
+            ssize_t res = write(to, buf + off, n - off);
+            if (res <= 0) {
+                perror("write");
+                exit(1);
+            }
+            off += res;
+            calls++;
+        }
+        if ((size_t)n == size && size < max)
+            size *= 2;
+    }
+    free(buf);
+    return calls;
+}
+
+/**
+ * @brief Measures relaying <size> bytes with one of the loops.
+ *
+ * @param[in] name : loop name.
+ * @param[in] mode : 0 for 8 KiB copies, 1 for growing copies, 2 for splice.
+ * @param[in] size : bytes to relay.
+ */
+static void bench(const char *name, int mode, size_t size) {
+    int in[2];
+    int out[2];
+    tcp_pair(in);
+    tcp_pair(out);
+    bench_source src = {.fd = in[0], .size = size};
+    pthread_t source_tid;
+    pthread_t sink_tid;
+
+    double start = now();
+    pthread_create(&source_tid, NULL, source, &src);
+    pthread_create(&sink_tid, NULL, sink, &out[1]);
+    long calls = -1;
+    if (mode == 2) {
+        if (splice_relay(in[1], out[0], SPLICE_EOF) != (ssize_t)size) {
+            perror("splice_relay");
+            exit(1);
+        }
+    } else {
+        calls = (mode == 0)
+                    ? copy_loop(in[1], out[0], BENCH_RIO, BENCH_RIO)
+                    : copy_loop(in[1], out[0], BENCH_READ_MIN, BENCH_READ_MAX);
+    }
+    close(out[0]);
+    pthread_join(source_tid, NULL);
+    pthread_join(sink_tid, NULL);
+    double elapsed = now() - start;
+    close(in[1]);
+    close(out[1]);
+
+    printf("%-9s %8.1f MB/s", name, size / elapsed / 1e6);
+    if (calls >= 0)
+        printf("  %8.1f syscalls/MiB", calls / (size / 1048576.0));
+    printf("\n");
+}
+
+int main(int argc, char **argv) {
+    size_t mib = (argc > 1) ? strtoul(argv[1], NULL, 10) : BENCH_MIB;
+    size_t size = mib << 20;
+    bench("copy 8K", 0, size);
+    bench("copy grow", 1, size);
+    bench("splice", 2, size);
+    return 0;
+}
@@ -0,0 +1,258 @@
+/**
+ * @file trace_replay.c
+ * @brief Replays request traces of the tiny web proxy against its cache.
+ *
+ * Reads trace files written by the proxy with -T (see trace.h) and replays
+ * their requests, in order, against the cache engine of cache.c, once per
+ * eviction policy and cache size, reporting the hit ratio and byte hit
+ * ratio each would have had, next to the ratios the traced proxy saw.
+ * A replayed hit pins and unpins the block; a miss fills a block with text
+ * of the traced response size, as the proxy fills one, unless larger than
+ * the object size limit. Requests
+ * traced as never cacheable are counted but not replayed, and neither
+ * ratio includes them. Blocks never expire during a replay, and concurrent
+ * misses the proxy collapsed into one fetch replay as one miss and hits.
+ *
+ * Build from the repository root with make trace_replay, or by hand:
+ *     gcc -O2 -pthread -I. bench/trace_replay.c cache.c csapp.c disk.c \
+ *         slab.c -o trace_replay
+ *
+ * Usage:
+ *     ./trace_replay [-o object size] [-s shards] [-c sizes] trace...
+ * where sizes is a comma-separated list, e.g. -c 1M,16M,256M.
+ *
+ * @author Iltikin Wayet
+ */
+
+#include "cache.h"
+#include "csapp.h"
+#include "trace.h"
+
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Cache sizes replayed by default.
+#define REPLAY_SIZES "1M,4M,16M,64M,256M"
+// Most cache sizes replayed.
+#define REPLAY_MAX_SIZES 16
+
+/**
+ * @brief Hits and misses of a replay, or of the traced proxy.
+ */
+typedef struct {
+    uint64_t hits;       // Requests answered from the cache
+    uint64_t misses;     // Cacheable requests that missed
+    uint64_t hit_bytes;  // Response bytes of hits
+    uint64_t miss_bytes; // Response bytes of misses
+} replay_stats;
+
+// Records of all traces, in order.
+static trace_record *records;
+// Number of records.
+static size_t nrecords;
+
+/**
+ * @brief Prints command line usage and exits.
+ *
+ * @param[in] prog : program name.
+ */
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-o object size] [-s shards] [-c sizes] "
+                    "trace...\n",
+            prog);
+    exit(1);
+}
+
+/**
+ * @brief Parses a size in bytes with an optional K, M, or G suffix.
+ *
+ * @param[in]  arg : size argument, e.g. 64M.
+ * @param[out] end : first character past the size.
+ *
+ * @return size in bytes, 0 if none.
+ */
+static size_t parse_size(const char *arg, char **end) {
+    size_t size = strtoull(arg, end, 10);
+    switch (toupper((unsigned char)**end)) {
+    case 'G':
+        size *= 1024;
+        // fall through
+    case 'M':
+        size *= 1024;
+        // fall through
+    case 'K':
+        size *= 1024;
+        (*end)++;
+        break;
+    }
+    return size;
+}
+
+/**
+ * @brief Appends the records of a trace file to the records read so far.
+ *     Exits if the file cannot be read or is not a trace.
+ *
+ * @param[in] path : trace file.
+ */
+static void trace_load(const char *path) {
+    FILE *file = fopen(path, "rb");
+    char magic[TRACE_MAGIC_LEN];
+    if (file == NULL ||
+        fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+        memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0) {
+        fprintf(stderr, "%s: not a trace file\n", path);
+        exit(1);
+    }
+    fseek(file, 0, SEEK_END);
+    size_t n = (ftell(file) - TRACE_MAGIC_LEN) / sizeof(trace_record);
+    fseek(file, TRACE_MAGIC_LEN, SEEK_SET);
+    records = realloc(records, (nrecords + n) * sizeof(trace_record));
+    if (records == NULL ||
+        fread(records + nrecords, sizeof(trace_record), n, file) != n) {
+        fprintf(stderr, "%s: could not read %zu records\n", path, n);
+        exit(1);
+    }
+    nrecords += n;
+    fclose(file);
+}
+
+/**
+ * @brief Prints the hit ratio and byte hit ratio of <stats>.
+ *
+ * @param[in] label : what the ratios are of.
+ * @param[in] stats : hits and misses counted.
+ * @param[in] extra : appended to the line, e.g. evictions.
+ */
+static void report(const char *label, const replay_stats *stats,
+                   const char *extra) {
+    uint64_t requests = stats->hits + stats->misses;
+    uint64_t bytes = stats->hit_bytes + stats->miss_bytes;
+    printf("%-22s %6.2f%% hits  %6.2f%% byte hits%s\n", label,
+           requests ? 100.0 * stats->hits / requests : 0.0,
+           bytes ? 100.0 * stats->hit_bytes / bytes : 0.0, extra);
+}
+
+/**
+ * @brief Replays all records against a fresh cache and reports the ratios.
+ *
+ * @param[in] config : cache configuration replayed.
+ * @param[in] text   : zeroed text of at least the object size limit.
+ */
+static void replay(const cconfig *config, char *text) {
+    cache_init(config);
+    replay_stats stats = {0};
+    size_t limit = config->object_size ? config->object_size : MAX_OBJECT_SIZE;
+    for (size_t i = 0; i < nrecords; i++) {
+        const trace_record *record = &records[i];
+        if (record->result == TRACE_BYPASS)
+            continue;
+        char key[32];
+        snprintf(key, sizeof(key), "trace:%016" PRIx64, record->hash);
+        cblock *block = cache_pin(key);
+        if (block != NULL) {
+            cache_unpin(block);
+            stats.hits++;
+            stats.hit_bytes += record->size;
+            continue;
+        }
+        stats.misses++;
+        stats.miss_bytes += record->size;
+        // Filled as the proxy fills, with the length unknown up front, so
+        // blocks take the storage they take in the proxy.
+        cfill *fill = (record->size <= limit) ? cache_fill(key, 0) : NULL;
+        if (fill != NULL && cache_fill_write(fill, text, record->size))
+            cache_fill_commit(fill);
+        else if (fill != NULL)
+            cache_fill_abort(fill);
+    }
+    cstats cache;
+    cache_stats(&cache);
+    cache_free();
+
+    char label[64];
+    char extra[64];
+    snprintf(label, sizeof(label), "%s %zuK", cache.policy,
+             config->size / 1024);
+    snprintf(extra, sizeof(extra), "  %" PRIu64 " evictions", cache.evictions);
+    report(label, &stats, extra);
+}
+
+int main(int argc, char **argv) {
+    size_t object_size = MAX_OBJECT_SIZE;
+    size_t shards = CACHE_SHARDS;
+    const char *list = REPLAY_SIZES;
+    char *end;
+    int opt;
+    while ((opt = getopt(argc, argv, "o:s:c:")) != -1) {
+        switch (opt) {
+        case 'o':
+            object_size = parse_size(optarg, &end);
+            break;
+        case 's':
+            shards = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            list = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind == argc || object_size == 0 || shards == 0)
+        usage(argv[0]);
+
+    size_t sizes[REPLAY_MAX_SIZES];
+    size_t nsizes = 0;
+    for (const char *p = list; *p != '\0' && nsizes < REPLAY_MAX_SIZES;) {
+        if ((sizes[nsizes++] = parse_size(p, &end)) == 0 ||
+            (*end != ',' && *end != '\0'))
+            usage(argv[0]);
+        p = (*end == ',') ? end + 1 : end;
+    }
+
+    for (int i = optind; i < argc; i++)
+        trace_load(argv[i]);
+    replay_stats traced = {0};
+    uint64_t bypassed = 0;
+    for (size_t i = 0; i < nrecords; i++) {
+        const trace_record *record = &records[i];
+        if (record->result == TRACE_HIT) {
+            traced.hits++;
+            traced.hit_bytes += record->size;
+        } else if (record->result == TRACE_MISS) {
+            traced.misses++;
+            traced.miss_bytes += record->size;
+        } else {
+            bypassed++;
+        }
+    }
+    printf("%zu requests, %" PRIu64 " not cacheable; object limit %zuK, "
+           "%zu shards\n",
+           nrecords, bypassed, object_size / 1024, shards);
+    report("traced", &traced, "");
+
+    char *text = calloc(1, object_size);
+    if (text == NULL) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        return 1;
+    }
+    enum cache_policy policies[] = {CACHE_CLOCK, CACHE_S3FIFO};
+    for (size_t p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+        for (size_t i = 0; i < nsizes; i++) {
+            cconfig config = {.shards = shards,
+                              .size = sizes[i],
+                              .object_size = object_size,
+                              .zerocopy = false,
+                              .policy = policies[p]};
+            replay(&config, text);
+        }
+    }
+    free(text);
+    free(records);
+    return 0;
+}
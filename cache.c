@@ -6,14 +6,73 @@
  * with its associated key such that future requests of the key return the
  * stored data.
  *
- * My implementation uses a circular doubly-linked list of cache blocks.
- * Key implementation details:
+ * My implementation splits the cache into shards chosen by URI hash, each
+ * with its own mutex, slab arena, hash table of blocks, and eviction policy
+ * lists; the policy is a set of hooks picked at startup. Key implementation
+ * details:
  *     - Request URIs used as keys.
  *     - Server response text used as values.
- *     - Block replacement via a least-recently-used policy (LRU).
- *     - Cache automatically resizes by removing LRU block whenever necessary;
- *       stays under MAX_CACHE_SIZE in size.
- *     - Synchronization via mutexes and block reference counts.
+ *     - Block replacement via an eviction policy chosen at startup; each
+ *       policy is a set of hooks (hit, add, evict, remove) over the shard's
+ *       block lists, run with the shard lock held except for hit.
+ *     - CLOCK (default), an approximate least-recently-used policy (LRU);
+ *       hits set a reference bit instead of moving blocks.
+ *     - S3-FIFO, scan-resistant: new blocks enter a small FIFO holding about
+ *       a tenth of the shard, and only blocks hit there move on to the main
+ *       FIFO; the rest are evicted early and remembered in a ghost table,
+ *       which admits them straight to the main FIFO if they come back.
+ *       Main FIFO blocks with hits are reinserted, spending one hit.
+ *     - Hits take no shared write for counting: every thread counts its own
+ *       hits and misses in its epoch slot, summed on demand.
+ *     - Block lookup via a chained hash table indexing the same blocks;
+ *       URI hashes are precomputed, strings only compared on hash match.
+ *     - Every block is one allocation from the slab arena of its shard:
+ *       header, then URI, then up to CACHE_CHUNK_SIZE bytes of inline text.
+ *       Longer text continues in chunks of CACHE_CHUNK_SIZE bytes from the
+ *       same arena, listed in a chunk table; chunks are only ever appended,
+ *       so text growing past the inline part is never copied. Arenas are mapped
+ *       once and split the cache size set at startup between shards, so
+ *       cache memory, allocator overhead included, never exceeds it.
+ *     - Cache automatically resizes by evicting blocks whenever its arena
+ *       has no room for a block; evicted blocks give their memory back to
+ *       the arena once reclaimed.
+ *     - Cache split into shards chosen by URI hash; each shard has its own
+ *       list, hash table, size budget, and mutex.
+ *     - Hits take no lock: readers walk hash buckets inside an epoch and pin
+ *       the block with an atomic reference count while writing its text.
+ *     - Evicted blocks are retired, and only released by the cache once
+ *       every reader that could have seen them has left its epoch; the last
+ *       reference dropped frees the block.
+ *     - With zero-copy enabled, arenas are memfds; pieces of text of at
+ *       least CACHE_ZEROCOPY_MIN bytes are sent straight from the page cache
+ *       with sendfile instead of copied with write.
+ *     - Blocks are filled in place: a fill handle owns an unpublished block
+ *       that is moved to an allocation of at least double, and at least
+ *       CACHE_FILL_CHUNK, bytes when its inline text outgrows it; past
+ *       CACHE_CHUNK_SIZE it gets chunks instead. Committing trims the
+ *       allocations and links the block in.
+ *     - Blocks expire at a time given by their fill; lookups skip stale
+ *       blocks, which are only pinned to be revalidated. A 304 from the
+ *       server stores a new expiry time in the block, atomically, so hits
+ *       resume without copying it; a new response replaces the stale block
+ *       on commit. Validators are not copied out of the text: the block
+ *       keeps the offsets of the ETag and Last-Modified values in its head.
+ *     - With a disk tier, evicted blocks still fresh are copied into its log
+ *       before they are retired, under the shard lock; retired blocks and
+ *       blocks replaced on commit are not. Memory misses look in the disk
+ *       tier; its hits are sent from the log file, or with promotion on,
+ *       filled back into a memory block. A promoted block keeps its expiry,
+ *       so evicting it again leaves the record it came from in place.
+ *     - A snapshot loaded at startup is another read-only tier, looked up
+ *       after the disk tier. Its hits are always promoted, and promoted
+ *       records dropped from its index, so the memory copy is the one
+ *       refreshed, evicted, and saved again. Saving walks every shard's
+ *       lists under the shard lock, then appends the snapshot records never
+ *       hit, so a restart soon after the last one does not lose them.
+ *     - With a compressor configured, committing a fill with no chunks
+ *       hands its text to it first, and keeps the compressed text instead
+ *       if there is any; the disk tier and snapshots store whichever text
+ *       the block holds.
  *
  * Descriptions of individual functions, data structures, and global variables
  * are provided in their respective leading comments.
@@ -23,10 +82,12 @@
 
 #include "cache.h"
 #include "csapp.h"
+#include "hash.h"
 
 #include <assert.h>
 #include <ctype.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -39,241 +100,1868 @@
 #include <netinet/in.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 
-// Mutex instance for the cache.
-static pthread_mutex_t mutex;
-// Cache instance.
-static cinfo *cache;
+/**
+ * @brief Per-thread epoch record for lock-free readers.
+ *     Slots are never freed; a slot released by an exiting thread is reused
+ *     by the next thread that reads from the cache.
+ */
+struct epoch_slot {
+    atomic_uint_fast64_t epoch;     // Epoch entered by reader, 0 if idle.
+    atomic_bool used;               // Whether slot owned by a live thread.
+    atomic_uint_fast64_t hits;      // Lookups that found a block.
+    atomic_uint_fast64_t misses;    // Lookups that found none.
+    atomic_uint_fast64_t refreshes; // Stale blocks revalidated.
+    atomic_uint_fast64_t disk_hits; // Memory misses hit on disk.
+    struct epoch_slot *next;        // Pointer to next slot in list.
+};
+typedef struct epoch_slot eslot;
+
+/**
+ * @brief Eviction policy hooks.
+ *     All but hit run with the shard lock held.
+ */
+struct cache_policy_ops {
+    const char *name;                         // Name given to cache_stats.
+    void (*hit)(cblock *block);               // Lookup found block.
+    void (*add)(cinfo *cache, cblock *block); // Links a new block.
+    cblock *(*evict)(cinfo *cache);           // Unlinks and returns victim.
+    void (*remove)(cinfo *cache, cblock *block); // Unlinks a given block.
+};
+typedef struct cache_policy_ops cpolicy;
+
+// Cache shard instances.
+static cinfo *shards;
+// Number of cache shards.
+static size_t nshards;
+// Largest text cached.
+static size_t object_size;
+// Eviction policy of every shard.
+static const cpolicy *policy;
+// Disk tier behind the shards, NULL if disabled.
+static disk_t *disk;
+// Whether disk hits are copied back into memory.
+static bool promote;
+// Snapshot loaded at startup, NULL if none.
+static disk_t *warm;
+// Compressor of committed text, NULL if text is stored as is.
+static size_t (*compressor)(const char *text, size_t len, char *out,
+                            size_t size);
+
+// Global reclamation epoch; advanced whenever a block is retired.
+static atomic_uint_fast64_t epoch_global = 1;
+// List of all reader epoch slots (push-only).
+static _Atomic(eslot *) epoch_slots;
+// Key releasing a thread's epoch slot on thread exit.
+static pthread_key_t epoch_key;
+// Epoch slot of the calling thread.
+static __thread eslot *epoch_self;
 
 // ---------- HELPER PROTOTYPES ------------ //
 static void block_free(cblock *block);
-static cblock *block_empty();
-static cblock *block_new(const char *uri, char *text, size_t text_len);
-static cblock *cache_findblock(const char *uri);
-static void cache_addblock(cblock *block);
-static void cache_remblock();
+static void block_release(cblock *block);
+static void *block_memory(cinfo *cache, size_t size, size_t *got);
+static cblock *block_new(cinfo *cache, const char *uri, uint64_t hash,
+                         size_t cap);
+static size_t block_room(const cblock *block);
+static bool block_grow(cfill *fill, size_t cap);
+static bool block_chunks(cfill *fill, size_t count);
+static bool block_fit(cfill *fill, size_t size, bool spare);
+static cblock *block_shrink(cblock *block);
+static cblock *block_compress(cblock *block);
+static bool block_fresh(cblock *block, time_t now);
+static void fill_fail(cfill *fill);
+static char *text_at(const cblock *block, size_t offset, size_t *avail);
+static size_t text_before(const cblock *block, size_t offset);
+static void text_copy(cblock *block, size_t offset, const char *data,
+                      size_t n);
+static void text_shift(cblock *block, size_t offset, size_t n);
+static ssize_t text_send(cblock *block, int fd, size_t offset, size_t n);
+static void text_read(const cblock *block, size_t offset, char *buf,
+                      size_t n);
+static size_t text_header(const cblock *block, const char *name,
+                          size_t offset, size_t n, char *buf, size_t size);
+static cinfo *cache_shard(uint64_t hash);
+static cblock *cache_findblock(cinfo *cache, const char *uri, uint64_t hash);
+static void cache_addblock(cinfo *cache, cblock *block);
+static void cache_hashblock(cinfo *cache, cblock *block);
+static void cache_unhashblock(cinfo *cache, cblock *block);
+static void cache_remblock(cinfo *cache);
+static void cache_retire(cinfo *cache, cblock *block);
+static void cache_spill(cblock *block);
+static void block_meta(cblock *block, dmeta *meta);
+static cblock *cache_promote(const char *uri);
+static void cache_reclaim(cinfo *cache);
+static eslot *epoch_slot();
+static void epoch_slot_release(void *vslot);
+static void epoch_enter();
+static void epoch_exit();
+static uint64_t epoch_min();
+static cblock *cache_lookup(const char *uri, bool count, bool stale);
+static void slot_count(atomic_uint_fast64_t *counter);
+static void list_add(cblock **list, cblock *block);
+static void list_del(cblock **list, cblock *block);
+static void list_free(cblock *list);
+static void list_save(dsnap *snap, cblock *list, time_t now);
+static void clock_hit(cblock *block);
+static void clock_add(cinfo *cache, cblock *block);
+static cblock *clock_evict(cinfo *cache);
+static void clock_remove(cinfo *cache, cblock *block);
+static void s3fifo_hit(cblock *block);
+static void s3fifo_add(cinfo *cache, cblock *block);
+static cblock *s3fifo_evict(cinfo *cache);
+static void s3fifo_remove(cinfo *cache, cblock *block);
+
+// Eviction policies, indexed by enum cache_policy.
+static const cpolicy policies[] = {
+    [CACHE_CLOCK] = {"clock", clock_hit, clock_add, clock_evict,
+                     clock_remove},
+    [CACHE_S3FIFO] = {"s3fifo", s3fifo_hit, s3fifo_add, s3fifo_evict,
+                      s3fifo_remove},
+};
 
 // ---------- FUNCTION ROUTINES ------------ //
 
 /**
  * @brief Initializes an empty cache.
- *     Cache empty iff: size = 0, start = NULL.
+ *     Shard empty iff: size = 0, start = NULL.
+ *     Shard count clamped so every shard arena can still hold a largest
+ *     object, with a page to spare for its header and URI; cache size
+ *     split evenly between shard arenas.
+ *
+ * @param[in] config : startup cache configuration.
  */
-void cache_init() {
-    cache = malloc_w(sizeof(cinfo));
-    cache->size = 0;
-    cache->start = NULL;
-    pthread_mutex_init(&mutex, NULL);
+void cache_init(const cconfig *config) {
+    size_t size = (config->size > 0) ? config->size : MAX_CACHE_SIZE;
+    object_size =
+        (config->object_size > 0) ? config->object_size : MAX_OBJECT_SIZE;
+    nshards = config->shards;
+    policy = &policies[config->policy];
+    compressor = config->compress;
+    if (nshards > size / (object_size + SLAB_PAGE_SIZE))
+        nshards = size / (object_size + SLAB_PAGE_SIZE);
+    if (nshards < 1)
+        nshards = 1;
+
+    shards = malloc_w(sizeof(cinfo) * nshards);
+    for (size_t i = 0; i < nshards; i++) {
+        cinfo *cache = &shards[i];
+        cache->size = 0;
+        slab_init(&cache->arena, size / nshards, config->zerocopy);
+        cache->capacity = cache->arena.size;
+        cache->start = NULL;
+        cache->small = NULL;
+        cache->small_size = 0;
+        cache->evictions = 0;
+        memset(cache->ghosts, 0, sizeof(cache->ghosts));
+        cache->retired = NULL;
+        for (size_t j = 0; j < CACHE_BUCKETS; j++)
+            atomic_init(&cache->buckets[j], NULL);
+        pthread_mutex_init(&cache->mutex, NULL);
+    }
+    if (config->disk_path != NULL) {
+        disk = malloc_w(sizeof(disk_t));
+        disk_init(disk, config->disk_path,
+                  (config->disk_size > 0) ? config->disk_size
+                                          : CACHE_DISK_SIZE);
+        promote = config->promote;
+    }
+    if (config->snapshot != NULL) {
+        warm = malloc_w(sizeof(disk_t));
+        if (!disk_load(warm, config->snapshot, time(NULL))) {
+            free(warm);
+            warm = NULL;
+        }
+    }
+    pthread_key_create(&epoch_key, epoch_slot_release);
 }
 
 /**
  * @brief Writes the text of a cached server response.
- *     Searches for block matching <uri>.
- *     If no such match, returns false.
- *     If match, moves block to start of the list.
- *         Then writes text to server file descriptor.
- *     Updates block reference count for synchronization.
+ *     Searches for block matching <uri> without taking the shard lock.
+ *     If no such match, sends a fresh disk tier or snapshot record, if any.
+ *     If match, pins the block and tells the eviction policy.
+ *         Then writes text to server file descriptor and unpins the block.
  *
  * @param[in] uri : client request URI used as key.
  * @param[in] fd  : file descriptor to be used in server connection.
  *
- * @return true if matching block in cache, false if not.
+ * @return true if matching block or record in cache, false if not.
  */
 bool cache_gettext(const char *uri, int fd) {
-    pthread_mutex_lock(&mutex);
-    cblock *block = cache_findblock(uri);
-    // If block not found, return.
+    cblock *block = cache_pin(uri);
+    // If block not found, try the disk tier.
     if (block == NULL) {
-        pthread_mutex_unlock(&mutex);
-        return false;
-    } else {
-        // Move block to start of list (LRU).
-        if (block == cache->start) {
-            block->ref_cont++;
-        } else {
-            block->next->prev = block->prev;
-            block->prev->next = block->next;
+        dentry *entry = cache_pin_disk(uri);
+        if (entry == NULL)
+            return false;
+        disk_writetext(entry->tier, entry, fd);
+        disk_unpin(entry);
+        return true;
+    }
+
+    // Send text to client, then unpin.
+    cache_writetext(block, fd, 0, block->text_len);
+    cache_unpin(block);
+    return true;
+}
+
+/**
+ * @brief Pins the block cached under <uri>, like cache_pin, without
+ *     counting the lookup; for requests whose miss was counted.
+ *     Memory blocks only; the disk tier was looked in by the miss.
+ *
+ * @param[in] uri : client request URI used as key.
+ *
+ * @return pinned block, NULL if no fresh matching block in cache.
+ */
+cblock *cache_repin(const char *uri) {
+    return cache_lookup(uri, false, false);
+}
+
+/**
+ * @brief Pins the block cached under <uri> so its text can be sent later.
+ *     Searches for block matching <uri> without taking the shard lock.
+ *     If fresh match, takes a reference and tells the eviction policy.
+ *     Else fills a block from a fresh snapshot record, or with promotion on
+ *     from a fresh disk tier record.
+ *
+ * @param[in] uri : client request URI used as key.
+ *
+ * @return pinned block, NULL if no fresh matching block in cache.
+ */
+cblock *cache_pin(const char *uri) {
+    cblock *block = cache_lookup(uri, true, false);
+    if (block == NULL && (promote || warm != NULL))
+        block = cache_promote(uri);
+    return block;
+}
+
+/**
+ * @brief Pins the block cached under <uri>, fresh or stale, to revalidate
+ *     it; the lookup is not counted.
+ *
+ * @param[in] uri : client request URI used as key.
+ *
+ * @return pinned block, NULL if no matching block in cache.
+ */
+cblock *cache_pin_stale(const char *uri) {
+    return cache_lookup(uri, false, true);
+}
+
+/**
+ * @brief Formats the request headers revalidating a pinned block:
+ *     If-None-Match with its ETag, If-Modified-Since with its Last-Modified.
+ *     Values copied out of the head of the block text.
+ *
+ * @param[in]  block : pinned block.
+ * @param[out] buf   : buffer to format headers into.
+ * @param[in]  size  : size of <buf>.
+ *
+ * @return length of the headers, 0 if the block has no validators or they
+ *     do not fit.
+ */
+size_t cache_conditions(cblock *block, char *buf, size_t size) {
+    size_t len = text_header(block, "If-None-Match: ", block->etag,
+                             block->etag_len, buf, size);
+    len += text_header(block, "If-Modified-Since: ", block->modified,
+                       block->modified_len, buf + len, size - len);
+    return len;
+}
+
+/**
+ * @brief Marks a pinned block fresh until <expires>, after the server
+ *     confirmed it is still valid.
+ *     A block evicted meanwhile is refreshed to no effect.
+ *
+ * @param[in] block   : pinned block.
+ * @param[in] expires : when the text goes stale again, time(NULL) seconds;
+ *                      -1 renews the lifetime it was cached with.
+ */
+void cache_refresh(cblock *block, time_t expires) {
+    if (expires < 0)
+        expires = time(NULL) + block->lifetime;
+    atomic_store_explicit(&block->expires, expires, memory_order_relaxed);
+    slot_count(&epoch_slot()->refreshes);
+}
+
+/**
+ * @brief Pins the disk tier or snapshot record of <uri>, if fresh, so its
+ *     text can be sent with cache_senddisk; for lookups that missed in
+ *     memory.
+ *     The disk tier is newer, so looked up first. Counts a disk hit.
+ *
+ * @param[in] uri : client request URI used as key.
+ *
+ * @return pinned entry, NULL if no fresh record.
+ */
+dentry *cache_pin_disk(const char *uri) {
+    uint64_t hash = hash_string(uri);
+    time_t now = time(NULL);
+    dentry *entry = NULL;
+    if (disk != NULL)
+        entry = disk_pin(disk, uri, hash, now);
+    if (entry == NULL && warm != NULL)
+        entry = disk_pin(warm, uri, hash, now);
+    if (entry != NULL)
+        slot_count(&epoch_slot()->disk_hits);
+    return entry;
+}
 
-            cache_addblock(block);
-            cache->size -= block->text_len;
+/**
+ * @brief Sends text of a pinned disk record from <offset> with a single
+ *     sendfile.
+ *
+ * @param[in] entry  : pinned entry.
+ * @param[in] fd     : file descriptor to which the text is written.
+ * @param[in] offset : offset into the text to send from, below its length.
+ *
+ * @return bytes sent, -1 on error (errno set, EAGAIN if <fd> would block).
+ */
+ssize_t cache_senddisk(dentry *entry, int fd, size_t offset) {
+    return disk_sendtext(entry->tier, entry, fd, offset,
+                         entry->text_len - offset);
+}
+
+/**
+ * @brief Unpins an entry returned by cache_pin_disk.
+ *
+ * @param[in] entry : pinned entry.
+ */
+void cache_unpin_disk(dentry *entry) {
+    disk_unpin(entry);
+}
+
+/**
+ * @brief Unpins a block returned by cache_pin.
+ *
+ * @param[in] block : pinned block.
+ */
+void cache_unpin(cblock *block) {
+    block_release(block);
+}
+
+/**
+ * @brief Sends text of a pinned block from <offset> with a single write.
+ *     Sends at most up to the end of the inline text or chunk holding
+ *     <offset>; memory file backed text sent with sendfile.
+ *
+ * @param[in] block  : pinned block.
+ * @param[in] fd     : file descriptor to which block text is written.
+ * @param[in] offset : offset into the block text to send from.
+ *
+ * @return bytes sent, -1 on error (errno set, EAGAIN if <fd> would block).
+ */
+ssize_t cache_sendtext(cblock *block, int fd, size_t offset) {
+    return text_send(block, fd, offset, block->text_len - offset);
+}
+
+/**
+ * @brief Sends up to <n> bytes of text of a pinned block from <offset>
+ *     with a single write; for text still filling, whose length is not to
+ *     be read.
+ *
+ * @param[in] block  : pinned block.
+ * @param[in] fd     : file descriptor to which block text is written.
+ * @param[in] offset : offset into the block text to send from.
+ * @param[in] n      : bytes wanted, greater than 0.
+ *
+ * @return bytes sent, -1 on error (errno set, EAGAIN if <fd> would block).
+ */
+ssize_t cache_sendpart(cblock *block, int fd, size_t offset, size_t n) {
+    return text_send(block, fd, offset, n);
+}
+
+/**
+ * @brief Writes <n> bytes of text of a pinned block from <offset>.
+ *     Written piecewise, one inline text or chunk part at a time.
+ *
+ * @param[in] block  : pinned block.
+ * @param[in] fd     : file descriptor to which block text is written.
+ * @param[in] offset : offset into the block text to write from.
+ * @param[in] n      : number of bytes to write.
+ *
+ * @return 0 if successful, -1 on error.
+ */
+int cache_writetext(cblock *block, int fd, size_t offset, size_t n) {
+    while (n > 0) {
+        ssize_t sent = text_send(block, fd, offset, n);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
         }
-        // Send text to client.
-        pthread_mutex_unlock(&mutex);
-        rio_writen(fd, block->text, block->text_len);
-
-        // Block no longer referenced.
-        pthread_mutex_lock(&mutex);
-        block->ref_cont--;
-        pthread_mutex_unlock(&mutex);
-        return true;
+        offset += sent;
+        n -= sent;
     }
+    return 0;
+}
+
+/**
+ * @brief Locates text of a pinned block for I/O submitted elsewhere, e.g.
+ *     to io_uring; the text stays in place while the block is pinned.
+ *
+ * @param[in]  block  : pinned block.
+ * @param[in]  offset : offset into the text, less than its length.
+ * @param[out] avail  : bytes of text contiguous from <offset>.
+ *
+ * @return pointer to the text at <offset>.
+ */
+const char *cache_textspan(cblock *block, size_t offset, size_t *avail) {
+    char *p = text_at(block, offset, avail);
+    if (*avail > (size_t)block->text_len - offset)
+        *avail = block->text_len - offset;
+    return p;
+}
+
+/**
+ * @brief Locates up to <n> bytes of text of a pinned block, for text still
+ *     filling, whose length is not to be read.
+ *
+ * @param[in]  block  : pinned block.
+ * @param[in]  offset : offset into the text.
+ * @param[in]  n      : bytes wanted.
+ * @param[out] avail  : bytes of text contiguous from <offset>, at most <n>.
+ *
+ * @return pointer to the text at <offset>.
+ */
+const char *cache_textpart(cblock *block, size_t offset, size_t n,
+                           size_t *avail) {
+    char *p = text_at(block, offset, avail);
+    if (*avail > n)
+        *avail = n;
+    return p;
+}
+
+/**
+ * @brief Returns the mapped text of an entry returned by cache_pin_disk.
+ *
+ * @param[in] entry : pinned entry.
+ */
+const char *cache_disktext(dentry *entry) {
+    return disk_text(entry->tier, entry);
 }
 
 /**
- * @brief Inserts a block at the front of the cache.
- *     Automatically resizes cache as necessary.
- *     To do so, continuously removes blocks at end of the list (LRU).
+ * @brief Inserts a block into its cache shard.
+ *     Fills a block with a copy of <text> and commits it.
  *
  * @param[in] uri      : client request URI used as key.
  * @param[in] text     : server response text to store with key.
  * @param[in] text_len : length of server response text.
  */
 void cache_insert(const char *uri, char *text, ssize_t text_len) {
-    pthread_mutex_lock(&mutex);
-    cblock *block = cache_findblock(uri);
-    // If matching block exists, do nothing.
-    if (block == NULL) {
-        // Downsize cache until block fits.
-        while (cache->size + text_len > MAX_CACHE_SIZE) {
-            cache_remblock();
+    cfill *fill = cache_fill(uri, text_len);
+    if (fill == NULL)
+        return;
+    cache_fill_write(fill, text, text_len);
+    cache_fill_commit(fill);
+}
+
+/**
+ * @brief Starts filling a block for <uri> with text of unknown length.
+ *     The block is private to the fill until committed.
+ *     Limit is the smaller of the object size limit and what the shard
+ *     arena can hold next to the block header and URI; storage for
+ *     <size_hint> bytes allocated up front.
+ *
+ * @param[in] uri       : client request URI used as key.
+ * @param[in] size_hint : expected text length, 0 if unknown.
+ *
+ * @return fill handle, NULL if <size_hint> already exceeds the limit or no
+ *     memory could be freed for the block.
+ */
+cfill *cache_fill(const char *uri, size_t size_hint) {
+    uint64_t hash = hash_string(uri);
+    cinfo *cache = cache_shard(hash);
+    size_t overhead = sizeof(cblock) + strlen(uri) + 1;
+    size_t max = slab_max(&cache->arena);
+    if (overhead >= max)
+        return NULL;
+    size_t limit = object_size;
+    if (max - overhead < limit)
+        limit = max - overhead;
+    if (size_hint > limit)
+        return NULL;
+
+    size_t cap = (size_hint < CACHE_CHUNK_SIZE) ? size_hint : CACHE_CHUNK_SIZE;
+    cblock *block = block_new(cache, uri, hash, cap);
+    if (block == NULL)
+        return NULL;
+    cfill *fill = malloc_w(sizeof(cfill));
+    fill->block = block;
+    fill->limit = limit;
+    fill->fresh.expires = LONG_MAX;
+    fill->fresh.lifetime = 0;
+    fill->fresh.etag = 0;
+    fill->fresh.etag_len = 0;
+    fill->fresh.modified = 0;
+    fill->fresh.modified_len = 0;
+    if (size_hint > block->text_cap && !block_fit(fill, size_hint, false)) {
+        cache_fill_abort(fill);
+        return NULL;
+    }
+    return fill;
+}
+
+/**
+ * @brief Appends <n> bytes of text to a fill.
+ *
+ * @param[in] fill : fill handle.
+ * @param[in] data : text to append.
+ * @param[in] n    : length of <data>.
+ *
+ * @return true if the text was stored, false if the fill failed.
+ */
+bool cache_fill_write(cfill *fill, const void *data, size_t n) {
+    if (fill->block == NULL)
+        return false;
+    return cache_fill_insert(fill, fill->block->text_len, data, n);
+}
+
+/**
+ * @brief Inserts <n> bytes of text at <offset> of the text filled so far.
+ *     Inline storage grows to at least double its size, and at least
+ *     CACHE_FILL_CHUNK, so appends cost amortized constant moves; beyond
+ *     CACHE_CHUNK_SIZE, chunks are appended without moving any text.
+ *     A fill growing past its limit fails and frees its storage.
+ *
+ * @param[in] fill   : fill handle.
+ * @param[in] offset : offset at most the current text length.
+ * @param[in] data   : text to insert.
+ * @param[in] n      : length of <data>.
+ *
+ * @return true if the text was stored, false if the fill failed.
+ */
+bool cache_fill_insert(cfill *fill, size_t offset, const void *data,
+                       size_t n) {
+    cblock *block = fill->block;
+    if (block == NULL)
+        return false;
+    size_t len = block->text_len;
+    if (len + n > fill->limit) {
+        fill_fail(fill);
+        return false;
+    }
+
+    if (len + n > block_room(block)) {
+        if (!block_fit(fill, len + n, true)) {
+            fill_fail(fill);
+            return false;
         }
-        block = block_new(uri, text, text_len);
-        cache_addblock(block);
+        block = fill->block;
+    }
+    if (offset < len)
+        text_shift(block, offset, n);
+    text_copy(block, offset, data, n);
+    block->text_len = len + n;
+    return true;
+}
+
+/**
+ * @brief Reserves storage for <size> bytes of text in a fill.
+ *     Text of a fill never moves while it fits in its reservation, and
+ *     writes within it never fail; so all chunks are allocated up front.
+ *
+ * @param[in] fill : fill handle.
+ * @param[in] size : total text length to reserve.
+ *
+ * @return true if reserved, false if the fill failed.
+ */
+bool cache_fill_reserve(cfill *fill, size_t size) {
+    if (fill->block == NULL)
+        return false;
+    if (size > fill->limit) {
+        fill_fail(fill);
+        return false;
+    }
+    if (size > block_room(fill->block) && !block_fit(fill, size, false)) {
+        fill_fail(fill);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Records the freshness of the response being filled, given to its
+ *     block on commit.
+ *     Fills without freshness never go stale.
+ *
+ * @param[in] fill  : fill handle.
+ * @param[in] fresh : expiry time and validator offsets of the response.
+ */
+void cache_fill_fresh(cfill *fill, const cfresh *fresh) {
+    fill->fresh = *fresh;
+}
+
+/**
+ * @brief Pins the block being filled so its text can be read while it is
+ *     written; the pin keeps the text valid after commit or abort.
+ *
+ * @param[in] fill : fill handle.
+ *
+ * @return pinned block, NULL if the fill failed.
+ */
+cblock *cache_fill_pin(cfill *fill) {
+    if (fill->block != NULL)
+        atomic_fetch_add_explicit(&fill->block->ref_cont, 1,
+                                  memory_order_relaxed);
+    return fill->block;
+}
+
+/**
+ * @brief Publishes the filled text in its cache shard and frees the handle.
+ *     Storage trimmed to the text, then the block is linked in, unless a
+ *     fresh block was cached for the URI in the meantime; a stale one is
+ *     replaced. Its memory was already made room for when it was allocated.
+ *     Empty and failed fills are dropped.
+ *
+ * @param[in] fill : fill handle.
+ */
+void cache_fill_commit(cfill *fill) {
+    cblock *block = fill->block;
+    cfresh fresh = fill->fresh;
+    free(fill);
+    if (block == NULL)
+        return;
+    if (block->text_len == 0) {
+        block_release(block);
+        return;
+    }
+    if (compressor != NULL && block->nchunks == 0)
+        block = block_compress(block);
+    block = block_shrink(block);
+    atomic_store_explicit(&block->expires, fresh.expires,
+                          memory_order_relaxed);
+    block->lifetime = fresh.lifetime;
+    block->etag = fresh.etag;
+    block->etag_len = fresh.etag_len;
+    block->modified = fresh.modified;
+    block->modified_len = fresh.modified_len;
+    cinfo *cache = cache_shard(block->hash);
+
+    pthread_mutex_lock(&cache->mutex);
+    // If fresh matching block exists, keep it.
+    cblock *old = cache_findblock(cache, block->uri, block->hash);
+    if (old != NULL && !block_fresh(old, time(NULL))) {
+        policy->remove(cache, old);
+        cache_retire(cache, old);
+        old = NULL;
+    }
+    if (old == NULL) {
+        cache_addblock(cache, block);
+        cache_hashblock(cache, block);
+        block = NULL;
+    }
+    cache_reclaim(cache);
+    pthread_mutex_unlock(&cache->mutex);
+
+    if (block != NULL)
+        block_release(block);
+}
+
+/**
+ * @brief Drops the filled text and frees the handle.
+ *
+ * @param[in] fill : fill handle.
+ */
+void cache_fill_abort(cfill *fill) {
+    if (fill->block != NULL)
+        block_release(fill->block);
+    free(fill);
+}
+
+/**
+ * @brief Reads the cache statistics.
+ *     Thread counters read without stopping their threads; shard figures
+ *     read under each shard lock.
+ *
+ * @param[out] stats : statistics.
+ */
+void cache_stats(cstats *stats) {
+    stats->policy = policy->name;
+    stats->hits = 0;
+    stats->misses = 0;
+    stats->evictions = 0;
+    stats->refreshes = 0;
+    stats->size = 0;
+    stats->capacity = 0;
+    stats->disk_hits = 0;
+    stats->spills = 0;
+    stats->disk_size = 0;
+    stats->disk_capacity = 0;
+    if (disk != NULL) {
+        pthread_mutex_lock(&disk->mutex);
+        stats->spills = disk->writes;
+        stats->disk_size = disk->used;
+        stats->disk_capacity = disk->size;
+        pthread_mutex_unlock(&disk->mutex);
+    }
+    eslot *slot = atomic_load(&epoch_slots);
+    for (; slot != NULL; slot = slot->next) {
+        stats->hits += atomic_load_explicit(&slot->hits, memory_order_relaxed);
+        stats->misses +=
+            atomic_load_explicit(&slot->misses, memory_order_relaxed);
+        stats->refreshes +=
+            atomic_load_explicit(&slot->refreshes, memory_order_relaxed);
+        stats->disk_hits +=
+            atomic_load_explicit(&slot->disk_hits, memory_order_relaxed);
+    }
+    for (size_t i = 0; i < nshards; i++) {
+        cinfo *cache = &shards[i];
+        pthread_mutex_lock(&cache->mutex);
+        stats->evictions += cache->evictions;
+        stats->size += cache->size;
+        stats->capacity += cache->capacity;
+        pthread_mutex_unlock(&cache->mutex);
+    }
+}
+
+/**
+ * @brief Saves the fresh blocks, and the snapshot records not hit since
+ *     startup, as the snapshot at <path>; the cache keeps serving.
+ *     Each shard is written under its lock, stalling its fills meanwhile;
+ *     hits go on.
+ *
+ * @param[in] path : snapshot path, replaced only once the snapshot is whole.
+ *
+ * @return 0 if saved, -1 on error.
+ */
+int cache_save(const char *path) {
+    dsnap snap;
+    if (!disk_snap_open(&snap, path))
+        return -1;
+    time_t now = time(NULL);
+    for (size_t i = 0; i < nshards; i++) {
+        cinfo *cache = &shards[i];
+        pthread_mutex_lock(&cache->mutex);
+        list_save(&snap, cache->start, now);
+        list_save(&snap, cache->small, now);
+        pthread_mutex_unlock(&cache->mutex);
     }
-    pthread_mutex_unlock(&mutex);
+    if (warm != NULL)
+        disk_snap_tier(&snap, warm, now);
+    return disk_snap_close(&snap);
 }
 
 /**
- * @brief Frees cache list and block items.
+ * @brief Frees cache shards and block items.
+ *     Assumes no reader is still using the cache.
  */
 void cache_free() {
-    if (cache->start != NULL) {
-        cblock *curr = cache->start;
-        do {
-            curr = curr->next;
-            block_free(curr->prev);
-        } while (curr != cache->start);
+    for (size_t i = 0; i < nshards; i++) {
+        cinfo *cache = &shards[i];
+        list_free(cache->start);
+        list_free(cache->small);
+        while (cache->retired != NULL) {
+            cblock *next = cache->retired->rnext;
+            block_free(cache->retired);
+            cache->retired = next;
+        }
+        slab_deinit(&cache->arena);
+        pthread_mutex_destroy(&cache->mutex);
+    }
+    free(shards);
+    if (disk != NULL) {
+        disk_deinit(disk);
+        free(disk);
+        disk = NULL;
+    }
+    if (warm != NULL) {
+        disk_deinit(warm);
+        free(warm);
+        warm = NULL;
     }
-    free(cache);
 }
 
 // ---------- HELPER ROUTINES ------------ //
 
 /**
  * @brief Frees a cache block.
- *     Waits until reference count of block = 0; no longer referenced.
- *     Then safely frees block URI, text, and data structure.
+ *     Header, URI, inline text, chunks, and chunk table return to the shard
+ *     arena together.
  *
  * @param[in] block : cache block to be freed.
  */
 static void block_free(cblock *block) {
-    // Continuously check if ref_cont 0.
-    while (1) {
-        if (block->ref_cont == 0) {
-            free(block->uri);
-            free(block->text);
-            free(block);
-            return;
-        }
+    slab_t *arena = &cache_shard(block->hash)->arena;
+    for (size_t i = 0; i < block->nchunks; i++)
+        slab_free(arena, block->chunks[i]);
+    if (block->chunks != NULL)
+        slab_free(arena, block->chunks);
+    slab_free(arena, block);
+}
+
+/**
+ * @brief Drops one reference to a cache block.
+ *     Frees the block when its last reference is dropped.
+ *
+ * @param[in] block : cache block no longer referenced by caller.
+ */
+static void block_release(cblock *block) {
+    if (atomic_fetch_sub_explicit(&block->ref_cont, 1, memory_order_acq_rel) ==
+        1)
+        block_free(block);
+}
+
+/**
+ * @brief Allocates <size> bytes of a shard arena for a block.
+ *     When the arena has no room, evicts blocks chosen by the policy and
+ *     reclaims them until it has, or the shard is empty.
+ *
+ * @param[in]  cache : shard whose arena to allocate from.
+ * @param[in]  size  : bytes needed.
+ * @param[out] got   : bytes actually allocated.
+ *
+ * @return allocated memory, NULL if it does not fit even after evicting.
+ */
+static void *block_memory(cinfo *cache, size_t size, size_t *got) {
+    void *mem = slab_alloc(&cache->arena, size, got);
+    if (mem != NULL)
+        return mem;
+
+    pthread_mutex_lock(&cache->mutex);
+    cache_reclaim(cache);
+    while ((mem = slab_alloc(&cache->arena, size, got)) == NULL &&
+           cache->size > 0) {
+        cache_remblock(cache);
+        cache_reclaim(cache);
     }
+    pthread_mutex_unlock(&cache->mutex);
+    return mem;
 }
 
 /**
- * @brief Returns an empty block.
+ * @brief Returns an empty block with room for <cap> bytes of text.
  *     Circular list; block points to itself.
+ *     Starts with the single reference owned by the cache.
+ *     URI copied right behind the header, text storage right behind it.
+ *
+ * @param[in] cache : shard of the block.
+ * @param[in] uri   : client request URI used as key.
+ * @param[in] hash  : precomputed hash of <uri>.
+ * @param[in] cap   : text storage needed.
  *
- * @return block with empty values.
+ * @return empty block, NULL if no memory could be freed for it.
  */
-static cblock *block_empty() {
-    cblock *block = malloc_w(sizeof(cblock));
+static cblock *block_new(cinfo *cache, const char *uri, uint64_t hash,
+                         size_t cap) {
+    size_t uri_len = strlen(uri) + 1;
+    size_t size;
+    cblock *block =
+        block_memory(cache, sizeof(cblock) + uri_len + cap, &size);
+    if (block == NULL)
+        return NULL;
+
+    char *key = (char *)(block + 1);
+    memcpy(key, uri, sizeof(char) * uri_len);
     block->text_len = 0;
-    block->ref_cont = 0;
+    block->text_cap = size - sizeof(cblock) - uri_len;
+    block->size = size;
+    atomic_init(&block->ref_cont, 1);
+    atomic_init(&block->freq, 0);
+    block->retire_epoch = 0;
     block->next = block;
     block->prev = block;
-    block->uri = NULL;
-    block->text = NULL;
+    atomic_init(&block->hnext, NULL);
+    block->rnext = NULL;
+    block->hash = hash;
+    block->uri = key;
+    block->text = key + uri_len;
+    block->chunks = NULL;
+    block->nchunks = 0;
+    block->slots = 0;
+    atomic_init(&block->expires, LONG_MAX);
+    block->lifetime = 0;
+    block->etag = 0;
+    block->etag_len = 0;
+    block->modified = 0;
+    block->modified_len = 0;
+    block->small = false;
     return block;
 }
 
 /**
- * @brief Returns a block with the inputted fields.
- *     First makes empty block, then initializes block values
- *     according to <uri>, <text>, and <text_len>.
+ * @brief Returns the text storage of a block, inline and in chunks.
  *
- * @param[in] uri      : client request URI used as key.
- * @param[in] text     : server response text to store with key.
- * @param[in] text_len : length of server response text.
+ * @param[in] block : cache block.
+ */
+static size_t block_room(const cblock *block) {
+    return block->text_cap + block->nchunks * CACHE_CHUNK_SIZE;
+}
+
+/**
+ * @brief Grows the inline text of a fill's block, which has no chunks yet,
+ *     to hold <cap> bytes.
+ *     Extends the allocation in place when the arena memory behind it is
+ *     free; otherwise moves the block to a new allocation, evicting for it.
+ *     A block too large to have both allocations at once has its text
+ *     staged on the heap while it is reallocated.
+ *     A pinned block cannot move; readers hold its text.
+ *
+ * @param[in] fill : fill handle with a block.
+ * @param[in] cap  : new inline text storage size, larger than text_cap.
  *
- * @return block with corresponding fields.
+ * @return true if grown, false if pinned or out of memory.
  */
-static cblock *block_new(const char *uri, char *text, size_t text_len) {
-    cblock *block = block_empty();
-    block->text_len = text_len;
-    size_t uri_len = strlen(uri) + 1;
+static bool block_grow(cfill *fill, size_t cap) {
+    cblock *old = fill->block;
+    cinfo *cache = cache_shard(old->hash);
+    size_t overhead = old->size - old->text_cap;
+    size_t size = slab_extend(&cache->arena, old, overhead + cap);
+    if (size > 0) {
+        old->size = size;
+        old->text_cap = size - overhead;
+        return true;
+    }
+    if (atomic_load_explicit(&old->ref_cont, memory_order_acquire) > 1)
+        return false;
 
-    block->uri = malloc_w(sizeof(char) * uri_len);
-    block->text = malloc_w(sizeof(char) * text_len);
+    cblock *block = block_new(cache, old->uri, old->hash, cap);
+    if (block != NULL) {
+        memcpy(block->text, old->text, old->text_len);
+        block->text_len = old->text_len;
+        block_release(old);
+        fill->block = block;
+        return true;
+    }
 
-    memcpy(block->uri, uri, sizeof(char) * uri_len);
-    memcpy(block->text, text, sizeof(char) * text_len);
+    // Free the old block first, keeping its URI and text aside.
+    size_t len = old->text_len;
+    char *stash = malloc_w(overhead + len);
+    char *uri = stash + len;
+    memcpy(stash, old->text, len);
+    strcpy(uri, old->uri);
+    uint64_t hash = old->hash;
+    block_release(old);
+    fill->block = block_new(cache, uri, hash, cap);
+    if (fill->block != NULL) {
+        memcpy(fill->block->text, stash, len);
+        fill->block->text_len = len;
+    }
+    free(stash);
+    return fill->block != NULL;
+}
 
-    return block;
+/**
+ * @brief Allocates chunks for a fill's block until it has <count>.
+ *     A full chunk table moves to an allocation at least twice as large;
+ *     readers of a pinned block may be walking the table, so a pinned
+ *     block only gets chunks its table has slots for.
+ *
+ * @param[in] fill  : fill handle with a block.
+ * @param[in] count : number of chunks needed.
+ *
+ * @return true if allocated, false if pinned with a full table or out of
+ *     memory.
+ */
+static bool block_chunks(cfill *fill, size_t count) {
+    cblock *block = fill->block;
+    cinfo *cache = cache_shard(block->hash);
+    size_t got;
+    if (count > block->slots) {
+        if (atomic_load_explicit(&block->ref_cont, memory_order_acquire) > 1)
+            return false;
+        size_t slots = block->slots * 2;
+        if (slots < count)
+            slots = count;
+        char **chunks = block_memory(cache, sizeof(char *) * slots, &got);
+        if (chunks == NULL)
+            return false;
+        if (block->chunks != NULL) {
+            memcpy(chunks, block->chunks, sizeof(char *) * block->nchunks);
+            slab_free(&cache->arena, block->chunks);
+            block->size -= sizeof(char *) * block->slots;
+        }
+        block->chunks = chunks;
+        block->slots = got / sizeof(char *);
+        block->size += got;
+    }
+    while (block->nchunks < count) {
+        char *chunk = block_memory(cache, CACHE_CHUNK_SIZE, &got);
+        if (chunk == NULL)
+            return false;
+        block->chunks[block->nchunks++] = chunk;
+        block->size += got;
+    }
+    return true;
 }
 
 /**
- * @brief Finds a block with matching <uri> in the cache.
+ * @brief Makes room for <size> bytes of text in a fill's block.
+ *     Text up to CACHE_CHUNK_SIZE stays inline; with <spare>, inline storage
+ *     grows to at least double, and at least CACHE_FILL_CHUNK, bytes.
+ *     Longer text gets chunks behind the inline text, which stays put.
  *
- * @param[in] uri : client request URI used as key.
- * @return NULL if list empty or no match, matching block otherwise.
+ * @param[in] fill  : fill handle with a block.
+ * @param[in] size  : text length needed, at most the fill limit.
+ * @param[in] spare : whether to leave room for further appends.
+ *
+ * @return true if the block has room, false if it could not grow.
  */
-static cblock *cache_findblock(const char *uri) {
-    cblock *curr = cache->start;
-    // Check if list empty.
-    if (curr == NULL) {
-        return NULL;
+static bool block_fit(cfill *fill, size_t size, bool spare) {
+    cblock *block = fill->block;
+    if (block->nchunks == 0 && size <= CACHE_CHUNK_SIZE) {
+        size_t cap = size;
+        if (spare) {
+            cap = block->text_cap * 2;
+            if (cap < CACHE_FILL_CHUNK)
+                cap = CACHE_FILL_CHUNK;
+            if (cap < size)
+                cap = size;
+            if (cap > CACHE_CHUNK_SIZE)
+                cap = CACHE_CHUNK_SIZE;
+            if (cap > fill->limit)
+                cap = fill->limit;
+        }
+        return block_grow(fill, cap);
     }
-    // Iterate through and return matching block.
-    do {
-        if (!strcmp(uri, curr->uri))
+    size_t count = (size - block->text_cap + CACHE_CHUNK_SIZE - 1) /
+                   CACHE_CHUNK_SIZE;
+    return block_chunks(fill, count);
+}
+
+/**
+ * @brief Returns unused memory of a filled block to its arena.
+ *     Chunks past the text are freed and the last one gives back its
+ *     trailing pages. Without chunks, page runs give back their trailing
+ *     pages in place, and a block using at most half its memory then moves
+ *     to a smaller chunk class, when nobody pins it; the move is a copy of
+ *     at most half a page. A filled block takes no more text, so text_cap
+ *     may then exceed the inline storage held.
+ *
+ * @param[in] block : filled block, not yet in the cache.
+ *
+ * @return trimmed block, possibly moved.
+ */
+static cblock *block_shrink(cblock *block) {
+    cinfo *cache = cache_shard(block->hash);
+    size_t len = block->text_len;
+    size_t count = 0;
+    if (len > block->text_cap)
+        count = (len - block->text_cap + CACHE_CHUNK_SIZE - 1) /
+                CACHE_CHUNK_SIZE;
+    while (block->nchunks > count) {
+        slab_free(&cache->arena, block->chunks[--block->nchunks]);
+        block->size -= CACHE_CHUNK_SIZE;
+    }
+    if (count > 0) {
+        size_t used =
+            len - block->text_cap - (count - 1) * CACHE_CHUNK_SIZE;
+        size_t held =
+            slab_shrink(&cache->arena, block->chunks[count - 1], used);
+        block->size -= CACHE_CHUNK_SIZE - held;
+        return block;
+    }
+    if (block->chunks != NULL) {
+        slab_free(&cache->arena, block->chunks);
+        block->size -= sizeof(char *) * block->slots;
+        block->chunks = NULL;
+        block->slots = 0;
+    }
+
+    size_t overhead = block->size - block->text_cap;
+    size_t needed = overhead + block->text_len;
+    // text_cap stays; followers of a pinned block locate text by it.
+    if (block->size >= SLAB_PAGE_SIZE)
+        block->size = slab_shrink(&cache->arena, block, needed);
+    if (needed * 2 > block->size ||
+        atomic_load_explicit(&block->ref_cont, memory_order_acquire) > 1)
+        return block;
+
+    size_t size;
+    cblock *small = slab_alloc(&cache->arena, needed, &size);
+    if (small == NULL)
+        return block;
+    memcpy(small, block, needed);
+    small->size = size;
+    small->text_cap = size - overhead;
+    small->next = small;
+    small->prev = small;
+    small->uri = (char *)(small + 1);
+    small->text = (char *)small + (block->text - (char *)block);
+    slab_free(&cache->arena, block);
+    return small;
+}
+
+/**
+ * @brief Replaces the inline text of a block with its compressed text,
+ *     if the compressor takes it.
+ *     In place unless followers have the block pinned; they keep reading
+ *     the text as filled, so the compressed text then goes in a new block.
+ *
+ * @param[in] block : filled block, not yet in the cache, without chunks.
+ *
+ * @return block with the text to commit, possibly a new one.
+ */
+static cblock *block_compress(cblock *block) {
+    static __thread char *scratch;
+    if (scratch == NULL)
+        scratch = malloc_w(CACHE_CHUNK_SIZE);
+    size_t size = (block->text_len < CACHE_CHUNK_SIZE) ? block->text_len
+                                                       : CACHE_CHUNK_SIZE;
+    size_t len = compressor(block->text, block->text_len, scratch, size);
+    if (len == 0)
+        return block;
+    if (atomic_load_explicit(&block->ref_cont, memory_order_acquire) == 1) {
+        memcpy(block->text, scratch, len);
+        block->text_len = len;
+        return block;
+    }
+
+    cblock *packed = block_new(cache_shard(block->hash), block->uri,
+                               block->hash, len);
+    if (packed == NULL)
+        return block;
+    memcpy(packed->text, scratch, len);
+    packed->text_len = len;
+    block_release(block);
+    return packed;
+}
+
+/**
+ * @brief Returns whether a block is still fresh at <now>.
+ *
+ * @param[in] block : cache block.
+ * @param[in] now   : current time, time(NULL) seconds.
+ */
+static bool block_fresh(cblock *block, time_t now) {
+    return atomic_load_explicit(&block->expires, memory_order_relaxed) > now;
+}
+
+/**
+ * @brief Fails a fill; its block and memory are released right away
+ *     unless still pinned.
+ *
+ * @param[in] fill : fill handle.
+ */
+static void fill_fail(cfill *fill) {
+    if (fill->block != NULL)
+        block_release(fill->block);
+    fill->block = NULL;
+}
+
+/**
+ * @brief Locates byte <offset> of a block's text storage.
+ *
+ * @param[in]  block  : cache block.
+ * @param[in]  offset : offset into the text, below block_room.
+ * @param[out] avail  : contiguous bytes from the returned pointer on.
+ *
+ * @return pointer to the byte, inline or in a chunk.
+ */
+static char *text_at(const cblock *block, size_t offset, size_t *avail) {
+    if (offset < block->text_cap) {
+        *avail = block->text_cap - offset;
+        return block->text + offset;
+    }
+    offset -= block->text_cap;
+    *avail = CACHE_CHUNK_SIZE - offset % CACHE_CHUNK_SIZE;
+    return block->chunks[offset / CACHE_CHUNK_SIZE] +
+           offset % CACHE_CHUNK_SIZE;
+}
+
+/**
+ * @brief Returns how many bytes right before <offset> of a block's text are
+ *     contiguous in storage.
+ *
+ * @param[in] block  : cache block.
+ * @param[in] offset : offset into the text, greater than 0.
+ */
+static size_t text_before(const cblock *block, size_t offset) {
+    if (offset <= block->text_cap)
+        return offset;
+    size_t rem = (offset - block->text_cap) % CACHE_CHUNK_SIZE;
+    return (rem > 0) ? rem : CACHE_CHUNK_SIZE;
+}
+
+/**
+ * @brief Copies <n> bytes of <data> into a block's text at <offset>.
+ *
+ * @param[in] block  : cache block with room for offset + n bytes.
+ * @param[in] offset : offset into the text.
+ * @param[in] data   : bytes to copy.
+ * @param[in] n      : number of bytes.
+ */
+static void text_copy(cblock *block, size_t offset, const char *data,
+                      size_t n) {
+    while (n > 0) {
+        size_t avail;
+        char *p = text_at(block, offset, &avail);
+        if (avail > n)
+            avail = n;
+        memcpy(p, data, avail);
+        offset += avail;
+        data += avail;
+        n -= avail;
+    }
+}
+
+/**
+ * @brief Moves the text of a block from <offset> on <n> bytes back,
+ *     opening a hole of <n> bytes at <offset>.
+ *     Copies back to front, a contiguous piece at a time.
+ *
+ * @param[in] block  : cache block with room for text_len + n bytes.
+ * @param[in] offset : offset into the text, at most text_len.
+ * @param[in] n      : size of the hole.
+ */
+static void text_shift(cblock *block, size_t offset, size_t n) {
+    size_t end = block->text_len;
+    while (end > offset) {
+        size_t piece = end - offset;
+        size_t src = text_before(block, end);
+        size_t dst = text_before(block, end + n);
+        if (piece > src)
+            piece = src;
+        if (piece > dst)
+            piece = dst;
+        size_t avail;
+        char *from = text_at(block, end - piece, &avail);
+        char *to = text_at(block, end + n - piece, &avail);
+        memmove(to, from, piece);
+        end -= piece;
+    }
+}
+
+/**
+ * @brief Writes up to <n> bytes of a block's text from <offset> to <fd>,
+ *     at most one contiguous piece.
+ *     Large pieces of an arena with a memory file go out with sendfile,
+ *     falling back to write where <fd> does not take it.
+ *
+ * @param[in] block  : pinned cache block.
+ * @param[in] fd     : file descriptor to write to.
+ * @param[in] offset : offset into the text.
+ * @param[in] n      : bytes wanted, greater than 0.
+ *
+ * @return bytes written, -1 on error with errno set.
+ */
+static ssize_t text_send(cblock *block, int fd, size_t offset, size_t n) {
+    slab_t *arena = &cache_shard(block->hash)->arena;
+    size_t avail;
+    char *p = text_at(block, offset, &avail);
+    if (n > avail)
+        n = avail;
+    if (arena->memfd >= 0 && n >= CACHE_ZEROCOPY_MIN) {
+        off_t off = slab_offset(arena, p);
+        ssize_t rc = sendfile(fd, arena->memfd, &off, n);
+        if (rc >= 0 || (errno != EINVAL && errno != ENOSYS))
+            return rc;
+    }
+    return write(fd, p, n);
+}
+
+/**
+ * @brief Copies <n> bytes of a block's text from <offset> into <buf>.
+ *
+ * @param[in]  block  : cache block.
+ * @param[in]  offset : offset into the text.
+ * @param[out] buf    : buffer of at least <n> bytes.
+ * @param[in]  n      : number of bytes, at most text_len - offset.
+ */
+static void text_read(const cblock *block, size_t offset, char *buf,
+                      size_t n) {
+    while (n > 0) {
+        size_t avail;
+        const char *p = text_at(block, offset, &avail);
+        if (avail > n)
+            avail = n;
+        memcpy(buf, p, avail);
+        offset += avail;
+        buf += avail;
+        n -= avail;
+    }
+}
+
+/**
+ * @brief Formats a header line with a value taken from a block's text.
+ *
+ * @param[in]  block  : cache block.
+ * @param[in]  name   : header name with its colon and space.
+ * @param[in]  offset : offset of the value in the text, 0 if none.
+ * @param[in]  n      : length of the value.
+ * @param[out] buf    : buffer to format the line into.
+ * @param[in]  size   : size of <buf>.
+ *
+ * @return length of the line, 0 if no value or it does not fit.
+ */
+static size_t text_header(const cblock *block, const char *name,
+                          size_t offset, size_t n, char *buf, size_t size) {
+    size_t name_len = strlen(name);
+    if (offset == 0 || name_len + n + 2 > size)
+        return 0;
+    memcpy(buf, name, name_len);
+    text_read(block, offset, buf + name_len, n);
+    memcpy(buf + name_len + n, "\r\n", 2);
+    return name_len + n + 2;
+}
+
+/**
+ * @brief Returns the cache shard responsible for <hash>.
+ *     Uses the high hash bits; low bits select the bucket within a shard.
+ *
+ * @param[in] hash : precomputed hash of a client request URI.
+ * @return shard holding blocks with <hash>.
+ */
+static cinfo *cache_shard(uint64_t hash) {
+    return &shards[(hash >> 32) % nshards];
+}
+
+/**
+ * @brief Finds a block with matching <uri> in a cache shard.
+ *     Only walks the hash bucket of <hash>; URIs compared on hash match.
+ *     Safe without the shard lock when called inside an epoch.
+ *
+ * @param[in] cache : shard to search, lock held or epoch entered.
+ * @param[in] uri   : client request URI used as key.
+ * @param[in] hash  : precomputed hash of <uri>.
+ * @return NULL if no match, matching block otherwise.
+ */
+static cblock *cache_findblock(cinfo *cache, const char *uri, uint64_t hash) {
+    _Atomic(cblock *) *bucket = &cache->buckets[hash & (CACHE_BUCKETS - 1)];
+    cblock *curr = atomic_load_explicit(bucket, memory_order_acquire);
+    // Iterate through bucket chain and return matching block.
+    while (curr != NULL) {
+        if (curr->hash == hash && !strcmp(uri, curr->uri))
             return curr;
-        curr = curr->next;
-    } while (curr != cache->start);
+        curr = atomic_load_explicit(&curr->hnext, memory_order_acquire);
+    }
     return NULL;
 }
 
 /**
- * @brief Adds a block to the front of the list.
- *     Increments cache size accordingly.
+ * @brief Adds a block to the shard through its eviction policy.
+ *     Increments shard size accordingly.
+ *
+ * @param[in] cache : shard to add to, lock held.
+ * @param[in] block : block to add.
+ */
+static void cache_addblock(cinfo *cache, cblock *block) {
+    policy->add(cache, block);
+    cache->size += block->size;
+}
+
+/**
+ * @brief Adds a block to the front of its hash bucket chain.
+ *     Publishes the block to lock-free readers.
+ *
+ * @param[in] cache : shard to index in, lock held.
+ * @param[in] block : block to index by its URI hash.
+ */
+static void cache_hashblock(cinfo *cache, cblock *block) {
+    _Atomic(cblock *) *bucket =
+        &cache->buckets[block->hash & (CACHE_BUCKETS - 1)];
+    atomic_store_explicit(&block->hnext,
+                          atomic_load_explicit(bucket, memory_order_relaxed),
+                          memory_order_relaxed);
+    atomic_store_explicit(bucket, block, memory_order_release);
+}
+
+/**
+ * @brief Removes a block from its hash bucket chain.
+ *     The block keeps its own hnext so readers standing on it can move on.
+ *
+ * @param[in] cache : shard indexing <block>, lock held.
+ * @param[in] block : indexed block to remove from the hash table.
+ */
+static void cache_unhashblock(cinfo *cache, cblock *block) {
+    _Atomic(cblock *) *link =
+        &cache->buckets[block->hash & (CACHE_BUCKETS - 1)];
+    while (atomic_load_explicit(link, memory_order_relaxed) != block)
+        link = &atomic_load_explicit(link, memory_order_relaxed)->hnext;
+    atomic_store_explicit(
+        link, atomic_load_explicit(&block->hnext, memory_order_relaxed),
+        memory_order_release);
+}
+
+/**
+ * @brief Evicts the block chosen by the eviction policy.
+ *     Evicted block is unlinked, written to the disk tier, and retired.
+ *
+ * @param[in] cache : shard to remove from, lock held, not empty.
+ */
+static void cache_remblock(cinfo *cache) {
+    cblock *rem = policy->evict(cache);
+    cache->evictions++;
+    cache_spill(rem);
+    cache_retire(cache, rem);
+}
+
+/**
+ * @brief Retires a block unlinked from the policy lists.
+ *     Removed from the hash table; reclaimed by cache_reclaim.
+ *     Updates shard size accordingly.
+ *
+ * @param[in] cache : shard holding <block>, lock held.
+ * @param[in] block : block no longer in any policy list.
+ */
+static void cache_retire(cinfo *cache, cblock *block) {
+    cache->size -= block->size;
+    cache_unhashblock(cache, block);
+
+    // Readers entering after this epoch can no longer find the block.
+    block->retire_epoch = atomic_fetch_add(&epoch_global, 1);
+    block->rnext = cache->retired;
+    cache->retired = block;
+}
+
+/**
+ * @brief Copies an evicted block into the disk tier, if it has one and the
+ *     block is still fresh.
+ *     Skipped when the log has no room free of pinned records.
+ *
+ * @param[in] block : block being evicted, shard lock held.
+ */
+static void cache_spill(cblock *block) {
+    if (disk == NULL || !block_fresh(block, time(NULL)))
+        return;
+    dmeta meta;
+    block_meta(block, &meta);
+    dentry *entry;
+    char *text = disk_reserve(disk, block->uri, block->hash, block->text_len,
+                              &meta, &entry);
+    if (text == NULL)
+        return;
+    text_read(block, 0, text, block->text_len);
+    disk_commit(disk, entry);
+}
+
+/**
+ * @brief Records the freshness of a block for the disk tier.
+ *
+ * @param[in]  block : cache block.
+ * @param[out] meta  : expiry time and validator offsets of the block.
+ */
+static void block_meta(cblock *block, dmeta *meta) {
+    *meta = (dmeta){
+        .expires = atomic_load_explicit(&block->expires, memory_order_relaxed),
+        .lifetime = block->lifetime,
+        .etag = block->etag,
+        .etag_len = block->etag_len,
+        .modified = block->modified,
+        .modified_len = block->modified_len};
+}
+
+/**
+ * @brief Fills a memory block from the fresh disk tier record of <uri>,
+ *     with promotion on, or else from its fresh snapshot record.
+ *     The block is published like any fill, keeping the record's expiry
+ *     and validators, and pinned for the caller. A promoted snapshot record
+ *     leaves the snapshot index. Counts a disk hit once promoted.
+ *
+ * @param[in] uri : client request URI used as key.
+ *
+ * @return pinned block, NULL if no fresh record or it does not fit.
+ */
+static cblock *cache_promote(const char *uri) {
+    uint64_t hash = hash_string(uri);
+    time_t now = time(NULL);
+    dentry *entry = NULL;
+    if (promote)
+        entry = disk_pin(disk, uri, hash, now);
+    if (entry == NULL && warm != NULL)
+        entry = disk_pin(warm, uri, hash, now);
+    if (entry == NULL)
+        return NULL;
+    cblock *block = NULL;
+    cfill *fill = cache_fill(uri, entry->text_len);
+    if (fill != NULL && cache_fill_write(fill, disk_text(entry->tier, entry),
+                                         entry->text_len)) {
+        cfresh fresh = {.expires = entry->meta.expires,
+                        .lifetime = entry->meta.lifetime,
+                        .etag = entry->meta.etag,
+                        .etag_len = entry->meta.etag_len,
+                        .modified = entry->meta.modified,
+                        .modified_len = entry->meta.modified_len};
+        cache_fill_fresh(fill, &fresh);
+        block = cache_fill_pin(fill);
+    }
+    if (fill != NULL)
+        cache_fill_commit(fill);
+    if (block != NULL) {
+        slot_count(&epoch_slot()->disk_hits);
+        if (entry->tier == warm)
+            disk_drop(warm, entry);
+    }
+    disk_unpin(entry);
+    return block;
+}
+
+/**
+ * @brief Releases the cache's reference to retired blocks no reader can
+ *     still find, i.e. blocks retired before the oldest active epoch.
+ *     Blocks still pinned by readers are freed by their last reader.
+ *
+ * @param[in] cache : shard to reclaim from, lock held.
+ */
+static void cache_reclaim(cinfo *cache) {
+    if (cache->retired == NULL)
+        return;
+
+    uint64_t safe = epoch_min();
+    cblock **link = &cache->retired;
+    while (*link != NULL) {
+        cblock *block = *link;
+        if (block->retire_epoch < safe) {
+            *link = block->rnext;
+            block_release(block);
+        } else {
+            link = &block->rnext;
+        }
+    }
+}
+
+/**
+ * @brief Looks up and pins the block cached under <uri>.
+ *     Searches for block matching <uri> without taking the shard lock.
+ *     If match, takes a reference and tells the eviction policy; a stale
+ *     match counts as a miss unless asked for.
+ *
+ * @param[in] uri   : client request URI used as key.
+ * @param[in] count : whether to count the lookup as a hit or miss.
+ * @param[in] stale : whether a stale block is returned too.
+ *
+ * @return pinned block, NULL if no matching block in cache.
+ */
+static cblock *cache_lookup(const char *uri, bool count, bool stale) {
+    uint64_t hash = hash_string(uri);
+    cinfo *cache = cache_shard(hash);
+
+    // Blocks seen inside the epoch still hold the cache's own reference.
+    epoch_enter();
+    cblock *block = cache_findblock(cache, uri, hash);
+    if (block != NULL)
+        atomic_fetch_add_explicit(&block->ref_cont, 1, memory_order_relaxed);
+    epoch_exit();
+    if (block != NULL && !stale && !block_fresh(block, time(NULL))) {
+        block_release(block);
+        block = NULL;
+    }
+
+    if (count)
+        slot_count((block != NULL) ? &epoch_self->hits : &epoch_self->misses);
+    if (block != NULL)
+        policy->hit(block);
+    return block;
+}
+
+/**
+ * @brief Counts an event in a counter of the calling thread's epoch slot.
+ *     Only this thread writes its counters; no read-modify-write needed.
+ *
+ * @param[in] counter : counter of the calling thread's slot.
+ */
+static void slot_count(atomic_uint_fast64_t *counter) {
+    atomic_store_explicit(
+        counter, atomic_load_explicit(counter, memory_order_relaxed) + 1,
+        memory_order_relaxed);
+}
+
+/**
+ * @brief Adds a block at the tail of a circular block list.
  *
- * @param[in] block : block to add to front of the list.
+ * @param[in] list  : list head; oldest block, or CLOCK hand.
+ * @param[in] block : block in no list.
  */
-static void cache_addblock(cblock *block) {
-    if (cache->start == NULL) {
-        cache->start = block;
+static void list_add(cblock **list, cblock *block) {
+    if (*list == NULL) {
+        block->next = block;
+        block->prev = block;
+        *list = block;
     } else {
-        block->next = cache->start;
-        block->prev = cache->start->prev;
+        block->next = *list;
+        block->prev = (*list)->prev;
 
         block->prev->next = block;
         block->next->prev = block;
+    }
+}
 
-        cache->start = block;
+/**
+ * @brief Removes a block from a circular block list.
+ *
+ * @param[in] list  : list head.
+ * @param[in] block : block in <list>.
+ */
+static void list_del(cblock **list, cblock *block) {
+    block->prev->next = block->next;
+    block->next->prev = block->prev;
+    if (*list == block)
+        *list = (block->next == block) ? NULL : block->next;
+    block->next = block;
+    block->prev = block;
+}
+
+/**
+ * @brief Frees every block of a circular block list.
+ *
+ * @param[in] list : list head, NULL if empty.
+ */
+static void list_free(cblock *list) {
+    if (list == NULL)
+        return;
+    // Break the circle, then free blocks in list order.
+    list->prev->next = NULL;
+    while (list != NULL) {
+        cblock *next = list->next;
+        block_free(list);
+        list = next;
     }
-    block->ref_cont++;
-    cache->size += block->text_len;
 }
 
 /**
- * @brief Removes a block from the end of the list.
- *     Since LRU policy, the block we want to remove is always at the end
- *     of the circular, doubly-linked cache list.
- *     Updates cache size and block reference counts accordingly.
+ * @brief Appends the fresh blocks of a circular list to a snapshot.
+ *
+ * @param[in] snap : snapshot being written.
+ * @param[in] list : list head, shard lock held; may be NULL.
+ * @param[in] now  : current time, time(NULL) seconds.
+ */
+static void list_save(dsnap *snap, cblock *list, time_t now) {
+    if (list == NULL)
+        return;
+    cblock *block = list;
+    do {
+        if (block_fresh(block, now)) {
+            dmeta meta;
+            block_meta(block, &meta);
+            disk_snap_add(snap, block->uri, block->hash, block->text_len,
+                          &meta);
+            for (size_t offset = 0; offset < (size_t)block->text_len;) {
+                size_t avail;
+                const char *text = text_at(block, offset, &avail);
+                if (avail > block->text_len - offset)
+                    avail = block->text_len - offset;
+                disk_snap_write(snap, text, avail);
+                offset += avail;
+            }
+        }
+        block = block->next;
+    } while (block != list);
+}
+
+/**
+ * @brief CLOCK hit: sets the reference bit.
+ *     Skips the store if set to keep the line shared.
+ *
+ * @param[in] block : pinned block.
  */
-static void cache_remblock() {
-    cblock *rem = cache->start->prev;
-    cblock *prev_new = rem->prev;
+static void clock_hit(cblock *block) {
+    if (!atomic_load_explicit(&block->freq, memory_order_relaxed))
+        atomic_store_explicit(&block->freq, 1, memory_order_relaxed);
+}
 
-    prev_new->next = cache->start;
-    cache->start->prev = prev_new;
-    cache->size -= rem->text_len;
+/**
+ * @brief CLOCK add: links a block just behind the CLOCK hand.
+ *     New blocks are the last ones the hand reaches.
+ *
+ * @param[in] cache : shard to add to, lock held.
+ * @param[in] block : block to add.
+ */
+static void clock_add(cinfo *cache, cblock *block) {
+    list_add(&cache->start, block);
+}
 
-    if (rem == cache->start)
-        cache->start = NULL;
+/**
+ * @brief CLOCK evict: unlinks the block under the CLOCK hand.
+ *     Blocks with their reference bit set get a second chance: the bit is
+ *     cleared and the hand moves on.
+ *
+ * @param[in] cache : shard to evict from, lock held, not empty.
+ *
+ * @return unlinked victim.
+ */
+static cblock *clock_evict(cinfo *cache) {
+    cblock *rem = cache->start;
+    while (atomic_exchange_explicit(&rem->freq, 0, memory_order_relaxed)) {
+        rem = rem->next;
+    }
+    cache->start = rem;
+    list_del(&cache->start, rem);
+    return rem;
+}
+
+/**
+ * @brief CLOCK remove: unlinks a block; the hand moves on if on it.
+ *
+ * @param[in] cache : shard holding <block>, lock held.
+ * @param[in] block : block to unlink.
+ */
+static void clock_remove(cinfo *cache, cblock *block) {
+    list_del(&cache->start, block);
+}
+
+/**
+ * @brief S3-FIFO hit: counts the hit, saturating at 3.
+ *
+ * @param[in] block : pinned block.
+ */
+static void s3fifo_hit(cblock *block) {
+    unsigned char freq =
+        atomic_load_explicit(&block->freq, memory_order_relaxed);
+    if (freq < 3)
+        atomic_store_explicit(&block->freq, freq + 1, memory_order_relaxed);
+}
 
-    rem->ref_cont--;
-    block_free(rem);
+/**
+ * @brief S3-FIFO add: links a block at the tail of the small FIFO, or of
+ *     the main FIFO if its URI is a ghost of a recently evicted block.
+ *
+ * @param[in] cache : shard to add to, lock held.
+ * @param[in] block : block to add.
+ */
+static void s3fifo_add(cinfo *cache, cblock *block) {
+    uint64_t *ghost = &cache->ghosts[block->hash & (CACHE_GHOSTS - 1)];
+    if (*ghost == block->hash) {
+        *ghost = 0;
+        list_add(&cache->start, block);
+        return;
+    }
+    list_add(&cache->small, block);
+    cache->small_size += block->size;
+    block->small = true;
+}
+
+/**
+ * @brief S3-FIFO evict: unlinks the next victim.
+ *     While the small FIFO holds a tenth of the shard or more (or the main
+ *     FIFO is empty), its oldest block is evicted, into the ghost table,
+ *     unless it was hit more than once there; then it moves to the main
+ *     FIFO. Otherwise the oldest main FIFO block is evicted, unless it was
+ *     hit; then it is reinserted with one hit less.
+ *
+ * @param[in] cache : shard to evict from, lock held, not empty.
+ *
+ * @return unlinked victim.
+ */
+static cblock *s3fifo_evict(cinfo *cache) {
+    while (1) {
+        if (cache->small != NULL &&
+            (cache->small_size * 10 >= cache->size || cache->start == NULL)) {
+            cblock *rem = cache->small;
+            list_del(&cache->small, rem);
+            cache->small_size -= rem->size;
+            rem->small = false;
+            if (atomic_load_explicit(&rem->freq, memory_order_relaxed) > 1) {
+                atomic_store_explicit(&rem->freq, 0, memory_order_relaxed);
+                list_add(&cache->start, rem);
+                continue;
+            }
+            cache->ghosts[rem->hash & (CACHE_GHOSTS - 1)] = rem->hash;
+            return rem;
+        }
+
+        cblock *rem = cache->start;
+        unsigned char freq =
+            atomic_load_explicit(&rem->freq, memory_order_relaxed);
+        if (freq > 0) {
+            atomic_store_explicit(&rem->freq, freq - 1, memory_order_relaxed);
+            cache->start = rem->next;
+            continue;
+        }
+        list_del(&cache->start, rem);
+        return rem;
+    }
+}
+
+/**
+ * @brief S3-FIFO remove: unlinks a block from whichever FIFO holds it.
+ *
+ * @param[in] cache : shard holding <block>, lock held.
+ * @param[in] block : block to unlink.
+ */
+static void s3fifo_remove(cinfo *cache, cblock *block) {
+    if (block->small) {
+        list_del(&cache->small, block);
+        cache->small_size -= block->size;
+        block->small = false;
+    } else {
+        list_del(&cache->start, block);
+    }
+}
+
+/**
+ * @brief Returns the epoch slot of the calling thread.
+ *     Reuses a released slot if any, otherwise pushes a new one.
+ *
+ * @return epoch slot owned by the calling thread.
+ */
+static eslot *epoch_slot() {
+    if (epoch_self != NULL)
+        return epoch_self;
+
+    eslot *slot = atomic_load(&epoch_slots);
+    for (; slot != NULL; slot = slot->next) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&slot->used, &expected, true))
+            break;
+    }
+    if (slot == NULL) {
+        slot = malloc_w(sizeof(eslot));
+        atomic_init(&slot->epoch, 0);
+        atomic_init(&slot->used, true);
+        atomic_init(&slot->hits, 0);
+        atomic_init(&slot->misses, 0);
+        atomic_init(&slot->refreshes, 0);
+        atomic_init(&slot->disk_hits, 0);
+        slot->next = atomic_load(&epoch_slots);
+        while (!atomic_compare_exchange_weak(&epoch_slots, &slot->next, slot))
+            ;
+    }
+    pthread_setspecific(epoch_key, slot);
+    epoch_self = slot;
+    return slot;
+}
+
+/**
+ * @brief Releases an exiting thread's epoch slot for reuse.
+ *
+ * @param[in] vslot : void* pointer to the thread's epoch slot.
+ */
+static void epoch_slot_release(void *vslot) {
+    eslot *slot = (eslot *)vslot;
+    atomic_store(&slot->epoch, 0);
+    atomic_store(&slot->used, false);
+}
+
+/**
+ * @brief Enters a read-side epoch; blocks seen until epoch_exit stay valid.
+ */
+static void epoch_enter() {
+    eslot *slot = epoch_slot();
+    atomic_store_explicit(&slot->epoch, atomic_load(&epoch_global),
+                          memory_order_relaxed);
+    // Publish the epoch before any bucket is read.
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+/**
+ * @brief Leaves the calling thread's read-side epoch.
+ */
+static void epoch_exit() {
+    atomic_store_explicit(&epoch_self->epoch, 0, memory_order_release);
+}
+
+/**
+ * @brief Returns the oldest epoch entered by any active reader.
+ *
+ * @return oldest active epoch, UINT64_MAX if no reader active.
+ */
+static uint64_t epoch_min() {
+    uint64_t min = UINT64_MAX;
+    // Order preceding unlinks before reading reader epochs.
+    atomic_thread_fence(memory_order_seq_cst);
+    eslot *slot = atomic_load(&epoch_slots);
+    for (; slot != NULL; slot = slot->next) {
+        uint64_t epoch = atomic_load(&slot->epoch);
+        if (epoch != 0 && epoch < min)
+            min = epoch;
+    }
+    return min;
 }
 
 /**
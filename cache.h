@@ -6,11 +6,34 @@
  * with its associated key such that future requests of the key return the
  * stored data.
  *
- * My implementation uses a circular doubly-linked list of cache blocks.
- * Key library details:
+ * My implementation splits the cache into shards chosen by URI hash. Each
+ * shard indexes its blocks in a hash table read without locks, keeps them
+ * on the lists of a pluggable eviction policy, and carves them from a slab
+ * arena of its own. Key library details:
  *     - Request URIs used as keys.
  *     - Server response text used as values.
- *     - Block replacement via a least-recently-used policy (LRU).
+ *     - Block replacement via a pluggable eviction policy: CLOCK, an
+ *       approximate least-recently-used policy (LRU) where hits only set a
+ *       reference bit, by default; or scan-resistant S3-FIFO.
+ *     - Hit and miss counters per thread, summed by cache_stats.
+ *     - Block lookup via a chained hash table over the block list.
+ *     - Cache split into independently locked shards chosen by URI hash.
+ *     - Lock-free hits; evicted blocks reclaimed once no reader holds them.
+ *     - Block header, key, and text carved together from a preallocated
+ *       slab arena per shard (see slab.h); the arenas bound cache memory.
+ *     - Text longer than CACHE_CHUNK_SIZE continues in separately allocated
+ *       chunks, so large objects need no large contiguous allocation.
+ *     - Cache and object size limits set at startup.
+ *     - Large text sent to clients with sendfile from the arena's memfd.
+ *     - Blocks carry an expiry time and the offsets of their validators;
+ *       only fresh blocks are hit, stale ones are pinned for revalidation
+ *       and refreshed in place, or replaced by a new response.
+ *     - Optional disk tier (see disk.h): fresh blocks evicted from memory
+ *       are written to a log-structured file, whose hits are sent with
+ *       sendfile or promoted back into memory.
+ *     - Optional snapshot (see disk.h): cache_save writes the fresh blocks
+ *       to a file that cache_init maps at the next start; its records are
+ *       promoted into memory as they are hit.
  *
  * Descriptions of individual functions, data structures, and global variables
  * are provided in their respective leading comments.
@@ -21,55 +44,354 @@
  */
 
 #include "csapp.h"
+#include "disk.h"
+#include "slab.h"
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
 
-// Max cache and object sizes
+// Default max cache and object sizes; both can be set at startup.
 #define MAX_CACHE_SIZE (1024 * 1024)
 #define MAX_OBJECT_SIZE (100 * 1024)
 
+// Default size of the disk tier, when enabled.
+#define CACHE_DISK_SIZE (1024L * 1024 * 1024)
+
+// Default number of cache shards; each shard gets an even part of the cache.
+#define CACHE_SHARDS 8
+
+// Number of hash table buckets (power of two).
+#define CACHE_BUCKETS 4096
+
+// Smallest text kept in a memory file and served with sendfile.
+#define CACHE_ZEROCOPY_MIN (16 * 1024)
+
+// Smallest storage step of a cache fill of unknown length.
+#define CACHE_FILL_CHUNK (16 * 1024)
+
+// Largest text stored inline in a block; longer text continues in chunks of
+// this size (a multiple of SLAB_PAGE_SIZE).
+#define CACHE_CHUNK_SIZE (256 * 1024)
+
+// Number of S3-FIFO ghost entries per shard (power of two).
+#define CACHE_GHOSTS 1024
+
+/**
+ * @brief Cache eviction policies (see cache.c).
+ */
+enum cache_policy {
+    CACHE_CLOCK,  // CLOCK (approximate LRU), the default
+    CACHE_S3FIFO, // S3-FIFO: small, main, and ghost FIFO queues
+};
+
 /**
  * @brief Cache block data structure.
+ *     Readers only touch ref_cont and freq; everything else is written
+ *     under the shard mutex before the block is published in its bucket.
+ *     Lives at the start of its slab allocation, followed by the URI and
+ *     the inline text; text beyond text_cap continues in chunks.
  */
 struct cache_block {
-    ssize_t text_len;         // Length of the text within request header.
-    ssize_t ref_cont;         // Reference count of the block.
-    struct cache_block *next; // Pointer to next block in list.
-    struct cache_block *prev; // Pointer to previous block in list.
+    ssize_t text_len;                    // Length of the text.
+    size_t text_cap;                     // Bytes of inline text storage.
+    size_t size;                         // Bytes of slab memory held.
+    atomic_long ref_cont;                // Reference count (cache + readers).
+    atomic_uchar freq;                   // Hits seen by the policy, capped.
+    uint64_t retire_epoch;               // Epoch at which block was evicted.
+    struct cache_block *next;            // Pointer to next block in list.
+    struct cache_block *prev;            // Pointer to previous block in list.
+    _Atomic(struct cache_block *) hnext; // Next block in hash bucket.
+    struct cache_block *rnext;           // Next block awaiting reclamation.
+    uint64_t hash;                       // Precomputed hash of the block URI.
+    atomic_long expires;                 // Stale from then, time(NULL) secs.
+    long lifetime;                       // Freshness lifetime in seconds.
+    size_t etag;                         // ETag value offset, 0 if none.
+    size_t etag_len;                     // Length of the ETag value.
+    size_t modified;                     // Last-Modified offset, 0 if none.
+    size_t modified_len;                 // Length of Last-Modified value.
+    bool small;                          // Whether in S3-FIFO small FIFO.
     const char *uri; // Universal resource identifier of block (used as key).
     char *text;      // Request header text (Value in key value pair).
+    char **chunks;   // Text past text_cap, CACHE_CHUNK_SIZE bytes each.
+    size_t nchunks;  // Number of chunks allocated.
+    size_t slots;    // Capacity of the chunk table.
 };
 typedef struct cache_block cblock;
 
 /**
- * @brief Cache data structure.
+ * @brief Freshness of a response being cached, from its headers.
+ *     Validators are located by offset in the committed text.
+ */
+struct cache_fresh {
+    time_t expires;      // When the text goes stale, time(NULL) seconds.
+    long lifetime;       // Freshness lifetime, renewed by revalidation.
+    size_t etag;         // Offset of the ETag value in the text, 0 if none.
+    size_t etag_len;     // Length of the ETag value.
+    size_t modified;     // Offset of the Last-Modified value, 0 if none.
+    size_t modified_len; // Length of the Last-Modified value.
+};
+typedef struct cache_fresh cfresh;
+
+/**
+ * @brief Cache shard data structure.
  *     Circular doubly-linked list saves space on tail pointer
  *     while allowing constant time tail access.
  *     Also just more fun than a regular list.
+ *     Hash buckets index the same blocks for constant time lookup;
+ *     bucket chains are independent of the list order.
+ *     Mutex only taken by writers; readers walk buckets lock-free.
  */
 struct cache_info {
-    ssize_t size;  // Size of the cache (<= MAX_CACHE_SIZE).
-    cblock *start; // Pointer to the starting block.
+    pthread_mutex_t mutex;                    // Mutex guarding shard writes.
+    ssize_t size;                             // Slab memory of the blocks.
+    ssize_t capacity;                         // Size of the shard arena.
+    slab_t arena;                             // Memory of the shard blocks.
+    cblock *start;                            // CLOCK hand / main FIFO.
+    cblock *small;                            // S3-FIFO small FIFO.
+    ssize_t small_size;                       // Slab memory of small FIFO.
+    uint64_t evictions;                       // Blocks evicted.
+    uint64_t ghosts[CACHE_GHOSTS];            // S3-FIFO hashes evicted.
+    cblock *retired;                          // Evicted blocks to reclaim.
+    _Atomic(cblock *) buckets[CACHE_BUCKETS]; // Hash buckets of blocks.
 };
 typedef struct cache_info cinfo;
 
+/**
+ * @brief Cache startup configuration.
+ */
+struct cache_config {
+    size_t shards;            // Number of cache shards (see CACHE_SHARDS).
+    size_t size;              // Cache memory in bytes, 0 for MAX_CACHE_SIZE.
+    size_t object_size;       // Largest text cached, 0 for MAX_OBJECT_SIZE.
+    bool zerocopy;            // Serve large hits from memory files.
+    enum cache_policy policy; // Eviction policy.
+    const char *disk_path;    // Disk tier log file, NULL for no disk tier.
+    size_t disk_size;         // Disk tier size, 0 for CACHE_DISK_SIZE.
+    bool promote;             // Copy disk hits back into memory.
+    const char *snapshot;     // Snapshot mapped at startup, NULL for none.
+    // Compresses committed text into a buffer, NULL to store text as is.
+    size_t (*compress)(const char *text, size_t len, char *out, size_t size);
+};
+typedef struct cache_config cconfig;
+
+/**
+ * @brief Cache statistics, summed over shards and threads.
+ */
+struct cache_stats {
+    const char *policy;   // Name of the eviction policy.
+    uint64_t hits;        // Lookups that found a block.
+    uint64_t misses;      // Lookups that found none.
+    uint64_t evictions;   // Blocks evicted.
+    uint64_t refreshes;   // Stale blocks revalidated by the server.
+    size_t size;          // Slab memory held by cached blocks.
+    size_t capacity;      // Slab memory of all shards.
+    uint64_t disk_hits;   // Memory misses found on disk or in snapshot.
+    uint64_t spills;      // Evicted blocks written to the disk tier.
+    size_t disk_size;     // Bytes of records in the disk tier.
+    size_t disk_capacity; // Size of the disk tier, 0 if disabled.
+};
+typedef struct cache_stats cstats;
+
+/**
+ * @brief Cache fill handle data structure.
+ *     Response text is written straight into the storage of a block that
+ *     is not in the cache yet; committing the fill publishes the block.
+ */
+struct cache_fill {
+    cblock *block; // Block being filled, NULL once the fill failed.
+    size_t limit;  // Largest text the block may grow to.
+    cfresh fresh;  // Freshness given to the block on commit.
+};
+typedef struct cache_fill cfill;
+
 // ---------- FUNCTION PROTOTYPES ---------- //
 
 /**
  * @brief Initializes an empty cache.
- *     Cache empty iff: size = 0, start = NULL.
+ *     Shard empty iff: size = 0, start = NULL.
+ *
+ * @param[in] config : startup cache configuration.
  */
-void cache_init();
+void cache_init(const cconfig *config);
 
 /**
- * @brief Writes the text of a cached server response.
+ * @brief Writes the text of a cached server response, if fresh; from the
+ *     disk tier if not in memory.
  *
  * @param[in] uri : client request URI used as key.
  * @param[in] fd  : file descriptor to which block value is written.
  *
- * @return true if matching block in cache, false if not.
+ * @return true if fresh matching block in cache, false if not.
  */
 bool cache_gettext(const char *uri, int fd);
 
+/**
+ * @brief Pins the block cached under <uri>, like cache_pin, without
+ *     counting the lookup; for requests whose miss was counted.
+ *
+ * @param[in] uri : client request URI used as key.
+ *
+ * @return pinned block, NULL if no fresh matching block in cache.
+ */
+cblock *cache_repin(const char *uri);
+
+/**
+ * @brief Pins the block cached under <uri> so its text can be sent later.
+ *     Pinned blocks stay valid after eviction until unpinned. A fresh
+ *     snapshot record, or with promotion on a fresh disk tier record, is
+ *     copied back into memory.
+ *
+ * @param[in] uri : client request URI used as key.
+ *
+ * @return pinned block, NULL if no fresh matching block in cache.
+ */
+cblock *cache_pin(const char *uri);
+
+/**
+ * @brief Pins the block cached under <uri>, fresh or stale, to revalidate
+ *     it; the lookup is not counted.
+ *
+ * @param[in] uri : client request URI used as key.
+ *
+ * @return pinned block, NULL if no matching block in cache.
+ */
+cblock *cache_pin_stale(const char *uri);
+
+/**
+ * @brief Formats the request headers revalidating a pinned block:
+ *     If-None-Match with its ETag, If-Modified-Since with its Last-Modified.
+ *
+ * @param[in]  block : pinned block.
+ * @param[out] buf   : buffer to format headers into.
+ * @param[in]  size  : size of <buf>.
+ *
+ * @return length of the headers, 0 if the block has no validators or they
+ *     do not fit.
+ */
+size_t cache_conditions(cblock *block, char *buf, size_t size);
+
+/**
+ * @brief Marks a pinned block fresh until <expires>, after the server
+ *     confirmed it is still valid.
+ *
+ * @param[in] block   : pinned block.
+ * @param[in] expires : when the text goes stale again, time(NULL) seconds;
+ *                      -1 renews the lifetime it was cached with.
+ */
+void cache_refresh(cblock *block, time_t expires);
+
+/**
+ * @brief Pins the disk tier or snapshot record of <uri>, if fresh, so its
+ *     text can be sent with cache_senddisk; for lookups that missed in
+ *     memory.
+ *
+ * @param[in] uri : client request URI used as key.
+ *
+ * @return pinned entry, NULL if no fresh record.
+ */
+dentry *cache_pin_disk(const char *uri);
+
+/**
+ * @brief Sends text of a pinned disk record from <offset> with a single
+ *     sendfile; meant for non-blocking file descriptors.
+ *
+ * @param[in] entry  : pinned entry.
+ * @param[in] fd     : file descriptor to which the text is written.
+ * @param[in] offset : offset into the text to send from, below its length.
+ *
+ * @return bytes sent, -1 on error (errno set, EAGAIN if <fd> would block).
+ */
+ssize_t cache_senddisk(dentry *entry, int fd, size_t offset);
+
+/**
+ * @brief Unpins an entry returned by cache_pin_disk.
+ *
+ * @param[in] entry : pinned entry.
+ */
+void cache_unpin_disk(dentry *entry);
+
+/**
+ * @brief Unpins a block returned by cache_pin.
+ *
+ * @param[in] block : pinned block.
+ */
+void cache_unpin(cblock *block);
+
+/**
+ * @brief Sends text of a pinned block from <offset> with a single write;
+ *     meant for non-blocking file descriptors.
+ *
+ * @param[in] block  : pinned block.
+ * @param[in] fd     : file descriptor to which block text is written.
+ * @param[in] offset : offset into the block text to send from.
+ *
+ * @return bytes sent, -1 on error (errno set, EAGAIN if <fd> would block).
+ */
+ssize_t cache_sendtext(cblock *block, int fd, size_t offset);
+
+/**
+ * @brief Sends up to <n> bytes of text of a pinned block from <offset>
+ *     with a single write, like cache_sendtext; text may still be filling,
+ *     up to the length published to the caller.
+ *
+ * @param[in] block  : pinned block.
+ * @param[in] fd     : file descriptor to which block text is written.
+ * @param[in] offset : offset into the block text to send from.
+ * @param[in] n      : bytes wanted, greater than 0.
+ *
+ * @return bytes sent, -1 on error (errno set, EAGAIN if <fd> would block).
+ */
+ssize_t cache_sendpart(cblock *block, int fd, size_t offset, size_t n);
+
+/**
+ * @brief Writes <n> bytes of text of a pinned block from <offset>.
+ *     Text may still be filling, up to the length published to the caller.
+ *
+ * @param[in] block  : pinned block.
+ * @param[in] fd     : file descriptor to which block text is written.
+ * @param[in] offset : offset into the block text to write from.
+ * @param[in] n      : number of bytes to write.
+ *
+ * @return 0 if successful, -1 on error.
+ */
+int cache_writetext(cblock *block, int fd, size_t offset, size_t n);
+
+/**
+ * @brief Locates text of a pinned block for I/O submitted elsewhere, e.g.
+ *     to io_uring; the text stays in place while the block is pinned.
+ *
+ * @param[in]  block  : pinned block.
+ * @param[in]  offset : offset into the text, less than its length.
+ * @param[out] avail  : bytes of text contiguous from <offset>.
+ *
+ * @return pointer to the text at <offset>.
+ */
+const char *cache_textspan(cblock *block, size_t offset, size_t *avail);
+
+/**
+ * @brief Locates up to <n> bytes of text of a pinned block, like
+ *     cache_textspan; text may still be filling, up to the length
+ *     published to the caller.
+ *
+ * @param[in]  block  : pinned block.
+ * @param[in]  offset : offset into the text.
+ * @param[in]  n      : bytes wanted.
+ * @param[out] avail  : bytes of text contiguous from <offset>, at most <n>.
+ *
+ * @return pointer to the text at <offset>.
+ */
+const char *cache_textpart(cblock *block, size_t offset, size_t n,
+                           size_t *avail);
+
+/**
+ * @brief Returns the mapped text of an entry returned by cache_pin_disk.
+ *
+ * @param[in] entry : pinned entry.
+ */
+const char *cache_disktext(dentry *entry);
+
 /**
  * @brief Inserts a block into the cache.
  *
@@ -80,7 +402,107 @@ bool cache_gettext(const char *uri, int fd);
 void cache_insert(const char *uri, char *text, ssize_t text_len);
 
 /**
- * @brief Frees cache list and block items.
+ * @brief Starts filling a block for <uri> with text of unknown length.
+ *
+ * @param[in] uri       : client request URI used as key.
+ * @param[in] size_hint : expected text length, 0 if unknown.
+ *
+ * @return fill handle, NULL if <size_hint> already exceeds the limit or no
+ *     memory could be freed for the block.
+ */
+cfill *cache_fill(const char *uri, size_t size_hint);
+
+/**
+ * @brief Appends <n> bytes of text to a fill.
+ *     A fill growing past its limit fails; its storage is freed at once
+ *     and further writes are ignored.
+ *
+ * @param[in] fill : fill handle.
+ * @param[in] data : text to append.
+ * @param[in] n    : length of <data>.
+ *
+ * @return true if the text was stored, false if the fill failed.
+ */
+bool cache_fill_write(cfill *fill, const void *data, size_t n);
+
+/**
+ * @brief Inserts <n> bytes of text at <offset> of the text filled so far.
+ *
+ * @param[in] fill   : fill handle.
+ * @param[in] offset : offset at most the current text length.
+ * @param[in] data   : text to insert.
+ * @param[in] n      : length of <data>.
+ *
+ * @return true if the text was stored, false if the fill failed.
+ */
+bool cache_fill_insert(cfill *fill, size_t offset, const void *data,
+                       size_t n);
+
+/**
+ * @brief Reserves storage for <size> bytes of text in a fill.
+ *     Text of a fill never moves while it fits in its reservation.
+ *
+ * @param[in] fill : fill handle.
+ * @param[in] size : total text length to reserve.
+ *
+ * @return true if reserved, false if the fill failed.
+ */
+bool cache_fill_reserve(cfill *fill, size_t size);
+
+/**
+ * @brief Records the freshness of the response being filled.
+ *     Fills without freshness never go stale.
+ *
+ * @param[in] fill  : fill handle.
+ * @param[in] fresh : expiry time and validator offsets of the response.
+ */
+void cache_fill_fresh(cfill *fill, const cfresh *fresh);
+
+/**
+ * @brief Pins the block being filled so its text can be read while it is
+ *     written; unpin with cache_unpin.
+ *
+ * @param[in] fill : fill handle.
+ *
+ * @return pinned block, NULL if the fill failed.
+ */
+cblock *cache_fill_pin(cfill *fill);
+
+/**
+ * @brief Publishes the filled text in the cache and frees the handle.
+ *     A stale block cached under the same URI is replaced.
+ *
+ * @param[in] fill : fill handle.
+ */
+void cache_fill_commit(cfill *fill);
+
+/**
+ * @brief Drops the filled text and frees the handle.
+ *
+ * @param[in] fill : fill handle.
+ */
+void cache_fill_abort(cfill *fill);
+
+/**
+ * @brief Reads the cache statistics.
+ *     Counters are read without stopping writers; totals may lag slightly.
+ *
+ * @param[out] stats : statistics.
+ */
+void cache_stats(cstats *stats);
+
+/**
+ * @brief Saves the fresh blocks, and the snapshot records not hit since
+ *     startup, as the snapshot at <path>; the cache keeps serving.
+ *
+ * @param[in] path : snapshot path, replaced only once the snapshot is whole.
+ *
+ * @return 0 if saved, -1 on error.
+ */
+int cache_save(const char *path);
+
+/**
+ * @brief Frees cache shards and block items.
  */
 void cache_free();
 
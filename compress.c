@@ -0,0 +1,418 @@
+/**
+ * @file compress.c
+ * @brief Compressed cache storage for a tiny web proxy.
+ *
+ * Compression runs once per cached response, in the cache fill commit;
+ * hits either send the stored bytes or inflate them. Key implementation
+ * details:
+ *     - gzip through zlib; every thread keeps one deflate and one inflate
+ *       stream, reset for each use, so compressing or inflating a text
+ *       allocates nothing inside zlib after the thread's first.
+ *     - The compressed head keeps every offset of the server's head: the
+ *       Content-Length value is overwritten in place and padded with
+ *       spaces, and the new lines go after the last header. Validator
+ *       offsets the block keeps into its head stay valid.
+ *     - Inflating needs no metadata either: the identity head is the stored
+ *       one without its Content-Encoding line, and the identity length is
+ *       the gzip trailer's, which also fits the Content-Length width.
+ *     - Text is stored compressed only if that saves at least an eighth of
+ *       its body; responses the server encoded, chunked, or cut short are
+ *       stored as they are.
+ *     - Servers never see the client's Accept-Encoding on cacheable
+ *       requests, so stored text is always identity text, compressed or
+ *       not, and one block serves every client.
+ *     - Clients not taking gzip get a hit inflated into a buffer of the
+ *       caller's, kept by the worker or connection for its next hit and
+ *       only grown, so at steady state inflating allocates nothing; hits of
+ *       text stored as it is cost them a scan of the head only.
+ *     - Compressed text that cannot be inflated, corrupt or not stored
+ *       inline, is reported as such rather than sent to a client that did
+ *       not ask for gzip.
+ *
+ * Descriptions of individual functions, data structures, and global variables
+ * are provided in their respective leading comments.
+ *
+ * @author Iltikin Wayet
+ */
+
+#define _GNU_SOURCE // memmem
+
+#include "compress.h"
+#include "cache.h"
+#include "response.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+
+// Header line of COMPRESS_MARK that identity heads go without.
+#define COMPRESS_ENCODING "Content-Encoding: gzip\r\n"
+// Largest ratio of inflated to deflated bytes deflate can reach.
+#define COMPRESS_RATIO_MAX 1032
+
+// Media types compressed, besides text/* and +json or +xml suffixes.
+static const char *const compress_types[] = {
+    "application/json", "application/javascript", "application/x-javascript",
+    "application/xml",  "application/ecmascript",
+};
+
+// Whether compressible text is stored compressed.
+static bool enabled = false;
+
+// ---------- HELPER PROTOTYPES ------------ //
+static size_t compressed_head(const char *text, size_t len);
+static bool compress_plain(const char *text, size_t len, size_t head_len,
+                           cplain *plain, size_t *plain_len);
+static bool type_compressible(const char *type, size_t len);
+static bool coding_accepted(const char *value, size_t len);
+static const char *head_field(const char *head, size_t head_len,
+                              const char *name, size_t *len);
+static bool length_put(char *value, size_t width, size_t n);
+static z_stream *deflater(void);
+static z_stream *inflater(void);
+
+// ---------- FUNCTION ROUTINES ------------ //
+
+/**
+ * @brief Turns compression on or off; call once, before serving.
+ *
+ * @param[in] on : whether compressible text is stored compressed.
+ */
+void compress_init(bool on) {
+    enabled = on;
+}
+
+/**
+ * @brief Returns whether compressible text is stored compressed.
+ */
+bool compress_enabled(void) {
+    return enabled;
+}
+
+/**
+ * @brief Returns whether a client takes gzip, by its Accept-Encoding.
+ *     gzip, x-gzip, or * with a nonzero q value; an explicit gzip entry
+ *     wins over *.
+ *
+ * @param[in] parser : parser of the client request head.
+ */
+bool compress_accepted(const request_parser *parser) {
+    const request_header *line =
+        request_lookup_header(parser, "Accept-Encoding");
+    return line != NULL && coding_accepted(line->value, line->value_len);
+}
+
+/**
+ * @brief Compresses a complete response text for storage, if worth it.
+ *     Only 200 responses with a Content-Length, no Content-Encoding, a
+ *     compressible Content-Type, and at least COMPRESS_MIN body bytes.
+ *
+ * @param[in]  text : response text, head and body.
+ * @param[in]  len  : length of <text>.
+ * @param[out] out  : compressed text.
+ * @param[in]  size : size of <out>.
+ *
+ * @return length of the compressed text, 0 if left uncompressed, if it
+ *     saves less than an eighth of the body, or if not shorter than <size>.
+ */
+size_t compress_text(const char *text, size_t len, char *out, size_t size) {
+    response_info response;
+    ssize_t head_len = response_parse_head(&response, text, len);
+    if (head_len < 4 || response.status != 200 || response.chunked ||
+        response.content_length != (ssize_t)len - head_len ||
+        len - head_len < COMPRESS_MIN ||
+        memcmp(text + head_len - 4, "\r\n\r\n", 4) != 0) {
+        return 0;
+    }
+    size_t type_len, length_len, coding_len;
+    const char *type = head_field(text, head_len, "Content-Type", &type_len);
+    const char *length =
+        head_field(text, head_len, "Content-Length", &length_len);
+    if (type == NULL || !type_compressible(type, type_len) || length == NULL ||
+        head_field(text, head_len, "Content-Encoding", &coding_len) != NULL) {
+        return 0;
+    }
+
+    // Head without its empty line, the mark, then the gzip body.
+    size_t limit = len - (len - head_len) / 8;
+    if (size > limit)
+        size = limit;
+    size_t prefix = head_len - 2;
+    size_t mark = sizeof(COMPRESS_MARK) - 1;
+    z_stream *z = deflater();
+    if (z == NULL || prefix + mark >= size)
+        return 0;
+    memcpy(out, text, prefix);
+    memcpy(out + prefix, COMPRESS_MARK, mark);
+    deflateReset(z);
+    z->next_in = (Bytef *)(text + head_len);
+    z->avail_in = len - head_len;
+    z->next_out = (Bytef *)(out + prefix + mark);
+    z->avail_out = size - prefix - mark;
+    if (deflate(z, Z_FINISH) != Z_STREAM_END ||
+        !length_put(out + (length - text), length_len, z->total_out)) {
+        return 0;
+    }
+    return prefix + mark + z->total_out;
+}
+
+/**
+ * @brief Inflates a cache hit into <plain>, if the hit is compressed and
+ *     the client does not take gzip.
+ *
+ * @param[in]     parser : parser of the client request head.
+ * @param[in]     block  : pinned memory block, NULL for a disk hit.
+ * @param[in]     entry  : pinned disk tier record, if <block> is NULL.
+ * @param[in,out] plain  : buffer of the caller, grown if too small.
+ * @param[out]    len    : length of the text inflated into <plain>.
+ *
+ * @return 1 if inflated, 0 if the pinned text is to be sent as it is, -1
+ *     if it is compressed but could not be inflated.
+ */
+int compress_hit(const request_parser *parser, cblock *block, dentry *entry,
+                 cplain *plain, size_t *len) {
+    if (!enabled || compress_accepted(parser))
+        return 0;
+    size_t avail;
+    const char *text;
+    if (block != NULL) {
+        text = cache_textspan(block, 0, &avail);
+    } else {
+        text = cache_disktext(entry);
+        avail = entry->text_len;
+    }
+    size_t head_len = compressed_head(text, avail);
+    if (head_len == 0)
+        return 0;
+    // Compressed text is stored inline, in one span.
+    if (block != NULL && avail < (size_t)block->text_len)
+        return -1;
+    return compress_plain(text, avail, head_len, plain, len) ? 1 : -1;
+}
+
+// ---------- HELPER ROUTINES ------------ //
+
+/**
+ * @brief Returns the head length of a compressed text, found by the
+ *     COMPRESS_MARK ending its head.
+ *
+ * @param[in] text : stored text, or its first span.
+ * @param[in] len  : length of <text>.
+ *
+ * @return length of the head, 0 if <text> is not compressed.
+ */
+static size_t compressed_head(const char *text, size_t len) {
+    const char *end = memmem(text, len, "\r\n\r\n", 4);
+    size_t mark = sizeof(COMPRESS_MARK) - 1;
+    if (end == NULL || (size_t)(end + 4 - text) < mark)
+        return 0;
+    size_t head_len = end + 4 - text;
+    return memcmp(text + head_len - mark, COMPRESS_MARK, mark) ? 0 : head_len;
+}
+
+/**
+ * @brief Inflates a compressed text into an identity one.
+ *
+ * @param[in]     text      : stored text, compressed.
+ * @param[in]     len       : length of <text>.
+ * @param[in]     head_len  : length of its head, from compressed_head.
+ * @param[in,out] plain     : buffer of the identity text, grown if needed.
+ * @param[out]    plain_len : length of the identity text.
+ *
+ * @return true if inflated, false if <text> is corrupt or the buffer could
+ *     not grow.
+ */
+static bool compress_plain(const char *text, size_t len, size_t head_len,
+                           cplain *plain, size_t *plain_len) {
+    if (len - head_len < 18)
+        return false;
+    const unsigned char *trailer = (const unsigned char *)text + len - 4;
+    size_t body = (uint32_t)trailer[0] | (uint32_t)trailer[1] << 8 |
+                  (uint32_t)trailer[2] << 16 | (uint32_t)trailer[3] << 24;
+    if (body / COMPRESS_RATIO_MAX > len - head_len)
+        return false;
+    size_t mark = sizeof(COMPRESS_MARK) - 1;
+    size_t cut = sizeof(COMPRESS_ENCODING) - 1;
+    size_t plain_head = head_len - cut;
+    size_t kept = head_len - mark;
+    if (plain->size < plain_head + body) {
+        char *grown = realloc(plain->text, plain_head + body);
+        if (grown == NULL)
+            return false;
+        plain->text = grown;
+        plain->size = plain_head + body;
+    }
+    char *out = plain->text;
+    memcpy(out, text, kept);
+    memcpy(out + kept, text + kept + cut, mark - cut);
+
+    size_t length_len;
+    char *length =
+        (char *)head_field(out, plain_head, "Content-Length", &length_len);
+    z_stream *z = inflater();
+    if (length == NULL || !length_put(length, length_len, body) || z == NULL)
+        return false;
+    inflateReset(z);
+    z->next_in = (Bytef *)(text + head_len);
+    z->avail_in = len - head_len;
+    z->next_out = (Bytef *)(out + plain_head);
+    z->avail_out = body;
+    if (inflate(z, Z_FINISH) != Z_STREAM_END || z->total_out != body)
+        return false;
+    *plain_len = plain_head + body;
+    return true;
+}
+
+/**
+ * @brief Returns whether a Content-Type value names a compressible type.
+ *
+ * @param[in] type : Content-Type value, parameters included.
+ * @param[in] len  : length of <type>.
+ */
+static bool type_compressible(const char *type, size_t len) {
+    const char *semi = memchr(type, ';', len);
+    if (semi != NULL)
+        len = semi - type;
+    while (len > 0 && (type[len - 1] == ' ' || type[len - 1] == '\t'))
+        len--;
+    if (len >= 5 && !strncasecmp(type, "text/", 5))
+        return true;
+    if ((len >= 5 && !strncasecmp(type + len - 5, "+json", 5)) ||
+        (len >= 4 && !strncasecmp(type + len - 4, "+xml", 4)))
+        return true;
+    for (size_t i = 0; i < sizeof(compress_types) / sizeof(*compress_types);
+         i++) {
+        if (strlen(compress_types[i]) == len &&
+            !strncasecmp(type, compress_types[i], len))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Returns whether an Accept-Encoding value takes gzip.
+ *
+ * @param[in] value : Accept-Encoding value, not terminated.
+ * @param[in] len   : length of <value>.
+ */
+static bool coding_accepted(const char *value, size_t len) {
+    bool gzip = false;
+    bool listed = false;
+    bool any = false;
+    const char *p = value;
+    const char *end = value + len;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        const char *name = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t')
+            p++;
+        size_t name_len = p - name;
+        // A q value of zero refuses the coding.
+        bool refused = false;
+        while (p < end && *p != ',') {
+            if (*p == 'q' && p + 1 < end && p[1] == '=')
+                refused = strtod(p + 2, NULL) <= 0.0;
+            p++;
+        }
+        if ((name_len == 4 && !strncasecmp(name, "gzip", 4)) ||
+            (name_len == 6 && !strncasecmp(name, "x-gzip", 6))) {
+            gzip = !refused;
+            listed = true;
+        } else if (name_len == 1 && *name == '*') {
+            any = !refused;
+        }
+    }
+    return listed ? gzip : any;
+}
+
+/**
+ * @brief Finds a header field in a response head.
+ *
+ * @param[in]  head     : response head, not terminated.
+ * @param[in]  head_len : length of <head>.
+ * @param[in]  name     : field name, matched case-insensitively.
+ * @param[out] len      : length of the value, leading whitespace off;
+ *                         trailing whitespace kept, as padding to reuse.
+ *
+ * @return start of the value, NULL if the head has no such field.
+ */
+static const char *head_field(const char *head, size_t head_len,
+                              const char *name, size_t *len) {
+    size_t name_len = strlen(name);
+    const char *end = head + head_len;
+    // Skip the status line.
+    const char *p = memchr(head, '\n', head_len);
+    while (p != NULL && ++p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (eol == NULL)
+            break;
+        if ((size_t)(eol - p) > name_len && p[name_len] == ':' &&
+            !strncasecmp(p, name, name_len)) {
+            const char *v = p + name_len + 1;
+            while (v < eol && (*v == ' ' || *v == '\t'))
+                v++;
+            *len = eol - v - (eol > v && eol[-1] == '\r');
+            return v;
+        }
+        p = eol;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Overwrites a header value with <n>, padded with trailing spaces.
+ *
+ * @param[out] value : value to overwrite.
+ * @param[in]  width : length of <value>, kept.
+ * @param[in]  n     : number written.
+ *
+ * @return true if <n> fits in <width> digits, false if not.
+ */
+static bool length_put(char *value, size_t width, size_t n) {
+    char digits[24];
+    size_t len = snprintf(digits, sizeof(digits), "%zu", n);
+    if (len > width)
+        return false;
+    memcpy(value, digits, len);
+    memset(value + len, ' ', width - len);
+    return true;
+}
+
+/**
+ * @brief Returns the deflate stream of the calling thread, set up on first
+ *     use; NULL if zlib could not set it up.
+ */
+static z_stream *deflater(void) {
+    static __thread z_stream *z;
+    if (z == NULL) {
+        z_stream *s = calloc(1, sizeof(z_stream));
+        if (s == NULL || deflateInit2(s, COMPRESS_LEVEL, Z_DEFLATED, 15 + 16,
+                                      8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            free(s);
+            return NULL;
+        }
+        z = s;
+    }
+    return z;
+}
+
+/**
+ * @brief Returns the inflate stream of the calling thread, set up on first
+ *     use; NULL if zlib could not set it up.
+ */
+static z_stream *inflater(void) {
+    static __thread z_stream *z;
+    if (z == NULL) {
+        z_stream *s = calloc(1, sizeof(z_stream));
+        if (s == NULL || inflateInit2(s, 15 + 16) != Z_OK) {
+            free(s);
+            return NULL;
+        }
+        z = s;
+    }
+    return z;
+}
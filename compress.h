@@ -0,0 +1,109 @@
+/**
+ * @file compress.h
+ * @brief Compressed cache storage for a tiny web proxy.
+ *
+ * With compression on, compressible response text (HTML, CSS, JavaScript,
+ * JSON, XML, SVG, plain text) is gzipped once, when its cache fill
+ * commits, and stored compressed. Hits for clients whose Accept-Encoding
+ * takes gzip are sent the stored bytes as they are; other clients get the
+ * text inflated. Both variants carry Vary: Accept-Encoding. Since the proxy
+ * negotiates the encoding itself, cacheable requests are then forwarded
+ * without the client's Accept-Encoding, so that servers answer with text
+ * the proxy can compress, and responses varying by Accept-Encoding alone
+ * are cached as well (see response.h).
+ *
+ * A compressed head is the server's head, with its Content-Length value
+ * rewritten in place, padded with spaces to its original width, followed by
+ * COMPRESS_MARK. The stored text thus describes itself: memory blocks, disk
+ * tier records, and snapshots need no extra metadata.
+ *
+ * Descriptions of individual functions and data structures are provided in
+ * their respective leading comments.
+ *
+ * compress.c has more detailed implementation-related comments.
+ *
+ * @author Iltikin Wayet
+ */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include "request.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Smallest body compressed, in bytes.
+#define COMPRESS_MIN 1024
+
+// zlib compression level, 1 (fastest) to 9 (smallest).
+#define COMPRESS_LEVEL 6
+
+// Header lines ending the head of every compressed text.
+#define COMPRESS_MARK "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n\r\n"
+
+// Cache block and disk tier record of a hit (see cache.h, disk.h).
+struct cache_block;
+struct disk_entry;
+
+/**
+ * @brief Buffer hits are inflated into, kept by its owner from one hit to
+ *     the next and grown as needed; freed by the owner, if ever.
+ */
+struct compress_buffer {
+    char *text;  // Identity text of the last hit inflated, NULL if none yet
+    size_t size; // Size of <text>
+};
+typedef struct compress_buffer cplain;
+
+/**
+ * @brief Turns compression on or off; call once, before serving.
+ *
+ * @param[in] enabled : whether compressible text is stored compressed.
+ */
+void compress_init(bool enabled);
+
+/**
+ * @brief Returns whether compressible text is stored compressed.
+ */
+bool compress_enabled(void);
+
+/**
+ * @brief Returns whether a client takes gzip, by its Accept-Encoding.
+ *
+ * @param[in] parser : parser of the client request head.
+ */
+bool compress_accepted(const request_parser *parser);
+
+/**
+ * @brief Compresses a complete response text for storage, if worth it.
+ *     Only 200 responses with a Content-Length, no Content-Encoding, a
+ *     compressible Content-Type, and at least COMPRESS_MIN body bytes.
+ *
+ * @param[in]  text : response text, head and body.
+ * @param[in]  len  : length of <text>.
+ * @param[out] out  : compressed text.
+ * @param[in]  size : size of <out>.
+ *
+ * @return length of the compressed text, 0 if left uncompressed, if it
+ *     saves less than an eighth of the body, or if not shorter than <size>.
+ */
+size_t compress_text(const char *text, size_t len, char *out, size_t size);
+
+/**
+ * @brief Inflates a cache hit into <plain>, if the hit is compressed and
+ *     the client does not take gzip.
+ *
+ * @param[in]     parser : parser of the client request head.
+ * @param[in]     block  : pinned memory block, NULL for a disk hit.
+ * @param[in]     entry  : pinned disk tier record, if <block> is NULL.
+ * @param[in,out] plain  : buffer of the caller, grown if too small.
+ * @param[out]    len    : length of the text inflated into <plain>.
+ *
+ * @return 1 if inflated, 0 if the pinned text is to be sent as it is, -1
+ *     if it is compressed but could not be inflated, and is not to be sent.
+ */
+int compress_hit(const request_parser *parser, struct cache_block *block,
+                 struct disk_entry *entry, cplain *plain, size_t *len);
+
+#endif /* COMPRESS_H */
@@ -5,20 +5,21 @@
 
 #include "csapp.h"
 
-#include <errno.h>      /* errno */
-#include <netdb.h>      /* freeaddrinfo() */
-#include <semaphore.h>  /* sem_t */
-#include <signal.h>     /* struct sigaction */
-#include <stdarg.h>     /* va_list */
-#include <stdbool.h>    /* bool */
-#include <stddef.h>     /* ssize_t */
-#include <stdint.h>     /* intmax_t */
-#include <stdio.h>      /* stderr */
-#include <stdlib.h>     /* abort() */
-#include <string.h>     /* memset() */
-#include <sys/socket.h> /* struct sockaddr */
-#include <sys/types.h>  /* struct sockaddr */
-#include <unistd.h>     /* STDIN_FILENO */
+#include <errno.h>        /* errno */
+#include <netdb.h>        /* freeaddrinfo() */
+#include <semaphore.h>    /* sem_t */
+#include <signal.h>       /* struct sigaction */
+#include <stdarg.h>       /* va_list */
+#include <stdbool.h>      /* bool */
+#include <stddef.h>       /* ssize_t */
+#include <stdint.h>       /* intmax_t */
+#include <stdio.h>        /* stderr */
+#include <stdlib.h>       /* abort() */
+#include <string.h>       /* memset() */
+#include <sys/sendfile.h> /* sendfile() */
+#include <sys/socket.h>   /* struct sockaddr */
+#include <sys/types.h>    /* struct sockaddr */
+#include <unistd.h>       /* STDIN_FILENO */
 
 /************************************
  * Wrappers for Unix signal functions
@@ -472,6 +473,31 @@ ssize_t rio_writen(int fd, const void *usrbuf, size_t n) {
     return (ssize_t)n;
 }
 
+/*
+ * rio_sendfilen - Robustly send n bytes of a file starting at offset
+ *     (unbuffered, no user space copy)
+ */
+ssize_t rio_sendfilen(int out_fd, int in_fd, off_t offset, size_t n) {
+    size_t nleft = n;
+    ssize_t nsent;
+
+    while (nleft > 0) {
+        if ((nsent = sendfile(out_fd, in_fd, &offset, nleft)) <= 0) {
+            if (nsent < 0 && errno != EINTR) {
+                return -1; /* errno set by sendfile() */
+            }
+            if (nsent == 0) {
+                break; /* EOF on in_fd */
+            }
+
+            /* Interrupted by sig handler return, call sendfile() again */
+            nsent = 0;
+        }
+        nleft -= (size_t)nsent;
+    }
+    return (ssize_t)(n - nleft);
+}
+
 /*
  * rio_read - This is a wrapper for the Unix read() function that
  *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
@@ -518,6 +544,55 @@ void rio_readinitb(rio_t *rp, int fd) {
     rp->rio_bufptr = rp->rio_buf;
 }
 
+/*
+ * rio_fillb - Move the unread bytes of the internal buf to its start and
+ *    read once more after them, so that callers may parse the unread bytes
+ *    in place; returns bytes read, 0 on EOF or if the buf is full.
+ */
+ssize_t rio_fillb(rio_t *rp) {
+    ssize_t nread;
+
+    if (rp->rio_bufptr != rp->rio_buf && rp->rio_cnt > 0) {
+        memmove(rp->rio_buf, rp->rio_bufptr, (size_t)rp->rio_cnt);
+    }
+    rp->rio_bufptr = rp->rio_buf;
+    if ((size_t)rp->rio_cnt == sizeof(rp->rio_buf)) {
+        return 0;
+    }
+
+    while ((nread = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt,
+                         sizeof(rp->rio_buf) - (size_t)rp->rio_cnt)) < 0) {
+        if (errno != EINTR) {
+            return -1; /* errno set by read() */
+        }
+
+        /* Interrupted by sig handler return, call read() again */
+    }
+    rp->rio_cnt += nread;
+    return nread;
+}
+
+/*
+ * rio_readsomeb - Read up to n bytes: the unread bytes of the internal buf
+ *    if there are any, else one read straight into usrbuf, so that large
+ *    reads skip the internal buf; returns bytes read, 0 on EOF.
+ */
+ssize_t rio_readsomeb(rio_t *rp, void *usrbuf, size_t n) {
+    ssize_t nread;
+
+    if (rp->rio_cnt > 0) {
+        return rio_read(rp, usrbuf, n);
+    }
+    while ((nread = read(rp->rio_fd, usrbuf, n)) < 0) {
+        if (errno != EINTR) {
+            return -1; /* errno set by read() */
+        }
+
+        /* Interrupted by sig handler return, call read() again */
+    }
+    return nread;
+}
+
 /*
  * rio_readnb - Robustly read n bytes (buffered)
  */
@@ -625,14 +700,15 @@ int open_clientfd(const char *hostname, const char *port) {
 }
 
 /*
- * open_listenfd - Open and return a listening socket on port. This
- *     function is reentrant and protocol-independent.
+ * open_listenfd_opt - Open and return a listening socket on port,
+ *     optionally with SO_REUSEPORT so several sockets can share the port.
+ *     This function is reentrant and protocol-independent.
  *
  *     On error, returns:
  *       -2 for getaddrinfo error
  *       -1 with errno set for other errors.
  */
-int open_listenfd(const char *port) {
+static int open_listenfd_opt(const char *port, bool reuseport) {
     struct addrinfo hints, *listp, *p;
     int listenfd = -1, rc, optval = 1;
 
@@ -659,6 +735,14 @@ int open_listenfd(const char *port) {
         setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, (const void *)&optval,
                    sizeof(int));
 
+        /* Lets the kernel spread connections across sockets on the port */
+        if (reuseport &&
+            setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                       (const void *)&optval, sizeof(int)) < 0) {
+            close(listenfd);
+            continue;
+        }
+
         /* Bind the descriptor to the address */
         if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0) {
             break; /* Success */
@@ -684,3 +768,28 @@ int open_listenfd(const char *port) {
     }
     return listenfd;
 }
+
+/*
+ * open_listenfd - Open and return a listening socket on port. This
+ *     function is reentrant and protocol-independent.
+ *
+ *     On error, returns:
+ *       -2 for getaddrinfo error
+ *       -1 with errno set for other errors.
+ */
+int open_listenfd(const char *port) {
+    return open_listenfd_opt(port, false);
+}
+
+/*
+ * open_listenfd_reuseport - Open and return one of several listening
+ *     sockets sharing port with SO_REUSEPORT; the kernel balances new
+ *     connections between them.
+ *
+ *     On error, returns:
+ *       -2 for getaddrinfo error
+ *       -1 with errno set for other errors.
+ */
+int open_listenfd_reuseport(const char *port) {
+    return open_listenfd_opt(port, true);
+}
@@ -96,9 +96,13 @@ ssize_t rio_writen(int fd, const void *usrbuf, size_t n);
 void rio_readinitb(rio_t *rp, int fd);
 ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t rio_fillb(rio_t *rp);
+ssize_t rio_readsomeb(rio_t *rp, void *usrbuf, size_t n);
+ssize_t rio_sendfilen(int out_fd, int in_fd, off_t offset, size_t n);
 
 /* Reentrant protocol-independent client/server helpers */
 int open_clientfd(const char *hostname, const char *port);
 int open_listenfd(const char *port);
+int open_listenfd_reuseport(const char *port);
 
 #endif /* CSAPP_H */
@@ -0,0 +1,665 @@
+/**
+ * @file disk.c
+ * @brief On-disk cache tier implementation for the tiny web proxy cache.
+ *
+ * The log is one file, mapped shared, written front to back and wrapping
+ * around at its end. Key implementation details:
+ *     - Records are appended at the head, DISK_ALIGN aligned. A record that
+ *       would run past the end of the file goes to offset 0 instead, and
+ *       the records behind the head are dropped with the ones it overwrites.
+ *     - Records in the log are listed oldest first; the oldest record is
+ *       always the next one the head overwrites, so making room only ever
+ *       drops records off the front of the list.
+ *     - A record pinned by a reader, or a writer still copying in its text,
+ *       is never overwritten: a write that would need its space is skipped.
+ *     - Text is copied in through the mapping without the tier lock; the
+ *       record is indexed only once complete.
+ *     - The index is a chained hash table over URI hashes; URIs compared in
+ *       the mapped records on hash match. A newer record of a URI takes the
+ *       place of the older one, which stays in the log until overwritten.
+ *     - Hits are sent with sendfile from the log file, coherent with the
+ *       shared mapping the text was written through. Sockets may still hold
+ *       page cache pages of a record after it is unpinned, so space written
+ *       before is punched out of the file ahead of a new record; records
+ *       are page aligned for it. Where the file system cannot punch holes,
+ *       hits are copied out of the mapping with write instead.
+ *     - One mutex per tier; pins are taken under it and dropped without it.
+ *     - Snapshots hold the same records, each DISK_ALIGN aligned, with
+ *       the padding left as holes. The index at the end copies every record
+ *       header, so loading builds the in-memory index from it alone; the
+ *       file is mapped read-only and records are paged in as they are hit.
+ *       Snapshots are written to a temporary file and renamed into place,
+ *       so a failed save keeps the previous one, and a loaded snapshot
+ *       stays mapped while the next one replaces it.
+ *
+ * Descriptions of individual functions, data structures, and global variables
+ * are provided in their respective leading comments.
+ *
+ * @author Iltikin Wayet
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // fallocate
+#endif
+
+#include "disk.h"
+#include "cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// ---------- HELPER PROTOTYPES ------------ //
+static dentry *index_find(disk_t *dp, const char *uri, uint64_t hash);
+static void index_add(disk_t *dp, dentry *entry);
+static void index_del(disk_t *dp, dentry *entry);
+static bool log_make_room(disk_t *dp, size_t start, size_t len);
+static bool log_overlaps(const dentry *entry, size_t start, size_t end);
+static void log_append(disk_t *dp, dentry *entry);
+static size_t align(size_t n);
+static void snap_put(dsnap *sp, const void *data, size_t n);
+
+// ---------- FUNCTION ROUTINES ------------ //
+
+/**
+ * @brief Opens, sizes, and maps the log file of a disk tier; exits if it
+ *     cannot. The tier starts empty.
+ *     Size rounded down to DISK_ALIGN; the file is sparse until written.
+ *
+ * @param[in] dp   : disk tier to initialize.
+ * @param[in] path : log file path, created if missing.
+ * @param[in] size : log file size in bytes.
+ */
+void disk_init(disk_t *dp, const char *path, size_t size) {
+    dp->size = size / DISK_ALIGN * DISK_ALIGN;
+    dp->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (dp->fd < 0 || dp->size == 0 || ftruncate(dp->fd, dp->size) < 0) {
+        fprintf(stderr, "Failed to open disk cache: %s: %s\n", path,
+                strerror(errno));
+        exit(1);
+    }
+    dp->base =
+        mmap(NULL, dp->size, PROT_READ | PROT_WRITE, MAP_SHARED, dp->fd, 0);
+    if (dp->base == MAP_FAILED) {
+        fprintf(stderr, "Failed to map disk cache: %s: %s\n", path,
+                strerror(errno));
+        exit(1);
+    }
+    dp->head = 0;
+    dp->used = 0;
+    dp->end = 0;
+    atomic_init(&dp->zerocopy, true);
+    dp->oldest = NULL;
+    dp->newest = NULL;
+    memset(dp->buckets, 0, sizeof(dp->buckets));
+    dp->writes = 0;
+    pthread_mutex_init(&dp->mutex, NULL);
+}
+
+/**
+ * @brief Maps a snapshot read-only and indexes its records fresh at <now>;
+ *     their text is only read once used.
+ *     Slots whose record does not lie before the index are skipped; the
+ *     records themselves are not read. A missing snapshot is not reported.
+ *
+ * @param[out] dp   : tier to initialize.
+ * @param[in]  path : snapshot path.
+ * @param[in]  now  : current time, time(NULL) seconds.
+ *
+ * @return true if loaded, false if there is no valid snapshot at <path>.
+ */
+bool disk_load(disk_t *dp, const char *path, time_t now) {
+    dp->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (dp->fd < 0) {
+        if (errno != ENOENT)
+            fprintf(stderr, "Failed to open cache snapshot: %s: %s\n", path,
+                    strerror(errno));
+        return false;
+    }
+    // The trailer must describe an index reaching up to it.
+    struct stat st;
+    dtrailer trailer = {0};
+    size_t size = 0;
+    if (fstat(dp->fd, &st) == 0 && (size_t)st.st_size > sizeof(trailer) &&
+        pread(dp->fd, &trailer, sizeof(trailer),
+              st.st_size - sizeof(trailer)) == (ssize_t)sizeof(trailer))
+        size = st.st_size;
+    size_t rest = size - sizeof(trailer) - trailer.index;
+    if (size == 0 || trailer.magic != DISK_SNAP_MAGIC ||
+        trailer.index % DISK_ALIGN != 0 ||
+        trailer.index > size - sizeof(trailer) || rest % sizeof(dslot) != 0 ||
+        rest / sizeof(dslot) != trailer.count) {
+        fprintf(stderr, "Ignoring invalid cache snapshot: %s\n", path);
+        close(dp->fd);
+        return false;
+    }
+    size_t index = trailer.index;
+    dp->size = size;
+    dp->base = mmap(NULL, dp->size, PROT_READ, MAP_SHARED, dp->fd, 0);
+    if (dp->base == MAP_FAILED) {
+        fprintf(stderr, "Failed to map cache snapshot: %s: %s\n", path,
+                strerror(errno));
+        close(dp->fd);
+        return false;
+    }
+
+    dp->head = dp->size;
+    dp->used = 0;
+    dp->end = dp->size;
+    atomic_init(&dp->zerocopy, true);
+    dp->oldest = NULL;
+    dp->newest = NULL;
+    memset(dp->buckets, 0, sizeof(dp->buckets));
+    dp->writes = 0;
+    pthread_mutex_init(&dp->mutex, NULL);
+
+    const dslot *slots = (const dslot *)(dp->base + index);
+    for (size_t i = 0; i < trailer.count; i++) {
+        const dslot *slot = &slots[i];
+        const drecord *record = &slot->record;
+        if (record->meta.expires <= now || record->uri_len == 0 ||
+            slot->offset % DISK_ALIGN != 0 || slot->offset >= index ||
+            record->uri_len > index || record->text_len > index ||
+            sizeof(drecord) + record->uri_len + record->text_len >
+                index - slot->offset)
+            continue;
+        dentry *e = malloc_w(sizeof(dentry));
+        e->tier = dp;
+        e->hash = record->hash;
+        e->offset = slot->offset;
+        e->len = align(sizeof(drecord) + record->uri_len + record->text_len);
+        e->text = slot->offset + sizeof(drecord) + record->uri_len;
+        e->text_len = record->text_len;
+        e->meta = record->meta;
+        atomic_init(&e->pins, 0);
+        e->live = false;
+        e->hnext = NULL;
+        e->next = NULL;
+        log_append(dp, e);
+        index_add(dp, e);
+    }
+    return true;
+}
+
+/**
+ * @brief Unmaps and closes the log file; every entry is gone.
+ *     Assumes no entry is still pinned.
+ *
+ * @param[in] dp : disk tier to free.
+ */
+void disk_deinit(disk_t *dp) {
+    while (dp->oldest != NULL) {
+        dentry *next = dp->oldest->next;
+        free(dp->oldest);
+        dp->oldest = next;
+    }
+    pthread_mutex_destroy(&dp->mutex);
+    munmap(dp->base, dp->size);
+    close(dp->fd);
+}
+
+/**
+ * @brief Makes room for a record at the head of the log.
+ *     Drops the records the new one overwrites, and the ones between the
+ *     head and the end of the file if it wraps; punches out their space
+ *     and writes the record header outside the lock.
+ *     The returned entry is pinned and not indexed until disk_commit.
+ *
+ * @param[in]  dp       : disk tier.
+ * @param[in]  uri      : client request URI used as key.
+ * @param[in]  hash     : precomputed hash of <uri>.
+ * @param[in]  text_len : length of the text to store.
+ * @param[in]  meta     : freshness of the text.
+ * @param[out] entry    : entry of the new record.
+ *
+ * @return where to copy the text to, NULL if the record does not fit, the
+ *     records in its way are pinned, or the same text is stored already.
+ */
+char *disk_reserve(disk_t *dp, const char *uri, uint64_t hash,
+                   size_t text_len, const dmeta *meta, dentry **entry) {
+    size_t uri_len = strlen(uri) + 1;
+    size_t len = align(sizeof(drecord) + uri_len + text_len);
+    if (len > dp->size)
+        return NULL;
+
+    pthread_mutex_lock(&dp->mutex);
+    // A block promoted from this tier comes back unchanged; keep its record.
+    dentry *old = index_find(dp, uri, hash);
+    if (old != NULL && old->text_len == text_len &&
+        old->meta.expires == meta->expires) {
+        pthread_mutex_unlock(&dp->mutex);
+        return NULL;
+    }
+    size_t start = (dp->head + len > dp->size) ? 0 : dp->head;
+    if (!log_make_room(dp, start, len)) {
+        pthread_mutex_unlock(&dp->mutex);
+        return NULL;
+    }
+
+    dentry *e = malloc_w(sizeof(dentry));
+    e->tier = dp;
+    e->hash = hash;
+    e->offset = start;
+    e->len = len;
+    e->text = start + sizeof(drecord) + uri_len;
+    e->text_len = text_len;
+    e->meta = *meta;
+    atomic_init(&e->pins, 1);
+    e->live = false;
+    e->hnext = NULL;
+    e->next = NULL;
+    log_append(dp, e);
+    dp->head = start + len;
+    dp->writes++;
+    size_t end = dp->end;
+    if (dp->end < dp->head)
+        dp->end = dp->head;
+    pthread_mutex_unlock(&dp->mutex);
+
+    // Fresh pages for the record; sockets keep the ones they hold.
+    if (start < end && atomic_load(&dp->zerocopy) &&
+        fallocate(dp->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start,
+                  (start + len < end) ? len : end - start) < 0)
+        atomic_store(&dp->zerocopy, false);
+
+    drecord *record = (drecord *)(dp->base + start);
+    record->magic = DISK_MAGIC;
+    record->hash = hash;
+    record->uri_len = uri_len;
+    record->text_len = text_len;
+    record->meta = *meta;
+    memcpy(record + 1, uri, uri_len);
+
+    *entry = e;
+    return dp->base + e->text;
+}
+
+/**
+ * @brief Indexes a record whose text was copied in, replacing an older
+ *     record of its URI, and unpins it.
+ *     The record may have been written over meanwhile only if unpinned, so
+ *     the entry is still in the log.
+ *
+ * @param[in] dp    : disk tier.
+ * @param[in] entry : entry returned by disk_reserve.
+ */
+void disk_commit(disk_t *dp, dentry *entry) {
+    const char *uri = dp->base + entry->offset + sizeof(drecord);
+    pthread_mutex_lock(&dp->mutex);
+    dentry *old = index_find(dp, uri, entry->hash);
+    if (old != NULL)
+        index_del(dp, old);
+    index_add(dp, entry);
+    atomic_fetch_sub_explicit(&entry->pins, 1, memory_order_release);
+    pthread_mutex_unlock(&dp->mutex);
+}
+
+/**
+ * @brief Pins the record stored under <uri> if fresh at <now>.
+ *
+ * @param[in] dp   : disk tier.
+ * @param[in] uri  : client request URI used as key.
+ * @param[in] hash : precomputed hash of <uri>.
+ * @param[in] now  : current time, time(NULL) seconds.
+ *
+ * @return pinned entry, NULL if no fresh record of <uri>.
+ */
+dentry *disk_pin(disk_t *dp, const char *uri, uint64_t hash, time_t now) {
+    pthread_mutex_lock(&dp->mutex);
+    dentry *entry = index_find(dp, uri, hash);
+    if (entry != NULL && entry->meta.expires <= now)
+        entry = NULL;
+    if (entry != NULL)
+        atomic_fetch_add_explicit(&entry->pins, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&dp->mutex);
+    return entry;
+}
+
+/**
+ * @brief Unpins an entry returned by disk_pin.
+ *     Entries are only freed under the tier lock, once unpinned.
+ *
+ * @param[in] entry : pinned entry.
+ */
+void disk_unpin(dentry *entry) {
+    atomic_fetch_sub_explicit(&entry->pins, 1, memory_order_release);
+}
+
+/**
+ * @brief Removes a pinned entry from the index; its record stays readable
+ *     until unpinned.
+ *     The entry itself stays in the log list until overwritten.
+ *
+ * @param[in] dp    : disk tier.
+ * @param[in] entry : pinned entry.
+ */
+void disk_drop(disk_t *dp, dentry *entry) {
+    pthread_mutex_lock(&dp->mutex);
+    if (entry->live)
+        index_del(dp, entry);
+    pthread_mutex_unlock(&dp->mutex);
+}
+
+/**
+ * @brief Returns the mapped text of a pinned entry.
+ *
+ * @param[in] dp    : disk tier.
+ * @param[in] entry : pinned entry.
+ */
+const char *disk_text(const disk_t *dp, const dentry *entry) {
+    return dp->base + entry->text;
+}
+
+/**
+ * @brief Sends up to <n> bytes of text of a pinned entry from <offset>
+ *     with a single sendfile, falling back to write from the mapping where
+ *     <fd> does not take it or holes cannot be punched.
+ *
+ * @param[in] dp     : disk tier.
+ * @param[in] entry  : pinned entry.
+ * @param[in] fd     : file descriptor to which the text is written.
+ * @param[in] offset : offset into the text.
+ * @param[in] n      : bytes wanted, greater than 0.
+ *
+ * @return bytes sent, -1 on error (errno set, EAGAIN if <fd> would block).
+ */
+ssize_t disk_sendtext(disk_t *dp, dentry *entry, int fd, size_t offset,
+                      size_t n) {
+    if (atomic_load_explicit(&dp->zerocopy, memory_order_relaxed)) {
+        off_t off = entry->text + offset;
+        ssize_t rc = sendfile(fd, dp->fd, &off, n);
+        if (rc >= 0 || (errno != EINVAL && errno != ENOSYS))
+            return rc;
+    }
+    return write(fd, dp->base + entry->text + offset, n);
+}
+
+/**
+ * @brief Writes the whole text of a pinned entry to <fd>.
+ *     Written piecewise, as much as each sendfile takes.
+ *
+ * @param[in] dp    : disk tier.
+ * @param[in] entry : pinned entry.
+ * @param[in] fd    : file descriptor to which the text is written.
+ *
+ * @return 0 if successful, -1 on error.
+ */
+int disk_writetext(disk_t *dp, dentry *entry, int fd) {
+    size_t offset = 0;
+    while (offset < entry->text_len) {
+        ssize_t sent =
+            disk_sendtext(dp, entry, fd, offset, entry->text_len - offset);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        offset += sent;
+    }
+    return 0;
+}
+
+/**
+ * @brief Starts writing a snapshot to a temporary file next to <path>.
+ *     The temporary file is <path> with a .tmp suffix, truncated if left
+ *     over from a failed save.
+ *
+ * @param[out] sp   : snapshot to write.
+ * @param[in]  path : snapshot path; must outlive <sp>.
+ *
+ * @return true if started, false if the temporary file cannot be created.
+ */
+bool disk_snap_open(dsnap *sp, const char *path) {
+    size_t len = strlen(path) + sizeof(".tmp");
+    sp->tmp = malloc_w(len);
+    snprintf(sp->tmp, len, "%s.tmp", path);
+    sp->fd = open(sp->tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (sp->fd < 0) {
+        fprintf(stderr, "Failed to create cache snapshot: %s: %s\n", sp->tmp,
+                strerror(errno));
+        free(sp->tmp);
+        return false;
+    }
+    sp->path = path;
+    sp->offset = 0;
+    sp->slots = NULL;
+    sp->count = 0;
+    sp->cap = 0;
+    sp->failed = false;
+    return true;
+}
+
+/**
+ * @brief Starts the next record of a snapshot; exactly <text_len> bytes of
+ *     text follow with disk_snap_write.
+ *     The record starts DISK_ALIGN aligned; the gap before it is a hole.
+ *
+ * @param[in] sp       : snapshot being written.
+ * @param[in] uri      : client request URI used as key.
+ * @param[in] hash     : precomputed hash of <uri>.
+ * @param[in] text_len : length of the text.
+ * @param[in] meta     : freshness of the text.
+ */
+void disk_snap_add(dsnap *sp, const char *uri, uint64_t hash,
+                   size_t text_len, const dmeta *meta) {
+    if (sp->count == sp->cap) {
+        sp->cap = (sp->cap > 0) ? 2 * sp->cap : 256;
+        sp->slots = Realloc(sp->slots, sizeof(dslot) * sp->cap);
+    }
+    dslot *slot = &sp->slots[sp->count++];
+    sp->offset = align(sp->offset);
+    slot->offset = sp->offset;
+    slot->record = (drecord){.magic = DISK_MAGIC,
+                             .hash = hash,
+                             .uri_len = strlen(uri) + 1,
+                             .text_len = text_len,
+                             .meta = *meta};
+    if (lseek(sp->fd, sp->offset, SEEK_SET) < 0)
+        sp->failed = true;
+    snap_put(sp, &slot->record, sizeof(drecord));
+    snap_put(sp, uri, slot->record.uri_len);
+}
+
+/**
+ * @brief Appends text to the current record of a snapshot.
+ *
+ * @param[in] sp   : snapshot being written.
+ * @param[in] data : text to append.
+ * @param[in] n    : length of <data>.
+ */
+void disk_snap_write(dsnap *sp, const void *data, size_t n) {
+    snap_put(sp, data, n);
+}
+
+/**
+ * @brief Appends the indexed records of a tier fresh at <now>.
+ *     Text copied out of the tier's mapping under its lock, so no record
+ *     is overwritten meanwhile.
+ *
+ * @param[in] sp  : snapshot being written.
+ * @param[in] dp  : disk tier or loaded snapshot.
+ * @param[in] now : current time, time(NULL) seconds.
+ */
+void disk_snap_tier(dsnap *sp, disk_t *dp, time_t now) {
+    pthread_mutex_lock(&dp->mutex);
+    for (dentry *e = dp->oldest; e != NULL; e = e->next) {
+        if (!e->live || e->meta.expires <= now)
+            continue;
+        disk_snap_add(sp, dp->base + e->offset + sizeof(drecord), e->hash,
+                      e->text_len, &e->meta);
+        snap_put(sp, dp->base + e->text, e->text_len);
+    }
+    pthread_mutex_unlock(&dp->mutex);
+}
+
+/**
+ * @brief Writes the index and trailer of a snapshot and puts it in place
+ *     of the one at its path; frees the handle either way.
+ *     Synced before the rename, so a crash leaves either snapshot whole.
+ *
+ * @param[in] sp : snapshot being written.
+ *
+ * @return 0 if saved, -1 on error (the previous snapshot is kept).
+ */
+int disk_snap_close(dsnap *sp) {
+    dtrailer trailer = {.magic = DISK_SNAP_MAGIC,
+                        .count = sp->count,
+                        .index = align(sp->offset)};
+    if (lseek(sp->fd, trailer.index, SEEK_SET) < 0)
+        sp->failed = true;
+    snap_put(sp, sp->slots, sizeof(dslot) * sp->count);
+    snap_put(sp, &trailer, sizeof(trailer));
+    if (fsync(sp->fd) < 0)
+        sp->failed = true;
+    if (close(sp->fd) < 0)
+        sp->failed = true;
+    if (!sp->failed && rename(sp->tmp, sp->path) < 0)
+        sp->failed = true;
+    if (sp->failed) {
+        fprintf(stderr, "Failed to write cache snapshot: %s: %s\n", sp->tmp,
+                strerror(errno));
+        unlink(sp->tmp);
+    }
+    free(sp->tmp);
+    free(sp->slots);
+    return sp->failed ? -1 : 0;
+}
+
+// ---------- HELPER ROUTINES ------------ //
+
+/**
+ * @brief Finds the indexed entry of <uri>.
+ *
+ * @param[in] dp   : disk tier, lock held.
+ * @param[in] uri  : client request URI used as key.
+ * @param[in] hash : precomputed hash of <uri>.
+ *
+ * @return matching entry, NULL if none.
+ */
+static dentry *index_find(disk_t *dp, const char *uri, uint64_t hash) {
+    dentry *curr = dp->buckets[hash & (DISK_BUCKETS - 1)];
+    while (curr != NULL) {
+        if (curr->hash == hash &&
+            !strcmp(uri, dp->base + curr->offset + sizeof(drecord)))
+            return curr;
+        curr = curr->hnext;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Adds an entry to the front of its hash bucket chain.
+ *
+ * @param[in] dp    : disk tier, lock held.
+ * @param[in] entry : entry in the log, not indexed.
+ */
+static void index_add(disk_t *dp, dentry *entry) {
+    dentry **bucket = &dp->buckets[entry->hash & (DISK_BUCKETS - 1)];
+    entry->hnext = *bucket;
+    *bucket = entry;
+    entry->live = true;
+}
+
+/**
+ * @brief Removes an entry from its hash bucket chain.
+ *
+ * @param[in] dp    : disk tier, lock held.
+ * @param[in] entry : indexed entry.
+ */
+static void index_del(disk_t *dp, dentry *entry) {
+    dentry **link = &dp->buckets[entry->hash & (DISK_BUCKETS - 1)];
+    while (*link != entry)
+        link = &(*link)->hnext;
+    *link = entry->hnext;
+    entry->hnext = NULL;
+    entry->live = false;
+}
+
+/**
+ * @brief Drops the records a new record at <start> overwrites, oldest
+ *     first; with <start> behind the head, the records between the head
+ *     and the end of the file go too.
+ *     Stops at the first pinned record in the way.
+ *
+ * @param[in] dp    : disk tier, lock held.
+ * @param[in] start : offset of the new record, the head or 0.
+ * @param[in] len   : length of the new record.
+ *
+ * @return true if the space is free, false if a pinned record is in it.
+ */
+static bool log_make_room(disk_t *dp, size_t start, size_t len) {
+    while (dp->oldest != NULL) {
+        dentry *entry = dp->oldest;
+        bool wrapped = start < dp->head;
+        if (!log_overlaps(entry, start, start + len) &&
+            !(wrapped && log_overlaps(entry, dp->head, dp->size)))
+            return true;
+        if (atomic_load_explicit(&entry->pins, memory_order_acquire) > 0)
+            return false;
+        if (entry->live)
+            index_del(dp, entry);
+        dp->oldest = entry->next;
+        if (dp->oldest == NULL)
+            dp->newest = NULL;
+        dp->used -= entry->len;
+        free(entry);
+    }
+    return true;
+}
+
+/**
+ * @brief Returns whether the record of an entry overlaps [start, end).
+ *
+ * @param[in] entry : entry in the log.
+ * @param[in] start : first offset of the range.
+ * @param[in] end   : offset past the range.
+ */
+static bool log_overlaps(const dentry *entry, size_t start, size_t end) {
+    return entry->offset < end && start < entry->offset + entry->len;
+}
+
+/**
+ * @brief Appends an entry to the log list, as its newest record.
+ *
+ * @param[in] dp    : disk tier, lock held or not yet shared.
+ * @param[in] entry : entry not in the log list.
+ */
+static void log_append(disk_t *dp, dentry *entry) {
+    if (dp->newest != NULL)
+        dp->newest->next = entry;
+    else
+        dp->oldest = entry;
+    dp->newest = entry;
+    dp->used += entry->len;
+}
+
+/**
+ * @brief Rounds a record length up to DISK_ALIGN.
+ *
+ * @param[in] n : length in bytes.
+ */
+static size_t align(size_t n) {
+    return (n + DISK_ALIGN - 1) / DISK_ALIGN * DISK_ALIGN;
+}
+
+/**
+ * @brief Writes bytes at the end of a snapshot; after a failed write,
+ *     only advances the offset.
+ *
+ * @param[in] sp   : snapshot being written.
+ * @param[in] data : bytes to write.
+ * @param[in] n    : length of <data>.
+ */
+static void snap_put(dsnap *sp, const void *data, size_t n) {
+    if (!sp->failed && n > 0 && rio_writen(sp->fd, data, n) < 0)
+        sp->failed = true;
+    sp->offset += n;
+}
@@ -0,0 +1,310 @@
+/**
+ * @file disk.h
+ * @brief On-disk cache tier for the tiny web proxy cache.
+ *
+ * A log-structured store kept in one memory-mapped file. Blocks evicted from
+ * the memory tier are appended to the log as records (header, URI, text);
+ * an in-memory index maps URI hashes to the records still in the log. The
+ * log wraps around when it reaches the end of the file, overwriting its
+ * oldest records, so the file size bounds the disk tier. Hits are sent to
+ * clients with sendfile straight from the file.
+ *
+ * The same records make up cache snapshots: written front to back into a
+ * file of their own, followed by an index of the records and a trailer, so
+ * a snapshot is mapped and indexed at startup without reading its text.
+ *
+ * disk.c has more detailed implementation-related comments.
+ *
+ * @author Iltikin Wayet
+ */
+
+#ifndef DISK_H
+#define DISK_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+// Alignment of records in the log; a page, so the space of overwritten
+// records can be punched out of the file.
+#define DISK_ALIGN 4096
+
+// Number of index hash buckets (power of two).
+#define DISK_BUCKETS 4096
+
+// First word of every record ("TPDISK01").
+#define DISK_MAGIC 0x31304b5349445054ULL
+
+// First word of a snapshot trailer ("TPSNAP01").
+#define DISK_SNAP_MAGIC 0x313050414e535054ULL
+
+/**
+ * @brief Freshness of a stored response, as given by the memory tier.
+ *     Fixed width, since it is part of the record written to the file.
+ */
+typedef struct disk_meta {
+    int64_t expires;       // When the text goes stale, time(NULL) seconds.
+    int64_t lifetime;      // Freshness lifetime in seconds.
+    uint64_t etag;         // Offset of the ETag value in the text, 0 if none.
+    uint64_t etag_len;     // Length of the ETag value.
+    uint64_t modified;     // Offset of the Last-Modified value, 0 if none.
+    uint64_t modified_len; // Length of the Last-Modified value.
+} dmeta;
+
+/**
+ * @brief Record header in the log; followed by the URI and its NUL, then
+ *     the text.
+ */
+typedef struct disk_record {
+    uint64_t magic;    // DISK_MAGIC.
+    uint64_t hash;     // Hash of the URI.
+    uint64_t uri_len;  // Length of the URI, NUL included.
+    uint64_t text_len; // Length of the text.
+    dmeta meta;        // Freshness of the text.
+} drecord;
+
+/**
+ * @brief Snapshot index slot: where a record is, and a copy of its header,
+ *     so the index is built without touching the records.
+ */
+typedef struct disk_slot {
+    uint64_t offset; // Offset of the record in the snapshot.
+    drecord record;  // Header of the record.
+} dslot;
+
+/**
+ * @brief Snapshot trailer, the last bytes of a snapshot.
+ */
+typedef struct disk_trailer {
+    uint64_t magic; // DISK_SNAP_MAGIC.
+    uint64_t count; // Number of index slots.
+    uint64_t index; // Offset of the index, DISK_ALIGN aligned.
+} dtrailer;
+
+/**
+ * @brief Index entry of a record in the log.
+ *     Entries stay in the log list until their record is overwritten, and
+ *     in the index until then or until a newer record of the URI replaces
+ *     them. A pinned record is never overwritten.
+ */
+typedef struct disk_entry {
+    struct disk_tier *tier;   // Tier holding the record.
+    uint64_t hash;            // Hash of the URI.
+    size_t offset;            // Offset of the record in the file.
+    size_t len;               // Length of the record, aligned.
+    size_t text;              // Offset of the text in the file.
+    size_t text_len;          // Length of the text.
+    dmeta meta;               // Freshness of the text.
+    atomic_long pins;         // Readers and writers holding the record.
+    bool live;                // Whether the index holds the entry.
+    struct disk_entry *hnext; // Next entry in hash bucket.
+    struct disk_entry *next;  // Next newer record in the log.
+} dentry;
+
+/**
+ * @brief Disk tier, or a snapshot loaded read-only; nothing is written to
+ *     a loaded snapshot.
+ */
+typedef struct disk_tier {
+    int fd;                        // Log file descriptor
+    char *base;                    // Mapping of the log file
+    size_t size;                   // Log file size in bytes
+    size_t head;                   // Offset the next record goes to
+    size_t used;                   // Bytes of records in the log
+    size_t end;                    // End of the part of the file written
+    atomic_bool zerocopy;          // Whether hits go out with sendfile
+    dentry *oldest;                // Oldest record in the log
+    dentry *newest;                // Newest record in the log
+    dentry *buckets[DISK_BUCKETS]; // Index hash buckets
+    uint64_t writes;               // Records written
+    pthread_mutex_t mutex;         // Protects the fields above
+} disk_t;
+
+/**
+ * @brief Snapshot being written: records go to a temporary file, renamed
+ *     over the snapshot once its index and trailer follow.
+ */
+typedef struct {
+    int fd;           // Temporary file descriptor
+    const char *path; // Snapshot path
+    char *tmp;        // Temporary file path
+    size_t offset;    // End of the records written so far
+    dslot *slots;     // Index of the records written
+    size_t count;     // Number of records written
+    size_t cap;       // Capacity of slots
+    bool failed;      // Whether a write failed
+} dsnap;
+
+/**
+ * @brief Opens, sizes, and maps the log file of a disk tier; exits if it
+ *     cannot. The tier starts empty.
+ *
+ * @param[in] dp   : disk tier to initialize.
+ * @param[in] path : log file path, created if missing.
+ * @param[in] size : log file size in bytes.
+ */
+void disk_init(disk_t *dp, const char *path, size_t size);
+
+/**
+ * @brief Maps a snapshot read-only and indexes its records fresh at <now>;
+ *     their text is only read once used.
+ *
+ * @param[out] dp   : tier to initialize.
+ * @param[in]  path : snapshot path.
+ * @param[in]  now  : current time, time(NULL) seconds.
+ *
+ * @return true if loaded, false if there is no valid snapshot at <path>.
+ */
+bool disk_load(disk_t *dp, const char *path, time_t now);
+
+/**
+ * @brief Unmaps and closes the log file; every entry is gone.
+ *
+ * @param[in] dp : disk tier to free.
+ */
+void disk_deinit(disk_t *dp);
+
+/**
+ * @brief Makes room for a record at the head of the log.
+ *     The returned entry is pinned and not indexed until disk_commit.
+ *
+ * @param[in]  dp       : disk tier.
+ * @param[in]  uri      : client request URI used as key.
+ * @param[in]  hash     : precomputed hash of <uri>.
+ * @param[in]  text_len : length of the text to store.
+ * @param[in]  meta     : freshness of the text.
+ * @param[out] entry    : entry of the new record.
+ *
+ * @return where to copy the text to, NULL if the record does not fit, the
+ *     records in its way are pinned, or the same text is stored already.
+ */
+char *disk_reserve(disk_t *dp, const char *uri, uint64_t hash,
+                   size_t text_len, const dmeta *meta, dentry **entry);
+
+/**
+ * @brief Indexes a record whose text was copied in, replacing an older
+ *     record of its URI, and unpins it.
+ *
+ * @param[in] dp    : disk tier.
+ * @param[in] entry : entry returned by disk_reserve.
+ */
+void disk_commit(disk_t *dp, dentry *entry);
+
+/**
+ * @brief Pins the record stored under <uri> if fresh at <now>.
+ *
+ * @param[in] dp   : disk tier.
+ * @param[in] uri  : client request URI used as key.
+ * @param[in] hash : precomputed hash of <uri>.
+ * @param[in] now  : current time, time(NULL) seconds.
+ *
+ * @return pinned entry, NULL if no fresh record of <uri>.
+ */
+dentry *disk_pin(disk_t *dp, const char *uri, uint64_t hash, time_t now);
+
+/**
+ * @brief Unpins an entry returned by disk_pin.
+ *
+ * @param[in] entry : pinned entry.
+ */
+void disk_unpin(dentry *entry);
+
+/**
+ * @brief Removes a pinned entry from the index; its record stays readable
+ *     until unpinned.
+ *
+ * @param[in] dp    : disk tier.
+ * @param[in] entry : pinned entry.
+ */
+void disk_drop(disk_t *dp, dentry *entry);
+
+/**
+ * @brief Returns the mapped text of a pinned entry.
+ *
+ * @param[in] dp    : disk tier.
+ * @param[in] entry : pinned entry.
+ */
+const char *disk_text(const disk_t *dp, const dentry *entry);
+
+/**
+ * @brief Sends up to <n> bytes of text of a pinned entry from <offset>
+ *     with a single sendfile.
+ *
+ * @param[in] dp     : disk tier.
+ * @param[in] entry  : pinned entry.
+ * @param[in] fd     : file descriptor to which the text is written.
+ * @param[in] offset : offset into the text.
+ * @param[in] n      : bytes wanted, greater than 0.
+ *
+ * @return bytes sent, -1 on error (errno set, EAGAIN if <fd> would block).
+ */
+ssize_t disk_sendtext(disk_t *dp, dentry *entry, int fd, size_t offset,
+                      size_t n);
+
+/**
+ * @brief Writes the whole text of a pinned entry to <fd>.
+ *
+ * @param[in] dp    : disk tier.
+ * @param[in] entry : pinned entry.
+ * @param[in] fd    : file descriptor to which the text is written.
+ *
+ * @return 0 if successful, -1 on error.
+ */
+int disk_writetext(disk_t *dp, dentry *entry, int fd);
+
+/**
+ * @brief Starts writing a snapshot to a temporary file next to <path>.
+ *
+ * @param[out] sp   : snapshot to write.
+ * @param[in]  path : snapshot path; must outlive <sp>.
+ *
+ * @return true if started, false if the temporary file cannot be created.
+ */
+bool disk_snap_open(dsnap *sp, const char *path);
+
+/**
+ * @brief Starts the next record of a snapshot; exactly <text_len> bytes of
+ *     text follow with disk_snap_write.
+ *
+ * @param[in] sp       : snapshot being written.
+ * @param[in] uri      : client request URI used as key.
+ * @param[in] hash     : precomputed hash of <uri>.
+ * @param[in] text_len : length of the text.
+ * @param[in] meta     : freshness of the text.
+ */
+void disk_snap_add(dsnap *sp, const char *uri, uint64_t hash,
+                   size_t text_len, const dmeta *meta);
+
+/**
+ * @brief Appends text to the current record of a snapshot.
+ *
+ * @param[in] sp   : snapshot being written.
+ * @param[in] data : text to append.
+ * @param[in] n    : length of <data>.
+ */
+void disk_snap_write(dsnap *sp, const void *data, size_t n);
+
+/**
+ * @brief Appends the indexed records of a tier fresh at <now>.
+ *
+ * @param[in] sp  : snapshot being written.
+ * @param[in] dp  : disk tier or loaded snapshot.
+ * @param[in] now : current time, time(NULL) seconds.
+ */
+void disk_snap_tier(dsnap *sp, disk_t *dp, time_t now);
+
+/**
+ * @brief Writes the index and trailer of a snapshot and puts it in place
+ *     of the one at its path; frees the handle either way.
+ *
+ * @param[in] sp : snapshot being written.
+ *
+ * @return 0 if saved, -1 on error (the previous snapshot is kept).
+ */
+int disk_snap_close(dsnap *sp);
+
+#endif /* DISK_H */
@@ -0,0 +1,423 @@
+/**
+ * @file dns.c
+ * @brief Asynchronous, cached name resolution for a tiny web proxy.
+ *
+ * Resolutions are kept in a chained hash table keyed by (host, port).
+ * Key implementation details:
+ *     - Table guarded by a reader-writer lock; lookups of fresh entries only
+ *       take the read lock and bump the entry's atomic reference count.
+ *     - A missing or expired entry is replaced by a pending one, queued for
+ *       the resolver threads; callers arriving while it is pending add
+ *       themselves to its waiters, so each name is resolved once at a time.
+ *     - Resolver threads run blocking getaddrinfo, publish the result under
+ *       the write lock, then notify every waiter with its own reference.
+ *     - Entries are freed by their last reference, so a replaced entry stays
+ *       valid for callers still connecting with its addresses.
+ *     - Expired entries in a bucket are dropped whenever a new entry is
+ *       added to it, bounding the table by names in recent use.
+ *
+ * Descriptions of individual functions, data structures, and global variables
+ * are provided in their respective leading comments.
+ *
+ * @author Iltikin Wayet
+ */
+
+#include "dns.h"
+#include "cache.h"
+#include "hash.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * @brief Caller waiting on a pending entry.
+ */
+struct dns_waiter {
+    dns_notify notify;       // Completion callback
+    void *arg;               // Argument passed to notify
+    struct dns_waiter *next; // Pointer to next waiter
+};
+typedef struct dns_waiter dwaiter;
+
+/**
+ * @brief Resolution of one (host, port) pair.
+ */
+struct dns_entry {
+    char *host;              // Server host
+    char *port;              // Server port
+    uint64_t hash;           // Hash of host and port
+    struct addrinfo *addrs;  // Resolved addresses, NULL if failed/pending
+    int error;               // getaddrinfo error, 0 if none
+    time_t expires;          // Time the entry goes stale
+    bool pending;            // Whether resolution is still in flight
+    atomic_long refs;        // References: table, queue, and callers
+    dwaiter *waiters;        // Callers waiting on a pending entry
+    struct dns_entry *next;  // Pointer to next entry in bucket
+    struct dns_entry *qnext; // Pointer to next entry in resolver queue
+};
+
+/**
+ * @brief Waiter state of a blocking lookup.
+ */
+typedef struct {
+    pthread_mutex_t mutex; // Mutex protecting entry
+    pthread_cond_t cond;   // Signaled once entry is set
+    dns_entry *entry;      // Resolved entry, NULL while pending
+} dsync;
+
+// Name cache hash table.
+static dns_entry *buckets[DNS_BUCKETS];
+// Lock protecting buckets and pending entry state.
+static pthread_rwlock_t dns_lock = PTHREAD_RWLOCK_INITIALIZER;
+// Queue of entries waiting for a resolver thread.
+static dns_entry *queue_head;
+static dns_entry *queue_tail;
+// Mutex and condition protecting the resolver queue.
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+// ---------- HELPER PROTOTYPES ------------ //
+static void *resolver(void *vargp);
+static void dns_resolve(dns_entry *entry);
+static dns_entry *entry_new(const char *host, const char *port,
+                            uint64_t hash);
+static dns_entry **dns_find(const char *host, const char *port,
+                            uint64_t hash);
+static void dns_prune(size_t bucket, time_t now);
+static void sync_notify(dns_entry *entry, void *arg);
+
+// ---------- FUNCTION ROUTINES ------------ //
+
+/**
+ * @brief Starts the resolver threads.
+ *
+ * @param[in] resolvers : number of resolver threads, at least 1.
+ */
+void dns_init(size_t resolvers) {
+    pthread_t tid;
+    for (size_t i = 0; i < ((resolvers < 1) ? 1 : resolvers); i++) {
+        pthread_create(&tid, NULL, resolver, NULL);
+        pthread_detach(tid);
+    }
+}
+
+/**
+ * @brief Looks up <host>:<port> without blocking.
+ *     A fresh cached entry is returned directly; otherwise the lookup is
+ *     queued (or joins one in flight) and <notify> is called on completion.
+ *
+ * @param[in] host   : server host.
+ * @param[in] port   : numeric server port.
+ * @param[in] notify : completion callback, if the lookup is pending.
+ * @param[in] arg    : argument passed to <notify>.
+ *
+ * @return cached entry, NULL if pending.
+ */
+dns_entry *dns_lookup(const char *host, const char *port, dns_notify notify,
+                      void *arg) {
+    uint64_t hash = hash_origin(host, port);
+    time_t now = time(NULL);
+
+    // Fresh entries only need the read lock.
+    pthread_rwlock_rdlock(&dns_lock);
+    dns_entry *entry = *dns_find(host, port, hash);
+    if (entry != NULL && !entry->pending && entry->expires > now) {
+        atomic_fetch_add(&entry->refs, 1);
+        pthread_rwlock_unlock(&dns_lock);
+        return entry;
+    }
+    pthread_rwlock_unlock(&dns_lock);
+
+    dwaiter *waiter = malloc_w(sizeof(dwaiter));
+    waiter->notify = notify;
+    waiter->arg = arg;
+
+    pthread_rwlock_wrlock(&dns_lock);
+    dns_entry **link = dns_find(host, port, hash);
+    entry = *link;
+    // Resolved while the lock was dropped.
+    if (entry != NULL && !entry->pending && entry->expires > now) {
+        atomic_fetch_add(&entry->refs, 1);
+        pthread_rwlock_unlock(&dns_lock);
+        free(waiter);
+        return entry;
+    }
+    // Missing or expired; replace with a pending entry.
+    bool start = (entry == NULL || !entry->pending);
+    if (start) {
+        dns_entry *fresh = entry_new(host, port, hash);
+        fresh->next = (entry != NULL) ? entry->next : NULL;
+        *link = fresh;
+        if (entry != NULL)
+            dns_release(entry);
+        entry = fresh;
+        dns_prune(hash % DNS_BUCKETS, now);
+    }
+    waiter->next = entry->waiters;
+    entry->waiters = waiter;
+    pthread_rwlock_unlock(&dns_lock);
+
+    // Queue new entries for a resolver thread.
+    if (start) {
+        pthread_mutex_lock(&queue_mutex);
+        entry->qnext = NULL;
+        if (queue_tail != NULL)
+            queue_tail->qnext = entry;
+        else
+            queue_head = entry;
+        queue_tail = entry;
+        pthread_cond_signal(&queue_cond);
+        pthread_mutex_unlock(&queue_mutex);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Looks up <host>:<port>, waiting for the resolution if needed.
+ *
+ * @param[in] host : server host.
+ * @param[in] port : numeric server port.
+ *
+ * @return resolved entry.
+ */
+dns_entry *dns_lookup_wait(const char *host, const char *port) {
+    dsync sync = {.mutex = PTHREAD_MUTEX_INITIALIZER,
+                  .cond = PTHREAD_COND_INITIALIZER,
+                  .entry = NULL};
+    dns_entry *entry = dns_lookup(host, port, sync_notify, &sync);
+    if (entry != NULL)
+        return entry;
+
+    pthread_mutex_lock(&sync.mutex);
+    while (sync.entry == NULL)
+        pthread_cond_wait(&sync.cond, &sync.mutex);
+    entry = sync.entry;
+    pthread_mutex_unlock(&sync.mutex);
+    pthread_cond_destroy(&sync.cond);
+    pthread_mutex_destroy(&sync.mutex);
+    return entry;
+}
+
+/**
+ * @brief Returns the addresses of a resolved entry.
+ *
+ * @param[in] entry : resolved entry.
+ *
+ * @return address list, NULL if resolution failed.
+ */
+const struct addrinfo *dns_addrs(const dns_entry *entry) {
+    return entry->addrs;
+}
+
+/**
+ * @brief Returns the getaddrinfo error of a resolved entry, 0 if none.
+ *
+ * @param[in] entry : resolved entry.
+ */
+int dns_error(const dns_entry *entry) {
+    return entry->error;
+}
+
+/**
+ * @brief Returns an entry obtained from a lookup.
+ *     Last reference frees the entry.
+ *
+ * @param[in] entry : resolved entry.
+ */
+void dns_release(dns_entry *entry) {
+    if (atomic_fetch_sub(&entry->refs, 1) != 1)
+        return;
+    if (entry->addrs != NULL)
+        freeaddrinfo(entry->addrs);
+    free(entry->host);
+    free(entry->port);
+    free(entry);
+}
+
+/**
+ * @brief Opens a connection to <host>:<port>, like open_clientfd, with the
+ *     addresses taken from the name cache.
+ *
+ * @param[in] host : server host.
+ * @param[in] port : numeric server port.
+ *
+ * @return connected socket descriptor, -2 if the name did not resolve, -1
+ *     if every connect failed.
+ */
+int dns_open_clientfd(const char *host, const char *port) {
+    dns_entry *entry = dns_lookup_wait(host, port);
+    const struct addrinfo *p = dns_addrs(entry);
+    if (p == NULL) {
+        dns_release(entry);
+        return -2;
+    }
+
+    // Walk the list for one that we can successfully connect to.
+    int clientfd = -1;
+    for (; p != NULL; p = p->ai_next) {
+        clientfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (clientfd < 0)
+            continue;
+        if (connect(clientfd, p->ai_addr, p->ai_addrlen) != -1)
+            break;
+        close(clientfd);
+        clientfd = -1;
+    }
+    dns_release(entry);
+    return clientfd;
+}
+
+// ---------- HELPER ROUTINES ------------ //
+
+/**
+ * @brief Resolver thread function.
+ *     Resolves queued entries one at a time, forever.
+ *
+ * @param[in] vargp : unused.
+ */
+static void *resolver(void *vargp) {
+    (void)vargp;
+    while (1) {
+        pthread_mutex_lock(&queue_mutex);
+        while (queue_head == NULL)
+            pthread_cond_wait(&queue_cond, &queue_mutex);
+        dns_entry *entry = queue_head;
+        queue_head = entry->qnext;
+        if (queue_head == NULL)
+            queue_tail = NULL;
+        pthread_mutex_unlock(&queue_mutex);
+
+        dns_resolve(entry);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Resolves a pending entry, then notifies its waiters.
+ *     Consumes the queue's reference to the entry.
+ *
+ * @param[in] entry : pending entry taken off the resolver queue.
+ */
+static void dns_resolve(dns_entry *entry) {
+    struct addrinfo hints, *addrs = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM; // Open a connection
+    hints.ai_flags = AI_NUMERICSERV; // ... using a numeric port arg.
+    hints.ai_flags |= AI_ADDRCONFIG; // Recommended for connections
+    int rc = getaddrinfo(entry->host, entry->port, &hints, &addrs);
+    if (rc != 0) {
+        fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", entry->host,
+                entry->port, gai_strerror(rc));
+        addrs = NULL;
+    }
+
+    // Publish result; every waiter gets a reference.
+    pthread_rwlock_wrlock(&dns_lock);
+    entry->addrs = addrs;
+    entry->error = rc;
+    entry->expires = time(NULL) + ((rc == 0) ? DNS_TTL : DNS_NEG_TTL);
+    entry->pending = false;
+    dwaiter *waiter = entry->waiters;
+    entry->waiters = NULL;
+    for (dwaiter *w = waiter; w != NULL; w = w->next)
+        atomic_fetch_add(&entry->refs, 1);
+    pthread_rwlock_unlock(&dns_lock);
+
+    while (waiter != NULL) {
+        dwaiter *next = waiter->next;
+        waiter->notify(entry, waiter->arg);
+        free(waiter);
+        waiter = next;
+    }
+    dns_release(entry);
+}
+
+/**
+ * @brief Allocates a pending entry, referenced by the table and the queue.
+ *
+ * @param[in] host : server host.
+ * @param[in] port : server port.
+ * @param[in] hash : hash of host and port.
+ */
+static dns_entry *entry_new(const char *host, const char *port,
+                            uint64_t hash) {
+    dns_entry *entry = malloc_w(sizeof(dns_entry));
+    entry->host = strdup(host);
+    entry->port = strdup(port);
+    entry->hash = hash;
+    entry->addrs = NULL;
+    entry->error = 0;
+    entry->expires = 0;
+    entry->pending = true;
+    atomic_init(&entry->refs, 2);
+    entry->waiters = NULL;
+    entry->next = NULL;
+    entry->qnext = NULL;
+    return entry;
+}
+
+/**
+ * @brief Finds the link to the entry for <host>:<port> in its bucket.
+ *     Requires dns_lock, read or write.
+ *
+ * @param[in] host : server host.
+ * @param[in] port : server port.
+ * @param[in] hash : hash of host and port.
+ *
+ * @return pointer to the link holding the entry; holds NULL if not cached.
+ */
+static dns_entry **dns_find(const char *host, const char *port,
+                            uint64_t hash) {
+    dns_entry **link = &buckets[hash % DNS_BUCKETS];
+    while (*link != NULL &&
+           ((*link)->hash != hash || strcmp((*link)->host, host) != 0 ||
+            strcmp((*link)->port, port) != 0)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+/**
+ * @brief Drops expired, resolved entries from a bucket.
+ *     Requires dns_lock for writing.
+ *
+ * @param[in] bucket : bucket index.
+ * @param[in] now    : current time.
+ */
+static void dns_prune(size_t bucket, time_t now) {
+    dns_entry **link = &buckets[bucket];
+    while (*link != NULL) {
+        dns_entry *entry = *link;
+        if (!entry->pending && entry->expires <= now) {
+            *link = entry->next;
+            dns_release(entry);
+        } else {
+            link = &entry->next;
+        }
+    }
+}
+
+/**
+ * @brief Completion callback of a blocking lookup; wakes the caller.
+ *
+ * @param[in] entry : resolved entry.
+ * @param[in] arg   : void* pointer to the caller's dsync struct.
+ */
+static void sync_notify(dns_entry *entry, void *arg) {
+    dsync *sync = (dsync *)arg;
+    pthread_mutex_lock(&sync->mutex);
+    sync->entry = entry;
+    pthread_cond_signal(&sync->cond);
+    pthread_mutex_unlock(&sync->mutex);
+}
@@ -0,0 +1,113 @@
+/**
+ * @file dns.h
+ * @brief Asynchronous, cached name resolution for a tiny web proxy.
+ *
+ * Server names are resolved off the serving threads by a small pool of
+ * resolver threads, and results are cached for every thread to share.
+ * Concurrent lookups of a name that is already being resolved wait for the
+ * same resolution instead of starting their own.
+ *
+ * getaddrinfo does not report record TTLs, so successful results are kept
+ * for DNS_TTL seconds and failures for DNS_NEG_TTL seconds.
+ *
+ * dns.c has more detailed implementation-related comments.
+ *
+ * @author Iltikin Wayet
+ */
+
+#ifndef DNS_H
+#define DNS_H
+
+#include <netdb.h>
+#include <stddef.h>
+
+// Default number of resolver threads.
+#define DNS_RESOLVERS 4
+// Seconds resolved addresses are cached.
+#define DNS_TTL 60
+// Seconds failed resolutions are cached.
+#define DNS_NEG_TTL 5
+// Number of name cache hash buckets.
+#define DNS_BUCKETS 1024
+
+/**
+ * @brief Resolution of one (host, port) pair; opaque.
+ *     Entries are reference counted; every entry handed out must be returned
+ *     with dns_release.
+ */
+typedef struct dns_entry dns_entry;
+
+/**
+ * @brief Completion callback of an asynchronous lookup.
+ *     Called from a resolver thread; <entry> is owned by the callee.
+ */
+typedef void (*dns_notify)(dns_entry *entry, void *arg);
+
+/**
+ * @brief Starts the resolver threads.
+ *
+ * @param[in] resolvers : number of resolver threads, at least 1.
+ */
+void dns_init(size_t resolvers);
+
+/**
+ * @brief Looks up <host>:<port> without blocking.
+ *     A fresh cached entry is returned directly; otherwise the lookup is
+ *     queued (or joins one in flight) and <notify> is called on completion.
+ *
+ * @param[in] host   : server host.
+ * @param[in] port   : numeric server port.
+ * @param[in] notify : completion callback, if the lookup is pending.
+ * @param[in] arg    : argument passed to <notify>.
+ *
+ * @return cached entry, NULL if pending.
+ */
+dns_entry *dns_lookup(const char *host, const char *port, dns_notify notify,
+                      void *arg);
+
+/**
+ * @brief Looks up <host>:<port>, waiting for the resolution if needed.
+ *
+ * @param[in] host : server host.
+ * @param[in] port : numeric server port.
+ *
+ * @return resolved entry.
+ */
+dns_entry *dns_lookup_wait(const char *host, const char *port);
+
+/**
+ * @brief Returns the addresses of a resolved entry.
+ *
+ * @param[in] entry : resolved entry.
+ *
+ * @return address list, NULL if resolution failed.
+ */
+const struct addrinfo *dns_addrs(const dns_entry *entry);
+
+/**
+ * @brief Returns the getaddrinfo error of a resolved entry, 0 if none.
+ *
+ * @param[in] entry : resolved entry.
+ */
+int dns_error(const dns_entry *entry);
+
+/**
+ * @brief Returns an entry obtained from a lookup.
+ *
+ * @param[in] entry : resolved entry.
+ */
+void dns_release(dns_entry *entry);
+
+/**
+ * @brief Opens a connection to <host>:<port>, like open_clientfd, with the
+ *     addresses taken from the name cache.
+ *
+ * @param[in] host : server host.
+ * @param[in] port : numeric server port.
+ *
+ * @return connected socket descriptor, -2 if the name did not resolve, -1
+ *     if every connect failed.
+ */
+int dns_open_clientfd(const char *host, const char *port);
+
+#endif /* DNS_H */
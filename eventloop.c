@@ -0,0 +1,1200 @@
+/**
+ * @file eventloop.c
+ * @brief Event-driven front end implementation for a tiny web proxy.
+ *
+ * Every event loop owns an epoll instance and a set of connections. A shared
+ * listening socket is registered with EPOLLEXCLUSIVE so each new connection
+ * wakes a single loop; with SO_REUSEPORT each loop has a socket of its own
+ * and the kernel picks the loop. Connections never migrate between loops.
+ *
+ * Key implementation details:
+ *     - All sockets are non-blocking; a connection state routine either makes
+ *       progress or registers interest in the descriptor it waits on.
+ *     - Epoll events carry a pointer to the endpoint (client or server side)
+ *       of a connection; the connection then steps until it would block.
+ *     - Request heads are parsed as they arrive, in the connection's input
+ *       buffer, resuming where the last read left off.
+ *     - Cache hits are pinned and sent piecewise with cache_sendtext; disk
+ *       tier hits likewise with cache_senddisk.
+ *     - Freshness of a response is judged from its first chunk; a response
+ *       whose head does not fit there is not cached. Stale copies with
+ *       validators are revalidated: a 304 in the first chunk refreshes the
+ *       copy, which the client is then sent as a hit.
+ *     - Responses not cached are spliced server to client through a pipe
+ *       of the connection when splicing is enabled (-r splice), after the
+ *       chunk read to judge freshness, if any, is sent.
+ *     - Closed connections go back to a free list of the loop after the
+ *       current batch of events, so a batch may still name endpoints of a
+ *       connection closed earlier. A connection accepted during the batch
+ *       cannot be named by it, and goes back at once: a client reconnecting
+ *       as fast as it is answered keeps one accept round going, which would
+ *       otherwise allocate a connection per request. Connections are
+ *       allocated only while the list is empty and never freed, so a loop
+ *       at steady state serves hits without allocating.
+ *     - Server names are resolved by the resolver threads of dns.c; a lookup
+ *       completed there is handed back to the owning loop through a queue,
+ *       linked through a node in the connection, and an eventfd registered
+ *       with its epoll instance.
+ *     - Concurrent misses on one URI share one server fetch (see fetch.h).
+ *       The leader reserves a shared response's text in its cache fill and
+ *       publishes each chunk saved; followers send the published text
+ *       from the pinned block, and are woken through the same queue as
+ *       lookups when there is more. A leader whose client is gone reads a
+ *       shared response on for its followers.
+ *
+ * Descriptions of individual functions, data structures, and global variables
+ * are provided in their respective leading comments.
+ *
+ * @author Iltikin Wayet
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // accept4
+#endif
+
+#include "eventloop.h"
+#include "accesslog.h"
+#include "admit.h"
+#include "cache.h"
+#include "compress.h"
+#include "csapp.h"
+#include "dns.h"
+#include "fetch.h"
+#include "metrics.h"
+#include "proxy.h"
+#include "request.h"
+#include "response.h"
+#include "splice.h"
+#include "trace.h"
+#include "tunnel.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// Max events handled per epoll_wait call.
+#define EVENT_BATCH 64
+
+/**
+ * @brief Connection states; see eventloop.h for the overall flow.
+ */
+typedef enum {
+    CONN_REQUEST, // Reading request line and headers from client
+    CONN_HIT,     // Sending cached text to client
+    CONN_FOLLOW,  // Sending text of a fetch another connection leads
+    CONN_RESOLVE, // Waiting for the server name to be resolved
+    CONN_CONNECT, // Waiting for non-blocking connect to server
+    CONN_SEND,    // Sending request to server
+    CONN_RELAY,   // Relaying server response to client
+    CONN_CLOSED   // Closed; recycled after the current event batch
+} conn_state;
+
+struct conn;
+struct evloop;
+
+/**
+ * @brief Name resolution completed, or a followed fetch changed, for a
+ *     connection, queued to its loop.
+ */
+typedef struct resolved {
+    struct conn *conn;     // Connection in CONN_RESOLVE or CONN_FOLLOW
+    dns_entry *entry;      // Resolved server name, NULL for a fetch
+    struct resolved *next; // Pointer to next completion
+} resolved;
+
+/**
+ * @brief One side of a connection registered with epoll.
+ */
+typedef struct {
+    int fd;            // Socket descriptor, -1 if none
+    uint32_t events;   // Events registered with epoll, 0 if unregistered
+    struct conn *conn; // Owning connection
+} endpoint;
+
+/**
+ * @brief Data structure with per-connection state.
+ */
+typedef struct conn {
+    conn_state state;            // Current state
+    struct evloop *loop;         // Owning event loop
+    struct conn *next_dead;      // Next closed or free connection
+    uint64_t batch;              // Loop batch the connection was accepted in
+    endpoint client;             // Client side of the connection
+    endpoint server;             // Server side of the connection
+    client_info info;            // Client connection information
+    request_info request;        // Client request information
+    request_parser parser;       // Parser of the client request head
+    dns_entry *dns;              // Resolved server name, NULL if pending
+    const struct addrinfo *addr; // Server address being connected to
+    cblock *block;               // Pinned cache block on a hit
+    cblock *stale;               // Stale copy being revalidated, or NULL
+    dentry *entry;               // Pinned disk tier record on a disk hit
+    cplain plain;                // Kept buffer compressed hits inflate into
+    size_t plain_len;            // Length of the hit inflated into plain
+    size_t sent;                 // Bytes of block or out already sent
+    char in[MAXLINE];            // Request bytes read from client
+    size_t in_len;               // Length of in
+    size_t head_len;             // Length of the request head in in
+    char out[MAXBUF];            // Request to server, then response chunk
+    size_t out_len;              // Length of out
+    cfill *fill;                 // Cache fill of response, NULL if uncacheable
+    bool checked;                // Whether response head was checked
+    bool storable;               // Whether the response may be cached
+    size_t response_head;        // Length of the checked response head
+    ssize_t content_length;      // Its Content-Length, -1 if absent
+    size_t relayed;              // Response bytes relayed to client
+    int origin;                  // Origin slot counting the fetch, or -1
+    fetch *fetch;                // Fetch led or followed, NULL if none
+    bool leader;                 // Whether the connection leads fetch
+    bool dead;                   // Whether writing to the client failed
+    fetch_waiter waiter;         // Wakes a CONN_FOLLOW connection
+    spipe pipe;                  // Pipe of a spliced response, if opened
+    resolved done;               // Queues the completed lookup to the loop
+    mtimer timer;                // Timings of the request
+} conn;
+
+/**
+ * @brief Data structure with per-loop state.
+ */
+typedef struct evloop {
+    int epfd;              // Epoll instance of the loop
+    int listenfd;          // Listening socket descriptor of the loop
+    int cpu;               // CPU the loop is pinned to, -1 if unpinned
+    conn *dead;            // Connections closed during the current batch
+    conn *spare;           // Closed connections kept for reuse
+    uint64_t batch;        // Batches of events handled, the current one last
+    endpoint wake;         // Eventfd signaled when lookups complete
+    pthread_mutex_t mutex; // Mutex protecting done
+    resolved *done;        // Completed lookups not yet handled
+} evloop;
+
+// ---------- HELPER PROTOTYPES ------------ //
+static void *eventloop(void *vargp);
+static void loop_accept(evloop *loop);
+static void loop_resolved(evloop *loop);
+static void conn_notify(dns_entry *entry, void *arg);
+static void conn_wake(void *arg);
+static void conn_queue(conn *c, dns_entry *entry);
+static void conn_watch(conn *c, endpoint *ep, uint32_t events);
+static void conn_step(conn *c);
+static void conn_close(conn *c);
+static int conn_request(conn *c);
+static int conn_lookup(conn *c);
+static bool conn_cached(conn *c);
+static int conn_hit(conn *c);
+static int conn_follow(conn *c);
+static int conn_upstream(conn *c);
+static int conn_resolve(conn *c);
+static int conn_open(conn *c);
+static int conn_connect(conn *c);
+static int conn_send(conn *c);
+static int conn_relay(conn *c);
+static int conn_splice(conn *c);
+static int conn_revalidated(conn *c, const response_info *response,
+                            time_t now);
+static void conn_share(conn *c);
+static void conn_unlead(conn *c, bool ok);
+static void conn_trace(conn *c);
+static int conn_tunnel(conn *c);
+
+// ---------- FUNCTION ROUTINES ------------ //
+
+/**
+ * @brief Serves client connections accepted on <listenfds> forever.
+ *     Makes the listening sockets non-blocking, then runs <nloops> - 1
+ *     loops in detached threads and the last one in the calling thread.
+ *
+ * @param[in] listenfds : listening socket descriptor of each loop.
+ * @param[in] nloops    : number of event loops, at least 1.
+ * @param[in] pin       : whether loop i is pinned to CPU i.
+ */
+void eventloop_run(const int *listenfds, size_t nloops, bool pin) {
+    pthread_t tid;
+    for (size_t i = 0; i < nloops; i++) {
+        int listenfd = listenfds[i];
+        fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+
+        evloop *loop = malloc_w(sizeof(evloop));
+        loop->listenfd = listenfd;
+        loop->cpu = pin ? (int)i : -1;
+        loop->dead = NULL;
+        loop->spare = NULL;
+        loop->batch = 0;
+        loop->done = NULL;
+        pthread_mutex_init(&loop->mutex, NULL);
+        if ((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+            perror("epoll_create1");
+            exit(1);
+        }
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLEXCLUSIVE,
+                                 .data.ptr = NULL};
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0) {
+            perror("epoll_ctl");
+            exit(1);
+        }
+        int wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        loop->wake = (endpoint){.fd = wakefd, .events = EPOLLIN, .conn = NULL};
+        ev = (struct epoll_event){.events = EPOLLIN, .data.ptr = &loop->wake};
+        if (wakefd < 0 ||
+            epoll_ctl(loop->epfd, EPOLL_CTL_ADD, wakefd, &ev) < 0) {
+            perror("eventfd");
+            exit(1);
+        }
+
+        if (i == nloops - 1) {
+            eventloop(loop);
+        } else {
+            pthread_create(&tid, NULL, eventloop, loop);
+            pthread_detach(tid);
+        }
+    }
+}
+
+// ---------- HELPER ROUTINES ------------ //
+
+/**
+ * @brief Event loop thread function.
+ *     Waits for events, steps the connections they belong to, then recycles
+ *     connections closed during the batch.
+ *
+ * @param[in] vargp : void* pointer to the loop's evloop struct.
+ */
+static void *eventloop(void *vargp) {
+    evloop *loop = (evloop *)vargp;
+    struct epoll_event events[EVENT_BATCH];
+    if (loop->cpu >= 0)
+        pin_thread(loop->cpu);
+
+    while (1) {
+        int n = epoll_wait(loop->epfd, events, EVENT_BATCH, -1);
+        if (n < 0) {
+            if (errno != EINTR)
+                perror("epoll_wait");
+            continue;
+        }
+
+        loop->batch++;
+        for (int i = 0; i < n; i++) {
+            endpoint *ep = events[i].data.ptr;
+            if (ep == NULL)
+                loop_accept(loop);
+            else if (ep == &loop->wake)
+                loop_resolved(loop);
+            else if (ep->conn->state != CONN_CLOSED)
+                conn_step(ep->conn);
+        }
+
+        while (loop->dead != NULL) {
+            conn *c = loop->dead;
+            loop->dead = c->next_dead;
+            c->next_dead = loop->spare;
+            loop->spare = c;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Accepts all pending client connections.
+ *     Other loops may win the race for a connection; EAGAIN ends the round.
+ *     Connections come from the loop's free list, allocated only when it
+ *     is empty.
+ *
+ * @param[in] loop : loop accepting the connections.
+ */
+static void loop_accept(evloop *loop) {
+    while (1) {
+        conn *c = loop->spare;
+        if (c != NULL)
+            loop->spare = c->next_dead;
+        else {
+            c = malloc_w(sizeof(conn));
+            c->plain = (cplain){.text = NULL, .size = 0};
+        }
+        c->info.addrlen = sizeof(c->info.addr);
+        int fd = accept4(loop->listenfd, (SA *)&c->info.addr, &c->info.addrlen,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("accept");
+            c->next_dead = loop->spare;
+            loop->spare = c;
+            return;
+        }
+        if (!admit_open()) {
+            metrics_count(METRIC_SHED_LOAD, 1);
+            clientretry(fd, "503", "Service Unavailable",
+                        "Tiny is serving too many clients", ADMIT_RETRY_AFTER);
+            close(fd);
+            continue;
+        }
+
+        c->state = CONN_REQUEST;
+        c->loop = loop;
+        c->next_dead = NULL;
+        c->batch = loop->batch;
+        c->info.connfd = fd;
+        c->client = (endpoint){.fd = fd, .events = 0, .conn = c};
+        c->server = (endpoint){.fd = -1, .events = 0, .conn = c};
+        request_parser_init(&c->parser);
+        c->dns = NULL;
+        c->addr = NULL;
+        c->block = NULL;
+        c->stale = NULL;
+        c->entry = NULL;
+        c->sent = 0;
+        c->in_len = 0;
+        c->head_len = 0;
+        c->out_len = 0;
+        c->fill = NULL;
+        c->checked = false;
+        c->storable = false;
+        c->response_head = 0;
+        c->content_length = -1;
+        c->relayed = 0;
+        c->origin = -1;
+        c->fetch = NULL;
+        c->leader = false;
+        c->dead = false;
+        c->waiter = (fetch_waiter){.notify = conn_wake, .arg = c};
+        c->pipe = (spipe){.fds = {-1, -1}, .size = 0, .held = 0};
+        metrics_begin(&c->timer);
+        metrics_count(METRIC_ACCEPTED, 1);
+
+        accesslog_accept(fd, &c->info.addr);
+        conn_step(c);
+    }
+}
+
+/**
+ * @brief Steps connections whose server name lookup completed, or whose
+ *     followed fetch changed.
+ *
+ * @param[in] loop : loop owning the connections.
+ */
+static void loop_resolved(evloop *loop) {
+    uint64_t count;
+    if (read(loop->wake.fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("eventfd read");
+
+    pthread_mutex_lock(&loop->mutex);
+    resolved *done = loop->done;
+    loop->done = NULL;
+    pthread_mutex_unlock(&loop->mutex);
+
+    while (done != NULL) {
+        resolved *next = done->next;
+        if (done->conn->state == CONN_RESOLVE)
+            done->conn->dns = done->entry;
+        conn_step(done->conn);
+        done = next;
+    }
+}
+
+/**
+ * @brief Lookup completion callback; runs on a resolver thread.
+ *     Queues the result to the connection's loop and wakes the loop.
+ *
+ * @param[in] entry : resolved server name.
+ * @param[in] arg   : void* pointer to the connection in CONN_RESOLVE.
+ */
+static void conn_notify(dns_entry *entry, void *arg) {
+    conn_queue((conn *)arg, entry);
+}
+
+/**
+ * @brief Fetch waiter callback; runs on the thread of the fetch leader.
+ *     Queues the connection to its loop and wakes the loop.
+ *
+ * @param[in] arg : void* pointer to the connection in CONN_FOLLOW.
+ */
+static void conn_wake(void *arg) {
+    conn_queue((conn *)arg, NULL);
+}
+
+/**
+ * @brief Queues a connection to its loop, to be stepped there, and wakes
+ *     the loop.
+ *
+ * @param[in] c     : connection in CONN_RESOLVE or CONN_FOLLOW.
+ * @param[in] entry : resolved server name, NULL for a fetch wakeup.
+ */
+static void conn_queue(conn *c, dns_entry *entry) {
+    evloop *loop = c->loop;
+    resolved *done = &c->done;
+    done->conn = c;
+    done->entry = entry;
+
+    pthread_mutex_lock(&loop->mutex);
+    done->next = loop->done;
+    loop->done = done;
+    pthread_mutex_unlock(&loop->mutex);
+
+    uint64_t one = 1;
+    if (write(loop->wake.fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("eventfd write");
+}
+
+/**
+ * @brief Sets the epoll events a connection endpoint waits on.
+ *     Registers, modifies, or unregisters the endpoint as needed.
+ *
+ * @param[in] c      : connection owning <ep>.
+ * @param[in] ep     : endpoint to watch.
+ * @param[in] events : events to wait on, 0 to stop watching.
+ */
+static void conn_watch(conn *c, endpoint *ep, uint32_t events) {
+    if (ep->fd < 0 || ep->events == events)
+        return;
+
+    struct epoll_event ev = {.events = events, .data.ptr = ep};
+    int op = (ep->events == 0) ? EPOLL_CTL_ADD
+             : (events == 0)   ? EPOLL_CTL_DEL
+                               : EPOLL_CTL_MOD;
+    if (epoll_ctl(c->loop->epfd, op, ep->fd, &ev) < 0)
+        perror("epoll_ctl");
+    ep->events = events;
+}
+
+/**
+ * @brief Steps a connection through its states until it would block.
+ *     State routines return 1 on progress, 0 if waiting on an event
+ *     (registered by the routine), -1 when the connection is finished.
+ *
+ * @param[in] c : connection to step.
+ */
+static void conn_step(conn *c) {
+    int res = 1;
+    while (res > 0) {
+        switch (c->state) {
+        case CONN_REQUEST:
+            res = conn_request(c);
+            break;
+        case CONN_HIT:
+            res = conn_hit(c);
+            break;
+        case CONN_FOLLOW:
+            res = conn_follow(c);
+            break;
+        case CONN_RESOLVE:
+            res = conn_resolve(c);
+            break;
+        case CONN_CONNECT:
+            res = conn_connect(c);
+            break;
+        case CONN_SEND:
+            res = conn_send(c);
+            break;
+        case CONN_RELAY:
+            res = conn_relay(c);
+            break;
+        case CONN_CLOSED:
+            return;
+        }
+    }
+    if (res < 0)
+        conn_close(c);
+}
+
+/**
+ * @brief Closes a connection and releases everything it holds.
+ *     The connection itself is recycled after the current event batch, or
+ *     at once if accepted during it.
+ *
+ * @param[in] c : connection to close.
+ */
+static void conn_close(conn *c) {
+    conn_watch(c, &c->client, 0);
+    conn_watch(c, &c->server, 0);
+    if (c->client.fd >= 0)
+        close(c->client.fd);
+    if (c->server.fd >= 0)
+        close(c->server.fd);
+    if (c->block != NULL)
+        cache_unpin(c->block);
+    if (c->stale != NULL)
+        cache_unpin(c->stale);
+    if (c->entry != NULL)
+        cache_unpin_disk(c->entry);
+    if (c->dns != NULL)
+        dns_release(c->dns);
+    if (c->fill != NULL)
+        cache_fill_abort(c->fill);
+    if (c->fetch != NULL && c->leader)
+        fetch_end(c->fetch, false);
+    if (c->fetch != NULL)
+        fetch_release(c->fetch);
+    spipe_close(&c->pipe);
+    admit_origin_done(c->origin);
+    // A tunnel owns the client, and gives it back itself.
+    if (c->client.fd >= 0)
+        admit_close();
+    metrics_end(&c->timer);
+    metrics_count(METRIC_CLOSED, 1);
+
+    c->state = CONN_CLOSED;
+    // Events of the batch predate connections accepted during it.
+    if (c->batch == c->loop->batch) {
+        c->next_dead = c->loop->spare;
+        c->loop->spare = c;
+    } else {
+        c->next_dead = c->loop->dead;
+        c->loop->dead = c;
+    }
+}
+
+/**
+ * @brief Reads client request bytes until the blank line ending the headers.
+ *     Each read is parsed as it arrives; the parser resumes where the last
+ *     one left off. A request addressed to the proxy itself is answered
+ *     with the metrics.
+ *
+ * @param[in] c : connection in CONN_REQUEST state.
+ *
+ * @return 1 on progress, 0 if waiting on client, -1 if finished.
+ */
+static int conn_request(conn *c) {
+    ssize_t n =
+        read(c->client.fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            conn_watch(c, &c->client, EPOLLIN);
+            return 0;
+        }
+        return (errno == EINTR) ? 1 : -1;
+    }
+    if (n == 0)
+        return -1;
+    c->in_len += n;
+
+    // Wait for the end of the headers.
+    uint64_t since = metrics_now();
+    ssize_t head_len =
+        request_parse_head(&c->parser, &c->request, c->in, c->in_len);
+    c->timer.parse += metrics_now() - since;
+    if (head_len == 0 && c->in_len < sizeof(c->in))
+        return 1;
+    if (head_len <= 0) {
+        clienterror(c->client.fd, "400", "Bad Request",
+                    "Tiny received a malformed request");
+        return -1;
+    }
+    c->head_len = head_len;
+    metrics_parsed(&c->timer);
+    // Scrapes of the metrics are never rate limited.
+    long retry = metrics_requested(&c->request)
+                     ? 0
+                     : admit_client(c->client.fd, &c->info.addr);
+    if (retry > 0) {
+        metrics_count(METRIC_SHED_RATE, 1);
+        clientretry(c->client.fd, "429", "Too Many Requests",
+                    "Tiny is serving this client too often", retry);
+        return -1;
+    }
+    if (metrics_requested(&c->request)) {
+        metrics_serve(c->client.fd, &c->request);
+        return -1;
+    }
+    return conn_lookup(c);
+}
+
+/**
+ * @brief Looks up the parsed request in the cache.
+ *     Concurrent misses on one URI are collapsed into one server fetch:
+ *     the first leads, later ones follow and send the leader's response.
+ *
+ * @param[in] c : connection in CONN_REQUEST state, request parsed.
+ *
+ * @return 1 on progress, 0 if waiting on server, -1 if finished.
+ */
+static int conn_lookup(conn *c) {
+    if (!request_cacheable(&c->request, &c->parser))
+        return conn_upstream(c);
+
+    // If fresh cache hit, in memory or on disk, serve text directly.
+    uint64_t since = metrics_now();
+    if ((c->block = cache_pin(c->request.uri)) == NULL)
+        c->entry = cache_pin_disk(c->request.uri);
+    metrics_time(LATENCY_LOOKUP, since);
+    if ((c->block != NULL || c->entry != NULL) && conn_cached(c))
+        return 1;
+
+    c->fetch = fetch_join(c->request.uri, &c->leader);
+    if (!c->leader) {
+        c->state = CONN_FOLLOW;
+        c->sent = 0;
+        return 1;
+    }
+    // Cached by a fetch that ended after the lookup above.
+    if ((c->block = cache_repin(c->request.uri)) != NULL && conn_cached(c)) {
+        conn_unlead(c, false);
+        return 1;
+    }
+    return conn_upstream(c);
+}
+
+/**
+ * @brief Starts sending the pinned hit, c->block or c->entry.
+ *     Compressed text goes out inflated to a client not taking gzip, from
+ *     the connection's buffer, with the hit unpinned.
+ *
+ * @param[in] c : connection holding the pinned hit.
+ *
+ * @return true if sending, false if the hit is compressed and could not
+ *     be inflated; it is then unpinned.
+ */
+static bool conn_cached(conn *c) {
+    size_t len =
+        (c->block != NULL) ? (size_t)c->block->text_len : c->entry->text_len;
+    int inflated =
+        compress_hit(&c->parser, c->block, c->entry, &c->plain, &c->plain_len);
+    if (inflated != 0) {
+        len = c->plain_len;
+        if (c->block != NULL)
+            cache_unpin(c->block);
+        else
+            cache_unpin_disk(c->entry);
+        c->block = NULL;
+        c->entry = NULL;
+    }
+    if (inflated < 0)
+        return false;
+    c->state = CONN_HIT;
+    c->sent = 0;
+    metrics_count(METRIC_CACHE_BYTES, len);
+    trace_request(c->request.uri, TRACE_HIT, len);
+    return true;
+}
+
+/**
+ * @brief Sends pinned cached text, or the text inflated from it, to the
+ *     client.
+ *
+ * @param[in] c : connection in CONN_HIT state.
+ *
+ * @return 1 on progress, 0 if waiting on client, -1 if finished.
+ */
+static int conn_hit(conn *c) {
+    bool inflated = c->block == NULL && c->entry == NULL;
+    size_t len = c->plain_len;
+    if (!inflated)
+        len = (c->block != NULL) ? (size_t)c->block->text_len
+                                 : c->entry->text_len;
+    if (c->sent == len)
+        return -1;
+
+    metrics_answer(&c->timer);
+    ssize_t n;
+    if (inflated)
+        n = write(c->client.fd, c->plain.text + c->sent, len - c->sent);
+    else if (c->block != NULL)
+        n = cache_sendtext(c->block, c->client.fd, c->sent);
+    else
+        n = cache_senddisk(c->entry, c->client.fd, c->sent);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            conn_watch(c, &c->client, EPOLLOUT);
+            return 0;
+        }
+        return (errno == EINTR) ? 1 : -1;
+    }
+    c->sent += n;
+    return 1;
+}
+
+/**
+ * @brief Sends text of a fetch led by another connection as its leader
+ *     publishes it. A fetch not shared is left: the request is served
+ *     from the cache if the fetch cached it, else fetched separately.
+ *     The client is only watched while it cannot take more text.
+ *
+ * @param[in] c : connection in CONN_FOLLOW state.
+ *
+ * @return 1 on progress, 0 if waiting on client or fetch, -1 if finished.
+ */
+static int conn_follow(conn *c) {
+    size_t len;
+    switch (fetch_poll(c->fetch, c->sent, &c->waiter, &len)) {
+    case FETCH_WAIT:
+        // Waiter queued; conn_wake steps the connection again.
+        conn_watch(c, &c->client, 0);
+        return 0;
+    case FETCH_DECLINED:
+        fetch_release(c->fetch);
+        c->fetch = NULL;
+        c->leader = false;
+        if ((c->block = cache_repin(c->request.uri)) != NULL &&
+            conn_cached(c))
+            return 1;
+        return conn_upstream(c);
+    case FETCH_DONE:
+        trace_request(c->request.uri, TRACE_MISS, c->sent);
+        return -1;
+    case FETCH_FAILED:
+        return -1;
+    case FETCH_TEXT:
+        break;
+    }
+
+    metrics_answer(&c->timer);
+    ssize_t n = cache_sendpart(fetch_block(c->fetch), c->client.fd, c->sent,
+                               len - c->sent);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            conn_watch(c, &c->client, EPOLLOUT);
+            return 0;
+        }
+        return (errno == EINTR) ? 1 : -1;
+    }
+    c->sent += n;
+    metrics_count(METRIC_ORIGIN_BYTES, n);
+    return 1;
+}
+
+/**
+ * @brief Formats the server request and starts resolving the server name.
+ *     The client is not watched again until the response is relayed.
+ *     Nothing is sent to the server of a CONNECT request. A stale cached
+ *     copy with validators is revalidated with a conditional request,
+ *     unless the client's request is conditional itself.
+ *
+ * @param[in] c : connection missing in the cache.
+ *
+ * @return 1 on progress, -1 if finished.
+ */
+static int conn_upstream(conn *c) {
+    int len = tunnel_requested(c->request.method)
+                  ? 0
+                  : format_header(c->out, sizeof(c->out), &c->request,
+                                  &c->parser, false);
+    if (len < 0) {
+        clienterror(c->client.fd, "400", "Bad Request",
+                    "Tiny received an oversized request");
+        return -1;
+    }
+    // Tunnels are not fetches; every other request counts for its origin.
+    if (!tunnel_requested(c->request.method) &&
+        !admit_origin(c->request.host, c->request.port, &c->origin)) {
+        metrics_count(METRIC_SHED_ORIGIN, 1);
+        clientretry(c->client.fd, "503", "Service Unavailable",
+                    "Tiny is fetching too much from this server",
+                    ADMIT_RETRY_AFTER);
+        return -1;
+    }
+    // Ask for the body only if the cached copy changed.
+    if (len > 0 && request_cacheable(&c->request, &c->parser) &&
+        request_lookup_header(&c->parser, "If-None-Match") == NULL &&
+        request_lookup_header(&c->parser, "If-Modified-Since") == NULL &&
+        (c->stale = cache_pin_stale(c->request.uri)) != NULL) {
+        size_t n = cache_conditions(c->stale, c->out + len - 2,
+                                    sizeof(c->out) - len);
+        if (n > 0) {
+            memcpy(c->out + len - 2 + n, "\r\n", 2);
+            len += n;
+        } else {
+            cache_unpin(c->stale);
+            c->stale = NULL;
+        }
+    }
+    c->out_len = len;
+    c->sent = 0;
+
+    conn_watch(c, &c->client, 0);
+    c->state = CONN_RESOLVE;
+    c->timer.step = metrics_now();
+    c->dns = dns_lookup(c->request.host, c->request.port, conn_notify, c);
+    return 1;
+}
+
+/**
+ * @brief Starts connecting once the server name is resolved.
+ *
+ * @param[in] c : connection in CONN_RESOLVE state.
+ *
+ * @return 1 on progress, 0 if waiting on lookup or server, -1 if finished.
+ */
+static int conn_resolve(conn *c) {
+    // Lookup pending; loop_resolved steps the connection again.
+    if (c->dns == NULL)
+        return 0;
+    if ((c->addr = dns_addrs(c->dns)) == NULL) {
+        metrics_count(METRIC_CONNECT_ERRORS, 1);
+        return -1;
+    }
+    return conn_open(c);
+}
+
+/**
+ * @brief Starts a non-blocking connect to the server.
+ *     Tries each resolved address, from c->addr on, until one is started.
+ *
+ * @param[in] c : connection with a resolved server name.
+ *
+ * @return 1 on progress, 0 if waiting on server, -1 if finished.
+ */
+static int conn_open(conn *c) {
+    for (; c->addr != NULL; c->addr = c->addr->ai_next) {
+        int fd = socket(c->addr->ai_family,
+                        c->addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        c->addr->ai_protocol);
+        if (fd < 0)
+            continue;
+        c->server = (endpoint){.fd = fd, .events = 0, .conn = c};
+
+        if (connect(fd, c->addr->ai_addr, c->addr->ai_addrlen) == 0) {
+            c->state = CONN_SEND;
+            metrics_time(LATENCY_CONNECT, c->timer.step);
+            return 1;
+        }
+        if (errno == EINPROGRESS) {
+            c->state = CONN_CONNECT;
+            conn_watch(c, &c->server, EPOLLOUT);
+            return 0;
+        }
+        close(fd);
+        c->server.fd = -1;
+    }
+    metrics_count(METRIC_CONNECT_ERRORS, 1);
+    fprintf(stderr, "Could not connect to %s:%s\n", c->request.host,
+            c->request.port);
+    if (tunnel_requested(c->request.method))
+        clienterror(c->client.fd, "502", "Bad Gateway",
+                    "Tiny could not connect to the server");
+    return -1;
+}
+
+/**
+ * @brief Completes a non-blocking connect to the server.
+ *     On failure, moves on to the next resolved address.
+ *
+ * @param[in] c : connection in CONN_CONNECT state.
+ *
+ * @return 1 on progress, 0 if waiting on server, -1 if finished.
+ */
+static int conn_connect(conn *c) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(c->server.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+        err = errno;
+    if (err == 0) {
+        c->state = CONN_SEND;
+        metrics_time(LATENCY_CONNECT, c->timer.step);
+        return 1;
+    }
+
+    conn_watch(c, &c->server, 0);
+    close(c->server.fd);
+    c->server.fd = -1;
+    c->addr = c->addr->ai_next;
+    return conn_open(c);
+}
+
+/**
+ * @brief Sends the formatted request to the server.
+ *
+ * @param[in] c : connection in CONN_SEND state.
+ *
+ * @return 1 on progress, 0 if waiting on server, -1 if finished.
+ */
+static int conn_send(conn *c) {
+    if (c->sent == c->out_len && tunnel_requested(c->request.method))
+        return conn_tunnel(c);
+    if (c->sent == c->out_len) {
+        // Request sent; relay response, caching it if it fits.
+        c->state = CONN_RELAY;
+        c->out_len = 0;
+        c->sent = 0;
+        c->checked = false;
+        c->storable = request_cacheable(&c->request, &c->parser);
+        if (c->storable)
+            c->fill = cache_fill(c->request.uri, 0);
+        return 1;
+    }
+
+    ssize_t n = write(c->server.fd, c->out + c->sent, c->out_len - c->sent);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            conn_watch(c, &c->server, EPOLLOUT);
+            return 0;
+        }
+        return (errno == EINTR) ? 1 : -1;
+    }
+    c->sent += n;
+    return 1;
+}
+
+/**
+ * @brief Relays the server response to the client one chunk at a time.
+ *     Only one side is watched at a time: the server while out is empty,
+ *     the client while a chunk is still being written.
+ *     Response cached on server EOF if it fit in its cache fill and its
+ *     body matches its Content-Length; once it is not cached, the rest is
+ *     spliced if enabled.
+ *
+ * @param[in] c : connection in CONN_RELAY state.
+ *
+ * @return 1 on progress, 0 if waiting on either side, -1 if finished.
+ */
+static int conn_relay(conn *c) {
+    ssize_t n;
+    // Finish writing the current chunk first; dropped if the client is gone.
+    if (c->dead && c->fetch == NULL)
+        return -1;
+    if (c->sent < c->out_len && c->dead) {
+        c->relayed += c->out_len - c->sent;
+        c->sent = c->out_len;
+    }
+    if (c->sent < c->out_len) {
+        metrics_answer(&c->timer);
+        n = write(c->client.fd, c->out + c->sent, c->out_len - c->sent);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                conn_watch(c, &c->server, 0);
+                conn_watch(c, &c->client, EPOLLOUT);
+                return 0;
+            }
+            if (errno == EINTR)
+                return 1;
+            if (c->fetch == NULL)
+                return -1;
+            // A shared response is read to the end for the followers.
+            c->dead = true;
+            return 1;
+        }
+        c->sent += n;
+        c->relayed += n;
+        metrics_count(METRIC_ORIGIN_BYTES, n);
+        return 1;
+    }
+    if (c->fill == NULL && splice_enabled() &&
+        (c->pipe.fds[0] >= 0 || spipe_open(&c->pipe, true)))
+        return conn_splice(c);
+
+    n = read(c->server.fd, c->out, sizeof(c->out));
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            conn_watch(c, &c->client, 0);
+            conn_watch(c, &c->server, EPOLLIN);
+            return 0;
+        }
+        return (errno == EINTR) ? 1 : -1;
+    }
+    if (n == 0) {
+        // Cached only if the body is whole: as long as its Content-Length
+        // says, or framed by the server closing.
+        bool whole = c->fill != NULL &&
+                     (c->content_length < 0 ||
+                      c->relayed - c->response_head ==
+                          (size_t)c->content_length);
+        if (whole)
+            cache_fill_commit(c->fill);
+        else if (c->fill != NULL)
+            cache_fill_abort(c->fill);
+        c->fill = NULL;
+        // Cached before the fetch ends, so followers joining late find it.
+        if (c->fetch != NULL)
+            conn_unlead(c, whole);
+        if (!c->dead)
+            conn_trace(c);
+        return -1;
+    }
+    c->out_len = n;
+    c->sent = 0;
+
+    // Keep the fill only if the response head allows caching it; a 304
+    // confirms the stale copy instead, and a new response replaces it.
+    if (!c->checked && (c->fill != NULL || c->stale != NULL)) {
+        response_info response;
+        time_t now = time(NULL);
+        ssize_t head_len = response_parse_head(&response, c->out, n);
+        if (head_len >= 0 && c->stale != NULL && response.status == 304)
+            return conn_revalidated(c, &response, now);
+        if (c->fill != NULL &&
+            (head_len < 0 || !response_cacheable(&response, now))) {
+            cache_fill_abort(c->fill);
+            c->fill = NULL;
+            c->storable = false;
+        } else if (c->fill != NULL) {
+            cfresh fresh = {.expires = response_expires(&response, now),
+                            .lifetime = response_lifetime(&response, now)};
+            fresh.etag =
+                response_field(c->out, head_len, "ETag", &fresh.etag_len);
+            fresh.modified = response_field(c->out, head_len, "Last-Modified",
+                                            &fresh.modified_len);
+            cache_fill_fresh(c->fill, &fresh);
+            c->response_head = head_len;
+            c->content_length = response.content_length;
+        }
+        if (c->stale != NULL)
+            cache_unpin(c->stale);
+        c->stale = NULL;
+    }
+    if (!c->checked && c->fetch != NULL)
+        conn_share(c);
+    c->checked = true;
+
+    // Save chunk for the cache while the response still fits; a body
+    // longer than its Content-Length is not cached.
+    if (c->fill != NULL &&
+        ((c->content_length >= 0 &&
+          c->relayed + n > c->response_head + (size_t)c->content_length) ||
+         !cache_fill_write(c->fill, c->out, n))) {
+        cache_fill_abort(c->fill);
+        c->fill = NULL;
+    }
+    if (c->fetch != NULL && c->fill == NULL)
+        conn_unlead(c, false);
+    else if (c->fetch != NULL)
+        fetch_publish(c->fetch, c->relayed + n);
+    return 1;
+}
+
+/**
+ * @brief Relays the rest of a response not cached through the pipe of the
+ *     connection, never copying it to user space.
+ *     The pipe is emptied to the client before the server is read again.
+ *
+ * @param[in] c : connection in CONN_RELAY state, with its pipe open.
+ *
+ * @return 1 on progress, 0 if waiting on either side, -1 if finished.
+ */
+static int conn_splice(conn *c) {
+    ssize_t n;
+    if (c->pipe.held > 0) {
+        metrics_answer(&c->timer);
+        if ((n = spipe_drain(&c->pipe, c->client.fd)) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                conn_watch(c, &c->server, 0);
+                conn_watch(c, &c->client, EPOLLOUT);
+                return 0;
+            }
+            return (errno == EINTR) ? 1 : -1;
+        }
+        c->relayed += n;
+        metrics_count(METRIC_ORIGIN_BYTES, n);
+        return 1;
+    }
+
+    n = spipe_fill(&c->pipe, c->server.fd, c->pipe.size);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            conn_watch(c, &c->client, 0);
+            conn_watch(c, &c->server, EPOLLIN);
+            return 0;
+        }
+        return (errno == EINTR) ? 1 : -1;
+    }
+    if (n == 0) {
+        conn_trace(c);
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * @brief Sends the stale copy a 304 confirmed as a hit, refreshed; its
+ *     lifetime is renewed unless the 304 gives one. The server connection
+ *     is closed, and a led fetch ends unshared, so that its followers find
+ *     the refreshed copy in the cache.
+ *
+ * @param[in] c        : connection in CONN_RELAY state, holding c->stale.
+ * @param[in] response : parsed 304 response head.
+ * @param[in] now      : time the response was received.
+ *
+ * @return 1 on progress, -1 if finished.
+ */
+static int conn_revalidated(conn *c, const response_info *response,
+                            time_t now) {
+    cache_refresh(c->stale, response_explicit(response)
+                                ? response_expires(response, now)
+                                : -1);
+    if (c->fill != NULL)
+        cache_fill_abort(c->fill);
+    c->fill = NULL;
+    conn_watch(c, &c->server, 0);
+    close(c->server.fd);
+    c->server.fd = -1;
+    if (c->fetch != NULL) {
+        fetch_share(c->fetch, NULL);
+        conn_unlead(c, false);
+    }
+    c->block = c->stale;
+    c->stale = NULL;
+    if (conn_cached(c))
+        return 1;
+    clienterror(c->client.fd, "502", "Bad Gateway",
+                "Tiny could not inflate the cached response");
+    return -1;
+}
+
+/**
+ * @brief Decides, once the response head is checked, whether a led fetch
+ *     is shared. Only text reserved in the cache fill is shared, since it
+ *     then stays in place while followers read it; else the fetch ends,
+ *     and its followers fetch the response themselves.
+ *
+ * @param[in] c : connection in CONN_RELAY state, leading c->fetch.
+ */
+static void conn_share(conn *c) {
+    cblock *block = NULL;
+    if (c->fill != NULL && c->content_length >= 0 &&
+        cache_fill_reserve(c->fill,
+                           c->response_head + (size_t)c->content_length))
+        block = cache_fill_pin(c->fill);
+    if (block != NULL)
+        fetch_share(c->fetch, block);
+    else
+        conn_unlead(c, false);
+}
+
+/**
+ * @brief Ends and releases the fetch a connection leads.
+ *
+ * @param[in] c  : connection leading c->fetch.
+ * @param[in] ok : whether the response text is complete.
+ */
+static void conn_unlead(conn *c, bool ok) {
+    fetch_end(c->fetch, ok);
+    fetch_release(c->fetch);
+    c->fetch = NULL;
+    c->leader = false;
+}
+
+/**
+ * @brief Traces a response relayed from the server in full.
+ *
+ * @param[in] c : connection in CONN_RELAY state, at server EOF.
+ */
+static void conn_trace(conn *c) {
+    trace_request(c->request.uri, c->storable ? TRACE_MISS : TRACE_BYPASS,
+                  c->relayed);
+}
+
+/**
+ * @brief Hands the client and server of a CONNECT request to a tunnel.
+ *     The connection is finished; the tunnel owns both sockets, and bytes
+ *     read past the request head.
+ *
+ * @param[in] c : connection in CONN_SEND state, connected to the server.
+ *
+ * @return -1, always.
+ */
+static int conn_tunnel(conn *c) {
+    conn_watch(c, &c->client, 0);
+    conn_watch(c, &c->server, 0);
+    tunnel_start(c->client.fd, c->server.fd, c->in + c->head_len,
+                 c->in_len - c->head_len);
+    c->client.fd = -1;
+    c->server.fd = -1;
+    return -1;
+}
@@ -0,0 +1,39 @@
+/**
+ * @file eventloop.h
+ * @brief Event-driven front end for a tiny web proxy.
+ *
+ * Serves client connections with non-blocking sockets multiplexed by epoll,
+ * one event loop thread per core, instead of one blocking thread per
+ * connection. Each connection is a small state machine:
+ *     1. Read request: request line and headers read and parsed.
+ *     2. Cache hit: cached text sent to client.
+ *     3. Connect upstream: non-blocking connect to server.
+ *     4. Send request: request forwarded to server.
+ *     5. Relay: server response relayed to client and saved in the cache.
+ * A CONNECT request leaves after step 3, its sockets handed to a tunnel (see
+ * tunnel.h).
+ *
+ * eventloop.c has more detailed implementation-related comments.
+ *
+ * @author Iltikin Wayet
+ */
+
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * @brief Serves client connections accepted on <listenfds> forever.
+ *     Runs <nloops> event loops; the calling thread runs one of them.
+ *     Loop i accepts on listenfds[i]; entries may repeat a shared socket
+ *     or be distinct SO_REUSEPORT sockets.
+ *
+ * @param[in] listenfds : listening socket descriptor of each loop.
+ * @param[in] nloops    : number of event loops, at least 1.
+ * @param[in] pin       : whether loop i is pinned to CPU i.
+ */
+void eventloop_run(const int *listenfds, size_t nloops, bool pin);
+
+#endif /* EVENTLOOP_H */
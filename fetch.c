@@ -0,0 +1,311 @@
+/**
+ * @file fetch.c
+ * @brief Collapsed forwarding of concurrent cache misses for a tiny proxy.
+ *
+ * In-flight fetches are kept in a chained hash table keyed by URI, guarded
+ * by a single mutex; it is only held to join or end a fetch. Key
+ * implementation details:
+ *     - A shared response is read straight out of the cache block the
+ *       leader fills; the fetch pins the block, so its text outlives the
+ *       fill however it ends, and leading costs no extra copy.
+ *     - Published text is never rewritten, so followers write it to their
+ *       clients without holding the fetch mutex; the mutex and condition
+ *       variable only guard the published length and the fetch state.
+ *     - Followers wait until the leader has seen the response head and
+ *       decided whether the response is shared, and only then write.
+ *     - Event loop followers cannot wait on the condition variable; they
+ *       poll, and if there is nothing new queue a waiter of their own on
+ *       the fetch. Publishing, sharing, and ending take every waiter off
+ *       the fetch and notify it, under the fetch mutex, so a waiter is
+ *       never notified twice nor after the fetch is gone.
+ *     - The leader caches a complete response before removing the fetch
+ *       from the table, so a later miss finds either the fetch or the cache
+ *       entry.
+ *     - Fetches are reference counted; the last reference frees one.
+ *
+ * Descriptions of individual functions, data structures, and global variables
+ * are provided in their respective leading comments.
+ *
+ * @author Iltikin Wayet
+ */
+
+#include "fetch.h"
+#include "cache.h"
+#include "csapp.h"
+#include "hash.h"
+#include "metrics.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Number of in-flight fetch hash buckets.
+#define FETCH_BUCKETS 256
+
+/**
+ * @brief In-flight server fetch of one URI.
+ */
+struct fetch {
+    char *uri;             // Request URI
+    uint64_t hash;         // Hash of uri
+    cblock *block;         // Pinned block filled with the shared text
+    size_t len;            // Length of text published
+    bool decided;          // Whether the leader called fetch_share
+    bool shared;           // Whether followers may stream the response
+    bool done;             // Whether the fetch ended
+    bool ok;               // Whether the response text is complete
+    long refs;             // References: leader and followers
+    fetch_waiter *waiters; // Followers to notify of the next change
+    pthread_mutex_t mutex; // Mutex protecting the fields above
+    pthread_cond_t cond;   // Signaled on publish, share, and end
+    struct fetch *next;    // Pointer to next fetch in bucket
+};
+
+// In-flight fetch hash table.
+static fetch *fetches[FETCH_BUCKETS];
+// Mutex protecting fetches.
+static pthread_mutex_t fetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// ---------- HELPER PROTOTYPES ------------ //
+static void fetch_wake(fetch *f);
+
+// ---------- FUNCTION ROUTINES ------------ //
+
+/**
+ * @brief Joins the in-flight fetch of <uri>, starting one if there is none.
+ *
+ * @param[in]  uri    : request URI.
+ * @param[out] leader : whether the caller started the fetch and must lead.
+ *
+ * @return fetch, released with fetch_release.
+ */
+fetch *fetch_join(const char *uri, bool *leader) {
+    uint64_t hash = hash_string(uri);
+    fetch **bucket = &fetches[hash % FETCH_BUCKETS];
+
+    pthread_mutex_lock(&fetch_mutex);
+    fetch *f = *bucket;
+    while (f != NULL && (f->hash != hash || strcmp(f->uri, uri) != 0))
+        f = f->next;
+    if (f != NULL) {
+        pthread_mutex_lock(&f->mutex);
+        f->refs++;
+        pthread_mutex_unlock(&f->mutex);
+        pthread_mutex_unlock(&fetch_mutex);
+        *leader = false;
+        return f;
+    }
+
+    f = malloc_w(sizeof(fetch));
+    f->uri = strdup(uri);
+    f->hash = hash;
+    f->block = NULL;
+    f->len = 0;
+    f->decided = false;
+    f->shared = false;
+    f->done = false;
+    f->ok = false;
+    f->refs = 1;
+    f->waiters = NULL;
+    pthread_mutex_init(&f->mutex, NULL);
+    pthread_cond_init(&f->cond, NULL);
+    f->next = *bucket;
+    *bucket = f;
+    pthread_mutex_unlock(&fetch_mutex);
+    *leader = true;
+    return f;
+}
+
+/**
+ * @brief Decides whether the response is shared with followers.
+ *     Called by the leader once per fetch, when the response head is
+ *     known; a leader failing after it ends the fetch, not shares again.
+ *
+ * @param[in] f     : fetch led by the caller.
+ * @param[in] block : block pinned with cache_fill_pin whose reserved text
+ *                    the leader fills; NULL if the response is not shared.
+ *                    The fetch takes over the pin.
+ */
+void fetch_share(fetch *f, cblock *block) {
+    pthread_mutex_lock(&f->mutex);
+    f->decided = true;
+    f->shared = (block != NULL);
+    f->block = block;
+    pthread_cond_broadcast(&f->cond);
+    fetch_wake(f);
+    pthread_mutex_unlock(&f->mutex);
+}
+
+/**
+ * @brief Publishes response text saved in the shared block to followers.
+ *
+ * @param[in] f   : fetch led by the caller.
+ * @param[in] len : total length of text saved so far.
+ */
+void fetch_publish(fetch *f, size_t len) {
+    pthread_mutex_lock(&f->mutex);
+    f->len = len;
+    if (f->shared) {
+        pthread_cond_broadcast(&f->cond);
+        fetch_wake(f);
+    }
+    pthread_mutex_unlock(&f->mutex);
+}
+
+/**
+ * @brief Ends the fetch; later misses start a new one.
+ *     The leader caches a complete response before ending the fetch.
+ *     Followers still waiting for a decision are sent back to the server.
+ *
+ * @param[in] f  : fetch led by the caller.
+ * @param[in] ok : whether the response text is complete.
+ */
+void fetch_end(fetch *f, bool ok) {
+    pthread_mutex_lock(&fetch_mutex);
+    fetch **link = &fetches[f->hash % FETCH_BUCKETS];
+    while (*link != f)
+        link = &(*link)->next;
+    *link = f->next;
+    pthread_mutex_unlock(&fetch_mutex);
+
+    pthread_mutex_lock(&f->mutex);
+    f->decided = true;
+    f->done = true;
+    f->ok = ok;
+    pthread_cond_broadcast(&f->cond);
+    fetch_wake(f);
+    pthread_mutex_unlock(&f->mutex);
+}
+
+/**
+ * @brief Streams the shared response to a follower's client.
+ *     Published text written as it arrives, without holding the mutex.
+ *
+ * @param[in]  f      : fetch followed by the caller.
+ * @param[in]  fd     : client connection file descriptor.
+ * @param[out] shared : whether the response was shared; if not, or if
+ *                      the fetch failed before publishing any text,
+ *                      nothing was written and the caller fetches it
+ *                      itself.
+ * @param[out] sent   : bytes of the response written to the client.
+ *
+ * @return 0 if the whole response was written, -1 if error.
+ */
+int fetch_follow(fetch *f, int fd, bool *shared, size_t *sent) {
+    *sent = 0;
+    pthread_mutex_lock(&f->mutex);
+    while (!f->decided)
+        pthread_cond_wait(&f->cond, &f->mutex);
+    if (!(*shared = f->shared)) {
+        pthread_mutex_unlock(&f->mutex);
+        return -1;
+    }
+
+    while (1) {
+        while (f->len == *sent && !f->done)
+            pthread_cond_wait(&f->cond, &f->mutex);
+        size_t len = f->len;
+        bool done = f->done;
+        bool ok = f->ok;
+        pthread_mutex_unlock(&f->mutex);
+        // A fetch failing before publishing anything is left to the caller.
+        if (done && !ok && len == 0) {
+            *shared = false;
+            return -1;
+        }
+
+        if (len > *sent &&
+            cache_writetext(f->block, fd, *sent, len - *sent) < 0)
+            return -1;
+        metrics_count(METRIC_ORIGIN_BYTES, len - *sent);
+        *sent = len;
+        if (done)
+            return ok ? 0 : -1;
+        pthread_mutex_lock(&f->mutex);
+    }
+}
+
+/**
+ * @brief Polls a followed fetch without blocking, for followers that send
+ *     published text themselves, from the block of fetch_block.
+ *     A fetch failing before publishing anything declines, as in
+ *     fetch_follow.
+ *
+ * @param[in]  f    : fetch followed by the caller.
+ * @param[in]  sent : bytes of the response the follower sent so far.
+ * @param[in]  w    : waiter queued if there is nothing new; stays queued
+ *                    until notified, however often polled meanwhile.
+ * @param[out] len  : length of text published, for FETCH_TEXT.
+ *
+ * @return what the follower is to do next.
+ */
+fetch_status fetch_poll(fetch *f, size_t sent, fetch_waiter *w, size_t *len) {
+    fetch_status status = FETCH_WAIT;
+    pthread_mutex_lock(&f->mutex);
+    *len = f->len;
+    if (f->decided) {
+        if (!f->shared || (f->done && !f->ok && f->len == 0))
+            status = FETCH_DECLINED;
+        else if (f->len > sent)
+            status = FETCH_TEXT;
+        else if (f->done)
+            status = f->ok ? FETCH_DONE : FETCH_FAILED;
+    }
+    if (status == FETCH_WAIT && !w->waiting) {
+        w->waiting = true;
+        w->next = f->waiters;
+        f->waiters = w;
+    }
+    pthread_mutex_unlock(&f->mutex);
+    return status;
+}
+
+/**
+ * @brief Returns the pinned block holding a shared response's text.
+ *     Set once, before any text is published, so reading it needs no lock
+ *     after fetch_poll saw text.
+ *
+ * @param[in] f : fetch followed by the caller.
+ */
+cblock *fetch_block(fetch *f) {
+    return f->block;
+}
+
+/**
+ * @brief Drops the caller's reference to a fetch.
+ *     Last reference frees the fetch.
+ *
+ * @param[in] f : fetch joined by the caller.
+ */
+void fetch_release(fetch *f) {
+    pthread_mutex_lock(&f->mutex);
+    long refs = --f->refs;
+    pthread_mutex_unlock(&f->mutex);
+    if (refs > 0)
+        return;
+    pthread_cond_destroy(&f->cond);
+    pthread_mutex_destroy(&f->mutex);
+    if (f->block != NULL)
+        cache_unpin(f->block);
+    free(f->uri);
+    free(f);
+}
+
+// ---------- HELPER ROUTINES ------------ //
+
+/**
+ * @brief Takes every waiter off a fetch and notifies it.
+ *     Called with the fetch mutex held.
+ *
+ * @param[in] f : fetch that changed.
+ */
+static void fetch_wake(fetch *f) {
+    while (f->waiters != NULL) {
+        fetch_waiter *w = f->waiters;
+        f->waiters = w->next;
+        w->waiting = false;
+        w->notify(w->arg);
+    }
+}
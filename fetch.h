@@ -0,0 +1,139 @@
+/**
+ * @file fetch.h
+ * @brief Collapsed forwarding of concurrent cache misses for a tiny proxy.
+ *
+ * Concurrent misses on one URI share a single server fetch. The first miss
+ * leads: it fetches from the server and publishes the response text (in the
+ * form it is cached) as it arrives. Later misses follow: they stream the
+ * published text to their own clients, blocking in fetch_follow or, in
+ * event loops, polling with fetch_poll and woken through a waiter. A
+ * response that cannot be shared, e.g. one too large to cache, sends its
+ * followers back to the server, before any of it is written to their
+ * clients.
+ *
+ * fetch.c has more detailed implementation-related comments.
+ *
+ * @author Iltikin Wayet
+ */
+
+#ifndef FETCH_H
+#define FETCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * @brief In-flight server fetch of one URI; opaque.
+ */
+typedef struct fetch fetch;
+
+// Cache block being filled with the shared response (see cache.h).
+struct cache_block;
+
+/**
+ * @brief Wakeup of a follower that cannot block, e.g. an event loop
+ *     connection; owned by the follower, queued on a fetch by fetch_poll.
+ */
+typedef struct fetch_waiter {
+    void (*notify)(void *arg); // Called once, on the leader's thread
+    void *arg;                 // Argument of notify
+    bool waiting;              // Whether queued on a fetch
+    struct fetch_waiter *next; // Next waiter of the fetch
+} fetch_waiter;
+
+/**
+ * @brief What a follower polling a fetch is to do next.
+ */
+typedef enum {
+    FETCH_WAIT,     // Nothing new; the waiter is notified once there is
+    FETCH_TEXT,     // Text published past what the follower sent
+    FETCH_DONE,     // Whole response published and sent
+    FETCH_FAILED,   // Fetch failed after publishing text
+    FETCH_DECLINED, // Nothing shared; the follower fetches the response
+} fetch_status;
+
+/**
+ * @brief Joins the in-flight fetch of <uri>, starting one if there is none.
+ *
+ * @param[in]  uri    : request URI.
+ * @param[out] leader : whether the caller started the fetch and must lead.
+ *
+ * @return fetch, released with fetch_release.
+ */
+fetch *fetch_join(const char *uri, bool *leader);
+
+/**
+ * @brief Decides whether the response is shared with followers.
+ *     Called by the leader once per fetch, when the response head is
+ *     known; a leader failing after it ends the fetch, not shares again.
+ *
+ * @param[in] f     : fetch led by the caller.
+ * @param[in] block : block pinned with cache_fill_pin whose reserved text
+ *                    the leader fills; NULL if the response is not shared.
+ *                    The fetch takes over the pin.
+ */
+void fetch_share(fetch *f, struct cache_block *block);
+
+/**
+ * @brief Publishes response text saved in the shared block to followers.
+ *
+ * @param[in] f   : fetch led by the caller.
+ * @param[in] len : total length of text saved so far.
+ */
+void fetch_publish(fetch *f, size_t len);
+
+/**
+ * @brief Ends the fetch; later misses start a new one.
+ *     The leader caches a complete response before ending the fetch.
+ *
+ * @param[in] f  : fetch led by the caller.
+ * @param[in] ok : whether the response text is complete.
+ */
+void fetch_end(fetch *f, bool ok);
+
+/**
+ * @brief Streams the shared response to a follower's client.
+ *
+ * @param[in]  f      : fetch followed by the caller.
+ * @param[in]  fd     : client connection file descriptor.
+ * @param[out] shared : whether the response was shared; if not, or if
+ *                      the fetch failed before publishing any text,
+ *                      nothing was written and the caller fetches it
+ *                      itself.
+ * @param[out] sent   : bytes of the response written to the client.
+ *
+ * @return 0 if the whole response was written, -1 if error.
+ */
+int fetch_follow(fetch *f, int fd, bool *shared, size_t *sent);
+
+/**
+ * @brief Polls a followed fetch without blocking, for followers that send
+ *     published text themselves, from the block of fetch_block.
+ *
+ * @param[in]  f    : fetch followed by the caller.
+ * @param[in]  sent : bytes of the response the follower sent so far.
+ * @param[in]  w    : waiter queued if there is nothing new; stays queued
+ *                    until notified, however often polled meanwhile.
+ * @param[out] len  : length of text published, for FETCH_TEXT.
+ *
+ * @return what the follower is to do next.
+ */
+fetch_status fetch_poll(fetch *f, size_t sent, fetch_waiter *w, size_t *len);
+
+/**
+ * @brief Returns the pinned block holding a shared response's text.
+ *     Valid once fetch_poll returned FETCH_TEXT, and pinned until the
+ *     fetch is released.
+ *
+ * @param[in] f : fetch followed by the caller.
+ */
+struct cache_block *fetch_block(fetch *f);
+
+/**
+ * @brief Drops the caller's reference to a fetch.
+ *
+ * @param[in] f : fetch joined by the caller.
+ */
+void fetch_release(fetch *f);
+
+#endif /* FETCH_H */
@@ -0,0 +1,64 @@
+/**
+ * @file hash.c
+ * @brief String hashing for a tiny web proxy.
+ *
+ * Key implementation details:
+ *     - 64-bit FNV-1a: one xor and one multiply per byte, no setup, and
+ *       bits mixed well enough for power-of-two tables indexed by either
+ *       end of the hash.
+ *     - Origins are hashed without building their "<host>:<port>" string,
+ *       and hash as that string would once the host is lowercased.
+ *
+ * Descriptions of individual functions are provided in their respective
+ * leading comments.
+ *
+ * @author Iltikin Wayet
+ */
+
+#include "hash.h"
+
+// FNV-1a offset basis and prime, 64-bit.
+#define FNV_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+// ---------- FUNCTION ROUTINES ------------ //
+
+/**
+ * @brief Hashes a string (64-bit FNV-1a), e.g. a request URI.
+ *
+ * @param[in] s : string to hash.
+ *
+ * @return hash of <s>.
+ */
+uint64_t hash_string(const char *s) {
+    uint64_t hash = FNV_BASIS;
+    for (const unsigned char *p = (const unsigned char *)s; *p; p++) {
+        hash ^= *p;
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/**
+ * @brief Hashes a server origin (64-bit FNV-1a) as "<host>:<port>", with
+ *     the host lowercased, so that names differing only in case share it.
+ *
+ * @param[in] host : server host name.
+ * @param[in] port : server port.
+ *
+ * @return hash of the origin.
+ */
+uint64_t hash_origin(const char *host, const char *port) {
+    uint64_t hash = FNV_BASIS;
+    for (const unsigned char *p = (const unsigned char *)host; *p; p++) {
+        hash ^= (*p >= 'A' && *p <= 'Z') ? *p + ('a' - 'A') : *p;
+        hash *= FNV_PRIME;
+    }
+    hash ^= ':';
+    hash *= FNV_PRIME;
+    for (const unsigned char *p = (const unsigned char *)port; *p; p++) {
+        hash ^= *p;
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
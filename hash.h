@@ -0,0 +1,42 @@
+/**
+ * @file hash.h
+ * @brief String hashing for a tiny web proxy.
+ *
+ * Every table keyed by a request URI or a server origin (the cache, the
+ * fetch table, the name cache, the upstream pool, the per-origin fetch
+ * caps) and the request trace hash their keys with the same 64-bit
+ * FNV-1a, so a URI hashes alike in the cache and in traces replayed
+ * against it.
+ *
+ * Descriptions of individual functions are provided in their respective
+ * leading comments.
+ *
+ * @author Iltikin Wayet
+ */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+
+/**
+ * @brief Hashes a string (64-bit FNV-1a), e.g. a request URI.
+ *
+ * @param[in] s : string to hash.
+ *
+ * @return hash of <s>.
+ */
+uint64_t hash_string(const char *s);
+
+/**
+ * @brief Hashes a server origin (64-bit FNV-1a) as "<host>:<port>", with
+ *     the host lowercased, so that names differing only in case share it.
+ *
+ * @param[in] host : server host name.
+ * @param[in] port : server port.
+ *
+ * @return hash of the origin.
+ */
+uint64_t hash_origin(const char *host, const char *port);
+
+#endif /* HASH_H */
@@ -0,0 +1,432 @@
+/**
+ * @file metrics.c
+ * @brief Request metrics for a tiny web proxy.
+ *
+ * Counters and latency histograms are kept per thread and summed on read.
+ * Key implementation details:
+ *     - Each thread records into a slot of its own, taken on first use and
+ *       linked into a push-only list that readers walk; slots are never
+ *       freed, as the threads recording live as long as the proxy.
+ *     - Slots are cache-line aligned and only ever written by their thread,
+ *       with a relaxed load and store instead of an atomic add, so
+ *       recording never takes a lock or bounces a line between cores.
+ *       Readers load the same atomics relaxed, so totals may lag slightly.
+ *     - Latencies land in power-of-two buckets of nanoseconds, picked with
+ *       a count of leading zeros; histograms are made cumulative only when
+ *       formatted.
+ *     - Stages are timed with CLOCK_MONOTONIC, read through the vDSO.
+ *     - The reply is formatted on the stack of the thread serving it, with
+ *       room kept in front of the body for the head, so it goes out in one
+ *       write.
+ *
+ * Descriptions of individual functions, data structures, and global variables
+ * are provided in their respective leading comments.
+ *
+ * @author Iltikin Wayet
+ */
+
+#include "metrics.h"
+#include "cache.h"
+#include "csapp.h"
+#include "proxy.h"
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+// Size of a cache line, which slots are aligned to.
+#define METRICS_LINE 64
+// Largest metrics reply, head included.
+#define METRICS_TEXT_MAX (16 * 1024)
+// Room kept in front of the metrics body for the reply head.
+#define METRICS_HEAD_MAX 160
+// Bound of the first latency bucket, as a power of two nanoseconds.
+#define METRICS_FIRST_SHIFT 10
+
+/**
+ * @brief Per-thread metrics, written only by the owning thread.
+ */
+struct metrics_slot {
+    atomic_uint_fast64_t counts[METRIC_COUNTERS]; // Counter values.
+    atomic_uint_fast64_t buckets[LATENCY_STAGES][METRICS_BUCKETS]; // Counts.
+    atomic_uint_fast64_t sums[LATENCY_STAGES]; // Nanoseconds per stage.
+    struct metrics_slot *next; // Pointer to next slot in list.
+};
+typedef struct metrics_slot mslot;
+
+/**
+ * @brief Metrics summed over all slots.
+ */
+typedef struct {
+    uint64_t counts[METRIC_COUNTERS];                  // Counter totals.
+    uint64_t buckets[LATENCY_STAGES][METRICS_BUCKETS]; // Bucket totals.
+    uint64_t sums[LATENCY_STAGES];                     // Nanosecond totals.
+} mtotals;
+
+// Label of each stage in the latency histogram.
+static const char *const stage_names[LATENCY_STAGES] = {
+    "parse", "lookup", "connect", "first_byte", "total"};
+
+// List of all thread slots (push-only).
+static _Atomic(mslot *) slots;
+// Slot of the calling thread.
+static __thread mslot *self;
+
+// ---------- HELPER PROTOTYPES ------------ //
+static mslot *slot_self(void);
+static void slot_add(atomic_uint_fast64_t *value, uint64_t n);
+static void slot_record(latency stage, uint64_t ns);
+static void metrics_sum(mtotals *totals);
+static bool text_put(char *buf, size_t size, size_t *len, const char *fmt,
+                     ...) __attribute__((format(printf, 4, 5)));
+
+// ---------- FUNCTION ROUTINES ------------ //
+
+/**
+ * @brief Returns the current time in nanoseconds, for timing stages.
+ */
+uint64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Adds <n> to a counter of the calling thread.
+ *
+ * @param[in] counter : counter to add to.
+ * @param[in] n       : amount added.
+ */
+void metrics_count(metric counter, uint64_t n) {
+    slot_add(&slot_self()->counts[counter], n);
+}
+
+/**
+ * @brief Records a stage that began at <since> and ends now.
+ *
+ * @param[in] stage : stage timed.
+ * @param[in] since : metrics_now() when the stage began.
+ */
+void metrics_time(latency stage, uint64_t since) {
+    slot_record(stage, metrics_now() - since);
+}
+
+/**
+ * @brief Prepares the timings of a new request, before its head is read.
+ *
+ * @param[out] timer : timings.
+ */
+void metrics_begin(mtimer *timer) {
+    timer->parse = 0;
+    timer->start = 0;
+    timer->step = 0;
+    timer->answered = false;
+}
+
+/**
+ * @brief Marks the request head parsed: counts the request and records
+ *     the parse time accumulated in <timer>.
+ *
+ * @param[in,out] timer : timings of the request.
+ */
+void metrics_parsed(mtimer *timer) {
+    timer->start = metrics_now();
+    metrics_count(METRIC_REQUESTS, 1);
+    slot_record(LATENCY_PARSE, timer->parse);
+}
+
+/**
+ * @brief Records the time to the first response byte, once per request.
+ *
+ * @param[in,out] timer : timings of a parsed request.
+ */
+void metrics_answer(mtimer *timer) {
+    if (timer->answered || timer->start == 0)
+        return;
+    timer->answered = true;
+    metrics_time(LATENCY_FIRST_BYTE, timer->start);
+}
+
+/**
+ * @brief Records the time to the end of the response, once per request;
+ *     no-op if the head was never parsed.
+ *
+ * @param[in,out] timer : timings of the request.
+ */
+void metrics_end(mtimer *timer) {
+    if (timer->start == 0)
+        return;
+    metrics_time(LATENCY_TOTAL, timer->start);
+    timer->start = 0;
+}
+
+/**
+ * @brief Returns whether <request> is addressed to the proxy itself, with
+ *     a path such as METRICS_PATH instead of an absolute URI.
+ *
+ * @param[in] request : parsed request.
+ */
+bool metrics_requested(const request_info *request) {
+    return request->host[0] == '\0';
+}
+
+/**
+ * @brief Answers a request addressed to the proxy itself: METRICS_PATH
+ *     gets the metrics, framed by Content-Length; other paths get a 404.
+ *     Written at once, like an error reply. A query string is ignored, and
+ *     a HEAD request gets the head alone.
+ *
+ * @param[in] fd      : client connection file descriptor.
+ * @param[in] request : parsed request, metrics_requested.
+ *
+ * @return 0 if the metrics were sent, -1 if not.
+ */
+int metrics_serve(int fd, const request_info *request) {
+    size_t path_len = strcspn(request->path, "?");
+    if (path_len != strlen(METRICS_PATH) ||
+        strncmp(request->path, METRICS_PATH, path_len)) {
+        clienterror(fd, "404", "Not Found", "Tiny has no such resource");
+        return -1;
+    }
+
+    char reply[METRICS_TEXT_MAX];
+    char *body = reply + METRICS_HEAD_MAX;
+    int body_len = metrics_format(body, sizeof(reply) - METRICS_HEAD_MAX);
+    if (body_len < 0) {
+        clienterror(fd, "500", "Internal Server Error",
+                    "Tiny could not format its metrics");
+        return -1;
+    }
+
+    // Head formatted once the body length is known, right before it.
+    char head[METRICS_HEAD_MAX];
+    int head_len = snprintf(head, sizeof(head),
+                            "HTTP/1.1 200 OK\r\n"
+                            "Content-Type: text/plain; version=0.0.4\r\n"
+                            "Cache-Control: no-store\r\n"
+                            "Content-Length: %d\r\n\r\n",
+                            body_len);
+    char *start = body - head_len;
+    memcpy(start, head, head_len);
+    size_t len = head_len;
+    if (strcasecmp(request->method, "HEAD"))
+        len += body_len;
+    return (rio_writen(fd, start, len) < 0) ? -1 : 0;
+}
+
+/**
+ * @brief Formats the metrics and cache statistics into <buf> in the
+ *     Prometheus text format, e.g. "proxy_requests_total 42".
+ *     Latency histograms are labeled by stage, with bounds in seconds.
+ *
+ * @param[out] buf  : buffer to format into.
+ * @param[in]  size : size of <buf>.
+ *
+ * @return length of the text, -1 if it does not fit in <buf>.
+ */
+int metrics_format(char *buf, size_t size) {
+    mtotals totals;
+    metrics_sum(&totals);
+    cstats stats;
+    cache_stats(&stats);
+
+    // Reads race with recording; never report fewer closes than accepts.
+    uint64_t accepted = totals.counts[METRIC_ACCEPTED];
+    uint64_t closed = totals.counts[METRIC_CLOSED];
+    uint64_t active = (accepted > closed) ? accepted - closed : 0;
+
+    size_t len = 0;
+    bool ok =
+        text_put(buf, size, &len,
+                 "# HELP proxy_requests_total Request heads parsed.\n"
+                 "# TYPE proxy_requests_total counter\n"
+                 "proxy_requests_total %" PRIu64 "\n"
+                 "# HELP proxy_connections_total Client connections "
+                 "accepted.\n"
+                 "# TYPE proxy_connections_total counter\n"
+                 "proxy_connections_total %" PRIu64 "\n"
+                 "# HELP proxy_connections_active Client connections being "
+                 "served.\n"
+                 "# TYPE proxy_connections_active gauge\n"
+                 "proxy_connections_active %" PRIu64 "\n"
+                 "# HELP proxy_response_bytes_total Response bytes sent to "
+                 "clients, by source.\n"
+                 "# TYPE proxy_response_bytes_total counter\n"
+                 "proxy_response_bytes_total{source=\"cache\"} %" PRIu64 "\n"
+                 "proxy_response_bytes_total{source=\"origin\"} %" PRIu64 "\n"
+                 "# HELP proxy_upstream_connect_errors_total Server names "
+                 "not resolved or connected to.\n"
+                 "# TYPE proxy_upstream_connect_errors_total counter\n"
+                 "proxy_upstream_connect_errors_total %" PRIu64 "\n"
+                 "# HELP proxy_shed_total Connections and requests refused "
+                 "under overload, by reason.\n"
+                 "# TYPE proxy_shed_total counter\n"
+                 "proxy_shed_total{reason=\"load\"} %" PRIu64 "\n"
+                 "proxy_shed_total{reason=\"rate\"} %" PRIu64 "\n"
+                 "proxy_shed_total{reason=\"origin\"} %" PRIu64 "\n",
+                 totals.counts[METRIC_REQUESTS], accepted, active,
+                 totals.counts[METRIC_CACHE_BYTES],
+                 totals.counts[METRIC_ORIGIN_BYTES],
+                 totals.counts[METRIC_CONNECT_ERRORS],
+                 totals.counts[METRIC_SHED_LOAD],
+                 totals.counts[METRIC_SHED_RATE],
+                 totals.counts[METRIC_SHED_ORIGIN]) &&
+        text_put(buf, size, &len,
+                 "# HELP proxy_cache_lookups_total Cache lookups, by "
+                 "result.\n"
+                 "# TYPE proxy_cache_lookups_total counter\n"
+                 "proxy_cache_lookups_total{result=\"hit\"} %" PRIu64 "\n"
+                 "proxy_cache_lookups_total{result=\"miss\"} %" PRIu64 "\n"
+                 "# HELP proxy_cache_disk_hits_total Memory misses found on "
+                 "disk or in the snapshot.\n"
+                 "# TYPE proxy_cache_disk_hits_total counter\n"
+                 "proxy_cache_disk_hits_total %" PRIu64 "\n"
+                 "# HELP proxy_cache_evictions_total Blocks evicted.\n"
+                 "# TYPE proxy_cache_evictions_total counter\n"
+                 "proxy_cache_evictions_total %" PRIu64 "\n"
+                 "# HELP proxy_cache_refreshes_total Stale blocks "
+                 "revalidated by the server.\n"
+                 "# TYPE proxy_cache_refreshes_total counter\n"
+                 "proxy_cache_refreshes_total %" PRIu64 "\n"
+                 "# HELP proxy_cache_size_bytes Memory held by cached "
+                 "blocks.\n"
+                 "# TYPE proxy_cache_size_bytes gauge\n"
+                 "proxy_cache_size_bytes %zu\n"
+                 "# HELP proxy_cache_capacity_bytes Cache memory limit.\n"
+                 "# TYPE proxy_cache_capacity_bytes gauge\n"
+                 "proxy_cache_capacity_bytes %zu\n"
+                 "# HELP proxy_latency_seconds Request stage latencies.\n"
+                 "# TYPE proxy_latency_seconds histogram\n",
+                 stats.hits, stats.misses, stats.disk_hits, stats.evictions,
+                 stats.refreshes, stats.size, stats.capacity);
+
+    for (size_t stage = 0; ok && stage < LATENCY_STAGES; stage++) {
+        const char *name = stage_names[stage];
+        uint64_t count = 0;
+        for (size_t i = 0; ok && i < METRICS_BUCKETS; i++) {
+            count += totals.buckets[stage][i];
+            if (i == METRICS_BUCKETS - 1) {
+                ok = text_put(buf, size, &len,
+                              "proxy_latency_seconds_bucket{stage=\"%s\","
+                              "le=\"+Inf\"} %" PRIu64 "\n",
+                              name, count);
+            } else {
+                double le = (double)(1ULL << (METRICS_FIRST_SHIFT + i)) / 1e9;
+                ok = text_put(buf, size, &len,
+                              "proxy_latency_seconds_bucket{stage=\"%s\","
+                              "le=\"%.9g\"} %" PRIu64 "\n",
+                              name, le, count);
+            }
+        }
+        ok = ok && text_put(buf, size, &len,
+                            "proxy_latency_seconds_sum{stage=\"%s\"} %.9f\n"
+                            "proxy_latency_seconds_count{stage=\"%s\"} "
+                            "%" PRIu64 "\n",
+                            name, totals.sums[stage] / 1e9, name, count);
+    }
+    return ok ? (int)len : -1;
+}
+
+// ---------- HELPER ROUTINES ------------ //
+
+/**
+ * @brief Returns the slot of the calling thread, taking one on first use.
+ */
+static mslot *slot_self(void) {
+    if (self != NULL)
+        return self;
+
+    size_t size = (sizeof(mslot) + METRICS_LINE - 1) & ~(METRICS_LINE - 1);
+    mslot *slot = aligned_alloc(METRICS_LINE, size);
+    if (slot == NULL) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        exit(1);
+    }
+    memset(slot, 0, size);
+    slot->next = atomic_load(&slots);
+    while (!atomic_compare_exchange_weak(&slots, &slot->next, slot))
+        ;
+    self = slot;
+    return slot;
+}
+
+/**
+ * @brief Adds <n> to a value of the caller's own slot.
+ *     The slot has a single writer, so no atomic read-modify-write.
+ *
+ * @param[in] value : value of the calling thread's slot.
+ * @param[in] n     : amount added.
+ */
+static void slot_add(atomic_uint_fast64_t *value, uint64_t n) {
+    atomic_store_explicit(
+        value, atomic_load_explicit(value, memory_order_relaxed) + n,
+        memory_order_relaxed);
+}
+
+/**
+ * @brief Records a latency of <ns> into the caller's own slot.
+ *     Bucket i holds latencies in [2^(9+i), 2^(10+i)) nanoseconds, bucket
+ *     0 everything shorter, the last bucket everything longer.
+ *
+ * @param[in] stage : stage timed.
+ * @param[in] ns    : latency in nanoseconds.
+ */
+static void slot_record(latency stage, uint64_t ns) {
+    size_t i = 0;
+    if (ns >> METRICS_FIRST_SHIFT) {
+        i = 64 - __builtin_clzll(ns) - METRICS_FIRST_SHIFT;
+        if (i >= METRICS_BUCKETS)
+            i = METRICS_BUCKETS - 1;
+    }
+    mslot *slot = slot_self();
+    slot_add(&slot->buckets[stage][i], 1);
+    slot_add(&slot->sums[stage], ns);
+}
+
+/**
+ * @brief Sums the metrics of all slots.
+ *
+ * @param[out] totals : sums.
+ */
+static void metrics_sum(mtotals *totals) {
+    memset(totals, 0, sizeof(*totals));
+    for (mslot *slot = atomic_load(&slots); slot != NULL; slot = slot->next) {
+        for (size_t i = 0; i < METRIC_COUNTERS; i++)
+            totals->counts[i] +=
+                atomic_load_explicit(&slot->counts[i], memory_order_relaxed);
+        for (size_t stage = 0; stage < LATENCY_STAGES; stage++) {
+            for (size_t i = 0; i < METRICS_BUCKETS; i++)
+                totals->buckets[stage][i] += atomic_load_explicit(
+                    &slot->buckets[stage][i], memory_order_relaxed);
+            totals->sums[stage] +=
+                atomic_load_explicit(&slot->sums[stage], memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * @brief Appends formatted text at <len> in <buf>.
+ *
+ * @param[out]    buf  : buffer to format into.
+ * @param[in]     size : size of <buf>.
+ * @param[in,out] len  : length of text in <buf>; advanced.
+ * @param[in]     fmt  : printf format.
+ *
+ * @return true if it fit, false if not.
+ */
+static bool text_put(char *buf, size_t size, size_t *len, const char *fmt,
+                     ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf + *len, size - *len, fmt, ap);
+    va_end(ap);
+    if (n < 0 || (size_t)n >= size - *len)
+        return false;
+    *len += n;
+    return true;
+}
@@ -0,0 +1,160 @@
+/**
+ * @file metrics.h
+ * @brief Request metrics for a tiny web proxy.
+ *
+ * Counts requests, connections, response bytes, server connect errors, and
+ * connections and requests shed under overload, and keeps latency
+ * histograms of the stages of a request: parsing its head, looking it up in
+ * the cache, connecting to the server, the first response byte, and the
+ * whole response. Every thread records into its own slot, so recording
+ * takes no shared write; slots are summed only when the metrics are read. A
+ * request for METRICS_PATH, addressed to the proxy itself instead of
+ * through it, gets the metrics and the cache statistics in the Prometheus
+ * text format.
+ *
+ * Descriptions of individual functions and data structures are provided in
+ * their respective leading comments.
+ *
+ * metrics.c has more detailed implementation-related comments.
+ *
+ * @author Iltikin Wayet
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "request.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Path of the request answered with the metrics, e.g.
+// "GET /proxy-stats HTTP/1.1" sent straight to the proxy.
+#define METRICS_PATH "/proxy-stats"
+
+// Latency histogram buckets; bucket i counts latencies below 2^(10+i)
+// nanoseconds (from about 1 us up to 4 s), the last one all others.
+#define METRICS_BUCKETS 24
+
+/**
+ * @brief Counters, summed over threads.
+ */
+typedef enum {
+    METRIC_REQUESTS,       // Request heads parsed
+    METRIC_CACHE_BYTES,    // Response bytes served from the cache
+    METRIC_ORIGIN_BYTES,   // Response bytes relayed from servers
+    METRIC_ACCEPTED,       // Client connections accepted
+    METRIC_CLOSED,         // Client connections closed or handed off
+    METRIC_CONNECT_ERRORS, // Server names not resolved or connected to
+    METRIC_SHED_LOAD,      // Connections refused, open or queued too many
+    METRIC_SHED_RATE,      // Requests refused by client rate limits
+    METRIC_SHED_ORIGIN,    // Requests refused by origin fetch caps
+    METRIC_COUNTERS        // Number of counters
+} metric;
+
+/**
+ * @brief Request stages timed into latency histograms.
+ */
+typedef enum {
+    LATENCY_PARSE,      // Parsing the request head, summed over reads
+    LATENCY_LOOKUP,     // Looking the request up in the cache
+    LATENCY_CONNECT,    // Resolving the server and connecting to it
+    LATENCY_FIRST_BYTE, // From the head parsed to the first response byte
+    LATENCY_TOTAL,      // From the head parsed to the response sent
+    LATENCY_STAGES      // Number of stages
+} latency;
+
+/**
+ * @brief Timings of one request, kept by the front end serving it.
+ */
+typedef struct {
+    uint64_t parse; // Nanoseconds spent parsing the head so far
+    uint64_t start; // When the head was parsed, 0 if not yet
+    uint64_t step;  // When the stage being timed by the caller began
+    bool answered;  // Whether the first response byte was timed
+} mtimer;
+
+/**
+ * @brief Returns the current time in nanoseconds, for timing stages.
+ */
+uint64_t metrics_now(void);
+
+/**
+ * @brief Adds <n> to a counter of the calling thread.
+ *
+ * @param[in] counter : counter to add to.
+ * @param[in] n       : amount added.
+ */
+void metrics_count(metric counter, uint64_t n);
+
+/**
+ * @brief Records a stage that began at <since> and ends now.
+ *
+ * @param[in] stage : stage timed.
+ * @param[in] since : metrics_now() when the stage began.
+ */
+void metrics_time(latency stage, uint64_t since);
+
+/**
+ * @brief Prepares the timings of a new request, before its head is read.
+ *
+ * @param[out] timer : timings.
+ */
+void metrics_begin(mtimer *timer);
+
+/**
+ * @brief Marks the request head parsed: counts the request and records
+ *     the parse time accumulated in <timer>.
+ *
+ * @param[in,out] timer : timings of the request.
+ */
+void metrics_parsed(mtimer *timer);
+
+/**
+ * @brief Records the time to the first response byte, once per request.
+ *
+ * @param[in,out] timer : timings of a parsed request.
+ */
+void metrics_answer(mtimer *timer);
+
+/**
+ * @brief Records the time to the end of the response, once per request;
+ *     no-op if the head was never parsed.
+ *
+ * @param[in,out] timer : timings of the request.
+ */
+void metrics_end(mtimer *timer);
+
+/**
+ * @brief Returns whether <request> is addressed to the proxy itself, with
+ *     a path such as METRICS_PATH instead of an absolute URI.
+ *
+ * @param[in] request : parsed request.
+ */
+bool metrics_requested(const request_info *request);
+
+/**
+ * @brief Answers a request addressed to the proxy itself: METRICS_PATH
+ *     gets the metrics, framed by Content-Length; other paths get a 404.
+ *     Written at once, like an error reply.
+ *
+ * @param[in] fd      : client connection file descriptor.
+ * @param[in] request : parsed request, metrics_requested.
+ *
+ * @return 0 if the metrics were sent, -1 if not.
+ */
+int metrics_serve(int fd, const request_info *request);
+
+/**
+ * @brief Formats the metrics and cache statistics into <buf> in the
+ *     Prometheus text format, e.g. "proxy_requests_total 42".
+ *
+ * @param[out] buf  : buffer to format into.
+ * @param[in]  size : size of <buf>.
+ *
+ * @return length of the text, -1 if it does not fit in <buf>.
+ */
+int metrics_format(char *buf, size_t size);
+
+#endif /* METRICS_H */
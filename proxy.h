@@ -0,0 +1,94 @@
+/**
+ * @file proxy.h
+ * @brief Shared request handling interface for a tiny web proxy.
+ *
+ * Data structures and helpers shared between the threaded front end in
+ * tinyproxy.c and the event-driven front end in eventloop.c.
+ *
+ * Descriptions of individual functions and data structures are provided in
+ * their respective leading comments.
+ *
+ * @author Iltikin Wayet
+ */
+
+#ifndef PROXY_H
+#define PROXY_H
+
+#include "request.h"
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+// Typedef for convenience
+typedef struct sockaddr SA;
+
+/**
+ * @brief Data structure with client connection information.
+ */
+typedef struct {
+    struct sockaddr_in addr; // Socket address
+    socklen_t addrlen;       // Socket address length
+    int connfd;              // Client connection file descriptor
+    uint64_t accepted;       // When accepted, metrics_now nanoseconds
+} client_info;
+
+// ---------- FUNCTION PROTOTYPES ---------- //
+
+/**
+ * @brief Returns whether the response to <request> may come from or go to
+ *     the cache.
+ *
+ * @param[in] request : information regarding request header line.
+ * @param[in] parser  : parser of the request head.
+ */
+bool request_cacheable(request_info *request, const request_parser *parser);
+
+/**
+ * @brief Formats the request forwarded to the server into <buf>.
+ *
+ * @param[out] buf       : buffer to format request into.
+ * @param[in]  size      : size of <buf>.
+ * @param[in]  request   : information regarding request header line.
+ * @param[in]  parser    : parser of the request head.
+ * @param[in]  keepalive : whether to ask for a persistent HTTP/1.1
+ *                         connection instead of HTTP/1.0 with close.
+ *
+ * @return length of formatted request, -1 if it does not fit in <buf>.
+ */
+int format_header(char *buf, size_t size, request_info *request,
+                  const request_parser *parser, bool keepalive);
+
+/**
+ * @brief Pins the calling thread to a CPU.
+ *
+ * @param[in] cpu : CPU index, wrapped to the number of online CPUs.
+ */
+void pin_thread(int cpu);
+
+/**
+ * @brief Returns an error message to the client.
+ *
+ * @param[in] fd       : file descriptor to write error message.
+ * @param[in] errnum   : HTTP error number to output.
+ * @param[in] shortmsg : short error message.
+ * @param[in] longmsg  : long error message.
+ */
+void clienterror(int fd, const char *errnum, const char *shortmsg,
+                 const char *longmsg);
+
+/**
+ * @brief Returns an error message to the client, telling it when to retry.
+ *
+ * @param[in] fd       : file descriptor to write error message.
+ * @param[in] errnum   : HTTP error number to output.
+ * @param[in] shortmsg : short error message.
+ * @param[in] longmsg  : long error message.
+ * @param[in] retry    : seconds sent as Retry-After, 0 for none.
+ */
+void clientretry(int fd, const char *errnum, const char *shortmsg,
+                 const char *longmsg, long retry);
+
+#endif /* PROXY_H */
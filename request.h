@@ -0,0 +1,110 @@
+/**
+ * @file request.h
+ * @brief HTTP request head parsing for a tiny web proxy.
+ *
+ * Parses a client request head in place, in the buffer it was received
+ * into: the request line, the absolute URI split into host, port, and path,
+ * and the header fields, returned as slices of the buffer. A request with
+ * a path alone is addressed to the proxy itself, and has an empty host.
+ * Parsing resumes where it stopped as more of the head arrives, so partial
+ * reads are never scanned twice.
+ *
+ * Descriptions of individual functions and data structures are provided in
+ * their respective leading comments.
+ *
+ * request.c has more detailed implementation-related comments.
+ *
+ * @author Iltikin Wayet
+ */
+
+#ifndef REQUEST_H
+#define REQUEST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define HOSTLEN 256
+#define SERVLEN 8
+
+// Most header fields in a request; a request with more is malformed.
+#define REQUEST_HEADERS 64
+
+/**
+ * @brief Data structure with client request information.
+ *     Strings are NUL terminated in the parsed buffer, except host and
+ *     port, which are copied out of the URI kept whole as the cache key.
+ */
+typedef struct {
+    const char *host;    // A network host, e.g. cs.cmu.edu, or empty
+    const char *port;    // The port to connect on, by default 80
+    const char *path;    // The path to find a resource, e.g. index.html
+    const char *method;  // HTTP request method, e.g. GET or POST
+    const char *uri;     // Entire universal resource identifier
+    const char *version; // HTTP version without the HTTP/, e.g. 1.1
+} request_info;
+
+/**
+ * @brief Header field, a slice of the parsed buffer.
+ *     Name and value are also NUL terminated in place; the value has
+ *     surrounding whitespace trimmed.
+ */
+typedef struct {
+    const char *name;  // Field name, without the colon
+    size_t name_len;   // Length of name
+    const char *value; // Field value
+    size_t value_len;  // Length of value
+} request_header;
+
+/**
+ * @brief Resumable request head parser.
+ *     Keeps offsets, not pointers, until the head is complete, so the
+ *     buffer may move between calls.
+ */
+typedef struct {
+    size_t start;                            // Offset of the request line
+    size_t scan;                             // Offset line end search is at
+    size_t nlines;                           // Line ends found so far
+    uint32_t ends[REQUEST_HEADERS + 1];      // Offset of LF ending each line
+    request_header headers[REQUEST_HEADERS]; // Header fields, in order
+    size_t nheaders;                         // Number of header fields
+    char host[HOSTLEN];                      // Host copied out of the URI
+    char port[SERVLEN];                      // Port copied out of the URI
+} request_parser;
+
+/**
+ * @brief Prepares a parser for a new request head.
+ *
+ * @param[out] rp : parser.
+ */
+void request_parser_init(request_parser *rp);
+
+/**
+ * @brief Parses the request head at the start of <buf>, resuming where the
+ *     last call on the same head stopped.
+ *     <buf> holds the bytes given before, unchanged, and may have moved.
+ *
+ * @param[in,out] rp      : parser.
+ * @param[out]    request : request information, once complete.
+ * @param[in,out] buf     : received bytes; terminated in place once complete.
+ * @param[in]     len     : length of <buf>.
+ *
+ * @return length of the head, empty line included, 0 if not complete
+ *     within <buf>, -1 if malformed.
+ */
+ssize_t request_parse_head(request_parser *rp, request_info *request,
+                           char *buf, size_t len);
+
+/**
+ * @brief Finds header field <name> of a parsed request head.
+ *
+ * @param[in] rp   : parser of a complete head.
+ * @param[in] name : field name to match, case-insensitively.
+ *
+ * @return first matching field, NULL if none.
+ */
+const request_header *request_lookup_header(const request_parser *rp,
+                                            const char *name);
+
+#endif /* REQUEST_H */
@@ -0,0 +1,436 @@
+/**
+ * @file response.c
+ * @brief HTTP response header parsing for a tiny web proxy.
+ *
+ * Header names are matched case-insensitively, and values may carry
+ * surrounding whitespace. Connection and Transfer-Encoding values are token
+ * lists, so they are searched for the token and not compared whole.
+ * Freshness follows the rules for shared caches: s-maxage wins over max-age,
+ * which wins over Expires; responses with neither get a tenth of their age
+ * since Last-Modified, capped at RESPONSE_HEURISTIC_MAX. Responses that vary
+ * by request headers are never stored, since the cache is keyed by URI, but
+ * for those varying by Accept-Encoding alone while compression is on: the
+ * cacheable requests they answer reached the server without one.
+ *
+ * @author Iltikin Wayet
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // strptime, timegm
+#endif
+
+#include "response.h"
+#include "compress.h"
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+// ---------- HELPER PROTOTYPES ------------ //
+static void cache_control(response_info *response, const char *value);
+static bool directive_is(const char *p, size_t len, const char *name);
+static bool token_alone(const char *value, const char *token);
+static time_t http_date(const char *value);
+
+// ---------- FUNCTION ROUTINES ------------ //
+
+/**
+ * @brief Parses a response status line, e.g. "HTTP/1.1 200 OK".
+ *     Resets all other response information.
+ *
+ * @param[out] response : response information to fill.
+ * @param[in]  line     : status line, with or without "\r\n".
+ *
+ * @return 0 if successful, -1 if malformed.
+ */
+int response_parse_status(response_info *response, const char *line) {
+    int major, minor, status;
+    response->chunked = false;
+    response->coded = false;
+    response->content_length = -1;
+    response->close = false;
+    response->keep_alive = false;
+    response->no_store = false;
+    response->vary_encoding = false;
+    response->no_cache = false;
+    response->max_age = -1;
+    response->s_maxage = -1;
+    response->age = 0;
+    response->date = -1;
+    response->expires = -1;
+    response->last_modified = -1;
+    response->validator = false;
+    if (sscanf(line, "HTTP/%d.%d %d", &major, &minor, &status) != 3) {
+        return -1;
+    }
+    response->status = status;
+    response->http11 = (major > 1 || (major == 1 && minor >= 1));
+    return 0;
+}
+
+/**
+ * @brief Parses a response header line, recording framing and freshness
+ *     headers.
+ *
+ * @param[in,out] response : response information to update.
+ * @param[in]     line     : header line, with or without "\r\n".
+ */
+void response_parse_header(response_info *response, const char *line) {
+    const char *value;
+    if ((value = header_value(line, "Content-Length")) != NULL) {
+        response->content_length = strtoll(value, NULL, 10);
+    } else if ((value = header_value(line, "Transfer-Encoding")) != NULL) {
+        response->chunked = header_has_token(value, "chunked");
+        response->coded |= !token_alone(value, "chunked");
+    } else if ((value = header_value(line, "Connection")) != NULL) {
+        response->close = header_has_token(value, "close");
+        response->keep_alive = header_has_token(value, "keep-alive");
+    } else if ((value = header_value(line, "Cache-Control")) != NULL) {
+        cache_control(response, value);
+    } else if ((value = header_value(line, "Pragma")) != NULL) {
+        response->no_cache |= header_has_token(value, "no-cache");
+    } else if ((value = header_value(line, "Expires")) != NULL) {
+        time_t expires = http_date(value);
+        response->expires = (expires >= 0) ? expires : 0;
+    } else if ((value = header_value(line, "Date")) != NULL) {
+        response->date = http_date(value);
+    } else if ((value = header_value(line, "Last-Modified")) != NULL) {
+        response->last_modified = http_date(value);
+        response->validator = true;
+    } else if ((value = header_value(line, "ETag")) != NULL) {
+        response->validator = true;
+    } else if ((value = header_value(line, "Age")) != NULL) {
+        response->age = strtol(value, NULL, 10);
+    } else if ((value = header_value(line, "Vary")) != NULL) {
+        if (token_alone(value, "Accept-Encoding"))
+            response->vary_encoding = true;
+        else
+            response->no_store = true;
+    }
+}
+
+/**
+ * @brief Parses a complete response head at the start of <buf>.
+ *     Lines are copied out one at a time, so <buf> need not be terminated.
+ *
+ * @param[out] response : response information to fill.
+ * @param[in]  buf      : response text.
+ * @param[in]  len      : length of <buf>.
+ *
+ * @return length of the head, empty line included, -1 if malformed or
+ *     not complete within <buf>.
+ */
+ssize_t response_parse_head(response_info *response, const char *buf,
+                            size_t len) {
+    char line[RESPONSE_LINE];
+    size_t pos = 0;
+    while (pos < len) {
+        const char *eol = memchr(buf + pos, '\n', len - pos);
+        if (eol == NULL)
+            return -1;
+        size_t n = eol + 1 - (buf + pos);
+        if (n >= sizeof(line))
+            return -1;
+        memcpy(line, buf + pos, n);
+        line[n] = '\0';
+        if (pos == 0) {
+            if (response_parse_status(response, line) < 0)
+                return -1;
+        } else if (!strcmp(line, "\r\n") || !strcmp(line, "\n")) {
+            return pos + n;
+        } else {
+            response_parse_header(response, line);
+        }
+        pos += n;
+    }
+    return -1;
+}
+
+/**
+ * @brief Returns whether a response to <method> carries a body.
+ *     HEAD responses and 1xx, 204, and 304 responses never do.
+ *
+ * @param[in] response : parsed response head.
+ * @param[in] method   : request method, e.g. GET or HEAD.
+ */
+bool response_has_body(const response_info *response, const char *method) {
+    if (!strcasecmp(method, "HEAD"))
+        return false;
+    int status = response->status;
+    return !((status >= 100 && status < 200) || status == 204 ||
+             status == 304);
+}
+
+/**
+ * @brief Returns whether the server connection may be reused after the body.
+ *     Requires a persistent connection and a body framed without EOF.
+ *
+ * @param[in] response : parsed response head.
+ * @param[in] method   : request method, e.g. GET or HEAD.
+ */
+bool response_reusable(const response_info *response, const char *method) {
+    bool persistent = response->http11 ? !response->close
+                                       : response->keep_alive;
+    if (!persistent)
+        return false;
+    return !response_has_body(response, method) || response->chunked ||
+           response->content_length >= 0;
+}
+
+/**
+ * @brief Returns the freshness lifetime of a response received at <now>.
+ *     No-cache responses get none; Date defaults to <now>. Responses that
+ *     say nothing of their freshness get RESPONSE_DEFAULT_TTL.
+ *
+ * @param[in] response : parsed response head.
+ * @param[in] now      : time the response was received.
+ *
+ * @return lifetime in seconds, 0 or less if stale at once.
+ */
+long response_lifetime(const response_info *response, time_t now) {
+    if (response->no_cache)
+        return 0;
+    if (response->s_maxage >= 0)
+        return response->s_maxage;
+    if (response->max_age >= 0)
+        return response->max_age;
+    time_t date = (response->date >= 0) ? response->date : now;
+    if (response->expires >= 0)
+        return response->expires - date;
+    if (response->last_modified >= 0 && response->last_modified < date) {
+        long lifetime = (date - response->last_modified) / 10;
+        return (lifetime < RESPONSE_HEURISTIC_MAX) ? lifetime
+                                                   : RESPONSE_HEURISTIC_MAX;
+    }
+    return (response->last_modified < 0) ? RESPONSE_DEFAULT_TTL : 0;
+}
+
+/**
+ * @brief Returns whether a response states its freshness lifetime, with
+ *     Cache-Control or Expires; a 304 that does not keeps the lifetime of
+ *     the response it validates.
+ *
+ * @param[in] response : parsed response head.
+ */
+bool response_explicit(const response_info *response) {
+    return response->no_cache || response->s_maxage >= 0 ||
+           response->max_age >= 0 || response->expires >= 0;
+}
+
+/**
+ * @brief Returns when a response received at <now> goes stale.
+ *     Its freshness lifetime less its current age, the larger of its Age
+ *     and the time since its Date.
+ *
+ * @param[in] response : parsed response head.
+ * @param[in] now      : time the response was received.
+ *
+ * @return expiry time, at most <now> if stale at once.
+ */
+time_t response_expires(const response_info *response, time_t now) {
+    time_t date = (response->date >= 0) ? response->date : now;
+    long age = (now > date) ? now - date : 0;
+    if (response->age > age)
+        age = response->age;
+    return now + response_lifetime(response, now) - age;
+}
+
+/**
+ * @brief Returns whether a response to a GET received at <now> may be
+ *     stored by a shared cache.
+ *     Only final responses cacheable by default that are not errors, and
+ *     only if they are fresh or can be revalidated. One varying by
+ *     Accept-Encoding alone may be only with compression on, which forwards
+ *     cacheable requests without the client's Accept-Encoding.
+ *
+ * @param[in] response : parsed response head.
+ * @param[in] now      : time the response was received.
+ */
+bool response_cacheable(const response_info *response, time_t now) {
+    switch (response->status) {
+    case 200:
+    case 203:
+    case 300:
+    case 301:
+    case 308:
+        break;
+    default:
+        return false;
+    }
+    if (response->no_store || (response->vary_encoding && !compress_enabled()))
+        return false;
+    return response->validator || response_expires(response, now) > now;
+}
+
+/**
+ * @brief Returns whether a comma-separated header value lists <token>,
+ *     e.g. "close" in a Connection header.
+ *
+ * @param[in] value : header value.
+ * @param[in] token : token to find, case-insensitively.
+ */
+bool header_has_token(const char *value, const char *token) {
+    size_t len = strlen(token);
+    const char *p = value;
+    while (*p != '\0') {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        if (!strncasecmp(p, token, len) &&
+            (p[len] == '\0' || p[len] == ',' || isspace((unsigned char)p[len])))
+            return true;
+        while (*p != '\0' && *p != ',')
+            p++;
+    }
+    return false;
+}
+
+/**
+ * @brief Returns the value of header <name> if <line> is that header.
+ *
+ * @param[in] line : header line.
+ * @param[in] name : header name to match, case-insensitively.
+ *
+ * @return start of the value with leading whitespace skipped, NULL if
+ *     <line> is a different header.
+ */
+const char *header_value(const char *line, const char *name) {
+    size_t len = strlen(name);
+    if (strncasecmp(line, name, len) || line[len] != ':')
+        return NULL;
+    const char *value = line + len + 1;
+    while (*value == ' ' || *value == '\t')
+        value++;
+    return value;
+}
+
+/**
+ * @brief Locates the value of header <name> in a complete response head,
+ *     e.g. a validator of text about to be cached.
+ *
+ * @param[in]  head     : response head, not terminated.
+ * @param[in]  head_len : length of <head>, empty line included.
+ * @param[in]  name     : header name to match, case-insensitively.
+ * @param[out] len      : length of the value, surrounding whitespace off.
+ *
+ * @return offset of the value in <head>, 0 if the head has no such header.
+ */
+size_t response_field(const char *head, size_t head_len, const char *name,
+                      size_t *len) {
+    size_t name_len = strlen(name);
+    const char *end = head + head_len;
+    // Skip the status line.
+    const char *p = memchr(head, '\n', head_len);
+    while (p != NULL && ++p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (eol == NULL)
+            break;
+        if ((size_t)(eol - p) > name_len && p[name_len] == ':' &&
+            !strncasecmp(p, name, name_len)) {
+            const char *v = p + name_len + 1;
+            while (v < eol && (*v == ' ' || *v == '\t'))
+                v++;
+            const char *e = eol;
+            while (e > v && (e[-1] == '\r' || e[-1] == ' ' || e[-1] == '\t'))
+                e--;
+            *len = e - v;
+            return v - head;
+        }
+        p = eol;
+    }
+    return 0;
+}
+
+// ---------- HELPER ROUTINES ------------ //
+
+/**
+ * @brief Records the Cache-Control directives of a response.
+ *     Private responses are not stored by a shared cache; no-cache ones,
+ *     with or without field names, are stored but always revalidated.
+ *
+ * @param[in,out] response : response information to update.
+ * @param[in]     value    : Cache-Control header value.
+ */
+static void cache_control(response_info *response, const char *value) {
+    const char *p = value;
+    while (*p != '\0') {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        size_t len = strcspn(p, "=, \t\r\n");
+        const char *arg = (p[len] == '=') ? p + len + 1 : NULL;
+        if (arg != NULL && *arg == '"')
+            arg++;
+        if (directive_is(p, len, "no-store") ||
+            directive_is(p, len, "private")) {
+            response->no_store = true;
+        } else if (directive_is(p, len, "no-cache")) {
+            response->no_cache = true;
+        } else if (directive_is(p, len, "max-age") && arg != NULL) {
+            response->max_age = strtol(arg, NULL, 10);
+        } else if (directive_is(p, len, "s-maxage") && arg != NULL) {
+            response->s_maxage = strtol(arg, NULL, 10);
+        }
+        while (*p != '\0' && *p != ',')
+            p++;
+    }
+}
+
+/**
+ * @brief Returns whether the directive of <len> bytes at <p> is <name>.
+ *
+ * @param[in] p    : start of the directive.
+ * @param[in] len  : length of the directive name.
+ * @param[in] name : directive name to match, case-insensitively.
+ */
+static bool directive_is(const char *p, size_t len, const char *name) {
+    return len == strlen(name) && !strncasecmp(p, name, len);
+}
+
+/**
+ * @brief Parses an HTTP date, e.g. "Sun, 06 Nov 1994 08:49:37 GMT".
+ *     Accepts the IMF-fixdate, RFC 850, and asctime formats.
+ *
+ * @param[in] value : header value.
+ *
+ * @return seconds since the epoch, -1 if malformed.
+ */
+static time_t http_date(const char *value) {
+    static const char *formats[] = {"%a, %d %b %Y %H:%M:%S",
+                                    "%a, %d-%b-%y %H:%M:%S",
+                                    "%a %b %d %H:%M:%S %Y"};
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        if (strptime(value, formats[i], &tm) != NULL)
+            return timegm(&tm);
+    }
+    return -1;
+}
+
+/**
+ * @brief Returns whether a comma-separated header value lists no token but
+ *     <token>, e.g. "chunked" alone in a Transfer-Encoding header.
+ *
+ * @param[in] value : header value.
+ * @param[in] token : token allowed, case-insensitively.
+ */
+static bool token_alone(const char *value, const char *token) {
+    size_t len = strlen(token);
+    const char *p = value;
+    while (*p != '\0') {
+        while (*p == ',' || isspace((unsigned char)*p))
+            p++;
+        if (*p == '\0')
+            break;
+        if (strncasecmp(p, token, len))
+            return false;
+        p += len;
+        while (isspace((unsigned char)*p))
+            p++;
+        if (*p != '\0' && *p != ',')
+            return false;
+    }
+    return true;
+}
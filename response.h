@@ -0,0 +1,183 @@
+/**
+ * @file response.h
+ * @brief HTTP response header parsing for a tiny web proxy.
+ *
+ * Extracts what the proxy needs from a server response head: the status
+ * code, how the body is framed (Content-Length, chunked, or until EOF),
+ * whether the server connection may be reused afterwards, and whether and
+ * for how long the response may be cached (Cache-Control, Expires, Date,
+ * Last-Modified, and Age, as a shared cache).
+ *
+ * Descriptions of individual functions and data structures are provided in
+ * their respective leading comments.
+ *
+ * @author Iltikin Wayet
+ */
+
+#ifndef RESPONSE_H
+#define RESPONSE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+// Longest response header line parsed from a buffer.
+#define RESPONSE_LINE 8192
+
+// Cap of the heuristic freshness lifetime, a tenth of the time since
+// Last-Modified, in seconds.
+#define RESPONSE_HEURISTIC_MAX (24 * 60 * 60)
+
+// Freshness lifetime of a response without Cache-Control, Expires, or
+// Last-Modified, in seconds.
+#define RESPONSE_DEFAULT_TTL 120
+
+/**
+ * @brief Data structure with server response information.
+ */
+typedef struct {
+    int status;             // Status code, e.g. 200
+    bool http11;            // Whether the server answered with HTTP/1.1
+    bool chunked;           // Transfer-Encoding: chunked
+    bool coded;             // Transfer-Encoding other than chunked alone
+    ssize_t content_length; // Content-Length, -1 if absent
+    bool close;             // Connection: close
+    bool keep_alive;        // Connection: keep-alive
+    bool no_store;          // Cache-Control no-store or private, or Vary
+                            // on more than Accept-Encoding
+    bool vary_encoding;     // Vary on Accept-Encoding alone
+    bool no_cache;          // Cache-Control no-cache, or Pragma no-cache
+    long max_age;           // Cache-Control max-age, -1 if absent
+    long s_maxage;          // Cache-Control s-maxage, -1 if absent
+    long age;               // Age, 0 if absent
+    time_t date;            // Date, -1 if absent
+    time_t expires;         // Expires, -1 if absent, 0 if invalid
+    time_t last_modified;   // Last-Modified, -1 if absent
+    bool validator;         // Whether ETag or Last-Modified is present
+} response_info;
+
+/**
+ * @brief Parses a response status line, e.g. "HTTP/1.1 200 OK".
+ *     Resets all other response information.
+ *
+ * @param[out] response : response information to fill.
+ * @param[in]  line     : status line, with or without "\r\n".
+ *
+ * @return 0 if successful, -1 if malformed.
+ */
+int response_parse_status(response_info *response, const char *line);
+
+/**
+ * @brief Parses a response header line, recording framing headers.
+ *
+ * @param[in,out] response : response information to update.
+ * @param[in]     line     : header line, with or without "\r\n".
+ */
+void response_parse_header(response_info *response, const char *line);
+
+/**
+ * @brief Parses a complete response head at the start of <buf>.
+ *
+ * @param[out] response : response information to fill.
+ * @param[in]  buf      : response text.
+ * @param[in]  len      : length of <buf>.
+ *
+ * @return length of the head, empty line included, -1 if malformed or
+ *     not complete within <buf>.
+ */
+ssize_t response_parse_head(response_info *response, const char *buf,
+                            size_t len);
+
+/**
+ * @brief Returns whether a response to <method> carries a body.
+ *
+ * @param[in] response : parsed response head.
+ * @param[in] method   : request method, e.g. GET or HEAD.
+ */
+bool response_has_body(const response_info *response, const char *method);
+
+/**
+ * @brief Returns whether the server connection may be reused after the body.
+ *     Requires a persistent connection and a body framed without EOF.
+ *
+ * @param[in] response : parsed response head.
+ * @param[in] method   : request method, e.g. GET or HEAD.
+ */
+bool response_reusable(const response_info *response, const char *method);
+
+/**
+ * @brief Returns the freshness lifetime of a response received at <now>.
+ *
+ * @param[in] response : parsed response head.
+ * @param[in] now      : time the response was received.
+ *
+ * @return lifetime in seconds, 0 or less if stale at once.
+ */
+long response_lifetime(const response_info *response, time_t now);
+
+/**
+ * @brief Returns whether a response states its freshness lifetime, with
+ *     Cache-Control or Expires; a 304 that does not keeps the lifetime of
+ *     the response it validates.
+ *
+ * @param[in] response : parsed response head.
+ */
+bool response_explicit(const response_info *response);
+
+/**
+ * @brief Returns when a response received at <now> goes stale.
+ *
+ * @param[in] response : parsed response head.
+ * @param[in] now      : time the response was received.
+ *
+ * @return expiry time, at most <now> if stale at once.
+ */
+time_t response_expires(const response_info *response, time_t now);
+
+/**
+ * @brief Returns whether a response to a GET received at <now> may be
+ *     stored by a shared cache. One varying by Accept-Encoding alone may be
+ *     only with compression on, which forwards cacheable requests without
+ *     the client's Accept-Encoding (see compress.h).
+ *
+ * @param[in] response : parsed response head.
+ * @param[in] now      : time the response was received.
+ */
+bool response_cacheable(const response_info *response, time_t now);
+
+/**
+ * @brief Returns the value of header <name> if <line> is that header.
+ *
+ * @param[in] line : header line.
+ * @param[in] name : header name to match, case-insensitively.
+ *
+ * @return start of the value with leading whitespace skipped, NULL if
+ *     <line> is a different header.
+ */
+const char *header_value(const char *line, const char *name);
+
+/**
+ * @brief Locates the value of header <name> in a complete response head,
+ *     e.g. a validator of text about to be cached.
+ *
+ * @param[in]  head     : response head, not terminated.
+ * @param[in]  head_len : length of <head>, empty line included.
+ * @param[in]  name     : header name to match, case-insensitively.
+ * @param[out] len      : length of the value, surrounding whitespace off.
+ *
+ * @return offset of the value in <head>, 0 if the head has no such header.
+ */
+size_t response_field(const char *head, size_t head_len, const char *name,
+                      size_t *len);
+
+/**
+ * @brief Returns whether a comma-separated header value lists <token>,
+ *     e.g. "close" in a Connection header.
+ *
+ * @param[in] value : header value.
+ * @param[in] token : token to find, case-insensitively.
+ */
+bool header_has_token(const char *value, const char *token);
+
+#endif /* RESPONSE_H */
@@ -0,0 +1,229 @@
+/**
+ * @file ring.c
+ * @brief Per-thread record rings for a tiny web proxy.
+ *
+ * Each ring has a single producer, its thread, and a single consumer, the
+ * drain of its set. Key implementation details:
+ *     - Appending is a plain store of the record followed by a release
+ *       store of the head; no lock and no atomic read-modify-write.
+ *     - Head and tail sit on cache lines of their own, and the producer
+ *       keeps the last tail it read, rereading it only when the ring looks
+ *       full, so the consumer's progress does not bounce the producer's
+ *       line.
+ *     - Records live right after the ring header, in one allocation
+ *       aligned to a cache line, and are indexed by position mod slots.
+ *     - Drops are counted by the producer with a relaxed load and store,
+ *       as it is the only writer; the consumer remembers how many it has
+ *       reported per ring.
+ *     - A set is a push-only list of rings; threads add theirs with a
+ *       compare-and-swap and drains walk it without a lock of the list.
+ *     - Writer threads sleep for a fixed period between flushes, so the
+ *       producers never signal anything.
+ *
+ * Descriptions of individual functions, data structures, and global variables
+ * are provided in their respective leading comments.
+ *
+ * @author Iltikin Wayet
+ */
+
+#include "ring.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Size of a cache line, which ring indices are aligned to.
+#define RING_LINE 64
+
+/**
+ * @brief Ring of records appended by one thread, drained by its set.
+ */
+struct record_ring {
+    // Written by the producer.
+    _Alignas(RING_LINE) atomic_size_t head; // Records appended
+    size_t tail_seen;                       // Last tail read by producer
+    atomic_uint_fast64_t dropped;           // Records that found ring full
+    // Written by the consumer.
+    _Alignas(RING_LINE) atomic_size_t tail; // Records drained
+    uint64_t reported;                      // Drops already returned
+    // Read-only once taken.
+    size_t size;              // Bytes per record
+    size_t mask;              // Records per ring, minus 1
+    struct record_ring *next; // Pointer to next ring
+    // Records, by index mod records per ring.
+    _Alignas(RING_LINE) unsigned char records[];
+};
+
+/**
+ * @brief Period and flush function of a writer thread.
+ */
+typedef struct {
+    long period_ms;      // Milliseconds between two flushes
+    void (*flush)(void); // Function draining and writing out a set
+} rwriter;
+
+// ---------- HELPER PROTOTYPES ------------ //
+static void *writer(void *vargp);
+
+// ---------- FUNCTION ROUTINES ------------ //
+
+/**
+ * @brief Initializes an empty set of rings.
+ *
+ * @param[out] set   : set to initialize.
+ * @param[in]  size  : bytes per record.
+ * @param[in]  slots : records per ring; a power of two.
+ */
+void ring_init(rset *set, size_t size, size_t slots) {
+    set->size = size;
+    set->slots = slots;
+    atomic_init(&set->head, NULL);
+}
+
+/**
+ * @brief Takes a ring for the calling thread, its only producer, and adds
+ *     it to a set; never freed.
+ *
+ * @param[in] set : set the ring belongs to.
+ */
+rring *ring_take(rset *set) {
+    size_t bytes = sizeof(rring) + set->size * set->slots;
+    bytes = (bytes + RING_LINE - 1) & ~(size_t)(RING_LINE - 1);
+    rring *ring = aligned_alloc(RING_LINE, bytes);
+    if (ring == NULL) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        exit(1);
+    }
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->dropped, 0);
+    ring->tail_seen = 0;
+    ring->reported = 0;
+    ring->size = set->size;
+    ring->mask = set->slots - 1;
+    ring->next = atomic_load(&set->head);
+    while (!atomic_compare_exchange_weak(&set->head, &ring->next, ring))
+        ;
+    return ring;
+}
+
+/**
+ * @brief Returns the slot of the next record of a ring, to be filled and
+ *     then published with ring_push; producer only.
+ *
+ * @param[in] ring : ring of the calling thread.
+ *
+ * @return slot of <size> bytes, NULL if the ring is full and the record is
+ *     dropped.
+ */
+void *ring_slot(rring *ring) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - ring->tail_seen > ring->mask) {
+        ring->tail_seen =
+            atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head - ring->tail_seen > ring->mask) {
+            atomic_store_explicit(
+                &ring->dropped,
+                atomic_load_explicit(&ring->dropped, memory_order_relaxed) + 1,
+                memory_order_relaxed);
+            return NULL;
+        }
+    }
+    return ring->records + (head & ring->mask) * ring->size;
+}
+
+/**
+ * @brief Publishes the record filled into the slot from ring_slot.
+ *
+ * @param[in] ring : ring of the calling thread.
+ */
+void ring_push(rring *ring) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/**
+ * @brief Visits and consumes every record pending in the rings of a set.
+ *     Rings have one consumer: drains of a set must not overlap.
+ *
+ * @param[in] set   : set to drain.
+ * @param[in] visit : function called with every record.
+ * @param[in] arg   : argument passed to <visit>.
+ *
+ * @return records dropped since the last drain.
+ */
+uint64_t ring_drain(rset *set, ring_visit visit, void *arg) {
+    uint64_t dropped = 0;
+    for (rring *ring = atomic_load(&set->head); ring != NULL;
+         ring = ring->next) {
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        for (; tail != head; tail++)
+            visit(ring->records + (tail & ring->mask) * ring->size, arg);
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+        uint64_t total =
+            atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+        dropped += total - ring->reported;
+        ring->reported = total;
+    }
+    return dropped;
+}
+
+/**
+ * @brief Returns the records dropped by the rings of a set so far.
+ *
+ * @param[in] set : set of rings.
+ */
+uint64_t ring_dropped(rset *set) {
+    uint64_t dropped = 0;
+    for (rring *ring = atomic_load(&set->head); ring != NULL;
+         ring = ring->next)
+        dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    return dropped;
+}
+
+/**
+ * @brief Starts a writer thread calling <flush> every <period_ms>
+ *     milliseconds, for as long as the proxy runs.
+ *
+ * @param[in] period_ms : milliseconds between two calls.
+ * @param[in] flush     : function called, e.g. draining and writing out a
+ *                        set.
+ *
+ * @return true if started.
+ */
+bool ring_writer(long period_ms, void (*flush)(void)) {
+    rwriter *w = malloc(sizeof(rwriter));
+    if (w == NULL)
+        return false;
+    w->period_ms = period_ms;
+    w->flush = flush;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, writer, w) != 0) {
+        free(w);
+        return false;
+    }
+    pthread_detach(tid);
+    return true;
+}
+
+// ---------- HELPER ROUTINES ------------ //
+
+/**
+ * @brief Writer thread function.
+ *     Every period, calls the flush function of the writer.
+ *
+ * @param[in] vargp : void* pointer to the malloc'd writer.
+ */
+static void *writer(void *vargp) {
+    rwriter *w = (rwriter *)vargp;
+    struct timespec pause = {.tv_sec = w->period_ms / 1000,
+                             .tv_nsec = (w->period_ms % 1000) * 1000000};
+    while (1) {
+        nanosleep(&pause, NULL);
+        w->flush();
+    }
+    return NULL;
+}
@@ -0,0 +1,116 @@
+/**
+ * @file ring.h
+ * @brief Per-thread record rings for a tiny web proxy.
+ *
+ * Off-path logging without locks: every producing thread appends fixed-size
+ * records to a ring of its own, and a single consumer, a writer thread
+ * waking at a fixed period, drains the rings of a set and writes the
+ * records out. A record finding its ring full is dropped and counted,
+ * never waited on. The access log and the request trace are both sets of
+ * rings.
+ *
+ * Descriptions of individual functions and data structures are provided in
+ * their respective leading comments.
+ *
+ * ring.c has more detailed implementation-related comments.
+ *
+ * @author Iltikin Wayet
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Ring of one producing thread (see ring.c).
+struct record_ring;
+typedef struct record_ring rring;
+
+/**
+ * @brief Set of rings with records of one kind, drained together.
+ */
+struct ring_set {
+    size_t size;           // Bytes per record
+    size_t slots;          // Records per ring; a power of two
+    _Atomic(rring *) head; // List of all rings (push-only)
+};
+typedef struct ring_set rset;
+
+/**
+ * @brief Function a drain calls for every record, in ring order.
+ *
+ * @param[in] record : record drained, valid only during the call.
+ * @param[in] arg    : argument given to ring_drain.
+ */
+typedef void (*ring_visit)(const void *record, void *arg);
+
+/**
+ * @brief Initializes an empty set of rings.
+ *
+ * @param[out] set   : set to initialize.
+ * @param[in]  size  : bytes per record.
+ * @param[in]  slots : records per ring; a power of two.
+ */
+void ring_init(rset *set, size_t size, size_t slots);
+
+/**
+ * @brief Takes a ring for the calling thread, its only producer, and adds
+ *     it to a set; never freed.
+ *
+ * @param[in] set : set the ring belongs to.
+ */
+rring *ring_take(rset *set);
+
+/**
+ * @brief Returns the slot of the next record of a ring, to be filled and
+ *     then published with ring_push; producer only.
+ *
+ * @param[in] ring : ring of the calling thread.
+ *
+ * @return slot of <size> bytes, NULL if the ring is full and the record is
+ *     dropped.
+ */
+void *ring_slot(rring *ring);
+
+/**
+ * @brief Publishes the record filled into the slot from ring_slot.
+ *
+ * @param[in] ring : ring of the calling thread.
+ */
+void ring_push(rring *ring);
+
+/**
+ * @brief Visits and consumes every record pending in the rings of a set.
+ *     Rings have one consumer: drains of a set must not overlap.
+ *
+ * @param[in] set   : set to drain.
+ * @param[in] visit : function called with every record.
+ * @param[in] arg   : argument passed to <visit>.
+ *
+ * @return records dropped since the last drain.
+ */
+uint64_t ring_drain(rset *set, ring_visit visit, void *arg);
+
+/**
+ * @brief Returns the records dropped by the rings of a set so far.
+ *
+ * @param[in] set : set of rings.
+ */
+uint64_t ring_dropped(rset *set);
+
+/**
+ * @brief Starts a writer thread calling <flush> every <period_ms>
+ *     milliseconds, for as long as the proxy runs.
+ *
+ * @param[in] period_ms : milliseconds between two calls.
+ * @param[in] flush     : function called, e.g. draining and writing out a
+ *                        set.
+ *
+ * @return true if started.
+ */
+bool ring_writer(long period_ms, void (*flush)(void));
+
+#endif /* RING_H */
@@ -0,0 +1,112 @@
+/**
+ * @file sbuf.c
+ * @brief Bounded queue of accepted client connections for a tiny web proxy.
+ *
+ * Circular array of client_info slots guarded by a mutex, with condition
+ * variables for waiting producers and consumers. Items are copied in and out
+ * so the accept path does not allocate.
+ *
+ * @author Iltikin Wayet
+ */
+
+#include "sbuf.h"
+#include "cache.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+// ---------- HELPER PROTOTYPES ------------ //
+static void sbuf_push(sbuf_t *sp, const client_info *item);
+
+// ---------- FUNCTION ROUTINES ------------ //
+
+/**
+ * @brief Initializes an empty buffer with <n> slots.
+ *
+ * @param[in] sp : buffer to initialize.
+ * @param[in] n  : number of slots, at least 1.
+ */
+void sbuf_init(sbuf_t *sp, size_t n) {
+    sp->n = (n < 1) ? 1 : n;
+    sp->buf = malloc_w(sizeof(client_info) * sp->n);
+    sp->front = 0;
+    sp->count = 0;
+    pthread_mutex_init(&sp->mutex, NULL);
+    pthread_cond_init(&sp->not_empty, NULL);
+    pthread_cond_init(&sp->not_full, NULL);
+}
+
+/**
+ * @brief Frees a buffer.
+ *
+ * @param[in] sp : buffer to free.
+ */
+void sbuf_deinit(sbuf_t *sp) {
+    pthread_cond_destroy(&sp->not_full);
+    pthread_cond_destroy(&sp->not_empty);
+    pthread_mutex_destroy(&sp->mutex);
+    free(sp->buf);
+}
+
+/**
+ * @brief Inserts <item> at the rear of the buffer, waiting for a free slot.
+ *
+ * @param[in] sp   : buffer to insert into.
+ * @param[in] item : client connection to insert.
+ */
+void sbuf_insert(sbuf_t *sp, const client_info *item) {
+    pthread_mutex_lock(&sp->mutex);
+    while (sp->count == sp->n)
+        pthread_cond_wait(&sp->not_full, &sp->mutex);
+    sbuf_push(sp, item);
+    pthread_mutex_unlock(&sp->mutex);
+}
+
+/**
+ * @brief Inserts <item> at the rear of the buffer if a slot is free.
+ *
+ * @param[in] sp   : buffer to insert into.
+ * @param[in] item : client connection to insert.
+ *
+ * @return true if inserted, false if buffer full.
+ */
+bool sbuf_tryinsert(sbuf_t *sp, const client_info *item) {
+    pthread_mutex_lock(&sp->mutex);
+    bool fits = sp->count < sp->n;
+    if (fits)
+        sbuf_push(sp, item);
+    pthread_mutex_unlock(&sp->mutex);
+    return fits;
+}
+
+/**
+ * @brief Removes the first item of the buffer, waiting for one if empty.
+ *
+ * @param[in]  sp   : buffer to remove from.
+ * @param[out] item : removed client connection.
+ */
+void sbuf_remove(sbuf_t *sp, client_info *item) {
+    pthread_mutex_lock(&sp->mutex);
+    while (sp->count == 0)
+        pthread_cond_wait(&sp->not_empty, &sp->mutex);
+    *item = sp->buf[sp->front];
+    sp->front = (sp->front + 1) % sp->n;
+    sp->count--;
+    pthread_cond_signal(&sp->not_full);
+    pthread_mutex_unlock(&sp->mutex);
+}
+
+// ---------- HELPER ROUTINES ------------ //
+
+/**
+ * @brief Copies <item> into the rear slot and wakes one consumer.
+ *
+ * @param[in] sp   : buffer with a free slot, mutex held.
+ * @param[in] item : client connection to insert.
+ */
+static void sbuf_push(sbuf_t *sp, const client_info *item) {
+    sp->buf[(sp->front + sp->count) % sp->n] = *item;
+    sp->count++;
+    pthread_cond_signal(&sp->not_empty);
+}
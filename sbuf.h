@@ -0,0 +1,79 @@
+/**
+ * @file sbuf.h
+ * @brief Bounded queue of accepted client connections for a tiny web proxy.
+ *
+ * Shared FIFO buffer (in the spirit of the CS:APP sbuf package) between the
+ * accepting main thread and the pool of worker threads. Inserting into a full
+ * buffer either blocks or fails, which is how the proxy applies back-pressure
+ * instead of growing without bound.
+ *
+ * Descriptions of individual functions and data structures are provided in
+ * their respective leading comments.
+ *
+ * @author Iltikin Wayet
+ */
+
+#ifndef SBUF_H
+#define SBUF_H
+
+#include "proxy.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * @brief Bounded circular buffer of client connections.
+ */
+typedef struct {
+    client_info *buf;         // Buffer array of n slots
+    size_t n;                 // Maximum number of slots
+    size_t front;             // Index of first item
+    size_t count;             // Number of items in buffer
+    pthread_mutex_t mutex;    // Protects accesses to buf
+    pthread_cond_t not_empty; // Signaled when an item is inserted
+    pthread_cond_t not_full;  // Signaled when an item is removed
+} sbuf_t;
+
+/**
+ * @brief Initializes an empty buffer with <n> slots.
+ *
+ * @param[in] sp : buffer to initialize.
+ * @param[in] n  : number of slots, at least 1.
+ */
+void sbuf_init(sbuf_t *sp, size_t n);
+
+/**
+ * @brief Frees a buffer.
+ *
+ * @param[in] sp : buffer to free.
+ */
+void sbuf_deinit(sbuf_t *sp);
+
+/**
+ * @brief Inserts <item> at the rear of the buffer, waiting for a free slot.
+ *
+ * @param[in] sp   : buffer to insert into.
+ * @param[in] item : client connection to insert.
+ */
+void sbuf_insert(sbuf_t *sp, const client_info *item);
+
+/**
+ * @brief Inserts <item> at the rear of the buffer if a slot is free.
+ *
+ * @param[in] sp   : buffer to insert into.
+ * @param[in] item : client connection to insert.
+ *
+ * @return true if inserted, false if buffer full.
+ */
+bool sbuf_tryinsert(sbuf_t *sp, const client_info *item);
+
+/**
+ * @brief Removes the first item of the buffer, waiting for one if empty.
+ *
+ * @param[in]  sp   : buffer to remove from.
+ * @param[out] item : removed client connection.
+ */
+void sbuf_remove(sbuf_t *sp, client_info *item);
+
+#endif /* SBUF_H */
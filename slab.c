@@ -0,0 +1,478 @@
+/**
+ * @file slab.c
+ * @brief Slab allocator implementation for the tiny web proxy cache.
+ *
+ * The arena is one mapping divided into SLAB_PAGE_SIZE pages, each with a
+ * descriptor kept outside the arena. Key implementation details:
+ *     - Chunk size classes start at SLAB_MIN_CHUNK and grow by a factor of
+ *       1.25, up to half a page; a chunk page holds chunks of one class,
+ *       linked through their first word while free.
+ *     - Each class keeps a list of its chunk pages with free chunks; a page
+ *       whose last chunk is freed goes back to the free pages.
+ *     - Larger requests get a run of contiguous pages, allocated first-fit
+ *       from a list of free extents; freed runs coalesce with neighbouring
+ *       free extents, found through boundary tags (the first and last page
+ *       of every extent record its length).
+ *     - Allocated runs tag their first page as the head and their last as
+ *       the tail, so a free extent never mistakes them for free neighbours.
+ *     - Runs grow in place into a free extent right behind them, and shrink
+ *       in place by freeing their trailing pages.
+ *     - With a memory file backing the arena, allocations can be sent with
+ *       sendfile at their slab_offset; freed runs are punched out of the
+ *       file, since sockets may still reference their pages.
+ *     - One mutex per arena; blocks may be freed from any thread.
+ *
+ * Descriptions of individual functions, data structures, and global variables
+ * are provided in their respective leading comments.
+ *
+ * @author Iltikin Wayet
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // memfd_create, fallocate
+#endif
+
+#include "slab.h"
+#include "cache.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Page descriptor kinds.
+#define SLAB_FREE 0   // Part of a free extent
+#define SLAB_CHUNKS 1 // Chunk page of one size class
+#define SLAB_HEAD 2   // First page of an allocated run
+#define SLAB_TAIL 3   // Last page of an allocated run of several pages
+
+// ---------- HELPER PROTOTYPES ------------ //
+static size_t page_index(const slab_t *sp, const slab_page *page);
+static char *page_addr(const slab_t *sp, const slab_page *page);
+static void list_push(slab_page **list, slab_page *page);
+static void list_remove(slab_page **list, slab_page *page);
+static slab_page *run_alloc(slab_t *sp, size_t n);
+static void run_free(slab_t *sp, size_t start, size_t n);
+static void run_punch(slab_t *sp, size_t start, size_t n);
+static void extent_add(slab_t *sp, size_t start, size_t n);
+static char *chunk_alloc(slab_t *sp, size_t cls);
+static void chunk_free(slab_t *sp, slab_page *page, char *chunk);
+
+// ---------- FUNCTION ROUTINES ------------ //
+
+/**
+ * @brief Maps an arena of <size> bytes, rounded down to whole pages.
+ *     Memory file backing falls back to anonymous memory if unavailable.
+ *     Whole arena starts as a single free extent.
+ *
+ * @param[in] sp    : arena to initialize.
+ * @param[in] size  : arena size in bytes, at least one page.
+ * @param[in] memfd : whether to back the arena with a memory file.
+ */
+void slab_init(slab_t *sp, size_t size, bool memfd) {
+    sp->npages = size / SLAB_PAGE_SIZE;
+    if (sp->npages < 1)
+        sp->npages = 1;
+    sp->size = sp->npages * SLAB_PAGE_SIZE;
+
+    sp->memfd = -1;
+    sp->base = MAP_FAILED;
+    if (memfd && (sp->memfd = memfd_create("cache_slab", MFD_CLOEXEC)) >= 0) {
+        if (ftruncate(sp->memfd, sp->size) == 0)
+            sp->base = mmap(NULL, sp->size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, sp->memfd, 0);
+        if (sp->base == MAP_FAILED) {
+            close(sp->memfd);
+            sp->memfd = -1;
+        }
+    }
+    // Pages are touched only when handed out; large arenas commit lazily.
+    if (sp->base == MAP_FAILED)
+        sp->base = mmap(NULL, sp->size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (sp->base == MAP_FAILED) {
+        fprintf(stderr, "Memory error.\n");
+        exit(1);
+    }
+
+    // Size classes grow by 1.25, rounded to keep chunks 8-byte aligned.
+    sp->nclasses = 0;
+    for (size_t c = SLAB_MIN_CHUNK;
+         c <= SLAB_PAGE_SIZE / 2 && sp->nclasses < SLAB_CLASSES;
+         c = (c * 5 / 4 + 7) & ~(size_t)7) {
+        sp->partial[sp->nclasses] = NULL;
+        sp->classes[sp->nclasses++] = c;
+    }
+
+    sp->pages = malloc_w(sizeof(slab_page) * sp->npages);
+    for (size_t i = 0; i < sp->npages; i++) {
+        sp->pages[i].kind = SLAB_FREE;
+        sp->pages[i].next = NULL;
+        sp->pages[i].prev = NULL;
+    }
+    sp->extents = NULL;
+    extent_add(sp, 0, sp->npages);
+    sp->used = 0;
+    pthread_mutex_init(&sp->mutex, NULL);
+}
+
+/**
+ * @brief Unmaps an arena; every allocation is gone.
+ *
+ * @param[in] sp : arena to free.
+ */
+void slab_deinit(slab_t *sp) {
+    pthread_mutex_destroy(&sp->mutex);
+    munmap(sp->base, sp->size);
+    if (sp->memfd >= 0)
+        close(sp->memfd);
+    free(sp->pages);
+}
+
+/**
+ * @brief Allocates <size> bytes from an arena.
+ *     Sizes up to the largest class get a chunk of the smallest class that
+ *     fits; larger sizes a run of whole pages.
+ *
+ * @param[in]  sp   : arena to allocate from.
+ * @param[in]  size : bytes needed.
+ * @param[out] got  : bytes actually handed out, at least <size>.
+ *
+ * @return allocated memory, NULL if the arena has no room.
+ */
+void *slab_alloc(slab_t *sp, size_t size, size_t *got) {
+    char *p = NULL;
+    pthread_mutex_lock(&sp->mutex);
+    size_t cls = 0;
+    while (cls < sp->nclasses && sp->classes[cls] < size)
+        cls++;
+    if (cls < sp->nclasses) {
+        if ((p = chunk_alloc(sp, cls)) != NULL)
+            *got = sp->classes[cls];
+    } else {
+        size_t n = (size + SLAB_PAGE_SIZE - 1) / SLAB_PAGE_SIZE;
+        slab_page *page = run_alloc(sp, n);
+        if (page != NULL) {
+            p = page_addr(sp, page);
+            *got = n * SLAB_PAGE_SIZE;
+        }
+    }
+    if (p != NULL)
+        sp->used += *got;
+    pthread_mutex_unlock(&sp->mutex);
+    return p;
+}
+
+/**
+ * @brief Grows an allocation to <size> bytes in place, if the memory right
+ *     behind it is free.
+ *     A page run takes pages from the free extent following it.
+ *
+ * @param[in] sp   : arena <p> came from.
+ * @param[in] p    : allocation to grow.
+ * @param[in] size : bytes needed.
+ *
+ * @return bytes the allocation now holds, 0 if it could not grow.
+ */
+size_t slab_extend(slab_t *sp, void *p, size_t size) {
+    pthread_mutex_lock(&sp->mutex);
+    size_t start = ((char *)p - sp->base) / SLAB_PAGE_SIZE;
+    slab_page *page = &sp->pages[start];
+    size_t held = 0;
+    if (page->kind == SLAB_CHUNKS) {
+        if (size <= sp->classes[page->cls])
+            held = sp->classes[page->cls];
+        pthread_mutex_unlock(&sp->mutex);
+        return held;
+    }
+
+    size_t n = (size + SLAB_PAGE_SIZE - 1) / SLAB_PAGE_SIZE;
+    size_t end = start + page->run;
+    if (n > page->run && end < sp->npages &&
+        sp->pages[end].kind == SLAB_FREE &&
+        sp->pages[end].run >= n - page->run) {
+        slab_page *ext = &sp->pages[end];
+        size_t left = ext->run - (n - page->run);
+        list_remove(&sp->extents, ext);
+        if (left > 0)
+            extent_add(sp, start + n, left);
+        sp->pages[start + n - 1].kind = SLAB_TAIL;
+        sp->used += (n - page->run) * SLAB_PAGE_SIZE;
+        page->run = n;
+    }
+    if (n <= page->run)
+        held = page->run * SLAB_PAGE_SIZE;
+    pthread_mutex_unlock(&sp->mutex);
+    return held;
+}
+
+/**
+ * @brief Returns trailing memory of an allocation to its arena, in place.
+ *     Only page runs shrink, by freeing their trailing pages.
+ *
+ * @param[in] sp   : arena <p> came from.
+ * @param[in] p    : allocation to shrink.
+ * @param[in] size : bytes still needed.
+ *
+ * @return bytes the allocation now holds.
+ */
+size_t slab_shrink(slab_t *sp, void *p, size_t size) {
+    pthread_mutex_lock(&sp->mutex);
+    size_t start = ((char *)p - sp->base) / SLAB_PAGE_SIZE;
+    slab_page *page = &sp->pages[start];
+    if (page->kind == SLAB_CHUNKS) {
+        size_t held = sp->classes[page->cls];
+        pthread_mutex_unlock(&sp->mutex);
+        return held;
+    }
+
+    size_t n = (size + SLAB_PAGE_SIZE - 1) / SLAB_PAGE_SIZE;
+    if (n < 1)
+        n = 1;
+    if (n < page->run) {
+        // Tag the new last page first, so the freed pages do not coalesce
+        // backwards into the run.
+        if (n > 1)
+            sp->pages[start + n - 1].kind = SLAB_TAIL;
+        run_punch(sp, start + n, page->run - n);
+        run_free(sp, start + n, page->run - n);
+        sp->used -= (page->run - n) * SLAB_PAGE_SIZE;
+        page->run = n;
+    }
+    size_t held = page->run * SLAB_PAGE_SIZE;
+    pthread_mutex_unlock(&sp->mutex);
+    return held;
+}
+
+/**
+ * @brief Frees an allocation back to its arena.
+ *
+ * @param[in] sp : arena <p> came from.
+ * @param[in] p  : allocation returned by slab_alloc.
+ */
+void slab_free(slab_t *sp, void *p) {
+    pthread_mutex_lock(&sp->mutex);
+    size_t start = ((char *)p - sp->base) / SLAB_PAGE_SIZE;
+    slab_page *page = &sp->pages[start];
+    if (page->kind == SLAB_CHUNKS) {
+        sp->used -= sp->classes[page->cls];
+        chunk_free(sp, page, p);
+    } else {
+        sp->used -= page->run * SLAB_PAGE_SIZE;
+        run_punch(sp, start, page->run);
+        run_free(sp, start, page->run);
+    }
+    pthread_mutex_unlock(&sp->mutex);
+}
+
+/**
+ * @brief Returns the largest allocation an empty arena can hand out.
+ *
+ * @param[in] sp : arena.
+ */
+size_t slab_max(const slab_t *sp) {
+    return sp->size;
+}
+
+/**
+ * @brief Returns the offset of <p> in the memory file of its arena.
+ *
+ * @param[in] sp : arena <p> came from.
+ * @param[in] p  : pointer into an allocation.
+ */
+off_t slab_offset(const slab_t *sp, const void *p) {
+    return (const char *)p - sp->base;
+}
+
+// ---------- HELPER ROUTINES ------------ //
+
+/**
+ * @brief Returns the index of <page> in the arena.
+ */
+static size_t page_index(const slab_t *sp, const slab_page *page) {
+    return page - sp->pages;
+}
+
+/**
+ * @brief Returns the memory of <page>.
+ */
+static char *page_addr(const slab_t *sp, const slab_page *page) {
+    return sp->base + page_index(sp, page) * SLAB_PAGE_SIZE;
+}
+
+/**
+ * @brief Pushes a page to the front of a doubly-linked page list.
+ *
+ * @param[in] list : list head.
+ * @param[in] page : page in no list.
+ */
+static void list_push(slab_page **list, slab_page *page) {
+    page->prev = NULL;
+    page->next = *list;
+    if (*list != NULL)
+        (*list)->prev = page;
+    *list = page;
+}
+
+/**
+ * @brief Removes a page from a doubly-linked page list.
+ *
+ * @param[in] list : list head.
+ * @param[in] page : page in <list>.
+ */
+static void list_remove(slab_page **list, slab_page *page) {
+    if (page->prev != NULL)
+        page->prev->next = page->next;
+    else
+        *list = page->next;
+    if (page->next != NULL)
+        page->next->prev = page->prev;
+    page->next = NULL;
+    page->prev = NULL;
+}
+
+/**
+ * @brief Allocates a run of <n> contiguous pages, first-fit.
+ *     The rest of a larger extent stays free.
+ *
+ * @param[in] sp : arena, mutex held.
+ * @param[in] n  : number of pages, at least 1.
+ *
+ * @return head page of the run, NULL if no extent is large enough.
+ */
+static slab_page *run_alloc(slab_t *sp, size_t n) {
+    slab_page *ext = sp->extents;
+    while (ext != NULL && ext->run < n)
+        ext = ext->next;
+    if (ext == NULL)
+        return NULL;
+
+    size_t start = page_index(sp, ext);
+    size_t left = ext->run - n;
+    list_remove(&sp->extents, ext);
+    if (left > 0)
+        extent_add(sp, start + n, left);
+
+    ext->kind = SLAB_HEAD;
+    ext->run = n;
+    if (n > 1)
+        sp->pages[start + n - 1].kind = SLAB_TAIL;
+    return ext;
+}
+
+/**
+ * @brief Frees a run of pages, coalescing it with free neighbours.
+ *
+ * @param[in] sp    : arena, mutex held.
+ * @param[in] start : index of the first page.
+ * @param[in] n     : number of pages.
+ */
+static void run_free(slab_t *sp, size_t start, size_t n) {
+    // The page before is the last page of its extent, if free.
+    if (start > 0 && sp->pages[start - 1].kind == SLAB_FREE) {
+        size_t prev = start - sp->pages[start - 1].run;
+        list_remove(&sp->extents, &sp->pages[prev]);
+        n += start - prev;
+        start = prev;
+    }
+    // The page after is the first page of its extent, if free.
+    if (start + n < sp->npages && sp->pages[start + n].kind == SLAB_FREE) {
+        slab_page *next = &sp->pages[start + n];
+        n += next->run;
+        list_remove(&sp->extents, next);
+    }
+    extent_add(sp, start, n);
+}
+
+/**
+ * @brief Drops the memory file pages of a run being freed.
+ *     sendfile queues references to file pages rather than copies, so text
+ *     of a freed block may still be in flight to a client; reusing its pages
+ *     in place would change what that client receives. Punched pages stay
+ *     with the sockets holding them, and the run faults in fresh pages when
+ *     reused.
+ *
+ * @param[in] sp    : arena, mutex held.
+ * @param[in] start : index of the first page.
+ * @param[in] n     : number of pages.
+ */
+static void run_punch(slab_t *sp, size_t start, size_t n) {
+    if (sp->memfd >= 0)
+        fallocate(sp->memfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  (off_t)start * SLAB_PAGE_SIZE, (off_t)n * SLAB_PAGE_SIZE);
+}
+
+/**
+ * @brief Adds a free extent; tags its first and last page with its length.
+ *
+ * @param[in] sp    : arena, mutex held.
+ * @param[in] start : index of the first page.
+ * @param[in] n     : number of pages, at least 1.
+ */
+static void extent_add(slab_t *sp, size_t start, size_t n) {
+    slab_page *first = &sp->pages[start];
+    slab_page *last = &sp->pages[start + n - 1];
+    first->kind = SLAB_FREE;
+    first->run = n;
+    last->kind = SLAB_FREE;
+    last->run = n;
+    list_push(&sp->extents, first);
+}
+
+/**
+ * @brief Allocates a chunk of class <cls>.
+ *     Takes a fresh page and carves it into chunks when no page of the
+ *     class has a free chunk.
+ *
+ * @param[in] sp  : arena, mutex held.
+ * @param[in] cls : size class.
+ *
+ * @return chunk, NULL if the arena has no free page.
+ */
+static char *chunk_alloc(slab_t *sp, size_t cls) {
+    slab_page *page = sp->partial[cls];
+    if (page == NULL) {
+        if ((page = run_alloc(sp, 1)) == NULL)
+            return NULL;
+        page->kind = SLAB_CHUNKS;
+        page->cls = cls;
+        page->used = 0;
+        page->free = NULL;
+        size_t size = sp->classes[cls];
+        char *addr = page_addr(sp, page);
+        for (size_t off = SLAB_PAGE_SIZE / size * size; off >= size;) {
+            off -= size;
+            *(char **)(addr + off) = page->free;
+            page->free = addr + off;
+        }
+        list_push(&sp->partial[cls], page);
+    }
+
+    char *chunk = page->free;
+    page->free = *(char **)chunk;
+    page->used++;
+    if (page->free == NULL)
+        list_remove(&sp->partial[cls], page);
+    return chunk;
+}
+
+/**
+ * @brief Frees a chunk; its page is freed with its last chunk.
+ *
+ * @param[in] sp    : arena, mutex held.
+ * @param[in] page  : chunk page holding <chunk>.
+ * @param[in] chunk : chunk to free.
+ */
+static void chunk_free(slab_t *sp, slab_page *page, char *chunk) {
+    if (page->free == NULL)
+        list_push(&sp->partial[page->cls], page);
+    *(char **)chunk = page->free;
+    page->free = chunk;
+    if (--page->used == 0) {
+        list_remove(&sp->partial[page->cls], page);
+        run_free(sp, page_index(sp, page), 1);
+    }
+}
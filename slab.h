@@ -0,0 +1,140 @@
+/**
+ * @file slab.h
+ * @brief Slab allocator for the tiny web proxy cache.
+ *
+ * A fixed arena of memory, mapped once at startup, from which cache blocks
+ * are carved (in the spirit of memcached's slab allocator). Small requests
+ * come from chunks of per-size-class pages; requests larger than the biggest
+ * class get a run of contiguous pages. The arena never grows, so its size is
+ * a hard bound on the memory held by cached objects, allocator overhead
+ * included; freed memory is recycled without going back to malloc.
+ *
+ * slab.c has more detailed implementation-related comments.
+ *
+ * @author Iltikin Wayet
+ */
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Size of an arena page; unit of page runs and of chunk pages.
+#define SLAB_PAGE_SIZE 4096
+
+// Smallest chunk size class; classes grow by a factor of 1.25.
+#define SLAB_MIN_CHUNK 64
+
+// Maximum number of chunk size classes.
+#define SLAB_CLASSES 32
+
+/**
+ * @brief Arena page descriptor.
+ */
+typedef struct slab_page {
+    int kind;               // Free, chunk page, or head/tail of a page run
+    int cls;                // Size class of a chunk page
+    size_t run;             // Pages in the run or free extent starting here
+    size_t used;            // Chunks of a chunk page in use
+    char *free;             // Free chunks of a chunk page
+    struct slab_page *next; // Next page in free extent or class list
+    struct slab_page *prev; // Previous page in free extent or class list
+} slab_page;
+
+/**
+ * @brief Slab arena.
+ */
+typedef struct {
+    char *base;                       // Arena memory
+    size_t size;                      // Arena size in bytes
+    int memfd;                        // Memory file of arena, -1 if none
+    size_t npages;                    // Number of pages
+    slab_page *pages;                 // Page descriptors
+    size_t nclasses;                  // Number of chunk size classes
+    size_t classes[SLAB_CLASSES];     // Chunk size of each class
+    slab_page *partial[SLAB_CLASSES]; // Chunk pages with free chunks
+    slab_page *extents;               // Free page extents, first-fit
+    size_t used;                      // Bytes handed out
+    pthread_mutex_t mutex;            // Protects the fields above
+} slab_t;
+
+/**
+ * @brief Maps an arena of <size> bytes, rounded down to whole pages.
+ *
+ * @param[in] sp    : arena to initialize.
+ * @param[in] size  : arena size in bytes, at least one page.
+ * @param[in] memfd : whether to back the arena with a memory file, so
+ *                    allocations can be sent with sendfile.
+ */
+void slab_init(slab_t *sp, size_t size, bool memfd);
+
+/**
+ * @brief Unmaps an arena; every allocation is gone.
+ *
+ * @param[in] sp : arena to free.
+ */
+void slab_deinit(slab_t *sp);
+
+/**
+ * @brief Allocates <size> bytes from an arena.
+ *
+ * @param[in]  sp   : arena to allocate from.
+ * @param[in]  size : bytes needed.
+ * @param[out] got  : bytes actually handed out, at least <size>.
+ *
+ * @return allocated memory, NULL if the arena has no room.
+ */
+void *slab_alloc(slab_t *sp, size_t size, size_t *got);
+
+/**
+ * @brief Grows an allocation to <size> bytes in place, if the memory right
+ *     behind it is free.
+ *     Only page runs grow.
+ *
+ * @param[in] sp   : arena <p> came from.
+ * @param[in] p    : allocation to grow.
+ * @param[in] size : bytes needed.
+ *
+ * @return bytes the allocation now holds, 0 if it could not grow.
+ */
+size_t slab_extend(slab_t *sp, void *p, size_t size);
+
+/**
+ * @brief Returns trailing memory of an allocation to its arena, in place.
+ *     Only page runs shrink; chunks keep their size.
+ *
+ * @param[in] sp   : arena <p> came from.
+ * @param[in] p    : allocation to shrink.
+ * @param[in] size : bytes still needed.
+ *
+ * @return bytes the allocation now holds.
+ */
+size_t slab_shrink(slab_t *sp, void *p, size_t size);
+
+/**
+ * @brief Frees an allocation back to its arena.
+ *
+ * @param[in] sp : arena <p> came from.
+ * @param[in] p  : allocation returned by slab_alloc.
+ */
+void slab_free(slab_t *sp, void *p);
+
+/**
+ * @brief Returns the largest allocation an empty arena can hand out.
+ *
+ * @param[in] sp : arena.
+ */
+size_t slab_max(const slab_t *sp);
+
+/**
+ * @brief Returns the offset of <p> in the memory file of its arena.
+ *
+ * @param[in] sp : arena <p> came from.
+ * @param[in] p  : pointer into an allocation.
+ */
+off_t slab_offset(const slab_t *sp, const void *p);
+
+#endif /* SLAB_H */
@@ -0,0 +1,178 @@
+/**
+ * @file splice.c
+ * @brief Zero-copy relaying of response bodies for a tiny web proxy.
+ *
+ * Bytes go from the source socket into a pipe and from the pipe to the
+ * destination socket; the kernel moves page references, not bytes, so the
+ * body is never copied to user space. Key implementation details:
+ *     - A pipe holds at most its capacity, so one splice in is followed by
+ *       splices out until the pipe is empty; syscalls per byte are bounded
+ *       by the capacity instead of a read buffer.
+ *     - Thread pipes, used by blocking relays, are opened on first use and
+ *       grown to SPLICE_PIPE_SIZE where the limits allow; they stay open
+ *       for the life of the thread. A relay failing with bytes still in the
+ *       pipe closes it, so the next relay starts from an empty one.
+ *     - Pipes of event loop connections keep the default capacity, since
+ *       unprivileged pipe capacity is capped per user and there may be many.
+ *     - The kernel treats a splice as non-blocking when either end is, so
+ *       thread pipes are blocking and connection pipes are not.
+ *     - Output is never marked SPLICE_F_MORE: the socket would hold back a
+ *       partial segment the client is waiting on.
+ *
+ * Descriptions of individual functions, data structures, and global variables
+ * are provided in their respective leading comments.
+ *
+ * @author Iltikin Wayet
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // splice, pipe2, F_SETPIPE_SZ
+#endif
+
+#include "splice.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+// Capacity requested for thread pipes.
+#define SPLICE_PIPE_SIZE (256 * 1024)
+
+// Whether bodies not cached are spliced.
+static bool enabled = false;
+
+// Pipe of the calling thread for blocking relays.
+static __thread spipe self = {.fds = {-1, -1}, .size = 0, .held = 0};
+
+// ---------- FUNCTION ROUTINES ------------ //
+
+/**
+ * @brief Enables or disables splicing for the process; off until called.
+ *
+ * @param[in] on : whether bodies not cached are spliced.
+ */
+void splice_init(bool on) {
+    enabled = on;
+}
+
+/**
+ * @brief Returns whether bodies not cached are spliced.
+ */
+bool splice_enabled(void) {
+    return enabled;
+}
+
+/**
+ * @brief Relays up to <n> bytes from <from> to <to>, blocking, through the
+ *     pipe of the calling thread.
+ *     Each pipe's worth is drained completely before the next is read.
+ *
+ * @param[in] from : socket to read from.
+ * @param[in] to   : socket to write to.
+ * @param[in] n    : bytes to relay, or SPLICE_EOF.
+ *
+ * @return bytes relayed, fewer than <n> only at EOF; -1 on error (errno
+ *     set) or if the pipe cannot be opened.
+ */
+ssize_t splice_relay(int from, int to, size_t n) {
+    if (self.fds[0] < 0) {
+        if (!spipe_open(&self, false))
+            return -1;
+        fcntl(self.fds[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+        int size = fcntl(self.fds[1], F_GETPIPE_SZ);
+        if (size > 0)
+            self.size = size;
+    }
+
+    size_t moved = 0;
+    while (moved < n) {
+        size_t want = (n - moved < self.size) ? n - moved : self.size;
+        ssize_t in = spipe_fill(&self, from, want);
+        if (in < 0 && errno == EINTR)
+            continue;
+        if (in <= 0)
+            return (in == 0) ? (ssize_t)moved : -1;
+        while (self.held > 0) {
+            if (spipe_drain(&self, to) < 0 && errno != EINTR) {
+                spipe_close(&self);
+                return -1;
+            }
+        }
+        moved += in;
+    }
+    return moved;
+}
+
+/**
+ * @brief Opens a pipe for splicing, empty.
+ *
+ * @param[out] sp       : pipe to open.
+ * @param[in]  nonblock : whether splices never block; otherwise they
+ *                        block on the socket spliced from or to.
+ *
+ * @return true if opened, false if out of descriptors.
+ */
+bool spipe_open(spipe *sp, bool nonblock) {
+    if (pipe2(sp->fds, O_CLOEXEC | (nonblock ? O_NONBLOCK : 0)) < 0) {
+        sp->fds[0] = sp->fds[1] = -1;
+        return false;
+    }
+    int size = fcntl(sp->fds[1], F_GETPIPE_SZ);
+    sp->size = (size > 0) ? (size_t)size : 4096;
+    sp->held = 0;
+    return true;
+}
+
+/**
+ * @brief Closes a pipe, dropping the bytes it holds; no-op if not open.
+ *
+ * @param[in,out] sp : pipe to close.
+ */
+void spipe_close(spipe *sp) {
+    if (sp->fds[0] < 0)
+        return;
+    close(sp->fds[0]);
+    close(sp->fds[1]);
+    sp->fds[0] = sp->fds[1] = -1;
+    sp->held = 0;
+}
+
+/**
+ * @brief Moves bytes from socket <fd> into a pipe with one splice.
+ *
+ * @param[in,out] sp : open pipe.
+ * @param[in]     fd : socket to read from.
+ * @param[in]     n  : most bytes to move, greater than 0.
+ *
+ * @return bytes moved, 0 on EOF, -1 on error (errno set, EAGAIN if <fd>
+ *     has nothing to read or the pipe is full).
+ */
+ssize_t spipe_fill(spipe *sp, int fd, size_t n) {
+    size_t room = sp->size - sp->held;
+    if (room == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    ssize_t in = splice(fd, NULL, sp->fds[1], NULL, (n < room) ? n : room,
+                        SPLICE_F_MOVE);
+    if (in > 0)
+        sp->held += in;
+    return in;
+}
+
+/**
+ * @brief Moves bytes a pipe holds out to socket <fd> with one splice.
+ *
+ * @param[in,out] sp : open pipe holding bytes.
+ * @param[in]     fd : socket to write to.
+ *
+ * @return bytes moved, -1 on error (errno set, EAGAIN if <fd> would
+ *     block).
+ */
+ssize_t spipe_drain(spipe *sp, int fd) {
+    ssize_t out = splice(sp->fds[0], NULL, fd, NULL, sp->held, SPLICE_F_MOVE);
+    if (out > 0)
+        sp->held -= out;
+    return out;
+}
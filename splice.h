@@ -0,0 +1,106 @@
+/**
+ * @file splice.h
+ * @brief Zero-copy relaying of response bodies for a tiny web proxy.
+ *
+ * Moves bytes from one socket to another through a pipe with splice, so
+ * they never reach user space. Used, when enabled, for response bodies
+ * that are neither cached nor shared with other clients, since nothing
+ * needs to look at them. Blocking callers relay through a pipe of their
+ * thread; event loops keep a pipe per connection, as unsent bytes stay in
+ * it while the client is not writable.
+ *
+ * Descriptions of individual functions and data structures are provided in
+ * their respective leading comments.
+ *
+ * splice.c has more detailed implementation-related comments.
+ *
+ * @author Iltikin Wayet
+ */
+
+#ifndef SPLICE_H
+#define SPLICE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Byte count meaning "until the source reaches EOF".
+#define SPLICE_EOF SIZE_MAX
+
+/**
+ * @brief Pipe between two sockets, with the bytes it holds.
+ */
+typedef struct {
+    int fds[2];  // Read and write ends, -1 if not open
+    size_t size; // Capacity of the pipe in bytes
+    size_t held; // Bytes spliced in and not yet out
+} spipe;
+
+/**
+ * @brief Enables or disables splicing for the process; off until called.
+ *
+ * @param[in] on : whether bodies not cached are spliced.
+ */
+void splice_init(bool on);
+
+/**
+ * @brief Returns whether bodies not cached are spliced.
+ */
+bool splice_enabled(void);
+
+/**
+ * @brief Relays up to <n> bytes from <from> to <to>, blocking, through the
+ *     pipe of the calling thread.
+ *
+ * @param[in] from : socket to read from.
+ * @param[in] to   : socket to write to.
+ * @param[in] n    : bytes to relay, or SPLICE_EOF.
+ *
+ * @return bytes relayed, fewer than <n> only at EOF; -1 on error (errno
+ *     set) or if the pipe cannot be opened.
+ */
+ssize_t splice_relay(int from, int to, size_t n);
+
+/**
+ * @brief Opens a pipe for splicing, empty.
+ *
+ * @param[out] sp       : pipe to open.
+ * @param[in]  nonblock : whether splices never block; otherwise they
+ *                        block on the socket spliced from or to.
+ *
+ * @return true if opened, false if out of descriptors.
+ */
+bool spipe_open(spipe *sp, bool nonblock);
+
+/**
+ * @brief Closes a pipe, dropping the bytes it holds; no-op if not open.
+ *
+ * @param[in,out] sp : pipe to close.
+ */
+void spipe_close(spipe *sp);
+
+/**
+ * @brief Moves bytes from socket <fd> into a pipe with one splice.
+ *
+ * @param[in,out] sp : open pipe.
+ * @param[in]     fd : socket to read from.
+ * @param[in]     n  : most bytes to move, greater than 0.
+ *
+ * @return bytes moved, 0 on EOF, -1 on error (errno set, EAGAIN if <fd>
+ *     has nothing to read or the pipe is full).
+ */
+ssize_t spipe_fill(spipe *sp, int fd, size_t n);
+
+/**
+ * @brief Moves bytes a pipe holds out to socket <fd> with one splice.
+ *
+ * @param[in,out] sp : open pipe holding bytes.
+ * @param[in]     fd : socket to write to.
+ *
+ * @return bytes moved, -1 on error (errno set, EAGAIN if <fd> would
+ *     block).
+ */
+ssize_t spipe_drain(spipe *sp, int fd);
+
+#endif /* SPLICE_H */
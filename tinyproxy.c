@@ -11,15 +11,49 @@
  * connections, and serves those connections via the serve function.
  *
  * High-level overview:
- *     1. Client connection request accepted; served in peer thread.
+ *     1. Client connection request accepted; queued for a worker thread.
  *     2. Request line parsed.
  *     3. If request response exists in cache, served directly to client.
  *     4. If not, connect to server, write response, serve back to client.
  *     5. Server response then saved in the cache.
  *
- * I use threads to allow for the proxy to serve clients concurrently.
- * Additionally, I cache server responses in a LRU cache implemented with a
- * doubly-linked list. More cache details can be found in cache.c and cache.h
+ * I use a fixed pool of worker threads, fed through a bounded queue of
+ * accepted connections, to allow for the proxy to serve clients concurrently.
+ * When the queue is full, clients get a 503 (or, with -B, accepting pauses).
+ * Alternatively, with -E, connections are served by non-blocking epoll event
+ * loops, one per core; see eventloop.c. With -U, the same loops submit their
+ * socket operations to io_uring instead (see uring.c), falling back to epoll
+ * where the kernel lacks it. With -R, every acceptor thread or
+ * event loop gets its own SO_REUSEPORT listening socket, so the kernel
+ * spreads new connections across cores.
+ * Cache misses from HTTP/1.1 clients reuse pooled keep-alive connections to
+ * the server (see upstream.c); responses are then framed by Content-Length
+ * or chunked encoding instead of by the server closing the connection, and
+ * chunked ones are cached as their chunk data, framed by a Content-Length.
+ * Client connections are persistent too: HTTP/1.1 clients may send further
+ * (pipelined) requests on the same connection, answered in order, until they
+ * close it or stay idle for client_timeout seconds.
+ * Concurrent misses on one URI share a single server fetch (see fetch.c).
+ * CONNECT requests become tunnels, relayed both ways by a few pump threads
+ * instead of the worker or event loop that connected them (see tunnel.c).
+ * Response bodies are read in pieces growing up to RELAY_READ_MAX; with
+ * -r splice, bodies neither cached nor shared go from server to client
+ * through a pipe instead, never copied to user space (see splice.c).
+ * Requests for METRICS_PATH sent straight to the proxy get counters and
+ * latency histograms kept per thread, summed on read (see metrics.c).
+ * Accepted connections are logged, numerically and optionally sampled, by a
+ * logger thread draining per-thread rings, off the accept path (see
+ * accesslog.c). With -T, answered requests are traced to a binary file the
+ * same way, for replay against the cache offline (see trace.c). With -z,
+ * compressible responses are cached gzipped and sent as stored to clients
+ * taking gzip, inflated to others (see compress.c).
+ * Under overload, -A and -W shed connections with a fast 503 and
+ * Retry-After, -L rate limits each client IP with a 429, and -O caps the
+ * server fetches in flight per origin (see admit.c).
+ * Additionally, I cache server responses in a cache split into shards by
+ * URI hash, each indexed by a hash table, with hits taking no lock and
+ * blocks evicted by CLOCK or, with -e s3fifo, S3-FIFO. More cache details
+ * can be found in cache.c and cache.h
  *
  * Descriptions of individual functions, data structures, and global variables
  * are provided in their respective leading comments.
@@ -27,9 +61,28 @@
  * @author Iltikin Wayet
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // pthread_setaffinity_np
+#endif
+
+#include "accesslog.h"
+#include "admit.h"
 #include "cache.h"
+#include "compress.h"
 #include "csapp.h"
-#include "http_parser.h"
+#include "dns.h"
+#include "eventloop.h"
+#include "fetch.h"
+#include "metrics.h"
+#include "proxy.h"
+#include "request.h"
+#include "response.h"
+#include "sbuf.h"
+#include "splice.h"
+#include "trace.h"
+#include "tunnel.h"
+#include "upstream.h"
+#include "uring.h"
 
 #include <assert.h>
 #include <ctype.h>
@@ -47,59 +100,205 @@
 #include <pthread.h>
 #include <signal.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/types.h>
 
-#define HOSTLEN 256
-#define SERVLEN 8
+// Default number of worker threads and accept queue slots.
+#define WORKERS 32
+#define QUEUE_DEPTH 256
+// Default seconds an idle persistent client connection is kept open.
+#define CLIENT_TIMEOUT 5
+// Size of the first and the largest response body read; reads double in
+// size while they come back full.
+#define RELAY_READ_MIN (16 * 1024)
+#define RELAY_READ_MAX (256 * 1024)
 
-// Typedef for convenience
-typedef struct sockaddr SA;
+// Queue of accepted connections waiting for a worker.
+static sbuf_t sbuf;
+// Whether acceptors wait for a free queue slot instead of answering 503.
+static bool block = false;
+// Seconds a persistent client may stay idle, 0 if clients are not kept.
+static long client_timeout = CLIENT_TIMEOUT;
+// Cache snapshot saved on SIGTERM or SIGINT, NULL if none.
+static const char *snapshot = NULL;
 
-// String to use for the User-Agent header.
-static const char *header_user_agent = "Mozilla/5.0"
-                                       " (X11; Linux x86_64; rv:3.10.0)"
-                                       " Gecko/20230411 Firefox/63.0.1";
+/**
+ * @brief Data structure with acceptor thread information.
+ */
+typedef struct {
+    int listenfd; // Listening socket descriptor to accept on
+    int cpu;      // CPU to pin the thread to, -1 if unpinned
+} acceptor_info;
+
+/**
+ * @brief Data structure with server response relay state.
+ *     Output to the client is buffered, so that small pieces such as the
+ *     response head and chunk sizes go out together.
+ */
+typedef struct {
+    int connfd;             // Client connection file descriptor
+    bool persist;           // Whether the client may keep the connection
+    fetch *fetch;           // Fetch led by this relay, NULL if none
+    bool decided;           // Whether fetch_share was called on fetch
+    bool shared;            // Whether followers stream the cache input
+    bool dead;              // Whether writing to the client failed
+    char buf[MAXBUF];       // Output not yet written to client
+    size_t buf_len;         // Length of output in buf
+    bool flushed;           // Whether any output was written to client
+    bool framed;            // Whether the body ends without server EOF
+    bool chunked;           // Whether chunk framing is kept off cache input
+    ssize_t content_length; // Content-Length of response, -1 if absent
+    cfill *fill;            // Cache fill of the response, NULL if uncached
+    cfresh fresh;           // Freshness and validators of the cache input
+    bool storable;          // Whether the response head allows caching
+    cblock *stale;          // Cached copy being revalidated, NULL if none
+    bool revalidated;       // Whether the server confirmed the cached copy
+    size_t head_len;        // Length of cache input before its empty line
+    size_t input_len;       // Total cache input length
+    bool splice;            // Whether the body goes through a pipe
+    size_t read_size;       // Size of the next body read
+    rio_t *rio;             // Server rio
+    char *chunk;            // Response body buffer, RELAY_READ_MAX bytes
+    mtimer *timer;          // Timings of the request relayed
+} relay_info;
 
 /**
- * @brief Data structure with client connection information.
+ * @brief Data structure with the state a worker serves connections with.
+ *     Allocated once per worker and never freed; every connection and
+ *     request the worker serves resets the parts it uses, so serving a
+ *     request allocates nothing.
  */
 typedef struct {
-    struct sockaddr_in addr; // Socket address
-    socklen_t addrlen;       // Socket address length
-    int connfd;              // Client connection file descriptor
-    char host[HOSTLEN];      // Client host
-    char serv[SERVLEN];      // Client service (port)
-} client_info;
+    client_info client;         // Client connection being served
+    rio_t rio;                  // Client rio, reset per connection
+    request_parser parser;      // Parser of the request head
+    request_info request;       // Request being served
+    char header[MAXBUF];        // Request formatted for the server
+    relay_info relay;           // Relay state of the response
+    rio_t rio_server;           // Server rio, reset per server connection
+    char chunk[RELAY_READ_MAX]; // Response body buffer
+    cplain plain;               // Buffer compressed hits are inflated into
+    mtimer timer;               // Timings of the request being served
+} worker_ctx;
 
 /**
- * @brief Data structure with client request information.
+ * @brief Name of a request header the proxy replaces or drops.
  */
 typedef struct {
-    const char *host;   // A network host, e.g. cs.cmu.edu
-    const char *port;   // The port to connect on, by default 80
-    const char *path;   // The path to find a resource, e.g. index.html
-    const char *method; // HTTP request method, e.g. GET or POST
-    const char *uri;    // Entire universal resource identifier
-} request_info;
+    const char *name; // Field name
+    size_t len;       // Length of name
+} header_name;
+
+// String to use for the User-Agent header.
+#define HEADER_USER_AGENT                                                      \
+    "Mozilla/5.0 (X11; Linux x86_64; rv:3.10.0) Gecko/20230411 Firefox/63.0.1"
+
+// Header lines following Host, towards a pooled HTTP/1.1 server connection
+// or a one-off one; formatted at compile time.
+static const char header_keepalive[] = "User-Agent: " HEADER_USER_AGENT "\r\n"
+                                       "Connection: keep-alive\r\n";
+static const char header_close[] = "User-Agent: " HEADER_USER_AGENT "\r\n"
+                                   "Connection: close\r\n"
+                                   "Proxy-Connection: close\r\n";
+
+// Client request headers not forwarded as they are.
+#define HEADER_NAME(s) {s, sizeof(s) - 1}
+static const header_name header_replaced[] = {
+    HEADER_NAME("Host"),       HEADER_NAME("User-Agent"),
+    HEADER_NAME("Connection"), HEADER_NAME("Proxy-Connection"),
+    HEADER_NAME("Keep-Alive"),
+};
+// Client request header dropped from cacheable requests with -z.
+static const header_name header_encoding = HEADER_NAME("Accept-Encoding");
 
 // ---------- FUNCTION PROTOTYPES ---------- //
-void *thread(void *vargp);
-static void serve(client_info *client);
-static void confirm_connection(client_info *client);
-static int parse_request(client_info *client, request_info *request,
-                         parser_t *parser);
-static int write_header(int fd_server, client_info *client,
-                        request_info *request, parser_t *parser);
-static void clienterror(int fd, const char *errnum, const char *shortmsg,
-                        const char *longmsg);
+static void usage(const char *prog);
+static size_t parse_size(const char *arg, const char *prog);
+void *acceptor(void *vargp);
+void *worker(void *vargp);
+void *reporter(void *vargp);
+static void serve(worker_ctx *ctx);
+static bool serve_request(worker_ctx *ctx, bool persist);
+static bool serve_hit(worker_ctx *ctx, cblock *block, dentry *entry);
+static bool serve_recheck(worker_ctx *ctx);
+static void serve_tunnel(client_info *client, request_info *request,
+                         rio_t *rio);
+static bool serve_miss(worker_ctx *ctx, bool persist, fetch *f);
+static bool client_persistent(request_info *request,
+                              const request_parser *parser);
+static int parse_request(client_info *client, rio_t *rio,
+                         request_info *request, request_parser *parser,
+                         mtimer *timer);
+static int forward(int fd_server, request_info *request, const char *header,
+                   size_t header_len, relay_info *relay);
+static void relay_validator(relay_info *relay, const char *line);
+static int relay_head(rio_t *rio, relay_info *relay, const char *method,
+                      response_info *response);
+static int relay_chunked(rio_t *rio, relay_info *relay);
+static int relay_copy(rio_t *rio, relay_info *relay, size_t n);
+static int relay_write(relay_info *relay, const void *data, size_t n);
+static void relay_save(relay_info *relay, const void *data, size_t n);
+static int relay_send(relay_info *relay, const void *data, size_t n);
+static int relay_flush(relay_info *relay);
+static int relay_lost(relay_info *relay);
+static void relay_publish(relay_info *relay);
+static void cache_response(relay_info *relay);
+static bool header_put(char *buf, size_t size, size_t *len, const char *data,
+                       size_t n);
+static bool header_is_replaced(const request_header *line);
 
 // ---------- FUNCTION ROUTINES ---------- //
 
 /**
  * @brief Continuously accepts and serves client connections.
- *     Each accepted connection served in peer thread.
+ *     Each accepted connection queued for a pre-spawned worker thread.
+ *     Full queue answered with 503, or waited on with -B.
  *     Robust; not all errors cause function termination.
  *
+ *     Options:
+ *         -s <shards>  : number of cache shards (default CACHE_SHARDS).
+ *         -Z           : copy cache hits instead of sending with sendfile.
+ *         -E           : serve with epoll event loops, one per core.
+ *         -U           : serve with io_uring event loops, one per core;
+ *                        epoll loops if io_uring is unavailable.
+ *         -t <workers> : number of worker threads (default WORKERS).
+ *         -q <depth>   : accept queue slots (default QUEUE_DEPTH).
+ *         -B           : stop accepting while the queue is full.
+ *         -R           : one SO_REUSEPORT listening socket per core, each
+ *                        with its own acceptor thread or event loop.
+ *         -P           : pin acceptor threads or event loops to CPUs.
+ *         -k <idle>    : idle server connections kept per origin (default
+ *                        UPSTREAM_MAX_IDLE), 0 disables keep-alive.
+ *         -K <seconds> : idle timeout of persistent client connections
+ *                        (default CLIENT_TIMEOUT), 0 closes after each
+ *                        response.
+ *         -e <policy>  : cache eviction policy, clock (default) or s3fifo.
+ *         -c <size>    : cache memory (default MAX_CACHE_SIZE); sizes take
+ *                        a K, M, or G suffix.
+ *         -o <size>    : largest response cached (default MAX_OBJECT_SIZE).
+ *         -D <path>    : disk tier log file for blocks evicted from memory.
+ *         -d <size>    : disk tier size (default CACHE_DISK_SIZE).
+ *         -p           : promote disk tier hits back into memory.
+ *         -S <path>    : cache snapshot, mapped at startup and saved on
+ *                        SIGTERM or SIGINT.
+ *         -l <sample>  : log one accepted connection in <sample> (default
+ *                        ACCESSLOG_SAMPLE), 0 turns the access log off.
+ *         -T <path>    : append a binary trace of answered requests to
+ *                        <path>, flushed on SIGTERM or SIGINT.
+ *         -z           : store compressible responses gzipped, inflated
+ *                        for clients not taking gzip.
+ *         -A <conns>   : answer 503 to connections past <conns> open at
+ *                        once.
+ *         -W <ms>      : answer 503 to connections queued for a worker
+ *                        longer than <ms> milliseconds.
+ *         -L <rate>    : answer 429 to requests past <rate> per second
+ *                        from one client IP, after a burst of ADMIT_BURST
+ *                        seconds' worth.
+ *         -O <fetches> : answer 503 to misses past <fetches> server
+ *                        fetches in flight to one origin.
+ *
+ *     Cache statistics are printed on SIGUSR1.
+ *
  * @param[in] argc : number of command line arguments.
  * @param[in] argv : command line input.
  *
@@ -108,26 +307,221 @@ static void clienterror(int fd, const char *errnum, const char *shortmsg,
 int main(int argc, char **argv) {
     // Ignore SIGPIPE signals.
     signal(SIGPIPE, SIG_IGN);
+    // Leave SIGUSR1 to the reporter thread; threads inherit the mask.
+    sigset_t report;
+    sigemptyset(&report);
+    sigaddset(&report, SIGUSR1);
+
+    // Parse command line options
+    cconfig config = {
+        .shards = CACHE_SHARDS, .zerocopy = true, .policy = CACHE_CLOCK};
+    bool evented = false;
+    bool ringed = false;
+    size_t workers = WORKERS;
+    size_t depth = QUEUE_DEPTH;
+    bool reuseport = false;
+    bool pin = false;
+    size_t idle = UPSTREAM_MAX_IDLE;
+    bool spliced = false;
+    unsigned long sample = ACCESSLOG_SAMPLE;
+    const char *trace = NULL;
+    aconfig limits = {0};
+    int opt;
+    while ((opt = getopt(argc, argv,
+                         "s:ZUEt:q:BRPk:K:e:c:o:D:d:pS:r:l:T:zA:W:L:O:")) !=
+           -1) {
+        switch (opt) {
+        case 's':
+            config.shards = strtoul(optarg, NULL, 10);
+            break;
+        case 'Z':
+            config.zerocopy = false;
+            break;
+        case 'E':
+            evented = true;
+            break;
+        case 'U':
+            ringed = true;
+            break;
+        case 't':
+            workers = strtoul(optarg, NULL, 10);
+            break;
+        case 'q':
+            depth = strtoul(optarg, NULL, 10);
+            break;
+        case 'B':
+            block = true;
+            break;
+        case 'R':
+            reuseport = true;
+            break;
+        case 'P':
+            pin = true;
+            break;
+        case 'k':
+            idle = strtoul(optarg, NULL, 10);
+            break;
+        case 'K':
+            client_timeout = strtol(optarg, NULL, 10);
+            break;
+        case 'e':
+            if (!strcmp(optarg, "clock")) {
+                config.policy = CACHE_CLOCK;
+            } else if (!strcmp(optarg, "s3fifo")) {
+                config.policy = CACHE_S3FIFO;
+            } else {
+                usage(argv[0]);
+            }
+            break;
+        case 'c':
+            config.size = parse_size(optarg, argv[0]);
+            break;
+        case 'o':
+            config.object_size = parse_size(optarg, argv[0]);
+            break;
+        case 'D':
+            config.disk_path = optarg;
+            break;
+        case 'd':
+            config.disk_size = parse_size(optarg, argv[0]);
+            break;
+        case 'p':
+            config.promote = true;
+            break;
+        case 'S':
+            snapshot = optarg;
+            break;
+        case 'r':
+            if (!strcmp(optarg, "copy")) {
+                spliced = false;
+            } else if (!strcmp(optarg, "splice")) {
+                spliced = true;
+            } else {
+                usage(argv[0]);
+            }
+            break;
+        case 'l':
+            sample = strtoul(optarg, NULL, 10);
+            break;
+        case 'T':
+            trace = optarg;
+            break;
+        case 'z':
+            config.compress = compress_text;
+            compress_init(true);
+            break;
+        case 'A':
+            limits.connections = strtoul(optarg, NULL, 10);
+            break;
+        case 'W':
+            limits.queue_ms = strtol(optarg, NULL, 10);
+            break;
+        case 'L':
+            limits.rate = strtod(optarg, NULL);
+            break;
+        case 'O':
+            limits.fetches = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
 
     // Check command line args
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
-        exit(1);
+    if (optind != argc - 1) {
+        usage(argv[0]);
+    }
+    const char *port = argv[optind];
+    // With a snapshot or a trace, the reporter also saves or flushes it on
+    // shutdown.
+    config.snapshot = snapshot;
+    if (snapshot != NULL || trace != NULL) {
+        sigaddset(&report, SIGTERM);
+        sigaddset(&report, SIGINT);
+    }
+    pthread_sigmask(SIG_BLOCK, &report, NULL);
+
+    // Open listening file descriptors; shared unless SO_REUSEPORT
+    long ncores = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nloops = (ncores > 0) ? (size_t)ncores : 1;
+    int *listenfds = malloc_w(sizeof(int) * nloops);
+    for (size_t i = 0; i < nloops; i++) {
+        if (i > 0 && !reuseport) {
+            listenfds[i] = listenfds[0];
+            continue;
+        }
+        listenfds[i] =
+            reuseport ? open_listenfd_reuseport(port) : open_listenfd(port);
+        if (listenfds[i] < 0) {
+            fprintf(stderr, "Failed to listen on port: %s\n", port);
+            exit(1);
+        }
     }
 
-    // Open listening file descriptor
-    int listenfd = open_listenfd(argv[1]);
-    if (listenfd < 0) {
-        fprintf(stderr, "Failed to listen on port: %s\n", argv[1]);
-        exit(1);
+    cache_init(&config);
+    splice_init(spliced);
+    accesslog_init(sample, STDOUT_FILENO);
+    trace_init(trace);
+    admit_init(&limits);
+    dns_init(DNS_RESOLVERS);
+    tunnel_init(TUNNEL_PUMPS);
+    upstream_init(idle);
+    // Signals stay pending until the reporter, started once all it reports
+    // on is set up, takes them.
+    pthread_t reporter_tid;
+    pthread_create(&reporter_tid, NULL, reporter, &report);
+    if (ringed && !uring_run(listenfds, nloops, pin)) {
+        fprintf(stderr, "io_uring unavailable; serving with epoll\n");
+        evented = true;
+    }
+    if (evented) {
+        eventloop_run(listenfds, nloops, pin);
     }
 
-    cache_init();
+    // Spawn worker pool
+    sbuf_init(&sbuf, depth);
     pthread_t tid;
-    while (1) {
-        // Make space on the stack for client info
-        client_info *client = malloc_w(sizeof(client_info));
+    for (size_t i = 0; i < ((workers < 1) ? 1 : workers); i++) {
+        pthread_create(&tid, NULL, worker, NULL);
+    }
+
+    // Spawn acceptors, one per listening socket; last one runs here
+    size_t nacceptors = reuseport ? nloops : 1;
+    for (size_t i = 0; i < nacceptors; i++) {
+        acceptor_info *info = malloc_w(sizeof(acceptor_info));
+        info->listenfd = listenfds[i];
+        info->cpu = pin ? (int)i : -1;
+        if (i == nacceptors - 1) {
+            acceptor(info);
+        } else {
+            pthread_create(&tid, NULL, acceptor, info);
+        }
+    }
+    sbuf_deinit(&sbuf);
+    upstream_free();
+    cache_free();
+    return 0;
+}
 
+/**
+ * @brief Acceptor thread function.
+ *     Continuously accepts client connections on one listening socket and
+ *     queues them for a worker.
+ *
+ * @param[in] vargp : void* pointer to acceptor_info struct.
+ */
+void *acceptor(void *vargp) {
+    acceptor_info *info = (acceptor_info *)vargp;
+    int listenfd = info->listenfd;
+    if (info->cpu >= 0) {
+        pin_thread(info->cpu);
+    }
+    free(vargp);
+
+    // Client info for the next connection; copied into the queue
+    client_info client_data;
+    client_info *client = &client_data;
+    while (1) {
         // Initialize the length of the address
         client->addrlen = sizeof(client->addr);
 
@@ -139,254 +533,1230 @@ int main(int argc, char **argv) {
             perror("accept");
             continue;
         }
+        client->accepted = metrics_now();
+        if (!admit_open()) {
+            metrics_count(METRIC_SHED_LOAD, 1);
+            clientretry(client->connfd, "503", "Service Unavailable",
+                        "Tiny is serving too many clients", ADMIT_RETRY_AFTER);
+            close(client->connfd);
+            continue;
+        }
 
-        // Connection is established; serve client
-        pthread_create(&tid, NULL, thread, (void *)(client));
+        // Connection is established; queue for a worker
+        if (block) {
+            sbuf_insert(&sbuf, client);
+        } else if (!sbuf_tryinsert(&sbuf, client)) {
+            metrics_count(METRIC_SHED_LOAD, 1);
+            clientretry(client->connfd, "503", "Service Unavailable",
+                        "Tiny is serving too many clients", ADMIT_RETRY_AFTER);
+            close(client->connfd);
+            admit_close();
+        }
     }
-    cache_free();
-    return 0;
+    return NULL;
 }
 
 /**
- * @brief Peer thread function.
- *     Creates copy of client info structure for each thread.
- *     Serves client request, after which closing connection.
+ * @brief Pins the calling thread to a CPU.
+ *     Failure only reported; the thread keeps running unpinned.
  *
- * @param[in] vargp : void* pointer to client_info struct.
+ * @param[in] cpu : CPU index, wrapped to the number of online CPUs.
  */
-void *thread(void *vargp) {
-    client_info *prev = (client_info *)(vargp);
+void pin_thread(int cpu) {
+    long ncores = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu % ((ncores > 0) ? ncores : 1), &set);
+    int res = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (res != 0) {
+        fprintf(stderr, "pthread_setaffinity_np failed: %s\n", strerror(res));
+    }
+}
 
-    // Store client info for the thread.
-    client_info client_data;
-    client_info *client = &client_data;
+/**
+ * @brief Prints command line usage and exits.
+ *
+ * @param[in] prog : program name.
+ */
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-s shards] [-Z] [-E] [-U] [-t workers] [-q depth] [-B] "
+            "[-R] [-P] [-k idle] [-K seconds] [-e policy] [-c size] "
+            "[-o size] [-D path] [-d size] [-p] [-S path] [-r relay] "
+            "[-l sample] [-T path] [-z] [-A conns] [-W ms] [-L rate] "
+            "[-O fetches] <port>\n",
+            prog);
+    exit(1);
+}
 
-    client->addr = prev->addr;
-    client->addrlen = prev->addrlen;
-    client->connfd = prev->connfd;
+/**
+ * @brief Parses a size in bytes with an optional K, M, or G suffix.
+ *     Exits with usage on anything else, or on zero.
+ *
+ * @param[in] arg  : size argument, e.g. 64M.
+ * @param[in] prog : program name for usage.
+ *
+ * @return size in bytes.
+ */
+static size_t parse_size(const char *arg, const char *prog) {
+    char *end;
+    size_t size = strtoull(arg, &end, 10);
+    switch (toupper((unsigned char)*end)) {
+    case 'G':
+        size *= 1024;
+        // fall through
+    case 'M':
+        size *= 1024;
+        // fall through
+    case 'K':
+        size *= 1024;
+        end++;
+        break;
+    }
+    if (*end != '\0' || size == 0 || !isdigit((unsigned char)*arg))
+        usage(prog);
+    return size;
+}
+
+/**
+ * @brief Reporter thread function.
+ *     Prints cache statistics whenever the proxy receives SIGUSR1.
+ *     On SIGTERM or SIGINT, flushes the trace, saves the cache snapshot,
+ *     and exits.
+ *
+ * @param[in] vargp : void* pointer to the signal set to wait for.
+ */
+void *reporter(void *vargp) {
+    const sigset_t *set = vargp;
+    pthread_detach(pthread_self());
+    while (1) {
+        int sig;
+        if (sigwait(set, &sig) != 0) {
+            continue;
+        }
+        if (sig != SIGUSR1) {
+            trace_flush();
+            exit(snapshot != NULL && cache_save(snapshot) < 0);
+        }
+        cstats stats;
+        cache_stats(&stats);
+        uint64_t lookups = stats.hits + stats.misses;
+        printf("cache %s: %" PRIu64 " hits, %" PRIu64 " misses (%.1f%% hit "
+               "ratio), %" PRIu64 " evictions, %" PRIu64 " refreshes, "
+               "%zu/%zu bytes\n",
+               stats.policy, stats.hits, stats.misses,
+               lookups ? 100.0 * stats.hits / lookups : 0.0, stats.evictions,
+               stats.refreshes, stats.size, stats.capacity);
+        if (stats.disk_capacity > 0) {
+            printf("disk: %" PRIu64 " hits, %" PRIu64 " spills, %zu/%zu "
+                   "bytes\n",
+                   stats.disk_hits, stats.spills, stats.disk_size,
+                   stats.disk_capacity);
+        }
+        fflush(stdout);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Worker thread function.
+ *     Repeatedly takes a client connection off the queue and serves it,
+ *     after which closing connection.
+ *
+ * @param[in] vargp : unused.
+ */
+void *worker(void *vargp) {
+    (void)vargp;
+    // Context of the thread, reused for every connection it serves.
+    worker_ctx *ctx = malloc_w(sizeof(worker_ctx));
+    ctx->plain = (cplain){.text = NULL, .size = 0};
+    client_info *client = &ctx->client;
 
     // Detach thread and begin serving.
     pthread_detach(pthread_self());
-    free(vargp);
-    serve(client);
-    close(client->connfd);
+    while (1) {
+        sbuf_remove(&sbuf, client);
+        metrics_count(METRIC_ACCEPTED, 1);
+        // Shed connections that queued too long before reading them.
+        if (admit_queued(client->accepted)) {
+            serve(ctx);
+        } else {
+            metrics_count(METRIC_SHED_LOAD, 1);
+            clientretry(client->connfd, "503", "Service Unavailable",
+                        "Tiny is serving too many clients", ADMIT_RETRY_AFTER);
+        }
+        metrics_count(METRIC_CLOSED, 1);
+        // A tunnel keeps the connection open, and gives it back itself.
+        if (client->connfd >= 0) {
+            close(client->connfd);
+            admit_close();
+        }
+    }
     return NULL;
 }
 
 /**
- * @brief Serves client requests; in order:
- *     1. Confirms client connection.
- *     2. Parses client request line, storing info.
- *     3. Searches cache for cached value.
- *     4. If cached, serves to client directly.
- *     5. If not cached, connects to server, writing response to client.
- *     6. Response from server then cached.
+ * @brief Serves client requests on one connection; for each request:
+ *     1. Parses client request line, storing info.
+ *     2. Searches cache for cached value.
+ *     3. If cached, serves to client directly.
+ *     4. If not cached, connects to server, writing response to client.
+ *     5. Response from server then cached.
+ *     Persistent (HTTP/1.1) clients have further requests, pipelined or
+ *     not, read from the same buffer and answered in order, until the client
+ *     closes, asks to close, or stays idle for client_timeout seconds.
+ *     A CONNECT request ends the loop, the connection becoming a tunnel.
+ *     Requests addressed to the proxy itself are answered with the
+ *     metrics, before any cache lookup.
  *
- * @param[in] client : information regarding client connection.
+ * @param[in] ctx : worker context, holding the client connection.
  */
-static void serve(client_info *client) {
-    // Confirms connection accepted from client.
-    confirm_connection(client);
+static void serve(worker_ctx *ctx) {
+    client_info *client = &ctx->client;
+    request_info *request = &ctx->request;
+    request_parser *parser = &ctx->parser;
 
-    int fd_server;
-    parser_t *parser = parser_new();
-    // Creating request_info struct to store info.
-    request_info request_data;
-    request_info *request = &request_data;
-
-    // Parse request line and store relevant info.
-    if (parse_request(client, request, parser) < 0) {
-        parser_free(parser);
-        return;
+    // Logs connection accepted from client.
+    accesslog_accept(client->connfd, &client->addr);
+
+    // Idle persistent clients time out instead of holding the worker.
+    if (client_timeout > 0) {
+        struct timeval tv = {.tv_sec = client_timeout, .tv_usec = 0};
+        setsockopt(client->connfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
     }
 
-    // If cache hit, serve text directly to client.
-    if (cache_gettext(request->uri, client->connfd)) {
-        parser_free(parser);
-        return;
+    // Client rio shared by all requests; keeps pipelined requests buffered.
+    rio_readinitb(&ctx->rio, client->connfd);
+
+    bool persist;
+    do {
+        // Parse request line and store relevant info.
+        persist = false;
+        metrics_begin(&ctx->timer);
+        if (parse_request(client, &ctx->rio, request, parser, &ctx->timer) ==
+            0) {
+            // Scrapes of the metrics are never rate limited.
+            long retry = metrics_requested(request)
+                             ? 0
+                             : admit_client(client->connfd, &client->addr);
+            if (retry > 0) {
+                metrics_count(METRIC_SHED_RATE, 1);
+                clientretry(client->connfd, "429", "Too Many Requests",
+                            "Tiny is serving this client too often", retry);
+                metrics_end(&ctx->timer);
+                return;
+            }
+            if (tunnel_requested(request->method)) {
+                serve_tunnel(client, request, &ctx->rio);
+                metrics_end(&ctx->timer);
+                return;
+            }
+            persist = client_timeout > 0 && client_persistent(request, parser);
+            if (metrics_requested(request)) {
+                persist =
+                    metrics_serve(client->connfd, request) == 0 && persist;
+            } else {
+                persist = serve_request(ctx, persist);
+            }
+            metrics_end(&ctx->timer);
+        }
+    } while (persist);
+}
+
+/**
+ * @brief Serves one parsed client request.
+ *     Concurrent GET misses on one URI are collapsed into one server fetch:
+ *     the first leads, later ones follow and stream the leader's response,
+ *     or the cached copy the leader revalidated.
+ *
+ * @param[in] ctx     : worker context, holding the parsed request.
+ * @param[in] persist : whether the client connection may stay open.
+ *
+ * @return true if the client connection stays open for another request.
+ */
+static bool serve_request(worker_ctx *ctx, bool persist) {
+    client_info *client = &ctx->client;
+    request_info *request = &ctx->request;
+    request_parser *parser = &ctx->parser;
+    if (!request_cacheable(request, parser)) {
+        return serve_miss(ctx, persist, NULL);
+    }
+    // If fresh cache hit, in memory or on disk, serve text directly.
+    uint64_t since = metrics_now();
+    cblock *block = cache_pin(request->uri);
+    dentry *entry = (block == NULL) ? cache_pin_disk(request->uri) : NULL;
+    metrics_time(LATENCY_LOOKUP, since);
+    // Compressed text that cannot be inflated for the client is a miss.
+    if ((block != NULL || entry != NULL) && serve_hit(ctx, block, entry)) {
+        return persist;
+    }
+
+    bool leader;
+    fetch *f = fetch_join(request->uri, &leader);
+    if (!leader) {
+        // Follow the fetch in flight; fetch it ourselves if not shared.
+        bool shared;
+        size_t sent;
+        int res = fetch_follow(f, client->connfd, &shared, &sent);
+        fetch_release(f);
+        if (shared) {
+            if (res == 0) {
+                trace_request(request->uri, TRACE_MISS, sent);
+            }
+            return persist && res == 0;
+        }
+        if (serve_recheck(ctx)) {
+            return persist;
+        }
+        return serve_miss(ctx, persist, NULL);
+    }
+
+    // Cached by a fetch that ended after the lookup above.
+    bool keep;
+    if (serve_recheck(ctx)) {
+        fetch_end(f, false);
+        keep = persist;
+    } else {
+        keep = serve_miss(ctx, persist, f);
+    }
+    fetch_release(f);
+    return keep;
+}
+
+/**
+ * @brief Sends pinned cached text to the client, then unpins it.
+ *     Compressed text goes out inflated to a client not taking gzip.
+ *
+ * @param[in] ctx   : worker context, holding the client connection.
+ * @param[in] block : pinned memory block, NULL for a disk hit.
+ * @param[in] entry : pinned disk tier record, if <block> is NULL.
+ *
+ * @return true if sent, false if nothing was sent since the text is
+ *     compressed and could not be inflated.
+ */
+static bool serve_hit(worker_ctx *ctx, cblock *block, dentry *entry) {
+    int fd = ctx->client.connfd;
+    size_t len;
+    int inflated = compress_hit(&ctx->parser, block, entry, &ctx->plain, &len);
+    if (inflated != 0) {
+        if (inflated > 0) {
+            metrics_answer(&ctx->timer);
+            metrics_count(METRIC_CACHE_BYTES, len);
+            trace_request(ctx->request.uri, TRACE_HIT, len);
+            rio_writen(fd, ctx->plain.text, len);
+        }
+        if (block != NULL) {
+            cache_unpin(block);
+        } else {
+            cache_unpin_disk(entry);
+        }
+        return inflated > 0;
+    }
+    metrics_answer(&ctx->timer);
+    if (block != NULL) {
+        metrics_count(METRIC_CACHE_BYTES, block->text_len);
+        trace_request(ctx->request.uri, TRACE_HIT, block->text_len);
+        cache_writetext(block, fd, 0, block->text_len);
+        cache_unpin(block);
+        return true;
+    }
+
+    metrics_count(METRIC_CACHE_BYTES, entry->text_len);
+    trace_request(ctx->request.uri, TRACE_HIT, entry->text_len);
+    size_t sent = 0;
+    while (sent < entry->text_len) {
+        ssize_t n = cache_senddisk(entry, fd, sent);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        sent += n;
+    }
+    cache_unpin_disk(entry);
+    return true;
+}
+
+/**
+ * @brief Serves the request from the cache if a fetch cached it meanwhile,
+ *     without counting a second lookup.
+ *
+ * @param[in] ctx : worker context, holding the parsed request.
+ *
+ * @return true if served from the cache, false if not cached, or cached
+ *     compressed and not to be inflated.
+ */
+static bool serve_recheck(worker_ctx *ctx) {
+    cblock *block = cache_repin(ctx->request.uri);
+    if (block == NULL) {
+        return false;
     }
+    return serve_hit(ctx, block, NULL);
+}
 
-    // No cache hit, connect with server, server file descriptor to write to.
-    if ((fd_server = open_clientfd(request->host, request->port)) < 0) {
-        fprintf(stderr, "Could not connect to %s:%s", request->host,
+/**
+ * @brief Connects to the server of a CONNECT request and hands both
+ *     connections to a tunnel, which relays them from then on.
+ *     Bytes the client sent past its request head go through the tunnel.
+ *     The client connection belongs to the tunnel afterwards; connfd is set
+ *     to -1.
+ *
+ * @param[in] client  : information regarding client connection.
+ * @param[in] request : information regarding request header line.
+ * @param[in] rio     : client rio, positioned past the request head.
+ */
+static void serve_tunnel(client_info *client, request_info *request,
+                         rio_t *rio) {
+    int fd_server = dns_open_clientfd(request->host, request->port);
+    if (fd_server < 0) {
+        metrics_count(METRIC_CONNECT_ERRORS, 1);
+        fprintf(stderr, "Could not connect to %s:%s\n", request->host,
                 request->port);
-        close(fd_server);
-        parser_free(parser);
+        clienterror(client->connfd, "502", "Bad Gateway",
+                    "Tiny could not connect to the server");
         return;
     }
+    tunnel_start(client->connfd, fd_server, rio->rio_bufptr, rio->rio_cnt);
+    client->connfd = -1;
+}
 
-    // Write headers to file descriptor.
-    if (write_header(fd_server, client, request, parser) < 0) {
-        close(fd_server);
-        parser_free(parser);
-        return;
+/**
+ * @brief Fetches a missed request from the server, relaying the response.
+ *     HTTP/1.1 clients are served over pooled server connections; a pooled
+ *     connection the server closed while idle is retried on a fresh one.
+ *     A stale cached copy with validators is revalidated with a conditional
+ *     request, unless the client's request is conditional itself; on 304
+ *     the client gets the refreshed copy.
+ *     A led fetch is ended once the response is cached, or as soon as an
+ *     attempt that shared or declined it fails.
+ *
+ * @param[in] ctx     : worker context, holding the parsed request.
+ * @param[in] persist : whether the client connection may stay open.
+ * @param[in] f       : fetch led by the caller, NULL if not collapsed.
+ *
+ * @return true if the client connection stays open for another request.
+ */
+static bool serve_miss(worker_ctx *ctx, bool persist, fetch *f) {
+    client_info *client = &ctx->client;
+    request_info *request = &ctx->request;
+    request_parser *parser = &ctx->parser;
+    // Server keep-alive only when the client speaks HTTP/1.1, since the
+    // response may then be chunked.
+    bool keepalive = upstream_pooling() && request->version != NULL &&
+                     !strcmp(request->version, "1.1");
+
+    // Format request header sent to server.
+    char *header = ctx->header;
+    int header_len =
+        format_header(header, sizeof(ctx->header), request, parser, keepalive);
+    if (header_len < 0) {
+        clienterror(client->connfd, "400", "Bad Request",
+                    "Tiny received an oversized request");
+        if (f != NULL)
+            fetch_end(f, false);
+        return false;
+    }
+    int origin;
+    if (!admit_origin(request->host, request->port, &origin)) {
+        metrics_count(METRIC_SHED_ORIGIN, 1);
+        clientretry(client->connfd, "503", "Service Unavailable",
+                    "Tiny is fetching too much from this server",
+                    ADMIT_RETRY_AFTER);
+        if (f != NULL)
+            fetch_end(f, false);
+        return false;
     }
 
-    // Have all necessary information, begin serving now.
-    // Initialize server rio.
-    rio_t rio_server;
-    rio_readinitb(&rio_server, fd_server);
+    relay_info *relay = &ctx->relay;
+    relay->rio = &ctx->rio_server;
+    relay->chunk = ctx->chunk;
+    relay->timer = &ctx->timer;
+    relay->connfd = client->connfd;
+    relay->persist = persist;
+    relay->fetch = f;
+    relay->shared = false;
+    relay->dead = false;
+    relay->fill = NULL;
+    relay->stale = NULL;
 
-    // Send header to server and write response to client.
-    // Buffer to scan server response.
-    char buf[MAXLINE];
-    ssize_t buf_len;
+    bool cacheable = request_cacheable(request, parser);
+    if (cacheable && request_lookup_header(parser, "If-None-Match") == NULL &&
+        request_lookup_header(parser, "If-Modified-Since") == NULL) {
+        relay->stale = cache_pin_stale(request->uri);
+    }
+    if (relay->stale != NULL) {
+        // Ask for the body only if the cached copy changed.
+        char conditions[MAXLINE];
+        size_t len =
+            cache_conditions(relay->stale, conditions, sizeof(conditions));
+        if (len > 0 && header_len + len <= sizeof(ctx->header)) {
+            memcpy(header + header_len - 2, conditions, len);
+            memcpy(header + header_len - 2 + len, "\r\n", 2);
+            header_len += len;
+        } else {
+            cache_unpin(relay->stale);
+            relay->stale = NULL;
+        }
+    }
+
+    int fd_server;
+    int res = -1;
+    bool reused = false;
+    do {
+        // No cache hit, connect with server (or reuse a pooled connection).
+        uint64_t since = metrics_now();
+        fd_server = keepalive
+                        ? upstream_get(request->host, request->port, &reused)
+                        : dns_open_clientfd(request->host, request->port);
+        if (fd_server < 0) {
+            metrics_count(METRIC_CONNECT_ERRORS, 1);
+            fprintf(stderr, "Could not connect to %s:%s\n", request->host,
+                    request->port);
+            break;
+        }
+        metrics_time(LATENCY_CONNECT, since);
 
-    // Input text to potentially save to cache.
-    char cache_input[MAX_OBJECT_SIZE];
-    size_t input_len = 0;
-    char *writep = cache_input;
-
-    // Scan response lines and write to client/cache input.
-    while ((buf_len = rio_readnb(&rio_server, buf, MAXLINE)) > 0) {
-        if (rio_writen(client->connfd, buf, buf_len) < 0) {
-            clienterror(client->connfd, "400", "Write error",
-                        "Error writing response to client");
-            return;
+        // Send header to server and relay response to client.
+        relay->buf_len = 0;
+        relay->flushed = false;
+        relay->decided = false;
+        relay->shared = false;
+        relay->revalidated = false;
+        relay->storable = false;
+        relay->chunked = false;
+        relay->input_len = 0;
+        // Text of cacheable requests goes straight into cache storage.
+        if (cacheable) {
+            relay->fill = cache_fill(request->uri, 0);
+        }
+        res = forward(fd_server, request, header, header_len, relay);
+        if (res > 0) {
+            upstream_put(request->host, request->port, fd_server);
         } else {
-            // Write response to text to send to cache.
-            if ((input_len += buf_len) < MAX_OBJECT_SIZE) {
-                memcpy(writep, buf, buf_len);
-                writep += buf_len;
+            close(fd_server);
+        }
+        if (res < 0 && relay->fill != NULL) {
+            cache_fill_abort(relay->fill);
+            relay->fill = NULL;
+        }
+        // A fetch is shared at most once; followers of a failed attempt
+        // are sent away, and a retry serves this client alone.
+        if (res < 0 && relay->decided) {
+            fetch_end(f, false);
+            relay->fetch = f = NULL;
+        }
+        // Retry only if the client has not seen any of the response.
+    } while (res < 0 && reused && !relay->flushed);
+    admit_origin_done(origin);
+    if (fd_server >= 0 && !relay->dead) {
+        metrics_count(METRIC_ORIGIN_BYTES, relay->input_len);
+    }
+
+    if (relay->fill != NULL) {
+        cache_response(relay);
+    }
+    if (f != NULL) {
+        fetch_end(f, res >= 0);
+    }
+    bool keep = res >= 0 && !relay->dead && persist && relay->framed;
+    if (res >= 0 && !relay->dead && !relay->revalidated) {
+        trace_request(request->uri,
+                      relay->storable ? TRACE_MISS : TRACE_BYPASS,
+                      relay->input_len);
+    }
+    if (relay->stale != NULL) {
+        if (res >= 0 && relay->revalidated) {
+            size_t len = relay->stale->text_len;
+            int inflated =
+                compress_hit(&ctx->parser, relay->stale, NULL, &ctx->plain,
+                             &len);
+            metrics_answer(&ctx->timer);
+            ssize_t n = -1;
+            if (inflated < 0) {
+                clienterror(client->connfd, "502", "Bad Gateway",
+                            "Tiny could not inflate the cached response");
+            } else {
+                metrics_count(METRIC_CACHE_BYTES, len);
+                trace_request(request->uri, TRACE_HIT, len);
+                n = (inflated > 0) ? rio_writen(client->connfd,
+                                                ctx->plain.text, len)
+                                   : cache_writetext(relay->stale,
+                                                     client->connfd, 0, len);
+            }
+            if (n < 0) {
+                keep = false;
             }
         }
+        cache_unpin(relay->stale);
     }
-    if (input_len < MAX_OBJECT_SIZE)
-        cache_insert(request->uri, cache_input, input_len);
+    return keep;
+}
 
-    close(fd_server);
-    parser_free(parser);
-    return;
+/**
+ * @brief Returns whether a client connection may stay open after <request>.
+ *     Only HTTP/1.1 clients that did not ask to close, and whose request
+ *     has no body, which is never forwarded and would be read as the next
+ *     request.
+ *
+ * @param[in] request : information regarding request header line.
+ * @param[in] parser  : parser of the request head.
+ */
+static bool client_persistent(request_info *request,
+                              const request_parser *parser) {
+    if (request->version == NULL || strcmp(request->version, "1.1"))
+        return false;
+    const request_header *line;
+    if ((line = request_lookup_header(parser, "Connection")) != NULL &&
+        header_has_token(line->value, "close"))
+        return false;
+    if ((line = request_lookup_header(parser, "Proxy-Connection")) != NULL &&
+        header_has_token(line->value, "close"))
+        return false;
+    if ((line = request_lookup_header(parser, "Content-Length")) != NULL &&
+        strtoll(line->value, NULL, 10) != 0)
+        return false;
+    return request_lookup_header(parser, "Transfer-Encoding") == NULL;
 }
 
 /**
- * @brief Outputs text confirming client connection.
+ * @brief Sends a request header to the server and relays its response.
+ *     The response head is parsed for its framing, and its Connection
+ *     header replaced towards the client. Framed responses are read exactly
+ *     to the end of the body, leaving a persistent server connection ready
+ *     for the next request; others are relayed until the server closes.
+ *
+ * @param[in] fd_server  : file descriptor used for server connection.
+ * @param[in] request    : information regarding request header line.
+ * @param[in] header     : formatted request header.
+ * @param[in] header_len : length of <header>.
+ * @param[in] relay      : relay state towards client and cache input.
  *
- * @param[in] client : information regarding client connection.
+ * @return 1 if the server connection may be reused, 0 if finished, -1 if
+ *     error.
  */
-static void confirm_connection(client_info *client) {
-    // Get client request info.
-    int res = getnameinfo((SA *)&client->addr, client->addrlen, client->host,
-                          sizeof(client->host), client->serv,
-                          sizeof(client->serv), 0);
-    // Output client request info.
-    if (res == 0) {
-        printf("Accepted connection from %s:%s\n", client->host, client->serv);
-    } else {
-        fprintf(stderr, "getnameinfo failed: %s\n", gai_strerror(res));
+static int forward(int fd_server, request_info *request, const char *header,
+                   size_t header_len, relay_info *relay) {
+    // Write headers to file descriptor.
+    if (rio_writen(fd_server, header, header_len) < 0) {
+        return -1;
+    }
+    // Initialize server rio.
+    rio_t *rio_server = relay->rio;
+    rio_readinitb(rio_server, fd_server);
+
+    // Parse and relay response head.
+    response_info response;
+    if (relay_head(rio_server, relay, request->method, &response) < 0) {
+        return -1;
+    }
+    // A 304 refreshes the cached copy, keeping its lifetime unless given.
+    time_t now = time(NULL);
+    if (relay->revalidated) {
+        cache_refresh(relay->stale, response_explicit(&response)
+                                        ? response_expires(&response, now)
+                                        : -1);
+    }
+    // Chunked text is cached as its chunk data alone, framed on commit by a
+    // Content-Length, unless it has other codings or a length already.
+    // A known length reserves its storage up front, or drops the fill at
+    // once when too large to cache.
+    relay->storable =
+        relay->fill != NULL && response_cacheable(&response, now);
+    if (relay->storable) {
+        relay->fresh.expires = response_expires(&response, now);
+        relay->fresh.lifetime = response_lifetime(&response, now);
+        cache_fill_fresh(relay->fill, &relay->fresh);
+    } else if (relay->fill != NULL) {
+        cache_fill_abort(relay->fill);
+        relay->fill = NULL;
+    }
+    if (relay->fill != NULL && response.chunked &&
+        (response.coded || response.content_length >= 0)) {
+        cache_fill_abort(relay->fill);
+        relay->fill = NULL;
+    }
+    if (relay->fill != NULL && !response.chunked &&
+        response.content_length >= 0 &&
+        !cache_fill_reserve(relay->fill,
+                            relay->head_len + 2 + response.content_length)) {
+        cache_fill_abort(relay->fill);
+        relay->fill = NULL;
     }
+
+    // Share with followers only text reserved in the cache fill, which then
+    // stays in place while followers read it.
+    if (relay->fetch != NULL) {
+        cblock *block = NULL;
+        if (relay->fill != NULL && response.content_length >= 0) {
+            block = cache_fill_pin(relay->fill);
+        }
+        relay->decided = true;
+        relay->shared = (block != NULL);
+        fetch_share(relay->fetch, block);
+    }
+    // Nothing but the client needs a body neither cached nor shared.
+    relay->splice = splice_enabled() && relay->fill == NULL && !relay->shared;
+    relay->read_size = RELAY_READ_MIN;
+
+    if (!relay->framed) {
+        // Relay response until EOF to client/cache input.
+        if (relay_copy(rio_server, relay, SPLICE_EOF) < 0 ||
+            relay_flush(relay) < 0) {
+            return -1;
+        }
+        return 0;
+    }
+
+    // Relay exactly one body.
+    if (response_has_body(&response, request->method)) {
+        int res = response.chunked
+                      ? relay_chunked(rio_server, relay)
+                      : relay_copy(rio_server, relay,
+                                   (size_t)response.content_length);
+        if (res < 0) {
+            return -1;
+        }
+    }
+    if (relay_flush(relay) < 0) {
+        return -1;
+    }
+    // Reusable only if the server sent nothing beyond the response.
+    return (response_reusable(&response, request->method) &&
+            rio_server->rio_cnt == 0)
+               ? 1
+               : 0;
 }
 
 /**
- * @brief Parses client request line and headers.
- *     Stores all request information in parser to request data structure.
- *     Encapsulates all parsing operations.
+ * @brief Records where the value of an ETag or Last-Modified header line
+ *     lands in the cache input, for revalidating the cached copy later.
+ *     Called before the line is saved.
  *
- * @param[in] client  : information regarding client connection.
- * @param[in] request : information regarding request header line.
- * @param[in] parser  : HTTP parser, stores & parses request header lines.
+ * @param[in] relay : relay state towards client and cache input.
+ * @param[in] line  : response header line.
+ */
+static void relay_validator(relay_info *relay, const char *line) {
+    size_t *offset = &relay->fresh.etag;
+    size_t *len = &relay->fresh.etag_len;
+    const char *value = header_value(line, "ETag");
+    if (value == NULL) {
+        offset = &relay->fresh.modified;
+        len = &relay->fresh.modified_len;
+        value = header_value(line, "Last-Modified");
+    }
+    if (value == NULL) {
+        return;
+    }
+    size_t n = strcspn(value, "\r\n");
+    while (n > 0 && (value[n - 1] == ' ' || value[n - 1] == '\t')) {
+        n--;
+    }
+    *offset = relay->input_len + (value - line);
+    *len = n;
+}
+
+/**
+ * @brief Reads a response status line and headers, relaying them.
+ *     Connection, Keep-Alive, and Proxy-Connection headers are hop-by-hop;
+ *     the client gets Connection: keep-alive if its connection stays open
+ *     after this response, and Connection: close if not. The cache input
+ *     gets an HTTP/1.1 status line and no Connection header, so hits suit
+ *     both persistent and closing clients, nor a Transfer-Encoding header
+ *     naming chunked alone, whose chunk framing it does not get either.
+ *     A 304 answering a revalidation is read but not relayed; the client
+ *     gets the cached copy instead.
+ *
+ * @param[in]  rio      : server rio.
+ * @param[in]  relay    : relay state towards client and cache input.
+ * @param[in]  method   : request method, e.g. GET or HEAD.
+ * @param[out] response : parsed response head.
  *
  * @return 0 if successful, -1 if error.
  */
-static int parse_request(client_info *client, request_info *request,
-                         parser_t *parser) {
+static int relay_head(rio_t *rio, relay_info *relay, const char *method,
+                      response_info *response) {
     char buf[MAXLINE];
-    // Read request line, check, and print.
-    rio_t rio;
-    rio_readinitb(&rio, client->connfd);
-    // Read request line
-    if (rio_readlineb(&rio, buf, sizeof(buf)) <= 0) {
-        fprintf(stderr, "File read error.\n");
+    ssize_t buf_len;
+    // Read and check status line.
+    if ((buf_len = rio_readlineb(rio, buf, sizeof(buf))) <= 0 ||
+        response_parse_status(response, buf) < 0) {
+        return -1;
+    }
+    if (relay->stale != NULL && response->status == 304) {
+        relay->revalidated = true;
+        relay->framed = true;
+        while ((buf_len = rio_readlineb(rio, buf, sizeof(buf))) > 0 &&
+               strcmp(buf, "\r\n") && strcmp(buf, "\n")) {
+            response_parse_header(response, buf);
+        }
+        return (buf_len > 0) ? 0 : -1;
+    }
+    relay->fresh.etag = 0;
+    relay->fresh.modified = 0;
+    const char *version = "HTTP/1.1";
+    size_t version_len = strlen(version);
+    if (!strncmp(buf, "HTTP/1.", version_len - 1) && buf[version_len] == ' ') {
+        relay_save(relay, version, version_len);
+        relay_save(relay, buf + version_len, buf_len - version_len);
+    } else {
+        relay_save(relay, buf, buf_len);
+    }
+    if (relay_send(relay, buf, buf_len) < 0) {
         return -1;
     }
 
-    // Check parse request.
-    parser_state parse_state = parser_parse_line(parser, buf);
-    if (parse_state != REQUEST) {
-        clienterror(client->connfd, "400", "Bad Request",
-                    "Tiny received a malformed request");
+    // Read header lines up to the empty line.
+    while ((buf_len = rio_readlineb(rio, buf, sizeof(buf))) > 0) {
+        if (!strcmp(buf, "\r\n") || !strcmp(buf, "\n")) {
+            break;
+        }
+        response_parse_header(response, buf);
+        if (!strncasecmp(buf, "Connection:", strlen("Connection:")) ||
+            !strncasecmp(buf, "Keep-Alive:", strlen("Keep-Alive:")) ||
+            !strncasecmp(buf, "Proxy-Connection:",
+                         strlen("Proxy-Connection:"))) {
+            continue;
+        }
+        if (header_value(buf, "Transfer-Encoding") != NULL &&
+            !response->coded) {
+            if (relay_send(relay, buf, buf_len) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        relay_validator(relay, buf);
+        if (relay_write(relay, buf, buf_len) < 0) {
+            return -1;
+        }
+    }
+    if (buf_len <= 0) {
         return -1;
     }
 
-    // First, parse request line for header line info.
-    parser_retrieve(parser, HOST, &request->host);
-    parser_retrieve(parser, PORT, &request->port);
-    parser_retrieve(parser, PATH, &request->path);
-    parser_retrieve(parser, METHOD, &request->method);
-    parser_retrieve(parser, URI, &request->uri);
+    // Interim (1xx) responses and unframed bodies end at EOF.
+    relay->framed = response->status >= 200 &&
+                    (!response_has_body(response, method) ||
+                     response->chunked || response->content_length >= 0);
+    relay->chunked = response->chunked;
+    relay->head_len = relay->input_len;
+    relay->content_length = response->content_length;
+    relay_save(relay, "\r\n", 2);
+    const char *end = (relay->persist && relay->framed)
+                          ? "Connection: keep-alive\r\n\r\n"
+                          : "Connection: close\r\n\r\n";
+    return relay_send(relay, end, strlen(end));
+}
 
-    // Second, parse request header lines--load into parser.
-    int strcmp_val;
+/**
+ * @brief Relays a chunked response body, trailers included.
+ *     Only the chunk data is saved as cache input; sizes, extensions, and
+ *     trailers go to the client alone.
+ *
+ * @param[in] rio   : server rio, positioned at the first chunk size.
+ * @param[in] relay : relay state towards client and cache input.
+ *
+ * @return 0 if successful, -1 if error.
+ */
+static int relay_chunked(rio_t *rio, relay_info *relay) {
+    char buf[MAXLINE];
+    ssize_t buf_len;
+    while (1) {
+        // Chunk size line, in hex, possibly with extensions.
+        if ((buf_len = rio_readlineb(rio, buf, sizeof(buf))) <= 0 ||
+            relay_send(relay, buf, buf_len) < 0) {
+            return -1;
+        }
+        char *endp;
+        unsigned long long size = strtoull(buf, &endp, 16);
+        if (endp == buf) {
+            return -1;
+        }
+        if (size == 0) {
+            break;
+        }
+        // Chunk data followed by CRLF.
+        if (relay_copy(rio, relay, size) < 0 ||
+            (buf_len = rio_readlineb(rio, buf, sizeof(buf))) <= 0 ||
+            relay_send(relay, buf, buf_len) < 0) {
+            return -1;
+        }
+    }
+    // Trailer lines up to the empty line.
     do {
-        if (rio_readlineb(&rio, buf, sizeof(buf)) <= 0) {
-            fprintf(stderr, "File read error.\n");
+        if ((buf_len = rio_readlineb(rio, buf, sizeof(buf))) <= 0 ||
+            relay_send(relay, buf, buf_len) < 0) {
             return -1;
         }
-        if (!!(strcmp_val = strcmp(buf, "\r\n")))
-            parser_parse_line(parser, buf);
-    } while (!!strcmp_val);
+    } while (strcmp(buf, "\r\n") && strcmp(buf, "\n"));
     return 0;
 }
 
 /**
- * @brief Writes client request to server file descriptor.
- *     Encapsulates all fd write operations.
+ * @brief Relays exactly <n> bytes of response body, or all of it up to EOF.
+ *     Bytes the server rio buffered go first. The rest is spliced if the
+ *     relay allows it, or else read straight into the worker's body buffer,
+ *     bypassing the rio buffer.
  *
- * @param[in] fd_server : file descriptor used for server connection.
- * @param[in] client    : information regarding client connection.
- * @param[in] request   : information regarding request header line.
- * @param[in] parser    : HTTP parser, stores & parses request header lines.
+ * @param[in] rio   : server rio.
+ * @param[in] relay : relay state towards client and cache input.
+ * @param[in] n     : number of bytes to relay, or SPLICE_EOF.
  *
- * @return 0 if successful, -1 if errors.
+ * @return 0 if successful, -1 if error or early EOF.
  */
-static int write_header(int fd_server, client_info *client,
-                        request_info *request, parser_t *parser) {
-    char buf[MAXLINE];
-    // Start writing header.
-    int buf_len =
-        sprintf(buf, "%s %s HTTP/1.0\r\n", request->method, request->path);
-    if (rio_writen(fd_server, buf, buf_len) < 0) {
+static int relay_copy(rio_t *rio, relay_info *relay, size_t n) {
+    bool to_eof = (n == SPLICE_EOF);
+    while (n > 0) {
+        if (relay->splice && rio->rio_cnt == 0) {
+            // Client output so far goes first.
+            if (relay_flush(relay) < 0) {
+                return -1;
+            }
+            relay->flushed = true;
+            ssize_t moved = splice_relay(rio->rio_fd, relay->connfd, n);
+            if (moved < 0 && (errno == EMFILE || errno == ENFILE)) {
+                relay->splice = false;
+                continue;
+            }
+            if (moved < 0) {
+                fprintf(stderr, "Error splicing response to client\n");
+                return -1;
+            }
+            relay->input_len += moved;
+            return (to_eof || (size_t)moved == n) ? 0 : -1;
+        }
+
+        size_t want = (n < relay->read_size) ? n : relay->read_size;
+        ssize_t buf_len = rio_readsomeb(rio, relay->chunk, want);
+        if (buf_len <= 0) {
+            return (buf_len == 0 && to_eof) ? 0 : -1;
+        }
+        if (relay_write(relay, relay->chunk, buf_len) < 0) {
+            return -1;
+        }
+        if ((size_t)buf_len == relay->read_size &&
+            relay->read_size < RELAY_READ_MAX) {
+            relay->read_size *= 2;
+        }
+        if (!to_eof) {
+            n -= buf_len;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Relays response text to the client, saving it as cache input.
+ *
+ * @param[in] relay : relay state towards client and cache input.
+ * @param[in] data  : response text.
+ * @param[in] n     : length of <data>.
+ *
+ * @return 0 if successful, -1 if error writing to client.
+ */
+static int relay_write(relay_info *relay, const void *data, size_t n) {
+    relay_save(relay, data, n);
+    return relay_send(relay, data, n);
+}
+
+/**
+ * @brief Saves response text as cache input, if it still fits.
+ *     The fill drops its storage as soon as the response outgrows it.
+ *
+ * @param[in] relay : relay state towards client and cache input.
+ * @param[in] data  : response text.
+ * @param[in] n     : length of <data>.
+ */
+static void relay_save(relay_info *relay, const void *data, size_t n) {
+    relay->input_len += n;
+    if (relay->fill != NULL) {
+        cache_fill_write(relay->fill, data, n);
+    }
+}
+
+/**
+ * @brief Sends response text to the client.
+ *     Text buffered until the relay buffer fills; large pieces written
+ *     directly.
+ *
+ * @param[in] relay : relay state towards client and cache input.
+ * @param[in] data  : response text.
+ * @param[in] n     : length of <data>.
+ *
+ * @return 0 if successful, -1 if error writing to client.
+ */
+static int relay_send(relay_info *relay, const void *data, size_t n) {
+    if (relay->buf_len + n > sizeof(relay->buf) && relay_flush(relay) < 0) {
+        return -1;
+    }
+    if (n >= sizeof(relay->buf)) {
+        relay_publish(relay);
+        relay->flushed = true;
+        metrics_answer(relay->timer);
+        if (!relay->dead && rio_writen(relay->connfd, data, n) < 0) {
+            return relay_lost(relay);
+        }
+        return 0;
+    }
+    memcpy(relay->buf + relay->buf_len, data, n);
+    relay->buf_len += n;
+    return 0;
+}
+
+/**
+ * @brief Writes buffered response text to the client.
+ *
+ * @param[in] relay : relay state towards client and cache input.
+ *
+ * @return 0 if successful, -1 if error writing to client.
+ */
+static int relay_flush(relay_info *relay) {
+    relay_publish(relay);
+    if (relay->buf_len == 0) {
+        return 0;
+    }
+    relay->flushed = true;
+    metrics_answer(relay->timer);
+    ssize_t res = relay->dead ? 0
+                              : rio_writen(relay->connfd, relay->buf,
+                                           relay->buf_len);
+    relay->buf_len = 0;
+    if (res < 0) {
+        return relay_lost(relay);
+    }
+    return 0;
+}
+
+/**
+ * @brief Handles a failed write to the client.
+ *     A shared response is still read to the end for its followers, with
+ *     further output to this client dropped.
+ *
+ * @param[in] relay : relay state towards client and cache input.
+ *
+ * @return 0 if the relay goes on without the client, -1 if it stops.
+ */
+static int relay_lost(relay_info *relay) {
+    fprintf(stderr, "Error writing response to client\n");
+    relay->dead = true;
+    return relay->shared ? 0 : -1;
+}
+
+/**
+ * @brief Publishes cache input saved so far to followers of a shared fetch.
+ *
+ * @param[in] relay : relay state towards client and cache input.
+ */
+static void relay_publish(relay_info *relay) {
+    if (relay->shared) {
+        fetch_publish(relay->fetch, relay->input_len);
+    }
+}
+
+/**
+ * @brief Saves a relayed response in the cache by committing its fill.
+ *     Responses that ended at EOF or were chunked get a Content-Length
+ *     header, so that hits are framed for persistent and HTTP/1.0 clients.
+ *
+ * @param[in] relay : relay state holding the complete cache fill.
+ */
+static void cache_response(relay_info *relay) {
+    if (relay->chunked || (!relay->framed && relay->content_length < 0)) {
+        // Insert the body length after the headers.
+        char length[MAXLINE];
+        int length_len =
+            snprintf(length, sizeof(length), "Content-Length: %zu\r\n",
+                     relay->input_len - relay->head_len - 2);
+        cache_fill_insert(relay->fill, relay->head_len, length, length_len);
+    }
+    cache_fill_commit(relay->fill);
+    relay->fill = NULL;
+}
+
+/**
+ * @brief Parses client request line and headers.
+ *     Parsed in place in the client rio buffer, read into until the head
+ *     is complete; request strings point into it until the next request.
+ *     Encapsulates all parsing operations; time spent parsing, not waiting
+ *     on the client, goes into <timer>.
+ *
+ * @param[in] client  : information regarding client connection.
+ * @param[in] rio     : client rio, positioned at the request line.
+ * @param[in] request : information regarding request header line.
+ * @param[in] parser  : parser of the request head.
+ * @param[in] timer   : timings of the request.
+ *
+ * @return 0 if successful, -1 if error or client closed.
+ */
+static int parse_request(client_info *client, rio_t *rio,
+                         request_info *request, request_parser *parser,
+                         mtimer *timer) {
+    request_parser_init(parser);
+    ssize_t head_len;
+    while (1) {
+        uint64_t since = metrics_now();
+        head_len = request_parse_head(parser, request, rio->rio_bufptr,
+                                      rio->rio_cnt);
+        timer->parse += metrics_now() - since;
+        if (head_len != 0) {
+            break;
+        }
+        if (rio->rio_cnt == sizeof(rio->rio_buf)) {
+            clienterror(client->connfd, "400", "Bad Request",
+                        "Tiny received an oversized request");
+            return -1;
+        }
+        // EOF before a request is a client done with its connection.
+        ssize_t n = rio_fillb(rio);
+        if (n <= 0) {
+            if ((n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) ||
+                (n == 0 && rio->rio_cnt > 0))
+                fprintf(stderr, "File read error.\n");
+            return -1;
+        }
+    }
+    if (head_len < 0) {
+        clienterror(client->connfd, "400", "Bad Request",
+                    "Tiny received a malformed request");
+        return -1;
+    }
+    rio->rio_bufptr += head_len;
+    rio->rio_cnt -= head_len;
+    metrics_parsed(timer);
+    return 0;
+}
+
+/**
+ * @brief Returns whether the response to <request> may come from or go to
+ *     the cache.
+ *     Only GET requests without credentials, whose responses a shared
+ *     cache must not hand to others, and without Cache-Control: no-store.
+ *
+ * @param[in] request : information regarding request header line.
+ * @param[in] parser  : parser of the request head.
+ */
+bool request_cacheable(request_info *request, const request_parser *parser) {
+    if (strcmp(request->method, "GET")) {
+        return false;
+    }
+    if (request_lookup_header(parser, "Authorization") != NULL) {
+        return false;
+    }
+    const request_header *line = request_lookup_header(parser, "Cache-Control");
+    return line == NULL || !header_has_token(line->value, "no-store");
+}
+
+/**
+ * @brief Formats the request forwarded to the server into <buf>.
+ *     Request line rewritten to HTTP/1.0 (HTTP/1.1 if keep-alive) with the
+ *     path only. Host header kept (or made), User-Agent, Connection, and
+ *     Proxy-Connection replaced, remaining headers copied. Accept-Encoding
+ *     dropped from cacheable requests when compression is on, so responses
+ *     are cached as identity text. Assembled with plain copies, in one pass
+ *     over the parsed fields.
+ *
+ * @param[out] buf       : buffer to format request into.
+ * @param[in]  size      : size of <buf>.
+ * @param[in]  request   : information regarding request header line.
+ * @param[in]  parser    : parser of the request head.
+ * @param[in]  keepalive : whether to ask for a persistent HTTP/1.1
+ *                         connection instead of HTTP/1.0 with close.
+ *
+ * @return length of formatted request, -1 if it does not fit in <buf>.
+ */
+int format_header(char *buf, size_t size, request_info *request,
+                  const request_parser *parser, bool keepalive) {
+    size_t len = 0;
+    // Start header with request line.
+    const char *version = keepalive ? " HTTP/1.1\r\n" : " HTTP/1.0\r\n";
+    if (!header_put(buf, size, &len, request->method,
+                    strlen(request->method)) ||
+        !header_put(buf, size, &len, " ", 1) ||
+        !header_put(buf, size, &len, request->path, strlen(request->path)) ||
+        !header_put(buf, size, &len, version, strlen(version))) {
         return -1;
     }
 
-    // Write host header to text.
-    header_t *line = parser_lookup_header(parser, "Host");
-    char *connection = "Connection: close\r\n";
-    char *proxy_conn = "Proxy-Connection: close\r\n";
     // Use existing host header or make one.
-    buf_len =
-        (line == NULL)
-            ? sprintf(buf, "Host: %s:%s\r\nUser-Agent: %s\r\n%s%s",
-                      request->host, request->port, header_user_agent,
-                      connection, proxy_conn)
-            : sprintf(buf, "Host: %s\r\nUser-Agent: %s\r\n%s%s", line->value,
-                      header_user_agent, connection, proxy_conn);
-    // Write host header to text.
-    if (rio_writen(fd_server, buf, buf_len) < 0) {
+    const request_header *line = request_lookup_header(parser, "Host");
+    bool fits = header_put(buf, size, &len, "Host: ", strlen("Host: "));
+    if (line == NULL) {
+        fits = fits &&
+               header_put(buf, size, &len, request->host,
+                          strlen(request->host)) &&
+               header_put(buf, size, &len, ":", 1) &&
+               header_put(buf, size, &len, request->port,
+                          strlen(request->port));
+    } else {
+        fits = fits &&
+               header_put(buf, size, &len, line->value, line->value_len);
+    }
+    const char *fixed = keepalive ? header_keepalive : header_close;
+    size_t fixed_len =
+        keepalive ? sizeof(header_keepalive) - 1 : sizeof(header_close) - 1;
+    if (!fits || !header_put(buf, size, &len, "\r\n", 2) ||
+        !header_put(buf, size, &len, fixed, fixed_len)) {
         return -1;
     }
 
-    // Write remaining request header lines.
-    while ((line = parser_retrieve_next_header(parser)) != NULL) {
-        int has_host = strcmp(line->name, "Host");
-        int has_usag = strcmp(line->name, "User-Agent");
-        int has_conn = strcmp(line->name, "Connection");
-        int has_pxyc = strcmp(line->name, "Proxy-Connection");
-        // Must not have any of the above headers.
-        if (!!has_host && !!has_usag && !!has_conn && !!has_pxyc) {
-            buf_len = sprintf(buf, "%s: %s\r\n", line->name, line->value);
-            if (rio_writen(fd_server, buf, buf_len) < 0) {
-                return -1;
-            }
+    // Append remaining request header lines.
+    bool identity = compress_enabled() && request_cacheable(request, parser);
+    for (size_t i = 0; i < parser->nheaders; i++) {
+        line = &parser->headers[i];
+        if (header_is_replaced(line) ||
+            (identity && line->name_len == header_encoding.len &&
+             !strncasecmp(line->name, header_encoding.name, line->name_len)))
+            continue;
+        if (!header_put(buf, size, &len, line->name, line->name_len) ||
+            !header_put(buf, size, &len, ": ", 2) ||
+            !header_put(buf, size, &len, line->value, line->value_len) ||
+            !header_put(buf, size, &len, "\r\n", 2)) {
+            return -1;
         }
     }
-    // Write last line with \r\n
-    sprintf(buf, "\r\n");
-    if (rio_writen(fd_server, buf, buf_len) < 0) {
+    // End with empty line.
+    if (!header_put(buf, size, &len, "\r\n", 2)) {
         return -1;
     }
+    return (int)len;
+}
 
-    return 0;
+/**
+ * @brief Appends bytes to a header buffer.
+ *
+ * @param[out]    buf  : header buffer.
+ * @param[in]     size : size of <buf>.
+ * @param[in,out] len  : length of text in <buf>, updated on success.
+ * @param[in]     data : bytes to append.
+ * @param[in]     n    : number of bytes.
+ *
+ * @return true if the bytes fit in <buf>, false if not.
+ */
+static bool header_put(char *buf, size_t size, size_t *len, const char *data,
+                       size_t n) {
+    if (n > size - *len) {
+        return false;
+    }
+    memcpy(buf + *len, data, n);
+    *len += n;
+    return true;
+}
+
+/**
+ * @brief Returns whether a client request header is replaced or dropped
+ *     rather than forwarded.
+ *     Names compared by length first, so most fields take no string compare.
+ *
+ * @param[in] line : parsed header field.
+ */
+static bool header_is_replaced(const request_header *line) {
+    for (size_t i = 0; i < sizeof(header_replaced) / sizeof(*header_replaced);
+         i++) {
+        if (line->name_len == header_replaced[i].len &&
+            !strncasecmp(line->name, header_replaced[i].name, line->name_len))
+            return true;
+    }
+    return false;
 }
 
 /**
@@ -397,9 +1767,24 @@ static int write_header(int fd_server, client_info *client,
  * @param[in] shortmsg : short error message.
  * @param[in] longmsg  : long error message.
  */
-static void clienterror(int fd, const char *errnum, const char *shortmsg,
-                        const char *longmsg) {
+void clienterror(int fd, const char *errnum, const char *shortmsg,
+                 const char *longmsg) {
+    clientretry(fd, errnum, shortmsg, longmsg, 0);
+}
+
+/**
+ * @brief Returns an error message to the client, telling it when to retry.
+ *
+ * @param[in] fd       : file descriptor to write error message.
+ * @param[in] errnum   : HTTP error number to output.
+ * @param[in] shortmsg : short error message.
+ * @param[in] longmsg  : long error message.
+ * @param[in] retry    : seconds sent as Retry-After, 0 for none.
+ */
+void clientretry(int fd, const char *errnum, const char *shortmsg,
+                 const char *longmsg, long retry) {
     char buf[MAXLINE];
+    char after[40] = "";
     char body[MAXBUF];
     size_t buflen;
     size_t bodylen;
@@ -418,11 +1803,15 @@ static void clienterror(int fd, const char *errnum, const char *shortmsg,
         return; // Overflow!
     }
     // Build the HTTP response headers
+    if (retry > 0) {
+        snprintf(after, sizeof(after), "Retry-After: %ld\r\n", retry);
+    }
     buflen = snprintf(buf, MAXLINE,
                       "HTTP/1.0 %s %s\r\n"
                       "Content-Type: text/html\r\n"
+                      "%s"
                       "Content-Length: %zu\r\n\r\n",
-                      errnum, shortmsg, bodylen);
+                      errnum, shortmsg, after, bodylen);
     if (buflen >= MAXLINE) {
         return; // Overflow!
     }
@@ -0,0 +1,90 @@
+/**
+ * @file trace.h
+ * @brief Binary request trace for a tiny web proxy.
+ *
+ * With a trace file given, every answered request is recorded: when it was
+ * answered, a hash of its URI, the response bytes sent, and whether it was a
+ * cache hit, a miss, or never cacheable. Threads serving requests append
+ * fixed-size records to rings of their own, and a writer thread appends
+ * them to the file in batches, so tracing costs the serving path a few
+ * stores. Traces are replayed offline against the cache with different
+ * sizes and policies by bench/trace_replay.c.
+ *
+ * File format: TRACE_MAGIC, then trace_record structs back to back, in host
+ * byte order. A file appended to by several runs may hold the magic again
+ * only at its start.
+ *
+ * Descriptions of individual functions and data structures are provided in
+ * their respective leading comments.
+ *
+ * trace.c has more detailed implementation-related comments.
+ *
+ * @author Iltikin Wayet
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Bytes a trace file starts with.
+#define TRACE_MAGIC "TPTRACE1"
+#define TRACE_MAGIC_LEN 8
+
+// Records each thread's ring holds; a power of two.
+#define TRACE_RING 4096
+
+// Milliseconds between two flushes of the writer thread.
+#define TRACE_FLUSH_MS 100
+
+/**
+ * @brief How a traced request was answered.
+ */
+typedef enum {
+    TRACE_HIT,   // From the cache, including revalidated copies
+    TRACE_MISS,  // From the server, response cacheable by its headers
+    TRACE_BYPASS // From the server, request or response not cacheable
+} trace_result;
+
+/**
+ * @brief Trace record of one answered request; 24 bytes.
+ */
+typedef struct {
+    uint64_t time_us; // Wall-clock microseconds when recorded
+    uint64_t hash;    // 64-bit FNV-1a hash of the request URI
+    uint32_t size;    // Response bytes sent, saturated at UINT32_MAX
+    uint8_t result;   // trace_result of the request
+    uint8_t pad[3];   // Zero
+} trace_record;
+
+/**
+ * @brief Opens the trace file and starts the writer thread; call once,
+ *     before trace_request. Exits if the file cannot be opened.
+ *
+ * @param[in] path : trace file, appended to; NULL leaves tracing off.
+ */
+void trace_init(const char *path);
+
+/**
+ * @brief Returns whether requests are traced.
+ */
+bool trace_enabled(void);
+
+/**
+ * @brief Records an answered request, if tracing.
+ *     Never blocks; the record is dropped if the thread's ring is full.
+ *
+ * @param[in] uri    : request URI.
+ * @param[in] result : how the request was answered.
+ * @param[in] bytes  : response bytes sent to the client.
+ */
+void trace_request(const char *uri, trace_result result, uint64_t bytes);
+
+/**
+ * @brief Writes every record still in the rings to the trace file.
+ *     Called on shutdown, so that the last records are not lost.
+ */
+void trace_flush(void);
+
+#endif /* TRACE_H */
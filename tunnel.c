@@ -0,0 +1,415 @@
+/**
+ * @file tunnel.c
+ * @brief CONNECT tunnels for a tiny web proxy.
+ *
+ * Every tunnel has two directions, client to server and server to client,
+ * each with a pipe its bytes are spliced through, so tunneled bytes are
+ * never copied to user space. Key implementation details:
+ *     - Tunnels go to the pump threads round-robin. A pump waits on the
+ *       sockets of its tunnels with edge-triggered epoll; on any event it
+ *       pumps both directions until each would block, which is why both
+ *       sockets are registered for input and output at once.
+ *     - A direction empties its pipe into the destination before splicing
+ *       more from the source. The early bytes the client sent past its
+ *       request head go to the server before anything spliced.
+ *     - Half-close: a source at EOF, with everything it sent delivered, has
+ *       the destination shut down for writing; the other direction goes on.
+ *       A tunnel whose directions are both shut down is closed, as is one
+ *       with an error on either side.
+ *     - Front end threads queue new tunnels to a pump and wake it through
+ *       an eventfd; only the pump registers their sockets and lists them,
+ *       so a tunnel cannot be closed while it is being set up.
+ *     - Each pump sweeps its list of tunnels about once a second, closing
+ *       tunnels without events for TUNNEL_TIMEOUT seconds.
+ *     - Tunnels closed while handling a batch of events are freed after
+ *       it, as later events of the batch may still refer to them.
+ *     - A tunnel takes over the client connection's admission (see
+ *       admit.h) with its socket, and gives it back once closed, so
+ *       tunnels count against the connection cap for as long as they
+ *       are open.
+ *
+ * Descriptions of individual functions, data structures, and global variables
+ * are provided in their respective leading comments.
+ *
+ * @author Iltikin Wayet
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "tunnel.h"
+#include "admit.h"
+#include "splice.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+// Max events handled per epoll_wait call.
+#define TUNNEL_BATCH 64
+
+// Reply to a CONNECT request once the server is connected.
+static const char tunnel_reply[] =
+    "HTTP/1.1 200 Connection established\r\n\r\n";
+
+/**
+ * @brief One direction of a tunnel.
+ */
+typedef struct {
+    int from;     // Socket bytes are read from
+    int to;       // Socket bytes are written to
+    spipe pipe;   // Pipe bytes are spliced through
+    char *early;  // Bytes to write before any spliced, NULL if none
+    size_t left;  // Bytes of early not written yet
+    size_t sent;  // Bytes of early written
+    bool eof;     // Whether from reached EOF
+    bool shut;    // Whether to was shut down for writing
+} tunnel_dir;
+
+struct pump;
+
+/**
+ * @brief Data structure with per-tunnel state.
+ */
+typedef struct tunnel {
+    int client;            // Client socket descriptor
+    int server;            // Server socket descriptor
+    tunnel_dir up;         // Client to server
+    tunnel_dir down;       // Server to client
+    time_t active;         // When its sockets last had events
+    bool closed;           // Whether closed, awaiting free
+    struct pump *pump;     // Owning pump
+    struct tunnel *prev;   // Previous tunnel of the pump
+    struct tunnel *next;   // Next tunnel of the pump
+    struct tunnel *queued; // Next tunnel queued to the pump
+    struct tunnel *dead;   // Next closed tunnel awaiting free
+} tunnel;
+
+/**
+ * @brief Data structure with per-pump state.
+ */
+typedef struct pump {
+    int epfd;              // Epoll instance of the pump
+    int wakefd;            // Eventfd signaled when tunnels are queued
+    pthread_mutex_t mutex; // Mutex protecting queued
+    tunnel *queued;        // Tunnels queued, not yet registered
+    tunnel *tunnels;       // Tunnels registered with the pump
+    tunnel *dead;          // Tunnels closed during the current batch
+    time_t swept;          // When tunnels were last swept
+} pump;
+
+// Pump threads and how many there are.
+static pump *pumps = NULL;
+static size_t npumps = 0;
+
+// Count of tunnels started, picking the pump of the next one.
+static atomic_size_t started = 0;
+
+// ---------- HELPER PROTOTYPES ------------ //
+static void *pump_thread(void *vargp);
+static void pump_queued(pump *p);
+static void pump_sweep(pump *p, time_t now);
+static bool tunnel_pump(tunnel *t);
+static int dir_pump(tunnel_dir *d);
+static void tunnel_close(tunnel *t);
+
+// ---------- FUNCTION ROUTINES ------------ //
+
+/**
+ * @brief Starts the threads pumping tunnels; call once, before
+ *     tunnel_start.
+ *
+ * @param[in] count : number of pump threads, at least 1.
+ */
+void tunnel_init(size_t count) {
+    pumps = calloc(count, sizeof(pump));
+    if (pumps == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    npumps = count;
+    pthread_t tid;
+    for (size_t i = 0; i < count; i++) {
+        pump *p = &pumps[i];
+        pthread_mutex_init(&p->mutex, NULL);
+        p->swept = time(NULL);
+        if ((p->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+            perror("epoll_create1");
+            exit(1);
+        }
+        p->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+        if (p->wakefd < 0 ||
+            epoll_ctl(p->epfd, EPOLL_CTL_ADD, p->wakefd, &ev) < 0) {
+            perror("eventfd");
+            exit(1);
+        }
+        pthread_create(&tid, NULL, pump_thread, p);
+        pthread_detach(tid);
+    }
+}
+
+/**
+ * @brief Establishes a tunnel between a client and the server it asked
+ *     for, taking ownership of both sockets and of the client's admission.
+ *     The reply is written before the tunnel is queued to a pump, so
+ *     nothing from the server can reach the client ahead of it.
+ *
+ * @param[in] client    : client socket descriptor.
+ * @param[in] server    : connected server socket descriptor.
+ * @param[in] early     : client bytes already read past the request head.
+ * @param[in] early_len : length of <early>.
+ *
+ * @return true if established, false if not (both sockets closed, and
+ *     the admission given back).
+ */
+bool tunnel_start(int client, int server, const char *early,
+                  size_t early_len) {
+    tunnel *t = calloc(1, sizeof(tunnel));
+    if (t == NULL) {
+        close(client);
+        close(server);
+        admit_close();
+        return false;
+    }
+    t->client = client;
+    t->server = server;
+    t->up = (tunnel_dir){.from = client, .to = server,
+                         .pipe = {.fds = {-1, -1}}};
+    t->down = (tunnel_dir){.from = server, .to = client,
+                           .pipe = {.fds = {-1, -1}}};
+    if (early_len > 0 && (t->up.early = malloc(early_len)) != NULL) {
+        memcpy(t->up.early, early, early_len);
+        t->up.left = early_len;
+    }
+    fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+    fcntl(server, F_SETFL, fcntl(server, F_GETFL) | O_NONBLOCK);
+
+    if ((early_len > 0 && t->up.early == NULL) ||
+        !spipe_open(&t->up.pipe, true) || !spipe_open(&t->down.pipe, true) ||
+        send(client, tunnel_reply, sizeof(tunnel_reply) - 1, MSG_NOSIGNAL) !=
+            (ssize_t)(sizeof(tunnel_reply) - 1)) {
+        tunnel_close(t);
+        free(t);
+        return false;
+    }
+
+    pump *p = &pumps[atomic_fetch_add(&started, 1) % npumps];
+    t->pump = p;
+    pthread_mutex_lock(&p->mutex);
+    t->queued = p->queued;
+    p->queued = t;
+    pthread_mutex_unlock(&p->mutex);
+
+    uint64_t one = 1;
+    if (write(p->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("eventfd write");
+    return true;
+}
+
+/**
+ * @brief Returns whether <method> is CONNECT, asking for a tunnel.
+ *
+ * @param[in] method : request method.
+ */
+bool tunnel_requested(const char *method) {
+    return !strcasecmp(method, "CONNECT");
+}
+
+// ---------- HELPER ROUTINES ------------ //
+
+/**
+ * @brief Pump thread function.
+ *     Pumps tunnels with events, frees those closed during the batch, and
+ *     sweeps idle tunnels about once a second.
+ *
+ * @param[in] vargp : void* pointer to the pump's pump struct.
+ */
+static void *pump_thread(void *vargp) {
+    pump *p = (pump *)vargp;
+    struct epoll_event events[TUNNEL_BATCH];
+    while (1) {
+        int n = epoll_wait(p->epfd, events, TUNNEL_BATCH, 1000);
+        if (n < 0) {
+            if (errno != EINTR)
+                perror("epoll_wait");
+            continue;
+        }
+
+        time_t now = time(NULL);
+        for (int i = 0; i < n; i++) {
+            tunnel *t = events[i].data.ptr;
+            if (t == NULL) {
+                pump_queued(p);
+                continue;
+            }
+            if (t->closed)
+                continue;
+            t->active = now;
+            if (!tunnel_pump(t))
+                tunnel_close(t);
+        }
+        if (now != p->swept)
+            pump_sweep(p, now);
+
+        while (p->dead != NULL) {
+            tunnel *t = p->dead;
+            p->dead = t->dead;
+            free(t);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Registers the sockets of tunnels queued to a pump and lists them.
+ *     Edge-triggered events fire once for what is ready at registration,
+ *     so early bytes and bytes already received are pumped right away.
+ *
+ * @param[in] p : pump the tunnels were queued to.
+ */
+static void pump_queued(pump *p) {
+    uint64_t count;
+    if (read(p->wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("eventfd read");
+
+    pthread_mutex_lock(&p->mutex);
+    tunnel *t = p->queued;
+    p->queued = NULL;
+    pthread_mutex_unlock(&p->mutex);
+
+    time_t now = time(NULL);
+    while (t != NULL) {
+        tunnel *next = t->queued;
+        t->active = now;
+        t->prev = NULL;
+        t->next = p->tunnels;
+        if (p->tunnels != NULL)
+            p->tunnels->prev = t;
+        p->tunnels = t;
+
+        struct epoll_event ev = {
+            .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+            .data.ptr = t};
+        if (epoll_ctl(p->epfd, EPOLL_CTL_ADD, t->client, &ev) < 0 ||
+            epoll_ctl(p->epfd, EPOLL_CTL_ADD, t->server, &ev) < 0) {
+            perror("epoll_ctl");
+            tunnel_close(t);
+        }
+        t = next;
+    }
+}
+
+/**
+ * @brief Closes tunnels of a pump without events for TUNNEL_TIMEOUT
+ *     seconds.
+ *
+ * @param[in] p   : pump owning the tunnels.
+ * @param[in] now : current time.
+ */
+static void pump_sweep(pump *p, time_t now) {
+    p->swept = now;
+    tunnel *t = p->tunnels;
+    while (t != NULL) {
+        tunnel *next = t->next;
+        if (now - t->active >= TUNNEL_TIMEOUT)
+            tunnel_close(t);
+        t = next;
+    }
+}
+
+/**
+ * @brief Pumps both directions of a tunnel until each would block.
+ *
+ * @param[in] t : open tunnel.
+ *
+ * @return true if the tunnel stays open, false if it is finished.
+ */
+static bool tunnel_pump(tunnel *t) {
+    if (dir_pump(&t->up) < 0 || dir_pump(&t->down) < 0)
+        return false;
+    return !(t->up.shut && t->down.shut);
+}
+
+/**
+ * @brief Moves bytes of one direction of a tunnel until it would block.
+ *     Shuts the destination down for writing once the source is at EOF
+ *     and everything read is delivered.
+ *
+ * @param[in,out] d : direction to pump.
+ *
+ * @return 0 if waiting on either socket or done, -1 on error.
+ */
+static int dir_pump(tunnel_dir *d) {
+    ssize_t n;
+    while (!d->shut) {
+        if (d->left > 0) {
+            n = send(d->to, d->early + d->sent, d->left, MSG_NOSIGNAL);
+            if (n > 0) {
+                d->sent += n;
+                d->left -= n;
+            }
+        } else if (d->pipe.held > 0) {
+            n = spipe_drain(&d->pipe, d->to);
+        } else if (!d->eof) {
+            n = spipe_fill(&d->pipe, d->from, d->pipe.size);
+            if (n == 0) {
+                d->eof = true;
+                continue;
+            }
+        } else {
+            shutdown(d->to, SHUT_WR);
+            d->shut = true;
+            break;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno != EINTR)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Closes a tunnel and both its sockets; a tunnel listed by a pump
+ *     is unlisted and freed after the current batch.
+ *
+ * @param[in] t : tunnel to close.
+ */
+static void tunnel_close(tunnel *t) {
+    close(t->client);
+    close(t->server);
+    admit_close();
+    spipe_close(&t->up.pipe);
+    spipe_close(&t->down.pipe);
+    free(t->up.early);
+    t->closed = true;
+
+    pump *p = t->pump;
+    if (p == NULL)
+        return;
+    if (t->prev != NULL)
+        t->prev->next = t->next;
+    else
+        p->tunnels = t->next;
+    if (t->next != NULL)
+        t->next->prev = t->prev;
+    t->dead = p->dead;
+    p->dead = t;
+}
@@ -0,0 +1,67 @@
+/**
+ * @file tunnel.h
+ * @brief CONNECT tunnels for a tiny web proxy.
+ *
+ * A CONNECT request asks the proxy for a raw byte stream to host:port,
+ * usually for TLS. Once a front end has connected to the server, it hands
+ * both sockets over here: the client is told the tunnel is established,
+ * and from then on bytes are relayed both ways, unread and uninterpreted,
+ * until both sides are done or the tunnel sits idle for TUNNEL_TIMEOUT
+ * seconds. Tunnels are pumped by a few threads multiplexing all of them
+ * with epoll, so a long-lived tunnel holds neither a worker thread nor an
+ * event loop connection.
+ *
+ * Descriptions of individual functions and data structures are provided in
+ * their respective leading comments.
+ *
+ * tunnel.c has more detailed implementation-related comments.
+ *
+ * @author Iltikin Wayet
+ */
+
+#ifndef TUNNEL_H
+#define TUNNEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Default number of threads pumping tunnels.
+#define TUNNEL_PUMPS 2
+
+// Seconds a tunnel may go without relaying a byte before it is closed.
+#define TUNNEL_TIMEOUT 300
+
+/**
+ * @brief Starts the threads pumping tunnels; call once, before
+ *     tunnel_start.
+ *
+ * @param[in] pumps : number of pump threads, at least 1.
+ */
+void tunnel_init(size_t pumps);
+
+/**
+ * @brief Establishes a tunnel between a client and the server it asked
+ *     for, taking ownership of both sockets and of the client's admission
+ *     by admit_open, given back when the tunnel closes.
+ *     Replies 200 to the client's CONNECT, then relays both ways; <early>
+ *     bytes the client sent after its request head go to the server first.
+ *
+ * @param[in] client    : client socket descriptor.
+ * @param[in] server    : connected server socket descriptor.
+ * @param[in] early     : client bytes already read past the request head.
+ * @param[in] early_len : length of <early>.
+ *
+ * @return true if established, false if not (both sockets closed, and
+ *     the admission given back).
+ */
+bool tunnel_start(int client, int server, const char *early,
+                  size_t early_len);
+
+/**
+ * @brief Returns whether <method> is CONNECT, asking for a tunnel.
+ *
+ * @param[in] method : request method.
+ */
+bool tunnel_requested(const char *method);
+
+#endif /* TUNNEL_H */
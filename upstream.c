@@ -0,0 +1,343 @@
+/**
+ * @file upstream.c
+ * @brief Pool of persistent server connections for a tiny web proxy.
+ *
+ * Idle connections are grouped by origin, i.e. the "host:port" the request
+ * was made to, in a chained hash table. Key implementation details:
+ *     - Each origin keeps a stack of idle connections; the most recently
+ *       used connection is reused first, so the oldest ones age out.
+ *     - A pooled connection is checked with a non-blocking peek before
+ *       reuse; a server that closed it, or sent unexpected data, makes it
+ *       unusable and it is closed.
+ *     - Connections idle longer than UPSTREAM_IDLE_TIMEOUT are closed when
+ *       their origin is next used, since servers time them out anyway, or
+ *       by a sweeper thread waking every UPSTREAM_SWEEP_MS, whichever comes
+ *       first; origins never used again do not keep their sockets open.
+ *     - Origins without idle connections are removed from the table.
+ *     - Pool protected by one mutex; it is held only to push or pop a
+ *       connection, or for a sweep to unlink expired ones, never during
+ *       connect or I/O.
+ *
+ * Descriptions of individual functions, data structures, and global variables
+ * are provided in their respective leading comments.
+ *
+ * @author Iltikin Wayet
+ */
+
+#include "upstream.h"
+#include "cache.h"
+#include "csapp.h"
+#include "dns.h"
+#include "hash.h"
+#include "ring.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * @brief Idle pooled server connection.
+ */
+struct idle_conn {
+    int fd;                 // Connected socket descriptor
+    time_t since;           // Time the connection became idle
+    struct idle_conn *next; // Pointer to next (older) idle connection
+};
+typedef struct idle_conn iconn;
+
+/**
+ * @brief Pooled origin, with its idle connections.
+ */
+struct origin {
+    char *key;           // Origin key, "host:port"
+    uint64_t hash;       // Hash of key
+    iconn *idle;         // Stack of idle connections, newest first
+    size_t nidle;        // Number of idle connections
+    struct origin *next; // Pointer to next origin in bucket
+};
+typedef struct origin origin;
+
+// Idle connections kept per origin, 0 if pooling disabled.
+static size_t max_idle;
+// Origin hash table.
+static origin *origins[UPSTREAM_BUCKETS];
+// Mutex protecting origins.
+static pthread_mutex_t upstream_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// ---------- HELPER PROTOTYPES ------------ //
+static char *origin_key(const char *host, const char *port);
+static origin **origin_find(const char *key, uint64_t hash);
+static bool conn_alive(int fd);
+static iconn *origin_expire(origin *o, time_t now);
+static void conns_close(iconn *conn);
+static void sweep(void);
+
+// ---------- FUNCTION ROUTINES ------------ //
+
+/**
+ * @brief Initializes the connection pool, and starts its sweeper thread.
+ *
+ * @param[in] max : idle connections kept per origin, 0 disables pooling.
+ */
+void upstream_init(size_t max) {
+    max_idle = max;
+    if (max_idle > 0 && !ring_writer(UPSTREAM_SWEEP_MS, sweep)) {
+        fprintf(stderr, "Could not start the connection pool sweeper; idle "
+                        "connections expire on reuse alone\n");
+    }
+}
+
+/**
+ * @brief Returns whether server connections are pooled.
+ */
+bool upstream_pooling(void) {
+    return max_idle > 0;
+}
+
+/**
+ * @brief Returns a connection to <host>:<port>.
+ *     Pooled idle connection reused if still open, else a new one opened.
+ *     Expired and dead pooled connections closed along the way.
+ *
+ * @param[in]  host   : server host.
+ * @param[in]  port   : server port.
+ * @param[out] reused : whether the connection came from the pool.
+ *
+ * @return connected socket descriptor, -1 if error.
+ */
+int upstream_get(const char *host, const char *port, bool *reused) {
+    *reused = false;
+    if (max_idle == 0)
+        return dns_open_clientfd(host, port);
+
+    char *key = origin_key(host, port);
+    uint64_t hash = hash_origin(host, port);
+    time_t now = time(NULL);
+    int fd = -1;
+
+    while (fd < 0) {
+        // Pop the newest idle connection, if any.
+        pthread_mutex_lock(&upstream_mutex);
+        origin **link = origin_find(key, hash);
+        origin *o = *link;
+        iconn *expired = (o != NULL) ? origin_expire(o, now) : NULL;
+        iconn *conn = (o != NULL) ? o->idle : NULL;
+        if (conn != NULL) {
+            o->idle = conn->next;
+            o->nidle--;
+        }
+        if (o != NULL && o->idle == NULL) {
+            *link = o->next;
+            free(o->key);
+            free(o);
+        }
+        pthread_mutex_unlock(&upstream_mutex);
+
+        // Close expired connections outside the lock.
+        conns_close(expired);
+        if (conn == NULL)
+            break;
+
+        if (conn_alive(conn->fd)) {
+            fd = conn->fd;
+            *reused = true;
+        } else {
+            close(conn->fd);
+        }
+        free(conn);
+    }
+    free(key);
+
+    if (fd < 0)
+        fd = dns_open_clientfd(host, port);
+    return fd;
+}
+
+/**
+ * @brief Returns an idle connection to <host>:<port> to the pool.
+ *     Connection closed instead if the origin already has enough idle ones.
+ *
+ * @param[in] host : server host.
+ * @param[in] port : server port.
+ * @param[in] fd   : connected socket descriptor, with no unread response.
+ */
+void upstream_put(const char *host, const char *port, int fd) {
+    if (max_idle == 0) {
+        close(fd);
+        return;
+    }
+    char *key = origin_key(host, port);
+    uint64_t hash = hash_origin(host, port);
+    iconn *conn = malloc_w(sizeof(iconn));
+    conn->fd = fd;
+    conn->since = time(NULL);
+
+    pthread_mutex_lock(&upstream_mutex);
+    origin *o = *origin_find(key, hash);
+    if (o == NULL) {
+        o = malloc_w(sizeof(origin));
+        o->key = key;
+        o->hash = hash;
+        o->idle = NULL;
+        o->nidle = 0;
+        o->next = origins[hash % UPSTREAM_BUCKETS];
+        origins[hash % UPSTREAM_BUCKETS] = o;
+        key = NULL;
+    }
+    if (o->nidle < max_idle) {
+        conn->next = o->idle;
+        o->idle = conn;
+        o->nidle++;
+        conn = NULL;
+    }
+    pthread_mutex_unlock(&upstream_mutex);
+
+    // Origin already has enough idle connections.
+    if (conn != NULL) {
+        close(conn->fd);
+        free(conn);
+    }
+    free(key);
+}
+
+/**
+ * @brief Closes all pooled connections and frees the pool.
+ */
+void upstream_free(void) {
+    pthread_mutex_lock(&upstream_mutex);
+    for (size_t i = 0; i < UPSTREAM_BUCKETS; i++) {
+        origin *o = origins[i];
+        while (o != NULL) {
+            origin *next = o->next;
+            conns_close(o->idle);
+            free(o->key);
+            free(o);
+            o = next;
+        }
+        origins[i] = NULL;
+    }
+    pthread_mutex_unlock(&upstream_mutex);
+}
+
+// ---------- HELPER ROUTINES ------------ //
+
+/**
+ * @brief Returns a newly allocated origin key, "host:port".
+ *
+ * @param[in] host : server host.
+ * @param[in] port : server port.
+ */
+static char *origin_key(const char *host, const char *port) {
+    size_t len = strlen(host) + strlen(port) + 2;
+    char *key = malloc_w(len);
+    snprintf(key, len, "%s:%s", host, port);
+    return key;
+}
+
+/**
+ * @brief Finds the link to origin <key> in its bucket. Requires the mutex.
+ *
+ * @param[in] key  : origin key.
+ * @param[in] hash : hash of key.
+ *
+ * @return pointer to the link holding the origin; holds NULL if not pooled.
+ */
+static origin **origin_find(const char *key, uint64_t hash) {
+    origin **link = &origins[hash % UPSTREAM_BUCKETS];
+    while (*link != NULL &&
+           ((*link)->hash != hash || strcmp((*link)->key, key) != 0)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+/**
+ * @brief Returns whether an idle connection is still usable.
+ *     An open idle connection has nothing to read; EOF means the server
+ *     closed it, and data means a stray response left on it.
+ *
+ * @param[in] fd : idle connected socket descriptor.
+ */
+static bool conn_alive(int fd) {
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/**
+ * @brief Unlinks the idle connections of an origin that have expired.
+ *     Requires the mutex.
+ *
+ * @param[in] o   : pooled origin.
+ * @param[in] now : current time.
+ *
+ * @return list of the expired connections, oldest last, NULL if none.
+ */
+static iconn *origin_expire(origin *o, time_t now) {
+    // Connections get older down the stack; cut it at the first expired.
+    iconn **link = &o->idle;
+    size_t kept = 0;
+    while (*link != NULL && now - (*link)->since <= UPSTREAM_IDLE_TIMEOUT) {
+        link = &(*link)->next;
+        kept++;
+    }
+    iconn *expired = *link;
+    *link = NULL;
+    o->nidle = kept;
+    return expired;
+}
+
+/**
+ * @brief Closes and frees a list of connections unlinked from the pool.
+ *
+ * @param[in] conn : first connection of the list, NULL if empty.
+ */
+static void conns_close(iconn *conn) {
+    while (conn != NULL) {
+        iconn *next = conn->next;
+        close(conn->fd);
+        free(conn);
+        conn = next;
+    }
+}
+
+/**
+ * @brief Sweeper function, called every UPSTREAM_SWEEP_MS milliseconds.
+ *     Closes every expired idle connection, and drops origins left with
+ *     none; connections are closed once the mutex is released.
+ */
+static void sweep(void) {
+    time_t now = time(NULL);
+    iconn *expired = NULL;
+    pthread_mutex_lock(&upstream_mutex);
+    for (size_t i = 0; i < UPSTREAM_BUCKETS; i++) {
+        origin **link = &origins[i];
+        while (*link != NULL) {
+            origin *o = *link;
+            iconn *conn = origin_expire(o, now);
+            if (conn != NULL) {
+                iconn *last = conn;
+                while (last->next != NULL)
+                    last = last->next;
+                last->next = expired;
+                expired = conn;
+            }
+            if (o->idle == NULL) {
+                *link = o->next;
+                free(o->key);
+                free(o);
+            } else {
+                link = &o->next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&upstream_mutex);
+    conns_close(expired);
+}
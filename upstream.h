@@ -0,0 +1,72 @@
+/**
+ * @file upstream.h
+ * @brief Pool of persistent server connections for a tiny web proxy.
+ *
+ * Keeps idle HTTP/1.1 keep-alive connections to origin servers, keyed by
+ * (host, port), so that cache misses to the same server skip the TCP
+ * handshake. Each origin keeps at most a configured number of idle
+ * connections, and connections idle longer than UPSTREAM_IDLE_TIMEOUT are
+ * closed instead of reused, by a sweep every UPSTREAM_SWEEP_MS if their
+ * origin is not used again first; an origin used once never holds its
+ * sockets past that.
+ *
+ * upstream.c has more detailed implementation-related comments.
+ *
+ * @author Iltikin Wayet
+ */
+
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Default idle connections kept per origin.
+#define UPSTREAM_MAX_IDLE 8
+// Seconds an idle connection may stay pooled.
+#define UPSTREAM_IDLE_TIMEOUT 30
+// Milliseconds between two sweeps of expired idle connections.
+#define UPSTREAM_SWEEP_MS 5000
+// Number of origin hash buckets.
+#define UPSTREAM_BUCKETS 256
+
+/**
+ * @brief Initializes the connection pool, and starts its sweeper thread.
+ *
+ * @param[in] max_idle : idle connections kept per origin, 0 disables pooling.
+ */
+void upstream_init(size_t max_idle);
+
+/**
+ * @brief Returns whether server connections are pooled.
+ */
+bool upstream_pooling(void);
+
+/**
+ * @brief Returns a connection to <host>:<port>.
+ *     Pooled idle connection reused if still open, else a new one opened.
+ *
+ * @param[in]  host   : server host.
+ * @param[in]  port   : server port.
+ * @param[out] reused : whether the connection came from the pool.
+ *
+ * @return connected socket descriptor, -1 if error.
+ */
+int upstream_get(const char *host, const char *port, bool *reused);
+
+/**
+ * @brief Returns an idle connection to <host>:<port> to the pool.
+ *     Connection closed instead if the origin already has enough idle ones.
+ *
+ * @param[in] host : server host.
+ * @param[in] port : server port.
+ * @param[in] fd   : connected socket descriptor, with no unread response.
+ */
+void upstream_put(const char *host, const char *port, int fd);
+
+/**
+ * @brief Closes all pooled connections and frees the pool.
+ */
+void upstream_free(void);
+
+#endif /* UPSTREAM_H */
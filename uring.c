@@ -0,0 +1,1465 @@
+/**
+ * @file uring.c
+ * @brief io_uring front end implementation for a tiny web proxy.
+ *
+ * Every loop owns an io_uring instance, a ring of receive buffers, and a set
+ * of connections; connections never migrate between loops. A connection has
+ * at most one operation of its own in flight, except for the linked connect
+ * and send, and moves on when it completes, as the epoll front end moves on
+ * when a descriptor is ready.
+ *
+ * Key implementation details:
+ *     - Rings are set up and driven with the raw system calls, sharing the
+ *       submission and completion queues with the kernel through mmap; the
+ *       queue indexes are published with release stores and read with
+ *       acquire loads, as the kernel does on its side.
+ *     - Each loop iteration submits everything queued since the last one and
+ *       waits for at least one completion in the same io_uring_enter call,
+ *       then handles every completion posted.
+ *     - Completions carry the connection pointer with the operation in its
+ *       low bits; accepts and lookup wakeups carry no connection.
+ *     - Receives pick a buffer from a ring of URING_BUFS provided buffers.
+ *       Request bytes are copied out into the connection, so the buffer goes
+ *       back at once; a response chunk is sent to the client from its buffer
+ *       and returned after the send. When the ring is empty, the receive
+ *       goes to the connection's own buffer instead.
+ *     - Large hits are sent with SEND_ZC from cached text in place. The
+ *       block stays pinned until the kernel is done with its pages, which
+ *       it signals with a second completion. The arenas are not registered
+ *       as fixed buffers: registration pins the pages of the moment, while
+ *       an arena punches freed pages out of its memory file and faults in
+ *       fresh ones on reuse, so sends would read stale text.
+ *     - A connect is linked to the send of the request; a failed connect
+ *       cancels the send and the next resolved address is tried.
+ *     - A closed connection is released once no operation of it is in
+ *       flight, and kept on a spare list of the loop; connections are only
+ *       allocated while the list is empty, so hits at steady state
+ *       allocate nothing. Lookup completions queue a node of the
+ *       connection.
+ *     - Server names are resolved by the resolver threads of dns.c; a lookup
+ *       completed there is queued to the owning loop, whose ring has a read
+ *       of an eventfd in flight for it.
+ *     - Concurrent misses on one URI share one server fetch (see fetch.h),
+ *       as in the epoll front end: followers send the text the leader
+ *       published from its pinned block, and wait with nothing in flight,
+ *       woken through the same queue and eventfd as lookups.
+ *     - As in the epoll front end, each client connection carries one
+ *       request and server connections close after the response; stale
+ *       copies with validators are revalidated, a 304 in the first chunk
+ *       sending the refreshed copy as a hit. CONNECT requests connect
+ *       without a linked send and are handed to a tunnel.
+ *
+ * Descriptions of individual functions, data structures, and global variables
+ * are provided in their respective leading comments.
+ *
+ * @author Iltikin Wayet
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "uring.h"
+#include "accesslog.h"
+#include "admit.h"
+#include "cache.h"
+#include "compress.h"
+#include "csapp.h"
+#include "dns.h"
+#include "fetch.h"
+#include "metrics.h"
+#include "proxy.h"
+#include "request.h"
+#include "response.h"
+#include "trace.h"
+#include "tunnel.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+
+// Built with io_uring only if the kernel headers have everything used here.
+#if defined(IORING_ACCEPT_MULTISHOT) && defined(IORING_RECVSEND_POLL_FIRST) && \
+    defined(IORING_CQE_F_NOTIF) && defined(IORING_SETUP_DEFER_TASKRUN) &&     \
+    defined(__NR_io_uring_setup)
+#define URING_SUPPORTED
+#endif
+
+#ifndef URING_SUPPORTED
+
+/**
+ * @brief Stands in for the io_uring front end in builds without it.
+ *
+ * @return false, always.
+ */
+bool uring_run(const int *listenfds, size_t nloops, bool pin) {
+    (void)listenfds;
+    (void)nloops;
+    (void)pin;
+    return false;
+}
+
+#else
+
+// Submission queue entries per loop; the completion queue has four times as
+// many, since accepts and zero-copy sends complete more than once.
+#define URING_ENTRIES 1024
+
+// Provided receive buffers per loop (power of two), and the size of each.
+#define URING_BUFS 256
+#define URING_BUF_SIZE (16 * 1024)
+
+// Buffer group of the provided receive buffers.
+#define URING_GROUP 0
+
+/**
+ * @brief Operations submitted, kept in the low bits of the user data.
+ */
+typedef enum {
+    OP_ACCEPT,  // Multishot accept on the listening socket
+    OP_WAKE,    // Read of the eventfd signaled when lookups complete
+    OP_REQUEST, // Receive of request bytes from the client
+    OP_HIT,     // Send of cached or followed text to the client
+    OP_CONNECT, // Connect to the server, linked to OP_SEND
+    OP_SEND,    // Send of the request to the server
+    OP_RECV,    // Receive of response bytes from the server
+    OP_RELAY    // Send of response bytes to the client
+} uring_op;
+
+// Bits of the user data holding the operation.
+#define OP_MASK 7
+
+/**
+ * @brief Connection states; see uring.h for the overall flow.
+ */
+typedef enum {
+    UCONN_REQUEST, // Reading request line and headers from client
+    UCONN_HIT,     // Sending cached text to client
+    UCONN_FOLLOW,  // Sending text of a fetch another connection leads
+    UCONN_RESOLVE, // Waiting for the server name to be resolved
+    UCONN_CONNECT, // Connecting to server and sending the request
+    UCONN_RELAY,   // Relaying server response to client
+    UCONN_CLOSED   // Closed; released once no operation is in flight
+} uconn_state;
+
+/**
+ * @brief Submission and completion queues shared with the kernel.
+ */
+typedef struct {
+    int fd;                     // io_uring instance
+    unsigned *sq_head;          // Submission queue head, kernel written
+    unsigned *sq_tail;          // Submission queue tail, published here
+    unsigned sq_mask;           // Submission queue index mask
+    unsigned sq_entries;        // Submission queue size
+    unsigned sq_local;          // Tail of entries queued, not yet published
+    struct io_uring_sqe *sqes;  // Submission queue entries
+    unsigned *cq_head;          // Completion queue head, published here
+    unsigned *cq_tail;          // Completion queue tail, kernel written
+    unsigned cq_mask;           // Completion queue index mask
+    struct io_uring_cqe *cqes;  // Completion queue entries
+    unsigned submitted;         // Entries published at the last enter
+} uring;
+
+struct uloop;
+struct uconn;
+
+/**
+ * @brief Name resolution completed, or a followed fetch changed, for a
+ *     connection, queued to its loop.
+ */
+typedef struct uresolved {
+    struct uconn *conn;     // Connection in UCONN_RESOLVE or UCONN_FOLLOW
+    dns_entry *entry;       // Resolved server name, NULL for a fetch
+    struct uresolved *next; // Pointer to next completion
+} uresolved;
+
+/**
+ * @brief Data structure with per-connection state.
+ */
+typedef struct uconn {
+    uconn_state state;           // Current state
+    struct uloop *loop;          // Owning loop
+    int client;                  // Client socket descriptor
+    int server;                  // Server socket descriptor, -1 if none
+    request_info request;        // Client request information
+    request_parser parser;       // Parser of the client request head
+    dns_entry *dns;              // Resolved server name, NULL if pending
+    const struct addrinfo *addr; // Server address being connected to
+    cblock *block;               // Pinned cache block on a hit
+    cblock *stale;               // Stale copy being revalidated, or NULL
+    dentry *entry;               // Pinned disk tier record on a disk hit
+    cplain plain;                // Kept buffer compressed hits inflate into
+    size_t plain_len;            // Length of the hit inflated into plain
+    size_t sent;                 // Bytes of hit, request, or chunk sent
+    char in[MAXLINE];            // Request bytes read from client
+    size_t in_len;               // Length of in
+    size_t head_len;             // Length of the request head in in
+    char out[MAXBUF];            // Request to server, else response chunk
+    size_t out_len;              // Length of the request in out
+    const char *chunk;           // Response chunk being relayed
+    size_t chunk_len;            // Length of chunk
+    int bid;                     // Ring buffer holding chunk, -1 if none
+    bool failed;                 // Whether connecting to addr failed
+    bool error;                  // Whether sending the request failed
+    cfill *fill;                 // Cache fill of response, NULL if uncacheable
+    bool checked;                // Whether response head was checked
+    bool storable;               // Whether the response may be cached
+    size_t response_head;        // Length of the checked response head
+    ssize_t content_length;      // Its Content-Length, -1 if absent
+    size_t relayed;              // Response bytes relayed to client
+    int origin;                  // Origin slot counting the fetch, or -1
+    fetch *fetch;                // Fetch led or followed, NULL if none
+    bool leader;                 // Whether the connection leads fetch
+    bool dead;                   // Whether sending to the client failed
+    fetch_waiter waiter;         // Wakes a UCONN_FOLLOW connection
+    int inflight;                // Operations submitted, not yet completed
+    uresolved done;              // Queues the completed lookup to the loop
+    struct uconn *next_spare;    // Next connection kept for reuse
+    mtimer timer;                // Timings of the request
+} uconn;
+
+/**
+ * @brief Data structure with per-loop state.
+ */
+typedef struct uloop {
+    uring ring;                    // io_uring instance of the loop
+    int listenfd;                  // Listening socket descriptor of the loop
+    int cpu;                       // CPU the loop is pinned to, -1 if not
+    int wakefd;                    // Eventfd signaled when lookups complete
+    uint64_t wakes;                // Count read from wakefd
+    struct io_uring_buf_ring *br;  // Ring of provided receive buffers
+    char *bufs;                    // Memory of the provided buffers
+    unsigned short br_tail;        // Tail of the buffer ring
+    pthread_mutex_t mutex;         // Mutex protecting done
+    uresolved *done;               // Completed lookups not yet handled
+    uconn *spare;                  // Freed connections kept for reuse
+} uloop;
+
+// ---------- HELPER PROTOTYPES ------------ //
+static void *uring_loop(void *vargp);
+static bool ring_init(uring *ring);
+static struct io_uring_sqe *ring_sqe(uring *ring);
+static int ring_enter(uring *ring, unsigned wait);
+static int ring_register(uring *ring, unsigned opcode, void *arg,
+                         unsigned nargs);
+static void loop_init(uloop *loop);
+static void loop_accept(uloop *loop);
+static void loop_wait(uloop *loop);
+static void loop_resolved(uloop *loop);
+static void loop_complete(uloop *loop, const struct io_uring_cqe *cqe);
+static void buf_recycle(uloop *loop, int bid);
+static void conn_start(uloop *loop, int fd);
+static void conn_notify(dns_entry *entry, void *arg);
+static void conn_wake(void *arg);
+static void conn_queue(uconn *c, dns_entry *entry);
+static void conn_recv(uconn *c, uring_op op, bool select);
+static void conn_send(uconn *c, uring_op op, const char *data, size_t n);
+static void conn_complete(uconn *c, uring_op op, int res, unsigned flags);
+static void conn_request(uconn *c, int res, unsigned flags);
+static void conn_lookup(uconn *c);
+static bool conn_cached(uconn *c);
+static void conn_hit(uconn *c);
+static void conn_follow(uconn *c);
+static void conn_upstream(uconn *c);
+static void conn_resolved(uconn *c);
+static void conn_open(uconn *c);
+static void conn_connected(uconn *c);
+static void conn_response(uconn *c, int res, unsigned flags);
+static void conn_relayed(uconn *c, size_t n);
+static void conn_revalidated(uconn *c, const response_info *response,
+                             time_t now);
+static void conn_share(uconn *c);
+static void conn_unlead(uconn *c, bool ok);
+static void conn_close(uconn *c);
+static void conn_free(uconn *c);
+
+// ---------- FUNCTION ROUTINES ------------ //
+
+/**
+ * @brief Serves client connections accepted on <listenfds> forever with
+ *     io_uring, if the kernel supports what it needs.
+ *     A probe ring checks for setup flags and provided buffer rings first;
+ *     then <nloops> - 1 loops run in detached threads and the last one in
+ *     the calling thread, each setting up its own ring.
+ *
+ * @param[in] listenfds : listening socket descriptor of each loop.
+ * @param[in] nloops    : number of loops, at least 1.
+ * @param[in] pin       : whether loop i is pinned to CPU i.
+ *
+ * @return false, with nothing served, if io_uring cannot be used; does not
+ *     return otherwise.
+ */
+bool uring_run(const int *listenfds, size_t nloops, bool pin) {
+    uring probe;
+    if (!ring_init(&probe))
+        return false;
+    struct io_uring_buf_reg reg = {.ring_addr = 0,
+                                   .ring_entries = URING_BUFS,
+                                   .bgid = URING_GROUP};
+    void *br = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf),
+                    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    reg.ring_addr = (uintptr_t)br;
+    bool usable =
+        br != MAP_FAILED &&
+        ring_register(&probe, IORING_REGISTER_PBUF_RING, &reg, 1) == 0;
+    close(probe.fd);
+    if (br != MAP_FAILED)
+        munmap(br, URING_BUFS * sizeof(struct io_uring_buf));
+    if (!usable)
+        return false;
+
+    pthread_t tid;
+    for (size_t i = 0; i < nloops; i++) {
+        uloop *loop = malloc_w(sizeof(uloop));
+        loop->listenfd = listenfds[i];
+        loop->cpu = pin ? (int)i : -1;
+        if (i == nloops - 1) {
+            uring_loop(loop);
+        } else {
+            pthread_create(&tid, NULL, uring_loop, loop);
+            pthread_detach(tid);
+        }
+    }
+    return true;
+}
+
+// ---------- HELPER ROUTINES ------------ //
+
+/**
+ * @brief Loop thread function.
+ *     Sets up the loop's ring, then submits and handles completions
+ *     forever.
+ *
+ * @param[in] vargp : void* pointer to the loop's uloop struct.
+ */
+static void *uring_loop(void *vargp) {
+    uloop *loop = (uloop *)vargp;
+    if (loop->cpu >= 0)
+        pin_thread(loop->cpu);
+    loop_init(loop);
+    loop_accept(loop);
+    loop_wait(loop);
+
+    uring *ring = &loop->ring;
+    while (1) {
+        if (ring_enter(ring, 1) < 0 && errno != EINTR && errno != EBUSY) {
+            perror("io_uring_enter");
+            continue;
+        }
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            loop_complete(loop, &ring->cqes[head & ring->cq_mask]);
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Sets up an io_uring instance and maps its queues.
+ *     Prefers a ring only this thread submits to, running completion work
+ *     when it waits; older kernels get a plain one.
+ *
+ * @param[out] ring : ring to initialize.
+ *
+ * @return true if set up, false if io_uring is unavailable.
+ */
+static bool ring_init(uring *ring) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL |
+              IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER |
+              IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = URING_ENTRIES * 4;
+    ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (ring->fd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = URING_ENTRIES * 4;
+        ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    }
+    if (ring->fd < 0)
+        return false;
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && cq_size > sq_size)
+        sq_size = cq_size;
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    char *cq = single ? sq
+                      : mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd,
+                             IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        close(ring->fd);
+        return false;
+    }
+
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+    ring->sq_local = *ring->sq_tail;
+    ring->submitted = ring->sq_local;
+    // Queue slot i always submits entry i.
+    unsigned *array = (unsigned *)(sq + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++)
+        array[i] = i;
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return true;
+}
+
+/**
+ * @brief Returns a cleared submission queue entry to fill in.
+ *     Submits what is queued first if the queue is full.
+ *
+ * @param[in] ring : ring to queue on.
+ */
+static struct io_uring_sqe *ring_sqe(uring *ring) {
+    while (ring->sq_local - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) ==
+           ring->sq_entries) {
+        if (ring_enter(ring, 0) < 0 && errno != EINTR && errno != EBUSY &&
+            errno != EAGAIN) {
+            perror("io_uring_enter");
+        }
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sq_local & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_local++;
+    return sqe;
+}
+
+/**
+ * @brief Publishes queued entries and submits them, waiting for <wait>
+ *     completions.
+ *
+ * @param[in] ring : ring to submit on.
+ * @param[in] wait : completions to wait for, 0 to return at once.
+ *
+ * @return entries submitted, -1 on error (errno set).
+ */
+static int ring_enter(uring *ring, unsigned wait) {
+    __atomic_store_n(ring->sq_tail, ring->sq_local, __ATOMIC_RELEASE);
+    unsigned n = ring->sq_local - ring->submitted;
+    int res = syscall(__NR_io_uring_enter, ring->fd, n, wait,
+                      wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (res > 0)
+        ring->submitted += res;
+    return res;
+}
+
+/**
+ * @brief Registers resources with a ring.
+ *
+ * @param[in] ring   : ring to register with.
+ * @param[in] opcode : IORING_REGISTER_* operation.
+ * @param[in] arg    : operation argument.
+ * @param[in] nargs  : number of entries in <arg>.
+ *
+ * @return 0 if successful, -1 on error (errno set).
+ */
+static int ring_register(uring *ring, unsigned opcode, void *arg,
+                         unsigned nargs) {
+    return syscall(__NR_io_uring_register, ring->fd, opcode, arg, nargs);
+}
+
+/**
+ * @brief Sets up the ring, buffer ring, and eventfd of a loop; exits if
+ *     any cannot be set up.
+ *
+ * @param[in] loop : loop to set up.
+ */
+static void loop_init(uloop *loop) {
+    loop->done = NULL;
+    loop->spare = NULL;
+    pthread_mutex_init(&loop->mutex, NULL);
+    if (!ring_init(&loop->ring)) {
+        perror("io_uring_setup");
+        exit(1);
+    }
+
+    // Provided receive buffers, all handed to the kernel.
+    struct io_uring_buf_reg reg = {.ring_entries = URING_BUFS,
+                                   .bgid = URING_GROUP};
+    loop->br = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf),
+                    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    reg.ring_addr = (uintptr_t)loop->br;
+    if (loop->br == MAP_FAILED ||
+        ring_register(&loop->ring, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        perror("io_uring buffer ring");
+        exit(1);
+    }
+    loop->bufs = malloc_w((size_t)URING_BUFS * URING_BUF_SIZE);
+    loop->br_tail = 0;
+    for (int bid = 0; bid < URING_BUFS; bid++)
+        buf_recycle(loop, bid);
+
+    if ((loop->wakefd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        perror("eventfd");
+        exit(1);
+    }
+}
+
+/**
+ * @brief Submits the multishot accept of the loop's listening socket.
+ *     One multishot accept has no room for client addresses; the access
+ *     log asks the socket for those of sampled connections.
+ *
+ * @param[in] loop : loop accepting connections.
+ */
+static void loop_accept(uloop *loop) {
+    struct io_uring_sqe *sqe = ring_sqe(&loop->ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->listenfd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = OP_ACCEPT;
+}
+
+/**
+ * @brief Submits the read of the loop's eventfd, completed when a lookup
+ *     of one of its connections completes.
+ *
+ * @param[in] loop : loop waiting on lookups.
+ */
+static void loop_wait(uloop *loop) {
+    struct io_uring_sqe *sqe = ring_sqe(&loop->ring);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = loop->wakefd;
+    sqe->addr = (uintptr_t)&loop->wakes;
+    sqe->len = sizeof(loop->wakes);
+    sqe->user_data = OP_WAKE;
+}
+
+/**
+ * @brief Moves on connections whose server name lookup completed, or whose
+ *     followed fetch changed.
+ *
+ * @param[in] loop : loop owning the connections.
+ */
+static void loop_resolved(uloop *loop) {
+    pthread_mutex_lock(&loop->mutex);
+    uresolved *done = loop->done;
+    loop->done = NULL;
+    pthread_mutex_unlock(&loop->mutex);
+
+    while (done != NULL) {
+        uresolved *next = done->next;
+        if (done->conn->state == UCONN_RESOLVE) {
+            done->conn->dns = done->entry;
+            conn_resolved(done->conn);
+        } else {
+            conn_follow(done->conn);
+        }
+        if (done->conn->state == UCONN_CLOSED && done->conn->inflight == 0)
+            conn_free(done->conn);
+        done = next;
+    }
+}
+
+/**
+ * @brief Handles one completion: hands it to its connection, re-arms
+ *     accepts and wakeups, and frees connections it finished.
+ *
+ * @param[in] loop : loop owning the ring.
+ * @param[in] cqe  : completion.
+ */
+static void loop_complete(uloop *loop, const struct io_uring_cqe *cqe) {
+    uring_op op = cqe->user_data & OP_MASK;
+    uconn *c = (uconn *)(uintptr_t)(cqe->user_data & ~(uint64_t)OP_MASK);
+    if (op == OP_ACCEPT) {
+        if (cqe->res >= 0)
+            conn_start(loop, cqe->res);
+        else if (cqe->res != -EAGAIN && cqe->res != -EINTR)
+            fprintf(stderr, "accept: %s\n", strerror(-cqe->res));
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            loop_accept(loop);
+    } else if (op == OP_WAKE) {
+        loop_resolved(loop);
+        loop_wait(loop);
+    } else {
+        conn_complete(c, op, cqe->res, cqe->flags);
+        if (c->state == UCONN_CLOSED && c->inflight == 0)
+            conn_free(c);
+    }
+}
+
+/**
+ * @brief Hands a provided buffer back to the kernel.
+ *
+ * @param[in] loop : loop owning the buffer ring.
+ * @param[in] bid  : buffer index.
+ */
+static void buf_recycle(uloop *loop, int bid) {
+    struct io_uring_buf *buf =
+        &loop->br->bufs[loop->br_tail & (URING_BUFS - 1)];
+    buf->addr = (uintptr_t)(loop->bufs + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    loop->br_tail++;
+    __atomic_store_n(&loop->br->tail, loop->br_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Sets up a connection for an accepted client and starts reading
+ *     its request.
+ *     Connections come from the loop's spare list, allocated only when it
+ *     is empty.
+ *
+ * @param[in] loop : loop that accepted the client.
+ * @param[in] fd   : client socket descriptor.
+ */
+static void conn_start(uloop *loop, int fd) {
+    if (!admit_open()) {
+        metrics_count(METRIC_SHED_LOAD, 1);
+        clientretry(fd, "503", "Service Unavailable",
+                    "Tiny is serving too many clients", ADMIT_RETRY_AFTER);
+        close(fd);
+        return;
+    }
+    uconn *c = loop->spare;
+    if (c != NULL)
+        loop->spare = c->next_spare;
+    else {
+        c = malloc_w(sizeof(uconn));
+        c->plain = (cplain){.text = NULL, .size = 0};
+    }
+    c->state = UCONN_REQUEST;
+    c->loop = loop;
+    c->client = fd;
+    c->server = -1;
+    request_parser_init(&c->parser);
+    c->dns = NULL;
+    c->addr = NULL;
+    c->block = NULL;
+    c->stale = NULL;
+    c->entry = NULL;
+    c->sent = 0;
+    c->in_len = 0;
+    c->head_len = 0;
+    c->out_len = 0;
+    c->chunk = NULL;
+    c->chunk_len = 0;
+    c->bid = -1;
+    c->fill = NULL;
+    c->checked = false;
+    c->storable = false;
+    c->response_head = 0;
+    c->content_length = -1;
+    c->relayed = 0;
+    c->origin = -1;
+    c->fetch = NULL;
+    c->leader = false;
+    c->dead = false;
+    c->waiter = (fetch_waiter){.notify = conn_wake, .arg = c};
+    c->inflight = 0;
+    metrics_begin(&c->timer);
+    metrics_count(METRIC_ACCEPTED, 1);
+
+    accesslog_accept(fd, NULL);
+    conn_recv(c, OP_REQUEST, true);
+}
+
+/**
+ * @brief Lookup completion callback; runs on a resolver thread.
+ *     Queues the result to the connection's loop and wakes the loop.
+ *
+ * @param[in] entry : resolved server name.
+ * @param[in] arg   : void* pointer to the connection in UCONN_RESOLVE.
+ */
+static void conn_notify(dns_entry *entry, void *arg) {
+    conn_queue((uconn *)arg, entry);
+}
+
+/**
+ * @brief Fetch waiter callback; runs on the thread of the fetch leader.
+ *     Queues the connection to its loop and wakes the loop.
+ *
+ * @param[in] arg : void* pointer to the connection in UCONN_FOLLOW.
+ */
+static void conn_wake(void *arg) {
+    conn_queue((uconn *)arg, NULL);
+}
+
+/**
+ * @brief Queues a connection to its loop, to be moved on there, and wakes
+ *     the loop.
+ *
+ * @param[in] c     : connection in UCONN_RESOLVE or UCONN_FOLLOW.
+ * @param[in] entry : resolved server name, NULL for a fetch wakeup.
+ */
+static void conn_queue(uconn *c, dns_entry *entry) {
+    uloop *loop = c->loop;
+    uresolved *done = &c->done;
+    done->conn = c;
+    done->entry = entry;
+
+    pthread_mutex_lock(&loop->mutex);
+    done->next = loop->done;
+    loop->done = done;
+    pthread_mutex_unlock(&loop->mutex);
+
+    uint64_t one = 1;
+    if (write(loop->wakefd, &one, sizeof(one)) < 0)
+        perror("eventfd write");
+}
+
+/**
+ * @brief Submits a receive from the client (OP_REQUEST) or the server
+ *     (OP_RECV).
+ *
+ * @param[in] c      : connection receiving.
+ * @param[in] op     : OP_REQUEST or OP_RECV.
+ * @param[in] select : whether the kernel picks a provided buffer; else
+ *                     bytes go to the connection's in or out.
+ */
+static void conn_recv(uconn *c, uring_op op, bool select) {
+    struct io_uring_sqe *sqe = ring_sqe(&c->loop->ring);
+    sqe->opcode = IORING_OP_RECV;
+    if (op == OP_REQUEST) {
+        sqe->fd = c->client;
+        sqe->addr = select ? 0 : (uintptr_t)(c->in + c->in_len);
+        sqe->len = sizeof(c->in) - c->in_len;
+    } else {
+        sqe->fd = c->server;
+        sqe->addr = select ? 0 : (uintptr_t)c->out;
+        sqe->len = select ? URING_BUF_SIZE : sizeof(c->out);
+    }
+    if (select) {
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_GROUP;
+    }
+    sqe->user_data = (uintptr_t)c | op;
+    c->inflight++;
+}
+
+/**
+ * @brief Submits a send to the client (OP_HIT, OP_RELAY) or the server
+ *     (OP_SEND).
+ *
+ * @param[in] c    : connection sending.
+ * @param[in] op   : OP_HIT, OP_RELAY, or OP_SEND.
+ * @param[in] data : bytes to send; must stay in place until completion.
+ * @param[in] n    : length of <data>.
+ */
+static void conn_send(uconn *c, uring_op op, const char *data, size_t n) {
+    struct io_uring_sqe *sqe = ring_sqe(&c->loop->ring);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = (op == OP_SEND) ? c->server : c->client;
+    sqe->addr = (uintptr_t)data;
+    sqe->len = n;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t)c | op;
+    c->inflight++;
+}
+
+/**
+ * @brief Handles the completion of an operation of a connection.
+ *
+ * @param[in] c     : connection.
+ * @param[in] op    : operation completed.
+ * @param[in] res   : result, negative errno on error.
+ * @param[in] flags : completion flags.
+ */
+static void conn_complete(uconn *c, uring_op op, int res, unsigned flags) {
+    // Zero-copy notification: the kernel is done with the hit's pages.
+    if (flags & IORING_CQE_F_NOTIF) {
+        c->inflight--;
+        return;
+    }
+    c->inflight--;
+    if (c->state == UCONN_CLOSED)
+        return;
+
+    switch (op) {
+    case OP_REQUEST:
+        conn_request(c, res, flags);
+        break;
+    case OP_HIT:
+        // A notification follows a zero-copy send.
+        if (flags & IORING_CQE_F_MORE)
+            c->inflight++;
+        if (res < 0) {
+            conn_close(c);
+        } else if (c->state == UCONN_FOLLOW) {
+            c->sent += res;
+            metrics_count(METRIC_ORIGIN_BYTES, res);
+            conn_follow(c);
+        } else {
+            c->sent += res;
+            conn_hit(c);
+        }
+        break;
+    case OP_CONNECT:
+        c->failed = c->failed || res < 0;
+        if (c->inflight == 0)
+            conn_connected(c);
+        break;
+    case OP_SEND:
+        if (res == -ECANCELED)
+            c->failed = true;
+        else if (res < 0)
+            c->error = true;
+        else
+            c->sent += res;
+        if (c->inflight == 0)
+            conn_connected(c);
+        break;
+    case OP_RECV:
+        conn_response(c, res, flags);
+        break;
+    case OP_RELAY:
+        // A shared response is read to the end for the followers.
+        if (res < 0 && c->fetch != NULL)
+            c->dead = true;
+        if (res < 0) {
+            if (c->dead)
+                conn_relayed(c, c->chunk_len - c->sent);
+            else
+                conn_close(c);
+            break;
+        }
+        c->sent += res;
+        c->relayed += res;
+        metrics_count(METRIC_ORIGIN_BYTES, res);
+        if (c->sent < c->chunk_len) {
+            conn_send(c, OP_RELAY, c->chunk + c->sent, c->chunk_len - c->sent);
+            break;
+        }
+        conn_relayed(c, 0);
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * @brief Handles request bytes received from the client.
+ *     Each receive is parsed as it arrives; the parser resumes where the
+ *     last one left off. A request addressed to the proxy itself is
+ *     answered with the metrics.
+ *
+ * @param[in] c     : connection in UCONN_REQUEST state.
+ * @param[in] res   : bytes received, negative errno on error.
+ * @param[in] flags : completion flags, naming the buffer used if any.
+ */
+static void conn_request(uconn *c, int res, unsigned flags) {
+    if (res == -ENOBUFS) {
+        conn_recv(c, OP_REQUEST, false);
+        return;
+    }
+    if (res <= 0) {
+        conn_close(c);
+        return;
+    }
+    if (flags & IORING_CQE_F_BUFFER) {
+        int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        memcpy(c->in + c->in_len, c->loop->bufs + (size_t)bid * URING_BUF_SIZE,
+               res);
+        buf_recycle(c->loop, bid);
+    }
+    c->in_len += res;
+
+    // Wait for the end of the headers.
+    uint64_t since = metrics_now();
+    ssize_t head_len =
+        request_parse_head(&c->parser, &c->request, c->in, c->in_len);
+    c->timer.parse += metrics_now() - since;
+    if (head_len == 0 && c->in_len < sizeof(c->in)) {
+        conn_recv(c, OP_REQUEST, true);
+        return;
+    }
+    if (head_len <= 0) {
+        clienterror(c->client, "400", "Bad Request",
+                    "Tiny received a malformed request");
+        conn_close(c);
+        return;
+    }
+    c->head_len = head_len;
+    metrics_parsed(&c->timer);
+    // Scrapes of the metrics are never rate limited.
+    long retry =
+        metrics_requested(&c->request) ? 0 : admit_client(c->client, NULL);
+    if (retry > 0) {
+        metrics_count(METRIC_SHED_RATE, 1);
+        clientretry(c->client, "429", "Too Many Requests",
+                    "Tiny is serving this client too often", retry);
+        conn_close(c);
+        return;
+    }
+    if (metrics_requested(&c->request)) {
+        metrics_serve(c->client, &c->request);
+        conn_close(c);
+        return;
+    }
+    conn_lookup(c);
+}
+
+/**
+ * @brief Looks up the parsed request in the cache, serving a hit or
+ *     starting the server fetch.
+ *     Concurrent misses on one URI are collapsed into one server fetch:
+ *     the first leads, later ones follow and send the leader's response.
+ *
+ * @param[in] c : connection in UCONN_REQUEST state, request parsed.
+ */
+static void conn_lookup(uconn *c) {
+    if (!request_cacheable(&c->request, &c->parser)) {
+        conn_upstream(c);
+        return;
+    }
+
+    // If fresh cache hit, in memory or on disk, serve text directly.
+    uint64_t since = metrics_now();
+    if ((c->block = cache_pin(c->request.uri)) == NULL)
+        c->entry = cache_pin_disk(c->request.uri);
+    metrics_time(LATENCY_LOOKUP, since);
+    if ((c->block != NULL || c->entry != NULL) && conn_cached(c))
+        return;
+
+    c->fetch = fetch_join(c->request.uri, &c->leader);
+    if (!c->leader) {
+        c->state = UCONN_FOLLOW;
+        c->sent = 0;
+        conn_follow(c);
+        return;
+    }
+    // Cached by a fetch that ended after the lookup above.
+    if ((c->block = cache_repin(c->request.uri)) != NULL && conn_cached(c)) {
+        conn_unlead(c, false);
+        return;
+    }
+    conn_upstream(c);
+}
+
+/**
+ * @brief Starts sending the pinned hit, c->block or c->entry.
+ *     Compressed text goes out inflated to a client not taking gzip, from
+ *     the connection's buffer, with the hit unpinned.
+ *
+ * @param[in] c : connection holding the pinned hit.
+ *
+ * @return true if sending, false if the hit is compressed and could not
+ *     be inflated; it is then unpinned.
+ */
+static bool conn_cached(uconn *c) {
+    size_t len =
+        (c->block != NULL) ? (size_t)c->block->text_len : c->entry->text_len;
+    int inflated =
+        compress_hit(&c->parser, c->block, c->entry, &c->plain, &c->plain_len);
+    if (inflated != 0) {
+        len = c->plain_len;
+        if (c->block != NULL)
+            cache_unpin(c->block);
+        else
+            cache_unpin_disk(c->entry);
+        c->block = NULL;
+        c->entry = NULL;
+    }
+    if (inflated < 0)
+        return false;
+    c->state = UCONN_HIT;
+    c->sent = 0;
+    metrics_count(METRIC_CACHE_BYTES, len);
+    trace_request(c->request.uri, TRACE_HIT, len);
+    conn_hit(c);
+    return true;
+}
+
+/**
+ * @brief Starts the server fetch of a request not served from the cache.
+ *     A stale cached copy with validators is revalidated with a conditional
+ *     request, unless the client's request is conditional itself.
+ *
+ * @param[in] c : connection with its request parsed.
+ */
+static void conn_upstream(uconn *c) {
+    int len = tunnel_requested(c->request.method)
+                  ? 0
+                  : format_header(c->out, sizeof(c->out), &c->request,
+                                  &c->parser, false);
+    if (len < 0) {
+        clienterror(c->client, "400", "Bad Request",
+                    "Tiny received an oversized request");
+        conn_close(c);
+        return;
+    }
+    // Tunnels are not fetches; every other request counts for its origin.
+    if (!tunnel_requested(c->request.method) &&
+        !admit_origin(c->request.host, c->request.port, &c->origin)) {
+        metrics_count(METRIC_SHED_ORIGIN, 1);
+        clientretry(c->client, "503", "Service Unavailable",
+                    "Tiny is fetching too much from this server",
+                    ADMIT_RETRY_AFTER);
+        conn_close(c);
+        return;
+    }
+    // Ask for the body only if the cached copy changed.
+    if (len > 0 && request_cacheable(&c->request, &c->parser) &&
+        request_lookup_header(&c->parser, "If-None-Match") == NULL &&
+        request_lookup_header(&c->parser, "If-Modified-Since") == NULL &&
+        (c->stale = cache_pin_stale(c->request.uri)) != NULL) {
+        size_t n = cache_conditions(c->stale, c->out + len - 2,
+                                    sizeof(c->out) - len);
+        if (n > 0) {
+            memcpy(c->out + len - 2 + n, "\r\n", 2);
+            len += n;
+        } else {
+            cache_unpin(c->stale);
+            c->stale = NULL;
+        }
+    }
+    c->out_len = len;
+    c->state = UCONN_RESOLVE;
+    c->timer.step = metrics_now();
+    c->dns = dns_lookup(c->request.host, c->request.port, conn_notify, c);
+    // Lookup pending; loop_resolved moves the connection on.
+    if (c->dns != NULL)
+        conn_resolved(c);
+}
+
+/**
+ * @brief Sends the next piece of pinned cached text, or of the text
+ *     inflated from it, to the client.
+ *     Memory hits are sent piecewise, one contiguous span of text at a
+ *     time, large spans with zero-copy sends.
+ *
+ * @param[in] c : connection in UCONN_HIT state.
+ */
+static void conn_hit(uconn *c) {
+    bool inflated = c->block == NULL && c->entry == NULL;
+    size_t len = c->plain_len;
+    if (!inflated)
+        len = (c->block != NULL) ? (size_t)c->block->text_len
+                                 : c->entry->text_len;
+    if (c->sent == len) {
+        conn_close(c);
+        return;
+    }
+    metrics_answer(&c->timer);
+    if (inflated) {
+        conn_send(c, OP_HIT, c->plain.text + c->sent, len - c->sent);
+        return;
+    }
+    if (c->block == NULL) {
+        conn_send(c, OP_HIT, cache_disktext(c->entry) + c->sent,
+                  len - c->sent);
+        return;
+    }
+
+    size_t avail;
+    const char *text = cache_textspan(c->block, c->sent, &avail);
+    if (avail < CACHE_ZEROCOPY_MIN) {
+        conn_send(c, OP_HIT, text, avail);
+        return;
+    }
+    struct io_uring_sqe *sqe = ring_sqe(&c->loop->ring);
+    sqe->opcode = IORING_OP_SEND_ZC;
+    sqe->fd = c->client;
+    sqe->addr = (uintptr_t)text;
+    sqe->len = avail;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t)c | OP_HIT;
+    c->inflight++;
+}
+
+/**
+ * @brief Sends the next span of text of a fetch led by another connection,
+ *     as its leader publishes it. A fetch not shared is left: the request
+ *     is served from the cache if the fetch cached it, else fetched
+ *     separately. Nothing is in flight while waiting on the leader.
+ *
+ * @param[in] c : connection in UCONN_FOLLOW state, nothing in flight.
+ */
+static void conn_follow(uconn *c) {
+    size_t len;
+    switch (fetch_poll(c->fetch, c->sent, &c->waiter, &len)) {
+    case FETCH_WAIT:
+        // Waiter queued; loop_resolved moves the connection on.
+        return;
+    case FETCH_DECLINED:
+        fetch_release(c->fetch);
+        c->fetch = NULL;
+        c->leader = false;
+        if ((c->block = cache_repin(c->request.uri)) == NULL ||
+            !conn_cached(c))
+            conn_upstream(c);
+        return;
+    case FETCH_DONE:
+        trace_request(c->request.uri, TRACE_MISS, c->sent);
+        conn_close(c);
+        return;
+    case FETCH_FAILED:
+        conn_close(c);
+        return;
+    case FETCH_TEXT:
+        break;
+    }
+
+    metrics_answer(&c->timer);
+    size_t avail;
+    const char *text =
+        cache_textpart(fetch_block(c->fetch), c->sent, len - c->sent, &avail);
+    conn_send(c, OP_HIT, text, avail);
+}
+
+/**
+ * @brief Starts connecting once the server name is resolved.
+ *
+ * @param[in] c : connection in UCONN_RESOLVE state, lookup complete.
+ */
+static void conn_resolved(uconn *c) {
+    if ((c->addr = dns_addrs(c->dns)) == NULL) {
+        metrics_count(METRIC_CONNECT_ERRORS, 1);
+        conn_close(c);
+        return;
+    }
+    conn_open(c);
+}
+
+/**
+ * @brief Submits a connect to the server address at c->addr, linked to
+ *     the send of the request, if any; skips addresses no socket can be
+ *     made for.
+ *
+ * @param[in] c : connection with a resolved server name.
+ */
+static void conn_open(uconn *c) {
+    for (; c->addr != NULL; c->addr = c->addr->ai_next) {
+        int fd = socket(c->addr->ai_family, c->addr->ai_socktype | SOCK_CLOEXEC,
+                        c->addr->ai_protocol);
+        if (fd < 0)
+            continue;
+        c->server = fd;
+        c->state = UCONN_CONNECT;
+        c->failed = false;
+        c->error = false;
+        c->sent = 0;
+
+        struct io_uring_sqe *sqe = ring_sqe(&c->loop->ring);
+        sqe->opcode = IORING_OP_CONNECT;
+        sqe->fd = fd;
+        sqe->addr = (uintptr_t)c->addr->ai_addr;
+        sqe->off = c->addr->ai_addrlen;
+        sqe->user_data = (uintptr_t)c | OP_CONNECT;
+        c->inflight++;
+        if (c->out_len > 0) {
+            sqe->flags = IOSQE_IO_LINK;
+            conn_send(c, OP_SEND, c->out, c->out_len);
+        }
+        return;
+    }
+    metrics_count(METRIC_CONNECT_ERRORS, 1);
+    fprintf(stderr, "Could not connect to %s:%s\n", c->request.host,
+            c->request.port);
+    if (tunnel_requested(c->request.method))
+        clienterror(c->client, "502", "Bad Gateway",
+                    "Tiny could not connect to the server");
+    conn_close(c);
+}
+
+/**
+ * @brief Moves on once the connect and the send of the request completed.
+ *     On a failed connect, tries the next resolved address; on a short
+ *     send, sends the rest. A CONNECT request is handed to a tunnel.
+ *
+ * @param[in] c : connection in UCONN_CONNECT state, nothing in flight.
+ */
+static void conn_connected(uconn *c) {
+    if (c->failed) {
+        close(c->server);
+        c->server = -1;
+        c->addr = c->addr->ai_next;
+        conn_open(c);
+        return;
+    }
+    if (c->error) {
+        conn_close(c);
+        return;
+    }
+    if (c->sent < c->out_len) {
+        conn_send(c, OP_SEND, c->out + c->sent, c->out_len - c->sent);
+        return;
+    }
+    metrics_time(LATENCY_CONNECT, c->timer.step);
+
+    if (tunnel_requested(c->request.method)) {
+        tunnel_start(c->client, c->server, c->in + c->head_len,
+                     c->in_len - c->head_len);
+        c->client = -1;
+        c->server = -1;
+        conn_close(c);
+        return;
+    }
+
+    // Request sent; relay response, caching it if it fits.
+    c->state = UCONN_RELAY;
+    c->checked = false;
+    c->storable = request_cacheable(&c->request, &c->parser);
+    if (c->storable)
+        c->fill = cache_fill(c->request.uri, 0);
+    conn_recv(c, OP_RECV, true);
+}
+
+/**
+ * @brief Handles response bytes received from the server: saves them for
+ *     the cache while the response fits and sends them to the client.
+ *     Response cached on server EOF if it fit in its cache fill and its
+ *     body matches its Content-Length.
+ *
+ * @param[in] c     : connection in UCONN_RELAY state.
+ * @param[in] res   : bytes received, 0 on EOF, negative errno on error.
+ * @param[in] flags : completion flags, naming the buffer used if any.
+ */
+static void conn_response(uconn *c, int res, unsigned flags) {
+    if (res == -ENOBUFS) {
+        conn_recv(c, OP_RECV, false);
+        return;
+    }
+    if (res <= 0) {
+        // Cached only if the body is whole: as long as its Content-Length
+        // says, or framed by the server closing.
+        bool whole = res == 0 && c->fill != NULL &&
+                     (c->content_length < 0 ||
+                      c->relayed - c->response_head ==
+                          (size_t)c->content_length);
+        if (whole)
+            cache_fill_commit(c->fill);
+        else if (c->fill != NULL)
+            cache_fill_abort(c->fill);
+        c->fill = NULL;
+        // Cached before the fetch ends, so followers joining late find it.
+        if (c->fetch != NULL)
+            conn_unlead(c, whole);
+        if (res == 0 && !c->dead)
+            trace_request(c->request.uri,
+                          c->storable ? TRACE_MISS : TRACE_BYPASS, c->relayed);
+        conn_close(c);
+        return;
+    }
+    if (flags & IORING_CQE_F_BUFFER) {
+        c->bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        c->chunk = c->loop->bufs + (size_t)c->bid * URING_BUF_SIZE;
+    } else {
+        c->bid = -1;
+        c->chunk = c->out;
+    }
+    c->chunk_len = res;
+    c->sent = 0;
+
+    // Keep the fill only if the response head allows caching it; a 304
+    // confirms the stale copy instead, and a new response replaces it.
+    if (!c->checked && (c->fill != NULL || c->stale != NULL)) {
+        response_info response;
+        time_t now = time(NULL);
+        ssize_t head_len = response_parse_head(&response, c->chunk, res);
+        if (head_len >= 0 && c->stale != NULL && response.status == 304) {
+            conn_revalidated(c, &response, now);
+            return;
+        }
+        if (c->fill != NULL &&
+            (head_len < 0 || !response_cacheable(&response, now))) {
+            cache_fill_abort(c->fill);
+            c->fill = NULL;
+            c->storable = false;
+        } else if (c->fill != NULL) {
+            cfresh fresh = {.expires = response_expires(&response, now),
+                            .lifetime = response_lifetime(&response, now)};
+            fresh.etag =
+                response_field(c->chunk, head_len, "ETag", &fresh.etag_len);
+            fresh.modified = response_field(
+                c->chunk, head_len, "Last-Modified", &fresh.modified_len);
+            cache_fill_fresh(c->fill, &fresh);
+            c->response_head = head_len;
+            c->content_length = response.content_length;
+        }
+        if (c->stale != NULL)
+            cache_unpin(c->stale);
+        c->stale = NULL;
+    }
+
+    if (!c->checked && c->fetch != NULL)
+        conn_share(c);
+    c->checked = true;
+
+    // Save chunk for the cache while the response still fits; a body
+    // longer than its Content-Length is not cached.
+    if (c->fill != NULL &&
+        ((c->content_length >= 0 &&
+          c->relayed + res > c->response_head + (size_t)c->content_length) ||
+         !cache_fill_write(c->fill, c->chunk, res))) {
+        cache_fill_abort(c->fill);
+        c->fill = NULL;
+    }
+    if (c->fetch != NULL && c->fill == NULL)
+        conn_unlead(c, false);
+    else if (c->fetch != NULL)
+        fetch_publish(c->fetch, c->relayed + res);
+    if (c->dead) {
+        conn_relayed(c, res);
+        return;
+    }
+    metrics_answer(&c->timer);
+    conn_send(c, OP_RELAY, c->chunk, c->chunk_len);
+}
+
+/**
+ * @brief Moves on once a response chunk is relayed: gives its buffer back
+ *     and receives the next. A connection whose client is gone counts the
+ *     chunk as relayed, and is closed once it no longer leads a fetch.
+ *
+ * @param[in] c : connection in UCONN_RELAY state, no send in flight.
+ * @param[in] n : bytes of the chunk not sent to a client gone.
+ */
+static void conn_relayed(uconn *c, size_t n) {
+    c->relayed += n;
+    if (c->bid >= 0)
+        buf_recycle(c->loop, c->bid);
+    c->bid = -1;
+    if (c->dead && c->fetch == NULL)
+        conn_close(c);
+    else
+        conn_recv(c, OP_RECV, true);
+}
+
+/**
+ * @brief Sends the stale copy a 304 confirmed as a hit, refreshed; its
+ *     lifetime is renewed unless the 304 gives one. The server connection
+ *     is closed, and a led fetch ends unshared, so that its followers find
+ *     the refreshed copy in the cache.
+ *
+ * @param[in] c        : connection in UCONN_RELAY state, holding c->stale.
+ * @param[in] response : parsed 304 response head.
+ * @param[in] now      : time the response was received.
+ */
+static void conn_revalidated(uconn *c, const response_info *response,
+                             time_t now) {
+    cache_refresh(c->stale, response_explicit(response)
+                                ? response_expires(response, now)
+                                : -1);
+    if (c->fill != NULL)
+        cache_fill_abort(c->fill);
+    c->fill = NULL;
+    if (c->bid >= 0)
+        buf_recycle(c->loop, c->bid);
+    c->bid = -1;
+    close(c->server);
+    c->server = -1;
+    if (c->fetch != NULL) {
+        fetch_share(c->fetch, NULL);
+        conn_unlead(c, false);
+    }
+    c->block = c->stale;
+    c->stale = NULL;
+    if (!conn_cached(c)) {
+        clienterror(c->client, "502", "Bad Gateway",
+                    "Tiny could not inflate the cached response");
+        conn_close(c);
+    }
+}
+
+/**
+ * @brief Decides, once the response head is checked, whether a led fetch
+ *     is shared. Only text reserved in the cache fill is shared, since it
+ *     then stays in place while followers read it; else the fetch ends,
+ *     and its followers fetch the response themselves.
+ *
+ * @param[in] c : connection in UCONN_RELAY state, leading c->fetch.
+ */
+static void conn_share(uconn *c) {
+    cblock *block = NULL;
+    if (c->fill != NULL && c->content_length >= 0 &&
+        cache_fill_reserve(c->fill,
+                           c->response_head + (size_t)c->content_length))
+        block = cache_fill_pin(c->fill);
+    if (block != NULL)
+        fetch_share(c->fetch, block);
+    else
+        conn_unlead(c, false);
+}
+
+/**
+ * @brief Ends and releases the fetch a connection leads.
+ *
+ * @param[in] c  : connection leading c->fetch.
+ * @param[in] ok : whether the response text is complete.
+ */
+static void conn_unlead(uconn *c, bool ok) {
+    fetch_end(c->fetch, ok);
+    fetch_release(c->fetch);
+    c->fetch = NULL;
+    c->leader = false;
+}
+
+/**
+ * @brief Closes a connection; what it holds is released, and the
+ *     connection kept for reuse, once no operation of it is in flight.
+ *
+ * @param[in] c : connection to close.
+ */
+static void conn_close(uconn *c) {
+    metrics_end(&c->timer);
+    metrics_count(METRIC_CLOSED, 1);
+    c->state = UCONN_CLOSED;
+}
+
+/**
+ * @brief Releases everything a closed connection holds and keeps it for
+ *     reuse.
+ *
+ * @param[in] c : closed connection, nothing in flight.
+ */
+static void conn_free(uconn *c) {
+    if (c->client >= 0)
+        close(c->client);
+    if (c->server >= 0)
+        close(c->server);
+    if (c->block != NULL)
+        cache_unpin(c->block);
+    if (c->stale != NULL)
+        cache_unpin(c->stale);
+    if (c->entry != NULL)
+        cache_unpin_disk(c->entry);
+    if (c->dns != NULL)
+        dns_release(c->dns);
+    if (c->fill != NULL)
+        cache_fill_abort(c->fill);
+    if (c->fetch != NULL && c->leader)
+        fetch_end(c->fetch, false);
+    if (c->fetch != NULL)
+        fetch_release(c->fetch);
+    admit_origin_done(c->origin);
+    // A tunnel owns the client, and gives it back itself.
+    if (c->client >= 0)
+        admit_close();
+    if (c->bid >= 0)
+        buf_recycle(c->loop, c->bid);
+    c->next_spare = c->loop->spare;
+    c->loop->spare = c;
+}
+
+#endif /* URING_SUPPORTED */
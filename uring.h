@@ -0,0 +1,47 @@
+/**
+ * @file uring.h
+ * @brief io_uring front end for a tiny web proxy.
+ *
+ * Serves client connections like the epoll front end (see eventloop.h), one
+ * loop per core and the same connection states, but every socket operation
+ * is submitted to an io_uring instance of the loop instead of being tried
+ * and retried on readiness:
+ *     1. Accept: one multishot accept per listening socket.
+ *     2. Read request: receives into buffers the kernel picks from a ring
+ *        shared by all connections of the loop.
+ *     3. Cache hit: cached text sent straight from the cache arenas with
+ *        zero-copy sends.
+ *     4. Connect upstream: connect linked to the send of the request.
+ *     5. Relay: server response received into ring buffers and sent on to
+ *        the client from there, saved in the cache as it passes.
+ * Operations of all connections are submitted together, with one system
+ * call per loop iteration that also waits for their completions.
+ *
+ * uring.c has more detailed implementation-related comments.
+ *
+ * @author Iltikin Wayet
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * @brief Serves client connections accepted on <listenfds> forever with
+ *     io_uring, if the kernel (and the build) support what it needs.
+ *     Runs <nloops> loops; the calling thread runs one of them. Loop i
+ *     accepts on listenfds[i]; entries may repeat a shared socket or be
+ *     distinct SO_REUSEPORT sockets.
+ *
+ * @param[in] listenfds : listening socket descriptor of each loop.
+ * @param[in] nloops    : number of loops, at least 1.
+ * @param[in] pin       : whether loop i is pinned to CPU i.
+ *
+ * @return false, with nothing served, if io_uring cannot be used; does not
+ *     return otherwise.
+ */
+bool uring_run(const int *listenfds, size_t nloops, bool pin);
+
+#endif /* URING_H */